@@ -71,7 +71,9 @@ for i in "${!ARCHS[@]}"; do
             --enable-encoder=aac \
             --enable-decoder=aac \
             --enable-parser=opus \
-            --enable-muxer=mp4
+            --enable-muxer=mp4 \
+            --enable-muxer=matroska \
+            --enable-muxer=webm
 
         make -j install
     )
@@ -81,5 +83,8 @@ for i in "${!ARCHS[@]}"; do
         mkdir -p $OUTPUT_DIR/lib
         cp -r $FFMPEG_DIR/install/lib/*.so $OUTPUT_DIR/lib
         cp -r $FFMPEG_DIR/install/include $OUTPUT_DIR/include
+        # libavcodec keeps libopus symbols private, link it again for FEC
+        cp $OPUS_DIR/install/lib/libopus.a $OUTPUT_DIR/lib
+        cp -r $OPUS_DIR/install/include/opus $OUTPUT_DIR/include/
     )
 done
@@ -63,10 +63,14 @@ for i in "${!SDKS[@]}"; do
             --enable-encoder=aac \
             --enable-decoder=aac \
             --enable-parser=opus \
-            --enable-muxer=mp4
+            --enable-muxer=mp4 \
+            --enable-muxer=matroska \
+            --enable-muxer=webm
 
         make -j install
     )
+    # libopus is linked in below, its API is used for receive side FEC
+    cp -r $OPUS_DIR/install/include/opus $FFMPEG_DIR/install/include/
     libtool -static -o $FFMPEG_DIR/libffmpeg.a \
         $OPUS_DIR/install/lib/libopus.a \
         $FFMPEG_DIR/install/lib/libavcodec.a \
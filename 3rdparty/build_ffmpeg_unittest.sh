@@ -42,7 +42,11 @@ OUTPUT_DIR="${TOP_DIR}/output/unittest/ffmpeg"
         --enable-encoder=aac \
         --enable-decoder=aac \
         --enable-parser=opus \
-        --enable-muxer=mp4
+        --enable-muxer=mp4 \
+        --enable-muxer=matroska \
+        --enable-muxer=webm \
+        --enable-demuxer=mov \
+        --enable-demuxer=matroska
 
     make -j install
 )
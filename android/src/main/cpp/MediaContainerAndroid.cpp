@@ -1,10 +1,13 @@
 #include "ffmpeg.h"
 #include "framepipe.h"
+#include "pixelconv.h"
 #include <android/native_window.h>
 #include <android/native_window_jni.h>
+#include <atomic>
 #include <chrono>
 #include <jni.h>
 #include <string>
+#include <thread>
 
 namespace facebook::react {
 
@@ -21,7 +24,7 @@ JNIEXPORT int JNICALL Java_com_webrtc_WebrtcFabricManager_subscribeVideo(
 	if (!surface) {
 		throw std::invalid_argument("Surface is null");
 	}
-	auto scaler = std::make_shared<Scaler>();
+	auto scaler = std::make_shared<Scaler>(ScaleQuality::FastBilinear, 0);
 	ANativeWindow *window = ANativeWindow_fromSurface(env, surface);
 	if (!window) {
 		throw std::runtime_error("Failed to get ANativeWindow from Surface");
@@ -29,10 +32,7 @@ JNIEXPORT int JNICALL Java_com_webrtc_WebrtcFabricManager_subscribeVideo(
 
 	auto callback = [window, scaler](std::string, int,
 	                                 std::shared_ptr<AVFrame> raw) {
-		auto frame =
-		    scaler->scale(raw, AV_PIX_FMT_RGBA, raw->width, raw->height);
-
-		ANativeWindow_setBuffersGeometry(window, frame->width, frame->height,
+		ANativeWindow_setBuffersGeometry(window, raw->width, raw->height,
 		                                 WINDOW_FORMAT_RGBA_8888);
 
 		ANativeWindow_Buffer buffer;
@@ -41,10 +41,16 @@ JNIEXPORT int JNICALL Java_com_webrtc_WebrtcFabricManager_subscribeVideo(
 		}
 
 		uint8_t *dst = static_cast<uint8_t *>(buffer.bits);
-		for (int y = 0; y < frame->height; ++y) {
-			uint8_t *srcRow = frame->data[0] + y * frame->linesize[0];
-			uint8_t *dstRow = dst + y * buffer.stride * 4;
-			memcpy(dstRow, srcRow, frame->width * 4);
+		if (raw->format == AV_PIX_FMT_NV12) {
+			// Convert straight into the window buffer
+			nv12ToRGBA(raw->data[0], raw->linesize[0], raw->data[1],
+			           raw->linesize[1], dst, buffer.stride * 4, raw->width,
+			           raw->height);
+		} else {
+			auto frame =
+			    scaler->scale(raw, AV_PIX_FMT_RGBA, raw->width, raw->height);
+			copyPlane(frame->data[0], frame->linesize[0], dst,
+			          buffer.stride * 4, frame->width * 4, frame->height);
 		}
 
 		ANativeWindow_unlockAndPost(window);
@@ -58,37 +64,86 @@ JNIEXPORT int JNICALL Java_com_webrtc_WebrtcFabricManager_subscribeVideo(
 
 JNIEXPORT int JNICALL Java_com_webrtc_WebrtcFabricManager_subscribeAudio(
     JNIEnv *env, jobject thiz, jstring pipeId) {
-	auto resampler = std::make_shared<Resampler>();
-	jobject gFabricManager = env->NewGlobalRef(thiz);
+	jclass fabricManagerClass = env->GetObjectClass(thiz);
+	jfieldID audioTrackField = env->GetFieldID(
+	    fabricManagerClass, "audioTrack", "Landroid/media/AudioTrack;");
+	jobject audioTrackObj = env->GetObjectField(thiz, audioTrackField);
+	env->DeleteLocalRef(fabricManagerClass);
+	if (!audioTrackObj) {
+		throw std::invalid_argument("AudioTrack is null");
+	}
+	jobject gAudioTrack = env->NewGlobalRef(audioTrackObj);
+	env->DeleteLocalRef(audioTrackObj);
+
+	auto playout = std::make_shared<PlayoutBuffer>(AV_SAMPLE_FMT_S16, 48000, 2);
+	auto running = std::make_shared<std::atomic<bool>>(true);
 
-	auto callback = [gFabricManager, resampler](std::string, int,
-	                                            std::shared_ptr<AVFrame> raw) {
+	// Written without blocking, so that cleanup never waits on the track. A
+	// full track is retried shortly, which paces the reads at its cadence.
+	auto player = std::make_shared<std::thread>([gAudioTrack, playout,
+	                                             running]() {
 		JNIEnv *env;
 		gJvm->AttachCurrentThread(&env, nullptr);
-		auto frame = resampler->resample(raw, AV_SAMPLE_FMT_S16, 48000, 2);
-		const jbyte *sample = reinterpret_cast<const jbyte *>(frame->data[0]);
-		int length = frame->nb_samples * sizeof(int16_t) * 2;
-		jbyteArray byteArray = env->NewByteArray(length);
-		env->SetByteArrayRegion(byteArray, 0, length, sample);
-
-		jclass fabricManagerClass = env->GetObjectClass(gFabricManager);
-		jfieldID audioTrackField = env->GetFieldID(
-		    fabricManagerClass, "audioTrack", "Landroid/media/AudioTrack;");
-		jobject audioTrackObj =
-		    env->GetObjectField(gFabricManager, audioTrackField);
-		jclass audioTrackCls = env->GetObjectClass(audioTrackObj);
+		jclass audioTrackCls = env->GetObjectClass(gAudioTrack);
 		jmethodID writeMethod =
-		    env->GetMethodID(audioTrackCls, "write", "([BII)I");
-		env->CallIntMethod(audioTrackObj, writeMethod, byteArray, 0, length);
+		    env->GetMethodID(audioTrackCls, "write", "([BIII)I");
+		// AudioTrack.WRITE_NON_BLOCKING
+		const jint nonBlocking = 1;
+
+		// 10 ms of S16 stereo
+		const int samples = 480;
+		const int length = samples * sizeof(int16_t) * 2;
+		auto frame = createAudioFrame(AV_SAMPLE_FMT_S16, 48000, 2, samples);
+		jbyteArray byteArray = env->NewByteArray(length);
+		int offset = length;
+		while (*running) {
+			if (offset == length) {
+				playout->read(frame->data, samples);
+				env->SetByteArrayRegion(
+				    byteArray, 0, length,
+				    reinterpret_cast<const jbyte *>(frame->data[0]));
+				offset = 0;
+			}
+			jint written =
+			    env->CallIntMethod(gAudioTrack, writeMethod, byteArray,
+			                       offset, length - offset, nonBlocking);
+			if (written < 0) {
+				break;
+			}
+			offset += written;
+			if (offset < length) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+		}
+		env->DeleteLocalRef(byteArray);
+		env->DeleteLocalRef(audioTrackCls);
+		gJvm->DetachCurrentThread();
+	});
+
+	// Held back and reported played for the receiver's a/v sync
+	auto callback = [playout](std::string pipeId, int,
+	                          std::shared_ptr<AVFrame> raw) {
+		playOut(pipeId, *playout, raw);
 	};
 
-	auto cleanup = [gFabricManager](int) {
+	std::string pipeIdStr(env->GetStringUTFChars(pipeId, nullptr));
+	int statsId = addStatsSource(
+	    pipeIdStr, [playout]() { return playoutStats(*playout); });
+
+	auto cleanup = [gAudioTrack, playout, running, player, statsId](int) {
+		removeStatsSource(statsId);
+		*running = false;
+		player->join();
+		auto stats = playout->stats();
+		LOGI("playout latency %.1f ms, target %.1f ms, jitter %.1f ms, "
+		     "%llu underruns, drift %.0f ppm\n",
+		     stats.latency, stats.targetDelay, stats.jitter,
+		     (unsigned long long)stats.underruns, stats.drift);
 		JNIEnv *env;
 		gJvm->AttachCurrentThread(&env, nullptr);
-		env->DeleteGlobalRef(gFabricManager);
+		env->DeleteGlobalRef(gAudioTrack);
 	};
 
-	std::string pipeIdStr(env->GetStringUTFChars(pipeId, nullptr));
 	return subscribe({pipeIdStr}, callback, cleanup);
 }
 
@@ -138,24 +193,13 @@ JNIEXPORT void JNICALL Java_com_webrtc_Camera_publish(JNIEnv *env, jobject,
 	uint8_t *vBufferPtr =
 	    static_cast<uint8_t *>(env->GetDirectBufferAddress(vByteBuffer));
 	jint vRowStride = env->CallIntMethod(vPlane, getRowStrideMethod);
-	jint vPixelStride = env->CallIntMethod(vPlane, getPixelStrideMethod);
 
 	auto frame = createVideoFrame(AV_PIX_FMT_NV12, width, height);
-	// Copy Y
-	for (int y = 0; y < height; ++y) {
-		memcpy(frame->data[0] + y * frame->linesize[0],
-		       yBufferPtr + y * yRowStride, width);
-	}
-
-	// Copy UV
-	for (int y = 0; y < height / 2; ++y) {
-		for (int x = 0; x < width / 2; ++x) {
-			frame->data[1][y * frame->linesize[1] + x * 2] =
-			    uBufferPtr[y * uRowStride + x * uPixelStride];
-			frame->data[1][y * frame->linesize[1] + x * 2 + 1] =
-			    vBufferPtr[y * vRowStride + x * vPixelStride];
-		}
-	}
+	copyPlane(yBufferPtr, yRowStride, frame->data[0], frame->linesize[0],
+	          width, height);
+	// YUV_420_888 guarantees U and V share the pixel stride
+	packNV12UV(uBufferPtr, uRowStride, vBufferPtr, vRowStride, uPixelStride,
+	           frame->data[1], frame->linesize[1], width / 2, height / 2);
 
 	env->DeleteLocalRef(yPlane);
 	env->DeleteLocalRef(uPlane);
@@ -1,11 +1,71 @@
 #include "RTCRtpReceiver.h"
+#include "avsynchandler.h"
 #include "ffmpeg.h"
 #include "framepipe.h"
+#include "jitterbufferhandler.h"
+#include "nackhandler.h"
 #include "negotiate.h"
-#include <set>
+#include "opusreceiver.h"
+#include "overusedetector.h"
+#include "pacerhandler.h"
+#include <atomic>
+#include <climits>
+#include <mutex>
 
-void SenderOnOpen(std::shared_ptr<rtc::Track> track, const std::string &pipeId,
-                  rtc::Description::Media::RtpMap rtpMap) {
+// Honours what the remote asked for in its fmtp.
+OpusEncoderOptions negotiateOpusOptions(OpusEncoderOptions opus,
+                                        const std::vector<std::string> &fmtps) {
+	if (getOpusUseDtx(fmtps)) {
+		opus.dtx = true;
+	}
+	// Whether it gets FEC is up to the remote (RFC 7587)
+	opus.fec = getOpusUseInbandFec(fmtps) != 0;
+	int maxBitrate = getOpusMaxAverageBitrate(fmtps);
+	if (maxBitrate > 0) {
+		opus.bitrate = std::min(opus.bitrate, maxBitrate);
+	}
+	return opus;
+}
+
+// A time on the wall clock as a pts, on the timeline of the frames
+// captured here.
+static int64_t wallClockPts(int64_t time, AVRational time_base) {
+	return av_rescale_q(time - micros(globalBaseTime), (AVRational){1, 1000000},
+	                    time_base);
+}
+
+// Of the audio and video lined up, reported by each of the two.
+static void addSyncStats(PipeStats &stats, SyncGroup &syncGroup) {
+	auto sync = syncGroup.stats();
+	stats["sync.offset"] = sync.offset;
+	stats["sync.audioDelay"] = sync.audioDelay;
+	stats["sync.videoDelay"] = sync.videoDelay;
+	stats["sync.synced"] = sync.synced;
+}
+
+std::shared_ptr<PacedSender> PeerConnectionMedia::pacedSender() {
+	std::lock_guard lock(mutex);
+	if (!paced) {
+		paced = std::make_shared<PacedSender>();
+	}
+	return paced;
+}
+
+std::shared_ptr<SyncGroup> PeerConnectionMedia::syncGroup() {
+	std::lock_guard lock(mutex);
+	if (!sync) {
+		sync = std::make_shared<SyncGroup>();
+	}
+	return sync;
+}
+
+// Returns the cleanup to run once the track is closed.
+std::function<void()> SenderOnOpen(std::shared_ptr<rtc::Track> track,
+                                   const std::string &pipeId,
+                                   rtc::Description::Media::RtpMap rtpMap,
+                                   const OpusEncoderOptions &opus,
+                                   const VideoEncoderOptions &videoOptions,
+                                   std::shared_ptr<PacedSender> pacedSender) {
 	const size_t mtu = 1200;
 	auto ssrcs = track->description().getSSRCs();
 	if (ssrcs.size() != 1) {
@@ -14,9 +74,10 @@ void SenderOnOpen(std::shared_ptr<rtc::Track> track, const std::string &pipeId,
 	rtc::SSRC ssrc = ssrcs[0];
 
 	AVCodecID avCodecId;
+	std::shared_ptr<rtc::RtpPacketizationConfig> rtpConfig;
 	auto separator = rtc::NalUnit::Separator::StartSequence;
 	if (rtpMap.format == "H265") {
-		auto rtpConfig = std::make_shared<rtc::RtpPacketizationConfig>(
+		rtpConfig = std::make_shared<rtc::RtpPacketizationConfig>(
 		    ssrc, track->mid(), rtpMap.payloadType,
 		    rtc::H265RtpPacketizer::ClockRate);
 		auto packetizer =
@@ -24,7 +85,7 @@ void SenderOnOpen(std::shared_ptr<rtc::Track> track, const std::string &pipeId,
 		track->chainMediaHandler(packetizer);
 		avCodecId = AV_CODEC_ID_H265;
 	} else if (rtpMap.format == "H264") {
-		auto rtpConfig = std::make_shared<rtc::RtpPacketizationConfig>(
+		rtpConfig = std::make_shared<rtc::RtpPacketizationConfig>(
 		    ssrc, track->mid(), rtpMap.payloadType,
 		    rtc::H264RtpPacketizer::ClockRate);
 		auto packetizer =
@@ -32,7 +93,7 @@ void SenderOnOpen(std::shared_ptr<rtc::Track> track, const std::string &pipeId,
 		track->chainMediaHandler(packetizer);
 		avCodecId = AV_CODEC_ID_H264;
 	} else if (rtpMap.format == "opus") {
-		auto rtpConfig = std::make_shared<rtc::RtpPacketizationConfig>(
+		rtpConfig = std::make_shared<rtc::RtpPacketizationConfig>(
 		    ssrc, track->mid(), rtpMap.payloadType,
 		    rtc::OpusRtpPacketizer::DefaultClockRate);
 		auto packetizer = std::make_shared<rtc::OpusRtpPacketizer>(rtpConfig);
@@ -41,40 +102,147 @@ void SenderOnOpen(std::shared_ptr<rtc::Track> track, const std::string &pipeId,
 	} else {
 		throw std::runtime_error("Unsupported codec: " + rtpMap.format);
 	}
+	// Sender reports pair the RTP timestamps with the wall clock, for the
+	// receiver to line audio and video up. Ahead of the pacer, which takes
+	// the packets it counts.
+	track->chainMediaHandler(std::make_shared<rtc::RtcpSrReporter>(rtpConfig));
+
+	bool video = avCodecId != AV_CODEC_ID_OPUS;
+	int stream =
+	    pacedSender->addStream(video ? videoOptions.bitrate : opus.bitrate);
+	// Receivers NACK video, not audio
+	std::shared_ptr<NackResponder> nackResponder;
+	if (video) {
+		nackResponder = std::make_shared<NackResponder>(
+		    std::max(videoOptions.nackHistory, 0), ssrc, pacedSender, stream);
+		track->chainMediaHandler(nackResponder);
+	}
+	// After the packetizer, which hands it each frame's packets at once
+	track->chainMediaHandler(
+	    std::make_shared<PacingHandler>(pacedSender, stream, !video));
 
-	auto encoder = std::make_shared<Encoder>(avCodecId);
-	int subscriptionId =
-	    subscribe({pipeId}, [encoder, track](std::string, int,
-	                                         std::shared_ptr<AVFrame> frame) {
+	auto encoder = std::make_shared<Encoder>(avCodecId, opus, videoOptions);
+	// Recorders of the same pipe reuse these packets instead of encoding
+	// the frames a second time.
+	int sourceId = addPacketSource(pipeId, avCodecId,
+	                               [encoder]() { encoder->requestKeyframe(); });
+	// Video is encoded smaller, then at a lower frame rate, while encoding
+	// takes longer than the frames are apart
+	auto overuse = std::make_shared<OveruseDetector>();
+	auto overuseMutex = std::make_shared<std::mutex>();
+	int subscriptionId = subscribe(
+	    {pipeId}, [encoder, track, sourceId, video, overuse, overuseMutex,
+	               pipeId](std::string, int, std::shared_ptr<AVFrame> frame) {
 		    if (!frame) {
 			    return;
 		    }
+		    std::lock_guard lock(*overuseMutex);
+		    auto start = std::chrono::steady_clock::now();
+		    if (video) {
+			    if (!overuse->offer(micros(start))) {
+				    return;
+			    }
+			    // Even, for the subsampled chroma
+			    double scale = overuse->scale();
+			    encoder->setSize(
+			        scale < 1 ? (int)(frame->width * scale) & ~1 : 0,
+			        scale < 1 ? (int)(frame->height * scale) & ~1 : 0);
+		    }
 		    auto packets = encoder->encode(frame);
+		    if (video) {
+			    int level = overuse->stats().level;
+			    overuse->encoded(micros(std::chrono::steady_clock::now()) -
+			                     micros(start));
+			    auto stat = overuse->stats();
+			    if (stat.level != level) {
+				    LOGI("%s: encode %.1f ms per frame, usage %.2f, now at "
+				         "level %d, %.2f of %dx%d\n",
+				         pipeId.c_str(), stat.encodeTime, stat.usage,
+				         stat.level, stat.scale, frame->width, frame->height);
+			    }
+		    }
+		    auto par = encoder->parameters();
 		    for (auto packet : packets) {
 			    if (!track->isOpen()) {
 				    return;
 			    }
 			    track->sendFrame((const rtc::byte *)packet->data, packet->size,
 			                     packet->pts);
+			    publishPacket(sourceId, packet, par);
 		    }
 	    });
-	track->onClosed([subscriptionId]() { unsubscribe(subscriptionId); });
+	int statsId = addStatsSource(pipeId, [video, overuse, overuseMutex,
+	                                      pacedSender, nackResponder]() {
+		PipeStats stats;
+		// Of every sender of the connection
+		auto paced = pacedSender->stats();
+		stats["pacer.packets"] = paced.packets;
+		stats["pacer.bytes"] = paced.bytes;
+		stats["pacer.dropped"] = paced.dropped;
+		stats["pacer.queued"] = paced.queued;
+		stats["pacer.rate"] = paced.rate;
+		stats["pacer.delay"] = paced.delay;
+		stats["pacer.maxDelay"] = paced.maxDelay;
+		if (nackResponder) {
+			auto resent = nackResponder->stats();
+			stats["nack.stored"] = resent.stored;
+			stats["nack.resent"] = resent.resent;
+			stats["nack.expired"] = resent.expired;
+		}
+		if (video) {
+			std::lock_guard lock(*overuseMutex);
+			auto stat = overuse->stats();
+			stats["overuse.frames"] = stat.frames;
+			stats["overuse.dropped"] = stat.dropped;
+			stats["overuse.downgrades"] = stat.downgrades;
+			stats["overuse.upgrades"] = stat.upgrades;
+			stats["overuse.level"] = stat.level;
+			stats["overuse.scale"] = stat.scale;
+			stats["overuse.encodeTime"] = stat.encodeTime;
+			stats["overuse.usage"] = stat.usage;
+		}
+		return stats;
+	});
+	return [subscriptionId, sourceId, statsId, video, overuse, overuseMutex,
+	        pacedSender, stream, nackResponder]() {
+		removeStatsSource(statsId);
+		removePacketSource(sourceId);
+		unsubscribe(subscriptionId);
+		pacedSender->removeStream(stream);
+		if (nackResponder) {
+			auto resent = nackResponder->stats();
+			LOGI("retransmitted %llu packets, %llu asked for too late\n",
+			     (unsigned long long)resent.resent,
+			     (unsigned long long)resent.expired);
+		}
+		auto paced = pacedSender->stats();
+		LOGI("pacer: %llu packets at %.0f kbps, delay avg %.1f ms max %.1f "
+		     "ms, dropped %llu\n",
+		     (unsigned long long)paced.packets, paced.rate / 1000, paced.delay,
+		     paced.maxDelay, (unsigned long long)paced.dropped);
+		std::lock_guard lock(*overuseMutex);
+		if (video) {
+			auto stat = overuse->stats();
+			LOGI("encoder overuse: %llu frames, dropped %llu, stepped down "
+			     "%llu times and up %llu, encode %.1f ms per frame\n",
+			     (unsigned long long)stat.frames,
+			     (unsigned long long)stat.dropped,
+			     (unsigned long long)stat.downgrades,
+			     (unsigned long long)stat.upgrades, stat.encodeTime);
+		}
+	};
 }
 
-void ReceiverOnOpen(std::shared_ptr<rtc::Track> track,
-                    const std::string &pipeId,
-                    rtc::Description::Media::RtpMap rtpMap) {
+// rtxPayloadType of the RTX the remote retransmits in, -1 when none.
+std::function<void()> ReceiverOnOpen(std::shared_ptr<rtc::Track> track,
+                                     const std::string &pipeId,
+                                     rtc::Description::Media::RtpMap rtpMap,
+                                     int rtxPayloadType,
+                                     std::shared_ptr<SyncGroup> syncGroup) {
 	AVCodecID avCodecId;
-	auto separator = rtc::NalUnit::Separator::StartSequence;
 	if (rtpMap.format == "H265") {
-		auto depacketizer =
-		    std::make_shared<rtc::H265RtpDepacketizer>(separator);
-		track->chainMediaHandler(depacketizer);
 		avCodecId = AV_CODEC_ID_H265;
 	} else if (rtpMap.format == "H264") {
-		auto depacketizer =
-		    std::make_shared<rtc::H264RtpDepacketizer>(separator);
-		track->chainMediaHandler(depacketizer);
 		avCodecId = AV_CODEC_ID_H264;
 	} else if (rtpMap.format == "opus") {
 		auto depacketizer = std::make_shared<rtc::OpusRtpDepacketizer>();
@@ -84,42 +252,274 @@ void ReceiverOnOpen(std::shared_ptr<rtc::Track> track,
 		throw std::runtime_error("Unsupported codec: " + rtpMap.format);
 	}
 
-	auto decoder = std::make_shared<Decoder>(avCodecId);
+	std::weak_ptr<rtc::Track> weakTrack = track;
+	auto requestKeyframe = [weakTrack]() {
+		if (auto track = weakTrack.lock()) {
+			track->requestKeyframe();
+		}
+	};
+	// A broken video stream is repaired by asking for a keyframe
+	auto decoder = std::make_shared<Decoder>(avCodecId, requestKeyframe);
+	// Recordings of the pipe can mux the received packets as they are.
+	int sourceId = addPacketSource(pipeId, avCodecId, requestKeyframe);
+	// Frames are published with pts on the local clock, which never go
+	// back or below zero. Those that would are dropped, e.g. when the first
+	// sender report lines the stream up with the others.
+	auto mediaClock = std::make_shared<MediaClockHandler>(
+	    avCodecId == AV_CODEC_ID_OPUS ? 48000 : 90000, syncGroup);
+	auto lastPts = std::make_shared<int64_t>(-1);
 
-	track->onFrame([decoder, pipeId](rtc::binary binary, rtc::FrameInfo info) {
-		auto packet = createAVPacket();
+	if (avCodecId == AV_CODEC_ID_OPUS) {
+		track->chainMediaHandler(mediaClock);
+		bool joined = syncGroup->join(SyncStream::Audio);
+		// Audio is reported played, and held back for the video, by the
+		// sinks playing it out. Frames from before the clock was aligned
+		// are on another timeline.
+		auto alignedPts = std::make_shared<std::atomic<int64_t>>(INT64_MAX);
+		int listenerId = -1;
+		if (joined) {
+			listenerId = addPlayoutListener(
+			    pipeId,
+			    [syncGroup, alignedPts](int64_t pts, int64_t time) {
+				    if (pts >= *alignedPts) {
+					    int64_t captured = av_rescale(pts, 1000000, 48000);
+					    syncGroup->played(SyncStream::Audio, captured, time);
+				    }
+			    },
+			    [syncGroup]() { return syncGroup->delay(SyncStream::Audio); });
+		}
+		// Opus goes through libopus directly for FEC and concealment, the
+		// decoder then only describes the stream
+		auto opusReceiver = std::make_shared<OpusReceiver>();
+		auto pool = std::make_shared<AudioFramePool>();
+		track->onFrame([pipeId, decoder, opusReceiver, pool, sourceId,
+		                mediaClock, alignedPts,
+		                lastPts](rtc::binary binary, rtc::FrameInfo info) {
+			auto packet = createAVPacket();
+			if (av_new_packet(packet.get(), static_cast<int>(binary.size())) <
+			    0) {
+				throw std::runtime_error("Could not allocate AVPacket data");
+			}
+			memcpy(packet->data, reinterpret_cast<const void *>(binary.data()),
+			       binary.size());
+			packet->time_base = (AVRational){1, 48000};
+			packet->flags |= AV_PKT_FLAG_KEY;
 
-		if (av_new_packet(packet.get(), static_cast<int>(binary.size())) < 0) {
-			throw std::runtime_error("Could not allocate AVPacket data");
+			int64_t pts = opusReceiver->receive(
+			    packet->data, packet->size, info.timestamp,
+			    [&](const float *samples, int nb_samples, int64_t pts) {
+				    int64_t time = mediaClock->toLocalClock((uint32_t)pts);
+				    int64_t framePts =
+				        wallClockPts(time, (AVRational){1, 48000});
+				    if (framePts < 0 || framePts <= *lastPts) {
+					    return;
+				    }
+				    *lastPts = framePts;
+				    if (*alignedPts == INT64_MAX && mediaClock->synced()) {
+					    *alignedPts = framePts;
+				    }
+				    auto frame = pool->get(AV_SAMPLE_FMT_FLT, 48000, 2,
+				                           nb_samples, framePts);
+				    memcpy(frame->data[0], samples,
+				           nb_samples * 2 * sizeof(float));
+				    publish(pipeId, frame);
+			    });
+			// Late packets are dropped, recordings get the rest on the
+			// unwrapped timeline, which never goes back
+			if (pts < 0) {
+				return;
+			}
+			packet->pts = pts;
+			packet->dts = pts;
+			publishPacket(sourceId, packet, decoder->parameters());
+		});
+		int statsId = -1;
+		if (joined) {
+			statsId = addStatsSource(pipeId, [syncGroup]() {
+				PipeStats stats;
+				addSyncStats(stats, *syncGroup);
+				return stats;
+			});
 		}
-		memcpy(packet->data, reinterpret_cast<const void *>(binary.data()),
-		       binary.size());
-		packet->pts = info.timestamp;
-		packet->dts = info.timestamp;
-
-		auto frames = decoder->decode(packet);
-		for (auto frame : frames) {
-			publish(pipeId, frame);
+		return [sourceId, syncGroup, joined, listenerId, statsId]() {
+			if (joined) {
+				removeStatsSource(statsId);
+				removePlayoutListener(listenerId);
+				syncGroup->leave(SyncStream::Audio);
+			}
+			removePacketSource(sourceId);
+		};
+	}
+
+	// Video frames are reassembled from the RTP packets by the jitter
+	// buffer, which hands them on in order when they fall due
+	auto codec = avCodecId == AV_CODEC_ID_H265 ? RtpVideoCodec::H265
+	                                            : RtpVideoCodec::H264;
+	bool joined = syncGroup->join(SyncStream::Video);
+	auto jitterBuffer = std::make_shared<JitterBufferHandler>(
+	    codec,
+	    [decoder, pipeId, avCodecId, sourceId, mediaClock, syncGroup, joined,
+	     lastPts](const JitterBufferFrame &frame) {
+		    auto packet = createAVPacket();
+		    if (av_new_packet(packet.get(), (int)frame.data.size()) < 0) {
+			    throw std::runtime_error("Could not allocate AVPacket data");
+		    }
+		    memcpy(packet->data, frame.data.data(), frame.data.size());
+		    packet->pts = frame.pts;
+		    packet->dts = frame.pts;
+		    packet->time_base = (AVRational){1, 90000};
+		    bool key = isKeyPacket(avCodecId, packet->data, packet->size);
+		    if (key) {
+			    packet->flags |= AV_PKT_FLAG_KEY;
+		    }
+
+		    // Nothing shows the frames, e.g. an offscreen view. Decoding
+		    // resumes at a keyframe once something subscribes, though the
+		    // first one is decoded for the parameters recordings need.
+		    auto par = decoder->parameters();
+		    if (par && !hasSubscribers(pipeId)) {
+			    decoder->skip();
+			    publishPacket(sourceId, packet, par);
+			    return;
+		    }
+		    if (!key && frame.afterLoss) {
+			    // Its references may be among the lost frames
+			    decoder->resync();
+		    }
+
+		    auto frames = decoder->decode(packet);
+		    par = decoder->parameters();
+		    if (par) {
+			    publishPacket(sourceId, packet, par);
+		    }
+		    for (auto frame : frames) {
+			    int64_t time = mediaClock->toLocalClock((uint32_t)frame->pts);
+			    frame->pts = wallClockPts(time, (AVRational){1, 90000});
+			    frame->time_base = (AVRational){1, 90000};
+			    if (frame->pts < 0 || frame->pts <= *lastPts) {
+				    continue;
+			    }
+			    *lastPts = frame->pts;
+			    if (joined && mediaClock->synced()) {
+				    // As it would have played out without waiting for audio
+				    int64_t now = micros(std::chrono::steady_clock::now());
+				    int64_t captured = av_rescale(frame->pts, 1000000, 90000);
+				    now -= syncGroup->delay(SyncStream::Video);
+				    syncGroup->played(SyncStream::Video, captured, now);
+			    }
+			    publish(pipeId, frame);
+		    }
+	    },
+	    [syncGroup, joined]() {
+		    return joined ? syncGroup->delay(SyncStream::Video) : 0;
+	    });
+	track->chainMediaHandler(jitterBuffer);
+	// Handles incoming RTP before the jitter buffer takes it, and sends the
+	// PLIs asked for by requestKeyframe
+	track->chainMediaHandler(std::make_shared<rtc::RtcpReceivingSession>());
+	track->chainMediaHandler(mediaClock);
+	auto ssrcs = track->description().getSSRCs();
+	auto nackHandler = std::make_shared<NackHandler>(
+	    ssrcs.empty() ? 1 : ssrcs[0], rtpMap.payloadType, rtxPayloadType);
+	track->chainMediaHandler(nackHandler);
+	int statsId = addStatsSource(pipeId, [jitterBuffer, decoder, nackHandler,
+	                                      syncGroup, joined]() {
+		PipeStats stats;
+		auto buffered = jitterBuffer->stats();
+		stats["jitterBuffer.packets"] = buffered.packets;
+		stats["jitterBuffer.duplicates"] = buffered.duplicates;
+		stats["jitterBuffer.late"] = buffered.late;
+		stats["jitterBuffer.frames"] = buffered.frames;
+		stats["jitterBuffer.lateFrames"] = buffered.lateFrames;
+		stats["jitterBuffer.dropped"] = buffered.dropped;
+		stats["jitterBuffer.resets"] = buffered.resets;
+		stats["jitterBuffer.buffered"] = buffered.buffered;
+		stats["jitterBuffer.jitter"] = buffered.jitter;
+		stats["jitterBuffer.targetDelay"] = buffered.targetDelay;
+		stats["jitterBuffer.avgDelay"] = buffered.avgDelay;
+		auto decoded = decoder->stats();
+		stats["decoder.packets"] = decoded.packets;
+		stats["decoder.frames"] = decoded.frames;
+		stats["decoder.errors"] = decoded.errors;
+		stats["decoder.dropped"] = decoded.dropped;
+		stats["decoder.skipped"] = decoded.skipped;
+		stats["decoder.keyframeRequests"] = decoded.keyframeRequests;
+		stats["decoder.degradation"] = (int)decoded.degradation;
+		stats["decoder.degradations"] = decoded.degradations;
+		stats["decoder.load"] = decoded.load;
+		auto nacked = nackHandler->stats();
+		stats["nack.missing"] = nacked.missing;
+		stats["nack.requests"] = nacked.requests;
+		stats["nack.recovered"] = nacked.recovered;
+		stats["nack.reordered"] = nacked.reordered;
+		stats["nack.lost"] = nacked.lost;
+		stats["nack.rtt"] = nacked.rtt;
+		if (joined) {
+			addSyncStats(stats, *syncGroup);
 		}
+		return stats;
 	});
+	return [sourceId, statsId, jitterBuffer, decoder, nackHandler, syncGroup,
+	        joined]() {
+		removeStatsSource(statsId);
+		jitterBuffer->close();
+		if (joined) {
+			auto sync = syncGroup->stats();
+			LOGI("a/v sync: video %.1f ms behind audio, audio delayed %.1f "
+			     "ms, video %.1f ms\n",
+			     sync.offset, sync.audioDelay, sync.videoDelay);
+			syncGroup->leave(SyncStream::Video);
+		}
+		auto nacked = nackHandler->stats();
+		LOGI("nack: %llu packets missing, %llu NACKed, recovered %llu, "
+		     "lost %llu, rtt %.1f ms\n",
+		     (unsigned long long)nacked.missing,
+		     (unsigned long long)nacked.requests,
+		     (unsigned long long)nacked.recovered,
+		     (unsigned long long)nacked.lost, nacked.rtt);
+		auto stat = jitterBuffer->stats();
+		LOGI("jitter buffer released %llu frames, dropped %llu, late %llu, "
+		     "delay avg %.1f ms target %.1f ms, jitter %.1f ms\n",
+		     (unsigned long long)stat.frames, (unsigned long long)stat.dropped,
+		     (unsigned long long)stat.lateFrames, stat.avgDelay,
+		     stat.targetDelay, stat.jitter);
+		auto decoded = decoder->stats();
+		LOGI("decoder errors %llu, dropped %llu packets, skipped %llu "
+		     "unwatched, requested %llu keyframes, degraded %llu times, "
+		     "level %d load %.2f\n",
+		     (unsigned long long)decoded.errors,
+		     (unsigned long long)decoded.dropped,
+		     (unsigned long long)decoded.skipped,
+		     (unsigned long long)decoded.keyframeRequests,
+		     (unsigned long long)decoded.degradations,
+		     (int)decoded.degradation, decoded.load);
+		removePacketSource(sourceId);
+	};
 }
 
 std::shared_ptr<rtc::Track>
-addTransceiver(std::shared_ptr<rtc::PeerConnection> peerConnection, int index,
+addTransceiver(std::shared_ptr<rtc::PeerConnection> peerConnection,
+               std::shared_ptr<PeerConnectionMedia> connectionMedia, int index,
                const std::string &kind, rtc::Description::Direction direction,
                const std::string &sendPipeId, const std::string &recvPipeId,
                const std::vector<std::string> &msids,
-               const std::optional<std::string> &trackid) {
+               const std::optional<std::string> &trackid,
+               const OpusEncoderOptions &opus,
+               const VideoEncoderOptions &video) {
 
+	// Rejected here rather than once the track opens
+	checkOpusOptions(opus);
+	// What this side prefers to receive, and can decode
+	auto opusFmtp = getOpusFmtp(opus.dtx);
 	std::shared_ptr<rtc::Track> track;
 	auto remoteDesc = peerConnection->remoteDescription();
 	if (!remoteDesc) {
 		auto media = getSupportedMedia(std::to_string(index), direction, kind,
-		                               msids, trackid);
+		                               msids, trackid, opusFmtp);
 		track = peerConnection->addTrack(std::move(media));
 	} else {
 		auto media = negotiateAnswerMedia(*remoteDesc, index, direction, kind,
-		                                  msids, trackid);
+		                                  msids, trackid, opusFmtp);
 		if (!media) {
 			throw std::runtime_error("No matching media found for index: " +
 			                         std::to_string(index));
@@ -127,21 +527,38 @@ addTransceiver(std::shared_ptr<rtc::PeerConnection> peerConnection, int index,
 		track = peerConnection->addTrack(std::move(*media));
 	}
 
-	track->onOpen([peerConnection, track, sendPipeId, recvPipeId]() {
+	track->onOpen([peerConnection, connectionMedia, track, sendPipeId,
+	               recvPipeId, opus, video]() {
+		auto remoteDesc = peerConnection->remoteDescription().value();
 		auto rtpMap = negotiateRtpMap(
-		    peerConnection->remoteDescription().value(),
-		    peerConnection->localDescription().value(), track->mid());
+		    remoteDesc, peerConnection->localDescription().value(),
+		    track->mid());
 		if (!rtpMap) {
 			return;
 		}
 
+		std::vector<std::function<void()>> cleanups;
 		if (!sendPipeId.empty()) {
-			SenderOnOpen(track, sendPipeId, rtpMap.value());
+			auto remoteFmtps =
+			    getFmtps(remoteDesc, track->mid(), rtpMap->payloadType);
+			cleanups.push_back(
+			    SenderOnOpen(track, sendPipeId, rtpMap.value(),
+			                 negotiateOpusOptions(opus, remoteFmtps), video,
+			                 connectionMedia->pacedSender()));
 		}
 
 		if (!recvPipeId.empty()) {
-			ReceiverOnOpen(track, recvPipeId, rtpMap.value());
+			int rtxPayloadType = getRtxPayloadType(
+			    remoteDesc, track->mid(), rtpMap->payloadType);
+			cleanups.push_back(
+			    ReceiverOnOpen(track, recvPipeId, rtpMap.value(),
+			                   rtxPayloadType, connectionMedia->syncGroup()));
 		}
+		track->onClosed([cleanups]() {
+			for (auto &cleanup : cleanups) {
+				cleanup();
+			}
+		});
 	});
 	return track;
 }
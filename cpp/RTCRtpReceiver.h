@@ -1,9 +1,33 @@
 #pragma once
+#include <memory>
+#include <mutex>
 #include <rtc/rtc.hpp>
 
+struct OpusEncoderOptions;
+struct VideoEncoderOptions;
+class PacedSender;
+class SyncGroup;
+
+// What the tracks of a peer connection share, kept with the connection:
+// the pacer of its senders and the a/v sync of its receivers. Each is
+// made on first use.
+class PeerConnectionMedia {
+  private:
+	std::mutex mutex;
+	std::shared_ptr<PacedSender> paced;
+	std::shared_ptr<SyncGroup> sync;
+
+  public:
+	std::shared_ptr<PacedSender> pacedSender();
+	std::shared_ptr<SyncGroup> syncGroup();
+};
+
 std::shared_ptr<rtc::Track>
-addTransceiver(std::shared_ptr<rtc::PeerConnection> peerConnection, int index,
+addTransceiver(std::shared_ptr<rtc::PeerConnection> peerConnection,
+               std::shared_ptr<PeerConnectionMedia> connectionMedia, int index,
                const std::string &kind, rtc::Description::Direction direction,
                const std::string &sendPipeId, const std::string &recvPipeId,
                const std::vector<std::string> &msids,
-               const std::optional<std::string> &trackid);
\ No newline at end of file
+               const std::optional<std::string> &trackid,
+               const OpusEncoderOptions &opus,
+               const VideoEncoderOptions &video);
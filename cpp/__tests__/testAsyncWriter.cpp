@@ -0,0 +1,168 @@
+#include "asyncwriter.h"
+#include "ffmpeg.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <thread>
+
+TEST(AsyncWriterTest, testOffsets) {
+	std::vector<uint8_t> out;
+	AsyncWriter writer(
+	    [&out](int64_t offset, const uint8_t *data, size_t size) {
+		    if (out.size() < offset + size) {
+			    out.resize(offset + size);
+		    }
+		    memcpy(out.data() + offset, data, size);
+	    },
+	    4);
+
+	const uint8_t a[] = {1, 2, 3, 4};
+	const uint8_t b[] = {9, 9};
+	writer.write(a, sizeof(a));
+	ASSERT_EQ(writer.seek(1, SEEK_SET), 1);
+	writer.write(b, sizeof(b));
+	ASSERT_EQ(writer.seek(0, SEEK_END), 4);
+	writer.write(a, 1);
+	writer.close();
+
+	ASSERT_EQ(out, std::vector<uint8_t>({1, 9, 9, 4, 1}));
+	ASSERT_EQ(writer.stats().bytesWritten, 7);
+	ASSERT_EQ(writer.stats().writes, 3);
+}
+
+TEST(AsyncWriterTest, testSinkError) {
+	AsyncWriter writer(
+	    [](int64_t, const uint8_t *, size_t) {
+		    throw std::runtime_error("disk full");
+	    },
+	    4);
+	const uint8_t a[] = {1};
+	writer.write(a, 1);
+	ASSERT_THROW(writer.flush(), std::runtime_error);
+	ASSERT_THROW(writer.write(a, 1), std::runtime_error);
+}
+
+TEST(AsyncWriterTest, testCloseReportsSinkError) {
+	AsyncWriter writer(
+	    [](int64_t, const uint8_t *, size_t) {
+		    throw std::runtime_error("disk full");
+	    },
+	    4);
+	const uint8_t a[] = {1};
+	writer.write(a, 1);
+	ASSERT_THROW(writer.close(), std::runtime_error);
+}
+
+TEST(AsyncWriterTest, testStopReportsSinkError) {
+	std::atomic<bool> full = false;
+	MuxerOptions options;
+	options.copyVideo = true;
+	options.openSink = [&](const std::string &) -> WriteSink {
+		return [&](int64_t, const uint8_t *, size_t) {
+			if (full) {
+				throw std::runtime_error("disk full");
+			}
+		};
+	};
+	std::string file = testing::TempDir() + "/test_full.mp4";
+	Muxer muxer(file, AV_CODEC_ID_NONE, AV_CODEC_ID_H264, options);
+
+	Encoder encoder(AV_CODEC_ID_H264);
+	for (int i = 0; i < 10; ++i) {
+		auto frame = createVideoFrame(AV_PIX_FMT_NV12, 320, 240, i * 3000);
+		for (auto &packet : encoder.encode(frame)) {
+			ASSERT_TRUE(muxer.mux_video_packet(packet, encoder.parameters()));
+		}
+	}
+	// Only the trailer and what is still buffered are lost
+	full = true;
+	ASSERT_THROW(muxer.stop(), std::runtime_error);
+}
+
+TEST(AsyncWriterTest, testThrottledSinkKeepsMuxRate) {
+	const int frames = 30;
+	double stall = 50; // ms per write
+	std::mutex mutex;
+	std::vector<uint8_t> out;
+	MuxerOptions options;
+	options.copyVideo = true;
+	// Small buffers, so that every few packets reach the sink
+	options.writeBufferSize = 4096;
+	options.writeQueueSize = 256;
+	options.openSink = [&](const std::string &) -> WriteSink {
+		return [&, stall](int64_t offset, const uint8_t *data, size_t size) {
+			std::this_thread::sleep_for(
+			    std::chrono::duration<double, std::milli>(stall));
+			std::lock_guard lock(mutex);
+			if (out.size() < offset + size) {
+				out.resize(offset + size);
+			}
+			memcpy(out.data() + offset, data, size);
+		};
+	};
+	std::string file = testing::TempDir() + "/test_throttled.mp4";
+	Muxer muxer(file, AV_CODEC_ID_NONE, AV_CODEC_ID_H264, options);
+
+	Encoder encoder(AV_CODEC_ID_H264);
+	std::vector<std::shared_ptr<AVPacket>> packets;
+	for (int i = 0; i < frames; ++i) {
+		auto frame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+		// Noise, so that the packets fill the buffer
+		for (int y = 0; y < 480; ++y) {
+			for (int x = 0; x < 640; ++x) {
+				frame->data[0][y * frame->linesize[0] + x] = rand();
+			}
+		}
+		for (auto &packet : encoder.encode(frame)) {
+			packets.push_back(packet);
+		}
+	}
+	for (auto &packet : encoder.encode(nullptr)) {
+		packets.push_back(packet);
+	}
+
+	double muxTime = 0;
+	size_t maxLag = 0;
+	for (auto &packet : packets) {
+		auto start = std::chrono::steady_clock::now();
+		ASSERT_TRUE(muxer.mux_video_packet(packet, encoder.parameters()));
+		muxTime += std::chrono::duration<double, std::milli>(
+		               std::chrono::steady_clock::now() - start)
+		               .count();
+		maxLag = std::max(maxLag, muxer.writerStats().queueDepth);
+	}
+	muxer.stop();
+	auto stat = muxer.writerStats();
+
+	LOGI("writes %llu, time in mux %.2f ms, max lag %zu, "
+	     "max write latency %.1f ms\n",
+	     (unsigned long long)stat.writes, muxTime, maxLag,
+	     stat.maxWriteLatency);
+
+	// Muxing every packet took less than the sink needs for a single
+	// write, the lag was absorbed by the queue
+	EXPECT_GT(stat.writes, 5u);
+	EXPECT_LT(muxTime, stall);
+	EXPECT_GT(maxLag, 1u);
+	EXPECT_GE(stat.maxWriteLatency, stall);
+	EXPECT_EQ(stat.queueDepth, 0u);
+
+	// The trailer patched in over what was written before reads back
+	{
+		std::ofstream copy(file, std::ios::binary);
+		copy.write((const char *)out.data(), out.size());
+	}
+	AVFormatContext *fmt_ctx = nullptr;
+	ASSERT_EQ(avformat_open_input(&fmt_ctx, file.c_str(), NULL, NULL), 0);
+	ASSERT_GE(avformat_find_stream_info(fmt_ctx, NULL), 0);
+	int read = 0;
+	auto packet = createAVPacket();
+	while (av_read_frame(fmt_ctx, packet.get()) >= 0) {
+		read += 1;
+		av_packet_unref(packet.get());
+	}
+	avformat_close_input(&fmt_ctx);
+	EXPECT_EQ(read, (int)packets.size());
+}
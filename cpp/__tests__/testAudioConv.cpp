@@ -0,0 +1,221 @@
+#include "audioconv.h"
+#include "ffmpeg.h"
+#include "pixelconv.h"
+#include <chrono>
+#include <gtest/gtest.h>
+#include <random>
+
+// Not a multiple of the vector width so the scalar tails run too
+static const int samples = 963;
+
+static std::vector<SimdLevel> supportedLevels() {
+	std::vector<SimdLevel> levels;
+	for (auto level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2,
+	                   SimdLevel::NEON}) {
+		if (simdLevelSupported(level)) {
+			levels.push_back(level);
+		}
+	}
+	return levels;
+}
+
+// Full scale noise going slightly past +-1 to exercise saturation.
+static std::shared_ptr<AVFrame> noiseFrame(AVSampleFormat format,
+                                           int channels, int nb_samples) {
+	static std::mt19937 rng(1);
+	std::uniform_real_distribution<float> dist(-1.1f, 1.1f);
+	auto frame = createAudioFrame(format, 48000, channels, nb_samples, 0);
+	bool planar = av_sample_fmt_is_planar(format);
+	int planes = planar ? channels : 1;
+	int count = planar ? nb_samples : nb_samples * channels;
+	for (int p = 0; p < planes; ++p) {
+		for (int i = 0; i < count; ++i) {
+			if (format == AV_SAMPLE_FMT_S16 || format == AV_SAMPLE_FMT_S16P) {
+				((int16_t *)frame->data[p])[i] = rng();
+			} else {
+				((float *)frame->data[p])[i] = dist(rng);
+			}
+		}
+	}
+	return frame;
+}
+
+// The conversion swresample makes, as the Resampler did before.
+static std::shared_ptr<AVFrame> swrConvert(std::shared_ptr<AVFrame> frame,
+                                           AVSampleFormat format,
+                                           int channels) {
+	AVChannelLayout layout;
+	av_channel_layout_default(&layout, channels);
+	SwrContext *swr = nullptr;
+	swr_alloc_set_opts2(&swr, &layout, format, 48000, &frame->ch_layout,
+	                    (AVSampleFormat)frame->format, 48000, 0, nullptr);
+	swr_init(swr);
+	auto dst = createAudioFrame(format, 48000, channels, frame->nb_samples, 0);
+	swr_convert(swr, dst->data, dst->nb_samples,
+	            (const uint8_t **)frame->data, frame->nb_samples);
+	swr_free(&swr);
+	return dst;
+}
+
+class AudioConvTest : public testing::Test {
+  protected:
+	void TearDown() override { setSimdLevel(detectSimdLevel()); }
+};
+
+TEST_F(AudioConvTest, testBitExactAcrossLevels) {
+	auto s16 = noiseFrame(AV_SAMPLE_FMT_S16, 2, samples);
+	auto flt = noiseFrame(AV_SAMPLE_FMT_FLTP, 2, samples);
+	const float *left = (const float *)flt->data[0];
+	const float *right = (const float *)flt->data[1];
+	auto run = [&]() {
+		std::vector<float> out(samples * 8);
+		std::vector<int16_t> out16(samples);
+		s16ToFloat((const int16_t *)s16->data[0], out.data(), samples);
+		floatToS16(left, out16.data(), samples);
+		interleave2(left, right, out.data() + samples, samples);
+		deinterleave2(out.data() + samples, out.data() + 3 * samples,
+		              out.data() + 4 * samples, samples);
+		mix2(left, right, out.data() + 5 * samples, samples, 0.5f);
+		applyGain(left, out.data() + 6 * samples, samples, M_SQRT1_2);
+		return std::make_pair(out, out16);
+	};
+	setSimdLevel(SimdLevel::Scalar);
+	auto ref = run();
+	for (auto level : supportedLevels()) {
+		setSimdLevel(level);
+		EXPECT_TRUE(run() == ref) << simdLevelName(level);
+	}
+}
+
+TEST_F(AudioConvTest, testFloatToS16Rounding) {
+	const float in[] = {0.5f / 32768,  1.5f / 32768, -0.5f / 32768,
+	                    -2.5f / 32768, 1.0f,         -1.0f,
+	                    2.0f,          -2.0f,        32767.5f / 32768};
+	const int16_t expected[] = {0, 2, 0, -2, 32767, -32768, 32767, -32768,
+	                            32767};
+	const int count = sizeof(in) / sizeof(in[0]);
+	for (auto level : supportedLevels()) {
+		setSimdLevel(level);
+		// Repeated so the vector loops see every value
+		std::vector<float> src;
+		for (int i = 0; i < 8; ++i) {
+			src.insert(src.end(), in, in + count);
+		}
+		std::vector<int16_t> dst(src.size());
+		floatToS16(src.data(), dst.data(), src.size());
+		for (size_t i = 0; i < dst.size(); ++i) {
+			EXPECT_EQ(dst[i], expected[i % count])
+			    << simdLevelName(level) << " " << src[i];
+		}
+	}
+}
+
+TEST_F(AudioConvTest, testResamplerMatchesSwr) {
+	const AVSampleFormat formats[] = {AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P,
+	                                  AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_FLTP};
+	for (auto inFormat : formats) {
+		for (int inChannels : {1, 2}) {
+			auto src = noiseFrame(inFormat, inChannels, samples);
+			for (auto outFormat : formats) {
+				for (int outChannels : {1, 2}) {
+					Resampler resampler;
+					auto out =
+					    resampler.resample(src, outFormat, 48000, outChannels);
+					auto ref = swrConvert(src, outFormat, outChannels);
+					ASSERT_EQ(out->nb_samples, samples);
+					ASSERT_EQ(out->format, outFormat);
+					ASSERT_EQ(out->ch_layout.nb_channels, outChannels);
+
+					// swresample mixes integers in fixed point
+					bool integer = av_get_bytes_per_sample(outFormat) == 2;
+					bool mixed = inChannels != outChannels;
+					double tolerance = integer && mixed ? 1 : 0;
+					bool planar = av_sample_fmt_is_planar(outFormat);
+					int planes = planar ? outChannels : 1;
+					int count = planar ? samples : samples * outChannels;
+					double maxDiff = 0;
+					for (int p = 0; p < planes; ++p) {
+						for (int i = 0; i < count; ++i) {
+							double a = integer
+							               ? ((int16_t *)out->data[p])[i]
+							               : ((float *)out->data[p])[i];
+							double b = integer
+							               ? ((int16_t *)ref->data[p])[i]
+							               : ((float *)ref->data[p])[i];
+							maxDiff = std::max(maxDiff, std::abs(a - b));
+						}
+					}
+					EXPECT_LE(maxDiff, tolerance)
+					    << av_get_sample_fmt_name(inFormat) << inChannels
+					    << " -> " << av_get_sample_fmt_name(outFormat)
+					    << outChannels;
+				}
+			}
+		}
+	}
+}
+
+TEST_F(AudioConvTest, testResamplerPts) {
+	Resampler resampler;
+	auto in1 = noiseFrame(AV_SAMPLE_FMT_S16, 1, 960);
+	auto in2 = noiseFrame(AV_SAMPLE_FMT_S16, 1, 960);
+	in1->pts = 100;
+	auto out1 = resampler.resample(in1, AV_SAMPLE_FMT_FLTP, 48000, 2);
+	auto out2 = resampler.resample(in2, AV_SAMPLE_FMT_FLTP, 48000, 2);
+	ASSERT_EQ(out1->pts, 100);
+	ASSERT_EQ(out2->pts, 1060);
+	ASSERT_EQ(resampler.resample(nullptr, AV_SAMPLE_FMT_FLTP, 48000, 2),
+	          nullptr);
+}
+
+TEST_F(AudioConvTest, benchmarkAgainstSwr) {
+	const int runs = 2000;
+	struct Case {
+		AVSampleFormat inFormat;
+		int inChannels;
+		AVSampleFormat outFormat;
+		int outChannels;
+		const char *name;
+	};
+	const Case cases[] = {
+	    {AV_SAMPLE_FMT_S16, 1, AV_SAMPLE_FMT_FLTP, 2, "s16 mono -> fltp"},
+	    {AV_SAMPLE_FMT_FLT, 2, AV_SAMPLE_FMT_FLTP, 2, "flt -> fltp"},
+	    {AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_S16, 2, "fltp -> s16"},
+	    {AV_SAMPLE_FMT_FLTP, 2, AV_SAMPLE_FMT_FLT, 1, "fltp -> flt mono"},
+	};
+	auto time = [&](const std::function<void()> &fn) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < runs; ++i) {
+			fn();
+		}
+		return std::chrono::duration<double, std::micro>(
+		           std::chrono::steady_clock::now() - start)
+		           .count() /
+		       runs;
+	};
+	for (auto &c : cases) {
+		auto src = noiseFrame(c.inFormat, c.inChannels, 960);
+		AVChannelLayout layout;
+		av_channel_layout_default(&layout, c.outChannels);
+		SwrContext *swr = nullptr;
+		swr_alloc_set_opts2(&swr, &layout, c.outFormat, 48000,
+		                    &src->ch_layout, c.inFormat, 48000, 0, nullptr);
+		swr_init(swr);
+		auto dst = createAudioFrame(c.outFormat, 48000, c.outChannels, 960);
+		double swrTime = time([&]() {
+			swr_convert(swr, dst->data, 960, (const uint8_t **)src->data,
+			            960);
+		});
+		swr_free(&swr);
+		LOGI("%-18s swr %.2f us\n", c.name, swrTime);
+		for (auto level : supportedLevels()) {
+			setSimdLevel(level);
+			Resampler resampler;
+			double directTime = time([&]() {
+				resampler.resample(src, c.outFormat, 48000, c.outChannels);
+			});
+			LOGI("%-18s %s %.2f us\n", c.name, simdLevelName(level),
+			     directTime);
+		}
+	}
+}
@@ -0,0 +1,138 @@
+#include "avsync.h"
+#include <gtest/gtest.h>
+#include <vector>
+
+static void write32(std::vector<uint8_t> &out, uint32_t value) {
+	out.push_back(value >> 24);
+	out.push_back(value >> 16);
+	out.push_back(value >> 8);
+	out.push_back(value);
+}
+
+static std::vector<uint8_t> senderReport(uint32_t ssrc, uint64_t ntp,
+                                         uint32_t timestamp) {
+	std::vector<uint8_t> out = {0x80, 200, 0, 6};
+	write32(out, ssrc);
+	write32(out, ntp >> 32);
+	write32(out, (uint32_t)ntp);
+	write32(out, timestamp);
+	write32(out, 100);    // packets
+	write32(out, 100000); // octets
+	return out;
+}
+
+// NTP time of seconds since the Unix epoch.
+static uint64_t ntp(double seconds) {
+	double since1900 = seconds + 2208988800.0;
+	return (uint64_t)(since1900 * 4294967296.0);
+}
+
+TEST(AvSyncTest, testParseSenderReport) {
+	// An SDES after it, as in a compound packet
+	auto packet = senderReport(1234, ntp(1000.5), 90000);
+	packet.insert(packet.end(), {0x81, 202, 0, 1, 0, 0, 0x04, 0xd2});
+	auto report = parseSenderReport(packet.data(), packet.size(), 1234);
+	ASSERT_TRUE(report);
+	EXPECT_EQ(report->rtpTimestamp, 90000u);
+	EXPECT_EQ(ntpToUnixMicros(report->ntp), 1000500000);
+	EXPECT_FALSE(parseSenderReport(packet.data(), packet.size(), 99));
+	EXPECT_FALSE(parseSenderReport(packet.data(), 20, 1234));
+}
+
+TEST(AvSyncTest, testMediaClock) {
+	MediaClock clock(90000);
+	// The arrival anchors the clock until a report
+	clock.arrived(1000, 5000000);
+	clock.arrived(91000, 6100000);
+	EXPECT_FALSE(clock.synced());
+	EXPECT_EQ(clock.toLocalClock(91000), 6000000);
+
+	// The sender's clock an hour ahead
+	clock.report({ntp(3605.5), 46000});
+	EXPECT_FALSE(clock.synced());
+	EXPECT_EQ(clock.offset(), -3600000000LL);
+	// As set by a stream that arrived 20 ms later
+	clock.align(clock.offset() + 20000);
+	EXPECT_TRUE(clock.synced());
+	EXPECT_EQ(clock.toLocalClock(46000), 5520000);
+	EXPECT_EQ(clock.toLocalClock(91000), 6020000);
+
+	// Later reports leave the local clock alone, a sender changing its
+	// clock included
+	clock.report({ntp(9000), 46000});
+	EXPECT_EQ(clock.toLocalClock(46000), 5520000);
+}
+
+TEST(AvSyncTest, testMediaClockWraps) {
+	MediaClock clock(90000);
+	uint32_t start = 4294967296 - 90000;
+	clock.arrived(start, 0);
+	EXPECT_EQ(clock.toLocalClock(45000), 1500000);
+	// On and on across several wraps
+	for (int64_t i = 1; i <= 8; ++i) {
+		uint32_t timestamp = start + (uint32_t)(i << 30);
+		clock.arrived(timestamp, 0);
+		EXPECT_EQ(clock.toLocalClock(timestamp), (i << 30) * 1000000 / 90000);
+	}
+}
+
+TEST(AvSyncTest, testClockOffsetShared) {
+	AvSync sync;
+	EXPECT_EQ(sync.clockOffset(-1000), -1000);
+	EXPECT_EQ(sync.clockOffset(5000), -1000);
+}
+
+// Frames 20 ms apart, audio playing out audioDelay after capture and video
+// videoDelay, each plus what the sync adds. The sender's clock is an
+// hour ahead.
+static void run(AvSync &sync, int frames, int64_t audioDelay,
+                int64_t videoDelay) {
+	const int64_t skew = 3600000000LL;
+	for (int i = 0; i < frames; ++i) {
+		int64_t captured = i * 20000;
+		sync.played(SyncStream::Audio, captured + skew, captured + audioDelay);
+		sync.played(SyncStream::Video, captured + skew, captured + videoDelay);
+	}
+}
+
+TEST(AvSyncTest, testDelaysAudio) {
+	AvSync sync;
+	run(sync, 5, 40000, 150000);
+	// Not measured long enough yet
+	EXPECT_EQ(sync.delay(SyncStream::Audio), 0);
+	EXPECT_FALSE(sync.stats().synced);
+	run(sync, 100, 40000, 150000);
+	EXPECT_EQ(sync.delay(SyncStream::Audio), 110000);
+	EXPECT_EQ(sync.delay(SyncStream::Video), 0);
+	auto stats = sync.stats();
+	EXPECT_TRUE(stats.synced);
+	EXPECT_NEAR(stats.offset, 110, 0.1);
+	EXPECT_NEAR(stats.audioDelay, 110, 0.1);
+	EXPECT_EQ(stats.videoDelay, 0);
+}
+
+TEST(AvSyncTest, testDelaysVideo) {
+	AvSync sync;
+	run(sync, 100, 200000, 60000);
+	EXPECT_EQ(sync.delay(SyncStream::Audio), 0);
+	EXPECT_EQ(sync.delay(SyncStream::Video), 140000);
+	EXPECT_NEAR(sync.stats().offset, -140, 0.1);
+}
+
+TEST(AvSyncTest, testSmallChangesIgnored) {
+	AvSync sync;
+	run(sync, 100, 40000, 150000);
+	run(sync, 200, 40000, 155000);
+	EXPECT_EQ(sync.delay(SyncStream::Audio), 110000);
+	EXPECT_NEAR(sync.stats().offset, 115, 0.1);
+	// Large ones are followed to within the same margin
+	run(sync, 200, 40000, 200000);
+	EXPECT_NEAR(sync.delay(SyncStream::Audio), 160000, 10000);
+}
+
+TEST(AvSyncTest, testBounded) {
+	AvSync sync(500);
+	run(sync, 100, 40000, 3000000);
+	EXPECT_EQ(sync.delay(SyncStream::Audio), 500000);
+	EXPECT_NEAR(sync.stats().offset, 2960, 0.1);
+}
@@ -1,8 +1,15 @@
 #include "ffmpeg.h"
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <map>
+#include <mutex>
 #include <random>
+#include <sys/mman.h>
+#include <thread>
 
 static void fillNoise(std::shared_ptr<AVFrame> frame) {
 	static std::mt19937 rng(std::random_device{}());
@@ -43,6 +50,21 @@ static void fillNoise(std::shared_ptr<AVFrame> frame) {
 	}
 }
 
+// Every C++ heap allocation of the test binary, FFmpeg's own go through
+// av_malloc() and are covered by the pools' counters.
+static std::atomic<uint64_t> heapAllocations{0};
+
+void *operator new(size_t size) {
+	heapAllocations++;
+	if (void *p = malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
 static void delay(int milliseconds) {
 	auto target = globalBaseTime + std::chrono::milliseconds(milliseconds);
 	while (std::chrono::high_resolution_clock::now() < target) {
@@ -150,6 +172,93 @@ TEST(AudioFifoTest, testPts) {
 	ASSERT_EQ(out2->pts, 961);
 }
 
+TEST(AudioFifoTest, testWrapAround) {
+	AudioFifo fifo;
+	int64_t next = 0;
+	int64_t expected = 0;
+	// Odd chunk sizes so reads straddle the end of the ring
+	for (int i = 0; i < 200; ++i) {
+		auto in = createAudioFrame(AV_SAMPLE_FMT_S16P, 48000, 2, 331, next);
+		for (int c = 0; c < 2; ++c) {
+			for (int j = 0; j < 331; ++j) {
+				((int16_t *)in->data[c])[j] = (next + j) * (c ? -1 : 1);
+			}
+		}
+		next += 331;
+		fifo.write(in);
+		while (auto out = fifo.read(1024)) {
+			ASSERT_EQ(out->pts, expected);
+			for (int j = 0; j < 1024; ++j) {
+				ASSERT_EQ(((int16_t *)out->data[0])[j],
+				          (int16_t)(expected + j));
+				ASSERT_EQ(((int16_t *)out->data[1])[j],
+				          (int16_t)-(expected + j));
+			}
+			expected += 1024;
+		}
+	}
+}
+
+TEST(AudioFifoTest, testExactFrameNotCopied) {
+	AudioFifo fifo;
+	auto in = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, 0);
+	fifo.write(in);
+	ASSERT_EQ(fifo.read(960), in);
+
+	// Buffered samples come first, then frames are copied
+	auto half = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 480, 960);
+	auto next = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, 1440);
+	fifo.write(half);
+	fifo.write(next);
+	auto out = fifo.read(960);
+	ASSERT_NE(out, next);
+	ASSERT_EQ(out->pts, 960);
+}
+
+static void steadyStateAllocations(AVSampleFormat format, int readSize) {
+	Resampler resampler;
+	AudioFifo fifo;
+	// Android microphone input, 10 ms of S16 mono
+	auto mic = createAudioFrame(AV_SAMPLE_FMT_S16, 48000, 1, 480, 0);
+	memset(mic->data[0], 0, 480 * 2);
+	auto run = [&](int chunks) {
+		for (int i = 0; i < chunks; ++i) {
+			mic->pts = i * 480;
+			fifo.write(resampler.resample(mic, format, 48000, 2));
+			while (auto frame = fifo.read(readSize)) {
+				ASSERT_EQ(frame->nb_samples, readSize);
+			}
+		}
+	};
+	run(50);
+	uint64_t heap = heapAllocations;
+	uint64_t frames = resampler.allocations() + fifo.allocations();
+	run(1000);
+	EXPECT_EQ(heapAllocations - heap, 0u);
+	EXPECT_EQ(resampler.allocations() + fifo.allocations(), frames);
+}
+
+TEST(AudioFifoTest, testSteadyStateAllocationsOpus) {
+	steadyStateAllocations(AV_SAMPLE_FMT_FLT, 960);
+}
+
+TEST(AudioFifoTest, testSteadyStateAllocationsAAC) {
+	steadyStateAllocations(AV_SAMPLE_FMT_FLTP, 1024);
+}
+
+TEST(AudioFifoTest, testExactFramesPassThrough) {
+	// 20 ms frames at 48 kHz, as Opus sources deliver them
+	Resampler resampler;
+	AudioFifo fifo;
+	auto in = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, 0);
+	for (int i = 0; i < 10; ++i) {
+		auto resampled = resampler.resample(in, AV_SAMPLE_FMT_FLT, 48000, 2);
+		fifo.write(resampled);
+		ASSERT_EQ(fifo.read(960), resampled);
+	}
+	ASSERT_EQ(fifo.allocations(), 1u); // the ring, no frames
+}
+
 TEST(ResamplerTest, testResampleFormat) {
 	auto inputFrame = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 1, 960);
 	fillNoise(inputFrame);
@@ -263,6 +372,180 @@ TEST(ResamplerTest, testPts) {
 	ASSERT_EQ(out2->pts, out1->nb_samples + 1);
 }
 
+// A stream of 20 ms frames read back 10 ms at a time, in ms of sink time.
+struct PlayoutSim {
+	PlayoutBuffer buffer;
+	double period = 20;
+	std::function<double(int)> delay = [](int) { return 0.0; };
+	bool sending = true;
+	int frames = 0;
+	int64_t reads = 0;
+	int silent = 0;
+	// As returned for the last frame written
+	int64_t playsIn = -1;
+	std::shared_ptr<AVFrame> out =
+	    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 480);
+
+	void run(double seconds) {
+		for (int64_t end = reads + seconds * 100; reads < end; ++reads) {
+			while (sending && frames * period + delay(frames) <= reads * 10) {
+				auto frame = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960,
+				                              frames * 960);
+				std::fill_n((float *)frame->data[0], 960 * 2, 0.25f);
+				playsIn = buffer.write(frame);
+				frames++;
+			}
+			buffer.read(out->data, 480);
+			silent += ((float *)out->data[0])[0] == 0;
+		}
+	}
+};
+
+TEST(PlayoutBufferTest, testSteady) {
+	PlayoutSim sim;
+	sim.run(10);
+	auto stats = sim.buffer.stats();
+	EXPECT_EQ(stats.underruns, 0u);
+	EXPECT_EQ(stats.discarded, 0u);
+	EXPECT_NEAR(stats.targetDelay, 20, 1);
+	EXPECT_LE(stats.latency, 20 + 10 + 20);
+	// Only while the target delay was first buffered
+	EXPECT_LE(sim.silent, 3);
+}
+
+TEST(PlayoutBufferTest, testJitterRaisesDelay) {
+	std::mt19937 rng(1);
+	std::vector<double> delays(2000);
+	for (auto &d : delays) {
+		d = std::uniform_real_distribution<double>(0, 60)(rng);
+	}
+	PlayoutSim sim;
+	sim.delay = [&](int i) { return delays[i]; };
+	sim.run(10);
+	auto settled = sim.buffer.stats();
+	EXPECT_GT(settled.jitter, 5);
+	EXPECT_GT(settled.targetDelay, 30);
+	EXPECT_LE(settled.targetDelay, 400);
+	sim.run(10);
+	EXPECT_EQ(sim.buffer.stats().underruns, settled.underruns);
+}
+
+TEST(PlayoutBufferTest, testDriftCompensated) {
+	for (double ppm : {-1000, 1000}) {
+		// Sending faster than the sink plays for positive ppm
+		PlayoutSim sim;
+		sim.period = 20 / (1 + ppm / 1e6);
+		sim.run(5);
+		double start = sim.buffer.stats().latency;
+		sim.run(60);
+		auto stats = sim.buffer.stats();
+		// Uncorrected the latency would have moved by 60 ms
+		EXPECT_NEAR(stats.latency, start, 20) << ppm;
+		EXPECT_NEAR(stats.drift, -ppm, 300) << ppm;
+		EXPECT_EQ(stats.underruns, 0u) << ppm;
+	}
+}
+
+TEST(PlayoutBufferTest, testUnderrun) {
+	PlayoutSim sim;
+	sim.run(2);
+	sim.sending = false;
+	sim.run(1);
+	EXPECT_EQ(sim.buffer.stats().underruns, 1u);
+	int silent = sim.silent;
+	EXPECT_GE(silent, 90);
+
+	// Plays again once the target delay is back
+	sim.frames = 150;
+	sim.sending = true;
+	sim.run(1);
+	EXPECT_LT(sim.silent - silent, 10);
+	EXPECT_EQ(sim.buffer.stats().underruns, 1u);
+}
+
+TEST(PlayoutBufferTest, testBacklogDropped) {
+	PlayoutSim sim;
+	sim.run(2);
+	// A second of audio held up somewhere arriving at once
+	for (int i = 0; i < 50; ++i) {
+		auto frame = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960,
+		                              (sim.frames + i) * 960);
+		sim.buffer.write(frame);
+	}
+	sim.buffer.read(sim.out->data, 480);
+	auto stats = sim.buffer.stats();
+	EXPECT_GT(stats.discarded, 0u);
+	EXPECT_LE(stats.latency, 400 + 10 + 20);
+}
+
+TEST(PlayoutBufferTest, testExtraDelay) {
+	PlayoutSim sim;
+	sim.run(2);
+	double start = sim.buffer.stats().latency;
+	EXPECT_NEAR(sim.playsIn / 1000.0, start, 20);
+	sim.buffer.setExtraDelay(100000);
+	int silent = sim.silent;
+	sim.run(2);
+	auto stats = sim.buffer.stats();
+	EXPECT_NEAR(stats.extraDelay, 100, 0.1);
+	EXPECT_NEAR(stats.latency, start + 100, 20);
+	EXPECT_NEAR(sim.playsIn / 1000.0, stats.latency, 20);
+	// Played as silence at once rather than stretched into
+	EXPECT_NEAR(sim.silent - silent, 10, 1);
+	EXPECT_EQ(stats.underruns, 0u);
+
+	sim.buffer.setExtraDelay(0);
+	sim.run(2);
+	EXPECT_NEAR(sim.buffer.stats().latency, start, 20);
+	EXPECT_EQ(sim.buffer.stats().underruns, 0u);
+}
+
+TEST(PlayoutBufferTest, testReset) {
+	PlayoutSim sim;
+	sim.run(1);
+	sim.buffer.reset();
+	sim.sending = false;
+	int silent = sim.silent;
+	sim.run(0.01);
+	// Dropped rather than run dry
+	EXPECT_EQ(sim.silent - silent, 1);
+	EXPECT_EQ(sim.buffer.stats().underruns, 0u);
+}
+
+TEST(PlayoutBufferTest, testConcurrentReader) {
+	// Each frame holds its index, which reads must never see go back
+	PlayoutBuffer buffer;
+	std::atomic<bool> done = false;
+	std::thread writer([&]() {
+		for (int i = 1; i <= 2000; ++i) {
+			auto frame =
+			    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, i * 960);
+			std::fill_n((float *)frame->data[0], 960 * 2, (float)i);
+			buffer.write(frame);
+			if (i % 4 == 0) {
+				std::this_thread::yield();
+			}
+		}
+		done = true;
+	});
+	auto out = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 480);
+	float last = 0;
+	int backwards = 0;
+	while (!done) {
+		buffer.read(out->data, 480);
+		const float *samples = (const float *)out->data[0];
+		for (int i = 0; i < 480 * 2; ++i) {
+			if (samples[i] != 0) {
+				backwards += samples[i] < last;
+				last = samples[i];
+			}
+		}
+	}
+	writer.join();
+	EXPECT_EQ(backwards, 0);
+	EXPECT_GT(last, 0);
+}
+
 TEST(ScalerTest, test_RGB24_to_NV12) {
 	Scaler scaler;
 	auto inputFrame = createVideoFrame(AV_PIX_FMT_RGB24, 640, 480);
@@ -285,6 +568,332 @@ TEST(ScalerTest, test_NV12_to_RGB24) {
 	ASSERT_EQ(outFrame->pts, inputFrame->pts);
 }
 
+TEST(WrapFrameTest, testMallocVideo) {
+	// Strides wider than the image, planes in separate allocations
+	const int width = 320;
+	const int height = 240;
+	uint8_t *y = (uint8_t *)malloc(384 * height);
+	uint8_t *uv = (uint8_t *)malloc(400 * height / 2);
+	memset(y, 16, 384 * height);
+	memset(uv, 128, 400 * height / 2);
+	int released = 0;
+	uint8_t *data[] = {y, uv};
+	int linesize[] = {384, 400};
+	auto frame = wrapVideoFrame(AV_PIX_FMT_NV12, width, height, data,
+	                            linesize, [&]() {
+		                            free(y);
+		                            free(uv);
+		                            released++;
+	                            });
+	ASSERT_EQ(frame->data[0], y);
+	ASSERT_EQ(frame->data[1], uv);
+	ASSERT_EQ(frame->linesize[1], 400);
+	ASSERT_EQ(av_frame_is_writable(frame.get()), 0);
+
+	// Consumers keep their own references
+	auto copy = std::shared_ptr<AVFrame>(av_frame_clone(frame.get()),
+	                                     [](AVFrame *f) { av_frame_free(&f); });
+	auto view = cropVideoFrame(frame, 0, 0, 160, 120);
+	Scaler scaler;
+	auto rgba = scaler.scale(frame, AV_PIX_FMT_RGBA, width, height);
+	ASSERT_EQ(rgba->data[0][0], 0);
+	frame.reset();
+	copy.reset();
+	ASSERT_EQ(released, 0);
+	view.reset();
+	ASSERT_EQ(released, 1);
+}
+
+TEST(WrapFrameTest, testBottomUpVideo) {
+	// Rows stored last to first, as in a bottom-up bitmap
+	const int width = 64;
+	const int height = 48;
+	std::vector<uint8_t> image(width * height);
+	for (int row = 0; row < height; ++row) {
+		memset(image.data() + row * width, row, width);
+	}
+	uint8_t *data[] = {image.data() + (height - 1) * width};
+	int linesize[] = {-width};
+	auto frame = wrapVideoFrame(AV_PIX_FMT_GRAY8, width, height, data,
+	                            linesize, nullptr);
+	ASSERT_EQ(frame->buf[0]->data, image.data());
+	ASSERT_EQ(frame->buf[0]->size, (size_t)width * height);
+
+	auto copy = cropVideoFrame(frame, 0, 0, width, height);
+	ASSERT_EQ(av_frame_make_writable(copy.get()), 0);
+	ASSERT_EQ(copy->data[0][0], height - 1);
+	ASSERT_EQ(copy->data[0][(height - 1) * copy->linesize[0]], 0);
+
+	int zero[] = {0};
+	ASSERT_THROW(wrapVideoFrame(AV_PIX_FMT_GRAY8, width, height, data, zero,
+	                            nullptr),
+	             std::invalid_argument);
+}
+
+TEST(WrapFrameTest, testMmapEncode) {
+	const int width = 640;
+	const int height = 480;
+	size_t size = width * height * 3 / 2;
+	void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ASSERT_NE(map, MAP_FAILED);
+	uint8_t *base = (uint8_t *)map;
+	memset(base, 128, size);
+	bool released = false;
+	uint8_t *data[] = {base, base + width * height};
+	int linesize[] = {width, width};
+	auto frame = wrapVideoFrame(AV_PIX_FMT_NV12, width, height, data,
+	                            linesize, [&]() {
+		                            munmap(map, size);
+		                            released = true;
+	                            });
+
+	Encoder encoder(AV_CODEC_ID_H264);
+	encoder.encode(frame);
+	frame.reset();
+	encoder.encode(nullptr);
+	ASSERT_TRUE(released);
+}
+
+TEST(WrapFrameTest, testAudio) {
+	std::vector<float> left(2048, 0.5f);
+	std::vector<float> right(2048, -0.5f);
+	bool released = false;
+	uint8_t *planes[] = {(uint8_t *)left.data(), (uint8_t *)right.data()};
+	auto frame = wrapAudioFrame(AV_SAMPLE_FMT_FLTP, 48000, 2, 2048, planes,
+	                            [&]() { released = true; });
+	ASSERT_EQ(frame->nb_samples, 2048);
+	ASSERT_EQ(frame->ch_layout.nb_channels, 2);
+	ASSERT_EQ(frame->extended_data[1], planes[1]);
+	ASSERT_EQ(frame->linesize[0], 2048 * 4);
+
+	// The encoder's FIFO copies the samples, the frame is not held on to
+	Encoder encoder(AV_CODEC_ID_OPUS);
+	encoder.encode(frame);
+	frame.reset();
+	ASSERT_TRUE(released);
+}
+
+TEST(CropTest, testSharesBuffers) {
+	auto frame = createVideoFrame(AV_PIX_FMT_RGBA, 640, 480, 1234);
+	auto view = cropVideoFrame(frame, 101, 51, 200, 100);
+	ASSERT_EQ(view->width, 200);
+	ASSERT_EQ(view->height, 100);
+	ASSERT_EQ(view->pts, 1234);
+	ASSERT_EQ(view->buf[0]->buffer, frame->buf[0]->buffer);
+	ASSERT_EQ(view->linesize[0], frame->linesize[0]);
+	ASSERT_EQ(view->data[0], frame->data[0] + 51 * frame->linesize[0] + 404);
+	ASSERT_EQ(frame->width, 640);
+}
+
+TEST(CropTest, testChromaAlignment) {
+	for (auto format : {AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P}) {
+		auto frame = createVideoFrame(format, 640, 480);
+		auto view = cropVideoFrame(frame, 101, 51, 200, 100);
+		// Moved to the even pixel, still covering the requested region
+		ASSERT_EQ(view->width, 201);
+		ASSERT_EQ(view->height, 101);
+		ASSERT_EQ(view->data[0],
+		          frame->data[0] + 50 * frame->linesize[0] + 100);
+		int chroma = format == AV_PIX_FMT_NV12 ? 100 : 50;
+		ASSERT_EQ(view->data[1],
+		          frame->data[1] + 25 * frame->linesize[1] + chroma);
+		if (format == AV_PIX_FMT_YUV420P) {
+			ASSERT_EQ(view->data[2],
+			          frame->data[2] + 25 * frame->linesize[2] + 50);
+		}
+	}
+}
+
+TEST(CropTest, testKeepsParentAlive) {
+	auto frame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480);
+	for (int y = 0; y < 480; ++y) {
+		memset(frame->data[0] + y * frame->linesize[0], y & 0xff, 640);
+	}
+	auto view = cropVideoFrame(frame, 320, 240, 320, 240);
+	ASSERT_EQ(av_buffer_get_ref_count(view->buf[0]), 2);
+	frame.reset();
+	ASSERT_EQ(av_buffer_get_ref_count(view->buf[0]), 1);
+	for (int y = 0; y < 240; ++y) {
+		ASSERT_EQ(view->data[0][y * view->linesize[0] + 319], (y + 240) & 0xff);
+	}
+
+	// Views of views and consumers that convert them
+	auto inner = cropVideoFrame(view, 0, 0, 160, 120);
+	view.reset();
+	Scaler scaler;
+	auto rgba = scaler.scale(inner, AV_PIX_FMT_RGBA, 160, 120);
+	ASSERT_EQ(rgba->width, 160);
+	ASSERT_EQ(av_buffer_get_ref_count(inner->buf[0]), 1);
+}
+
+TEST(CropTest, testOutOfBounds) {
+	auto frame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480);
+	ASSERT_THROW(cropVideoFrame(frame, 600, 0, 100, 100),
+	             std::invalid_argument);
+	ASSERT_THROW(cropVideoFrame(frame, -2, 0, 100, 100),
+	             std::invalid_argument);
+	ASSERT_THROW(cropVideoFrame(frame, 0, 0, 0, 100), std::invalid_argument);
+}
+
+// Detail at several frequencies so the filters differ in quality
+static std::shared_ptr<AVFrame> texturedNV12(int w, int h) {
+	auto frame = createVideoFrame(AV_PIX_FMT_NV12, w, h, 0);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			double v = 128 + 50 * std::sin(x * 0.05) * std::cos(y * 0.03) +
+			           30 * std::sin((x + y) * 0.4);
+			frame->data[0][y * frame->linesize[0] + x] = (uint8_t)v;
+		}
+	}
+	for (int y = 0; y < h / 2; ++y) {
+		for (int x = 0; x < w; ++x) {
+			double v = 128 + 60 * std::sin(x * 0.02 + y * 0.05);
+			frame->data[1][y * frame->linesize[1] + x] = (uint8_t)v;
+		}
+	}
+	return frame;
+}
+
+static double psnrY(const AVFrame *a, const AVFrame *b) {
+	double sse = 0;
+	for (int y = 0; y < a->height; ++y) {
+		for (int x = 0; x < a->width; ++x) {
+			int d = a->data[0][y * a->linesize[0] + x] -
+			        b->data[0][y * b->linesize[0] + x];
+			sse += d * d;
+		}
+	}
+	double mse = sse / (a->width * a->height);
+	return mse == 0 ? 100 : 10 * std::log10(255.0 * 255.0 / mse);
+}
+
+TEST(ScalerTest, testBoxDownscale) {
+	auto src = createVideoFrame(AV_PIX_FMT_YUV420P, 640, 480);
+	for (int p = 0; p < 3; ++p) {
+		int h = p ? 240 : 480;
+		for (int y = 0; y < h; ++y) {
+			memset(src->data[p] + y * src->linesize[p], y, src->linesize[p]);
+		}
+	}
+	Scaler scaler(ScaleQuality::Point);
+	auto out = scaler.scale(src, AV_PIX_FMT_YUV420P, 160, 120);
+	ASSERT_EQ(out->width, 160);
+	ASSERT_EQ(out->height, 120);
+	ASSERT_EQ(out->pts, src->pts);
+	// Rows 4y..4y+3 average to 4y + 1.5, rounded up
+	for (int y = 0; y < 120; ++y) {
+		ASSERT_EQ(out->data[0][y * out->linesize[0]], 4 * y + 2);
+	}
+	for (int y = 0; y < 60; ++y) {
+		ASSERT_EQ(out->data[1][y * out->linesize[1] + 59], 4 * y + 2);
+	}
+}
+
+TEST(ScalerTest, benchmarkQuality) {
+	const int w = 1920;
+	const int h = 1080;
+	const int runs = 10;
+	auto src = texturedNV12(w, h);
+	Scaler reference(ScaleQuality::Bicubic);
+	const std::pair<ScaleQuality, const char *> policies[] = {
+	    {ScaleQuality::Point, "point/box"},
+	    {ScaleQuality::FastBilinear, "fast-bilinear/box"},
+	    {ScaleQuality::Bilinear, "bilinear/box"},
+	    {ScaleQuality::Bicubic, "bicubic"},
+	    {ScaleQuality::Lanczos, "lanczos"},
+	};
+	for (int factor : {2, 4}) {
+		double boxPsnr = 0;
+		for (auto &[quality, name] : policies) {
+			Scaler scaler(quality);
+			std::shared_ptr<AVFrame> small;
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < runs; ++i) {
+				small =
+				    scaler.scale(src, AV_PIX_FMT_NV12, w / factor, h / factor);
+			}
+			double ms = std::chrono::duration<double, std::milli>(
+			                std::chrono::steady_clock::now() - start)
+			                .count() /
+			            runs;
+			// Upscale back the same way for every policy and compare
+			auto back = reference.scale(small, AV_PIX_FMT_NV12, w, h);
+			double psnr = psnrY(src.get(), back.get());
+			LOGI("1080p /%d %-18s %7.3f ms, PSNR %.2f dB\n", factor, name, ms,
+			     psnr);
+			if (quality == ScaleQuality::Bilinear) {
+				boxPsnr = psnr;
+			}
+		}
+		// swscale point and bilinear stay around 29 dB at either factor
+		EXPECT_GT(boxPsnr, 30);
+	}
+}
+
+static bool sameFrame(const AVFrame *a, const AVFrame *b) {
+	auto format = (AVPixelFormat)a->format;
+	auto *desc = av_pix_fmt_desc_get(format);
+	for (int p = 0; p < 4 && a->data[p]; ++p) {
+		int bytes = av_image_get_linesize(format, a->width, p);
+		int rows = p == 0 ? a->height
+		                  : AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h);
+		for (int y = 0; y < rows; ++y) {
+			if (memcmp(a->data[p] + y * a->linesize[p],
+			           b->data[p] + y * b->linesize[p], bytes) != 0) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+TEST(ScalerTest, testThreadsMatchSingleThread) {
+	auto src = texturedNV12(3840, 2160);
+	struct Target {
+		AVPixelFormat format;
+		int width;
+		int height;
+		ScaleQuality quality;
+	};
+	const Target targets[] = {
+	    {AV_PIX_FMT_RGBA, 3840, 2160, ScaleQuality::Bilinear},
+	    {AV_PIX_FMT_YUV420P, 1920, 1080, ScaleQuality::Bicubic},
+	    {AV_PIX_FMT_NV12, 1280, 720, ScaleQuality::Lanczos},
+	    {AV_PIX_FMT_BGRA, 1000, 700, ScaleQuality::FastBilinear},
+	};
+	for (auto &target : targets) {
+		Scaler single(target.quality, 1);
+		auto ref = single.scale(src, target.format, target.width,
+		                        target.height);
+		for (int threads : {2, 4, 0}) {
+			Scaler threaded(target.quality, threads);
+			auto out = threaded.scale(src, target.format, target.width,
+			                          target.height);
+			EXPECT_TRUE(sameFrame(ref.get(), out.get()))
+			    << av_get_pix_fmt_name(target.format) << " threads " << threads;
+		}
+	}
+}
+
+TEST(ScalerTest, benchmarkThreads4K) {
+	const int runs = 10;
+	auto src = texturedNV12(3840, 2160);
+	for (int threads : {1, 2, 4, 0}) {
+		Scaler scaler(ScaleQuality::Bilinear, threads);
+		scaler.scale(src, AV_PIX_FMT_RGBA, 3840, 2160);
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < runs; ++i) {
+			scaler.scale(src, AV_PIX_FMT_RGBA, 3840, 2160);
+		}
+		double ms = std::chrono::duration<double, std::milli>(
+		                std::chrono::steady_clock::now() - start)
+		                .count() /
+		            runs;
+		LOGI("4K nv12->rgba threads %d: %.2f ms\n", threads, ms);
+	}
+}
+
 TEST(EncoderTest, testEncodeOpus) {
 	Encoder encoder(AV_CODEC_ID_OPUS);
 	auto inputFrame = createAudioFrame(AV_SAMPLE_FMT_FLTP, 48000, 2, 960);
@@ -317,6 +926,94 @@ TEST(EncoderTest, testEncodeOpusBigFrame) {
 	ASSERT_GT(packets.size(), 0);
 }
 
+// Encodes 10 ms frames of silence or noise, then flushes.
+static std::vector<std::shared_ptr<AVPacket>>
+encodeOpus(Encoder &encoder, int milliseconds, bool silent) {
+	std::vector<std::shared_ptr<AVPacket>> packets;
+	for (int i = 0; i < milliseconds / 10; ++i) {
+		auto frame =
+		    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 480, i * 480);
+		if (silent) {
+			av_samples_set_silence(frame->data, 0, 480, 2, AV_SAMPLE_FMT_FLT);
+		} else {
+			fillNoise(frame);
+		}
+		for (auto &pkt : encoder.encode(frame)) {
+			packets.push_back(pkt);
+		}
+	}
+	return packets;
+}
+
+TEST(EncoderTest, testOpusFrameDuration) {
+	for (int duration : {10, 20, 40, 60}) {
+		OpusEncoderOptions opus;
+		opus.frameDuration = duration;
+		Encoder encoder(AV_CODEC_ID_OPUS, opus);
+		auto packets = encodeOpus(encoder, 1200, false);
+		ASSERT_GE(packets.size(), 1200u / duration - 1) << duration;
+		ASSERT_LE(packets.size(), 1200u / duration) << duration;
+		for (auto &pkt : packets) {
+			EXPECT_EQ(pkt->duration, duration * 48) << duration;
+		}
+	}
+}
+
+TEST(EncoderTest, testOpusOptions) {
+	OpusEncoderOptions opus;
+	opus.bitrate = 24000;
+	opus.fec = true;
+	opus.packetLoss = 10;
+	opus.constrainedVbr = true;
+	opus.complexity = 5;
+	Encoder encoder(AV_CODEC_ID_OPUS, opus);
+	auto packets = encodeOpus(encoder, 1000, false);
+	ASSERT_FALSE(packets.empty());
+	EXPECT_EQ(encoder.ctx->bit_rate, 24000);
+	EXPECT_EQ(encoder.ctx->compression_level, 5);
+	int64_t fec = 0, vbr = 0;
+	av_opt_get_int(encoder.ctx->priv_data, "fec", 0, &fec);
+	av_opt_get_int(encoder.ctx->priv_data, "vbr", 0, &vbr);
+	EXPECT_EQ(fec, 1);
+	EXPECT_EQ(vbr, 2);
+
+	opus = {};
+	opus.frameDuration = 30;
+	EXPECT_THROW(Encoder(AV_CODEC_ID_OPUS, opus), std::invalid_argument);
+	opus = {};
+	opus.complexity = 11;
+	EXPECT_THROW(Encoder(AV_CODEC_ID_OPUS, opus), std::invalid_argument);
+}
+
+TEST(EncoderTest, testOpusDtx) {
+	OpusEncoderOptions opus;
+	Encoder continuous(AV_CODEC_ID_OPUS, opus);
+	auto all = encodeOpus(continuous, 2000, true);
+	opus.dtx = true;
+	Encoder dtx(AV_CODEC_ID_OPUS, opus);
+	auto sparse = encodeOpus(dtx, 2000, true);
+	int64_t value = 0;
+	av_opt_get_int(dtx.ctx->priv_data, "dtx", 0, &value);
+	EXPECT_EQ(value, 1);
+	// A hangover, then comfort noise updates every 400 ms
+	EXPECT_EQ(all.size(), 100u);
+	EXPECT_LT(sparse.size(), 25u);
+	EXPECT_GT(sparse.back()->pts, 1500 * 48);
+	for (size_t i = 0; i < sparse.size(); ++i) {
+		EXPECT_GT(sparse[i]->size, 2);
+		if (i > 0) {
+			EXPECT_GE(sparse[i]->pts - sparse[i - 1]->pts, 960);
+		}
+	}
+
+	// Sound is sent right away, at its own time
+	auto frame = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, 96000);
+	fillNoise(frame);
+	auto packets = dtx.encode(frame);
+	ASSERT_EQ(packets.size(), 1u);
+	EXPECT_EQ(packets[0]->pts + dtx.ctx->initial_padding, 96000);
+}
+
 TEST(EncoderTest, testEncodeH264) {
 	Encoder encoder(AV_CODEC_ID_H264);
 	auto inputFrame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480);
@@ -332,6 +1029,146 @@ TEST(EncoderTest, testEncodeH264) {
 	ASSERT_GT(packets.size(), 0);
 }
 
+TEST(EncoderTest, testNativeNV12Input) {
+	Encoder h264(AV_CODEC_ID_H264);
+	Encoder h265(AV_CODEC_ID_H265);
+	auto frame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, 3000);
+	h264.encode(frame);
+	h265.encode(frame);
+	EXPECT_EQ(h264.ctx->pix_fmt, AV_PIX_FMT_NV12);
+	// libx265 has no NV12 input
+	EXPECT_EQ(h265.ctx->pix_fmt, AV_PIX_FMT_YUV420P);
+	// The frame is shared with other subscribers
+	EXPECT_EQ(frame->pts, 3000);
+	EXPECT_EQ(frame->pict_type, AV_PICTURE_TYPE_NONE);
+}
+
+TEST(EncoderTest, benchmarkNV12Input) {
+	const int frames = 30;
+	for (auto [width, height] : {std::pair{1280, 720}, std::pair{1920, 1080}}) {
+		Scaler scaler;
+		Encoder encoder(AV_CODEC_ID_H264);
+		double convertTime = 0;
+		double encodeTime = 0;
+		for (int i = 0; i < frames; ++i) {
+			auto frame =
+			    createVideoFrame(AV_PIX_FMT_NV12, width, height, i * 3000);
+			// The conversion every frame paid before
+			auto start = std::chrono::steady_clock::now();
+			scaler.scale(frame, AV_PIX_FMT_YUV420P, width, height);
+			auto mid = std::chrono::steady_clock::now();
+			encoder.encode(frame);
+			auto end = std::chrono::steady_clock::now();
+			convertTime +=
+			    std::chrono::duration<double, std::milli>(mid - start).count();
+			encodeTime +=
+			    std::chrono::duration<double, std::milli>(end - mid).count();
+		}
+		LOGI("%dp: NV12 encode %.2f ms/frame, saved conversion %.2f "
+		     "ms/frame\n",
+		     height, encodeTime / frames, convertTime / frames);
+		EXPECT_EQ(encoder.ctx->pix_fmt, AV_PIX_FMT_NV12);
+		EXPECT_GT(convertTime, 0);
+	}
+}
+
+TEST(EncoderTest, testSetSize) {
+	Encoder encoder(AV_CODEC_ID_H264);
+	std::vector<std::shared_ptr<AVPacket>> packets;
+	for (int i = 0; i < 20; ++i) {
+		if (i == 10) {
+			encoder.setSize(320, 240);
+		}
+		auto frame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+		auto encoded = encoder.encode(frame);
+		if (i == 10) {
+			// The old stream is drained, the new one starts with a keyframe
+			ASSERT_FALSE(encoded.empty());
+			auto last = encoded.back();
+			EXPECT_TRUE(isKeyPacket(AV_CODEC_ID_H264, last->data, last->size));
+		}
+		packets.insert(packets.end(), encoded.begin(), encoded.end());
+	}
+	EXPECT_EQ(encoder.ctx->width, 320);
+	EXPECT_EQ(encoder.parameters()->height, 240);
+	for (size_t i = 1; i < packets.size(); ++i) {
+		EXPECT_GT(packets[i]->pts, packets[i - 1]->pts);
+	}
+}
+
+// The textured frame panning right by a pixel a frame.
+static std::shared_ptr<AVFrame> panNV12(int w, int h, int shift) {
+	auto frame = createVideoFrame(AV_PIX_FMT_NV12, w, h, shift * 3000);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			double v = 128 + 50 * std::sin((x + shift) * 0.05) *
+			                     std::cos(y * 0.03) +
+			           30 * std::sin((x + shift + y) * 0.4);
+			frame->data[0][y * frame->linesize[0] + x] = (uint8_t)v;
+		}
+	}
+	for (int y = 0; y < h / 2; ++y) {
+		memset(frame->data[1] + y * frame->linesize[1], 128, w);
+	}
+	return frame;
+}
+
+// Largest frame over the average, the first IDR left out.
+static double peakToMean(const VideoEncoderOptions &options, int &keyframes) {
+	Encoder encoder(AV_CODEC_ID_H264, {}, options);
+	std::vector<int> sizes;
+	keyframes = 0;
+	for (int i = 0; i < 180; ++i) {
+		for (auto &packet : encoder.encode(panNV12(640, 360, i))) {
+			sizes.push_back(packet->size);
+			if (sizes.size() > 1 &&
+			    isKeyPacket(AV_CODEC_ID_H264, packet->data, packet->size)) {
+				keyframes++;
+			}
+		}
+	}
+	EXPECT_GT(sizes.size(), 100u);
+	double sum = 0;
+	int peak = 0;
+	for (size_t i = 1; i < sizes.size(); ++i) {
+		sum += sizes[i];
+		peak = std::max(peak, sizes[i]);
+	}
+	return peak / (sum / (sizes.size() - 1));
+}
+
+TEST(EncoderTest, testIntraRefresh) {
+	int keyframes = 0;
+	double gop = peakToMean({}, keyframes);
+	EXPECT_GT(keyframes, 0);
+	VideoEncoderOptions options;
+	options.intraRefresh = true;
+	double refresh = peakToMean(options, keyframes);
+	EXPECT_EQ(keyframes, 0);
+	LOGI("peak to mean frame size: %.2f with IDRs, %.2f with intra refresh\n",
+	     gop, refresh);
+	EXPECT_LT(refresh, gop / 2);
+}
+
+TEST(EncoderTest, testInfiniteGop) {
+	VideoEncoderOptions options;
+	options.infiniteGop = true;
+	Encoder encoder(AV_CODEC_ID_H264, {}, options);
+	int keyframes = 0;
+	for (int i = 0; i < 200; ++i) {
+		if (i == 150) {
+			encoder.requestKeyframe();
+		}
+		for (auto &packet : encoder.encode(panNV12(320, 180, i))) {
+			if (isKeyPacket(AV_CODEC_ID_H264, packet->data, packet->size)) {
+				keyframes++;
+			}
+		}
+	}
+	// The first and the one asked for
+	EXPECT_EQ(keyframes, 2);
+}
+
 TEST(EncoderTest, testEncodeH265) {
 	Encoder encoder(AV_CODEC_ID_H265);
 	auto inputFrame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480);
@@ -443,4 +1280,540 @@ TEST(MuxerTest, testSaveMp4) {
 	}
 	muxer.stop();
 	EXPECT_TRUE(std::filesystem::exists(file));
-}
\ No newline at end of file
+}
+TEST(MuxerTest, testFragmentedSurvivesCrash) {
+	std::string file = testing::TempDir() + "/test_fragmented.mp4";
+	MuxerOptions options;
+	options.fragmented = true;
+	options.fragmentDuration = 500;
+	{
+		Muxer muxer(file, AV_CODEC_ID_AAC, AV_CODEC_ID_H264, options);
+		for (int i = 0; i < 90; ++i) {
+			auto in1 =
+			    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 1, 1600, i * 1600);
+			fillNoise(in1);
+			auto in2 = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+			muxer.mux_audio(in1);
+			muxer.mux_video(in2);
+		}
+		// no stop(): the trailer is never written
+	}
+
+	std::ifstream in(file, std::ios::binary);
+	std::string content((std::istreambuf_iterator<char>(in)),
+	                    std::istreambuf_iterator<char>());
+	EXPECT_NE(content.find("moov"), std::string::npos);
+	EXPECT_NE(content.find("moof"), std::string::npos);
+	EXPECT_NE(content.find("mdat"), std::string::npos);
+}
+
+TEST(MuxerTest, testSegmentRing) {
+	std::string file = testing::TempDir() + "/test_segment.mp4";
+	MuxerOptions options;
+	options.segmentDuration = 1000;
+	options.maxSegments = 2;
+
+	std::vector<std::string> paths;
+	std::vector<int64_t> durations;
+	bool last = false;
+	Muxer muxer(file, AV_CODEC_ID_AAC, AV_CODEC_ID_H264, options);
+	muxer.onSegment([&](const std::string &path, int index, int64_t duration,
+	                    int64_t size, bool isLast) {
+		ASSERT_EQ(index, (int)paths.size());
+		ASSERT_GT(size, 0);
+		paths.push_back(path);
+		durations.push_back(duration);
+		last = isLast;
+	});
+
+	// 5 seconds with a keyframe every 2 seconds (gop_size = 60)
+	for (int i = 0; i < 150; ++i) {
+		auto in1 =
+		    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 1, 1600, i * 1600);
+		fillNoise(in1);
+		auto in2 = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+		muxer.mux_audio(in1);
+		muxer.mux_video(in2);
+	}
+	muxer.stop();
+
+	ASSERT_EQ(paths.size(), 3);
+	EXPECT_TRUE(last);
+	EXPECT_NEAR(durations[0], 2000, 100);
+	EXPECT_NEAR(durations[1], 2000, 100);
+	EXPECT_FALSE(std::filesystem::exists(paths[0]));
+	EXPECT_TRUE(std::filesystem::exists(paths[1]));
+	EXPECT_TRUE(std::filesystem::exists(paths[2]));
+	EXPECT_NE(paths[1], paths[2]);
+}
+
+TEST(MuxerTest, testRotationDoesNotWaitForWrites) {
+	const double stall = 50; // ms per write
+	std::mutex mutex;
+	std::map<std::string, std::vector<uint8_t>> files;
+	MuxerOptions options;
+	options.copyVideo = true;
+	options.segmentDuration = 1000;
+	options.writeBufferSize = 4096;
+	options.writeQueueSize = 1024;
+	options.openSink = [&](const std::string &path) -> WriteSink {
+		return [&, path](int64_t offset, const uint8_t *data, size_t size) {
+			std::this_thread::sleep_for(
+			    std::chrono::duration<double, std::milli>(stall));
+			std::lock_guard lock(mutex);
+			auto &out = files[path];
+			if (out.size() < offset + size) {
+				out.resize(offset + size);
+			}
+			memcpy(out.data() + offset, data, size);
+		};
+	};
+	int segments = 0;
+	std::string file = testing::TempDir() + "/test_rotation.mp4";
+	Muxer muxer(file, AV_CODEC_ID_NONE, AV_CODEC_ID_H264, options);
+	muxer.onSegment([&](const std::string &, int, int64_t, int64_t, bool) {
+		segments += 1;
+	});
+
+	// A keyframe every 2 seconds, the segment is cut on the second
+	Encoder encoder(AV_CODEC_ID_H264);
+	std::vector<std::shared_ptr<AVPacket>> packets;
+	for (int i = 0; i < 90; ++i) {
+		auto frame = createVideoFrame(AV_PIX_FMT_NV12, 320, 240, i * 3000);
+		for (int y = 0; y < 240; ++y) {
+			for (int x = 0; x < 320; ++x) {
+				frame->data[0][y * frame->linesize[0] + x] = rand();
+			}
+		}
+		for (auto &packet : encoder.encode(frame)) {
+			packets.push_back(packet);
+		}
+	}
+
+	double maxMuxTime = 0;
+	for (auto &packet : packets) {
+		auto start = std::chrono::steady_clock::now();
+		ASSERT_TRUE(muxer.mux_video_packet(packet, encoder.parameters()));
+		maxMuxTime = std::max(
+		    maxMuxTime, std::chrono::duration<double, std::milli>(
+		                    std::chrono::steady_clock::now() - start)
+		                    .count());
+	}
+	muxer.stop();
+
+	// The old segment's writes landed behind the new one's packets
+	EXPECT_EQ(segments, 2);
+	EXPECT_EQ(files.size(), 2u);
+	EXPECT_LT(maxMuxTime, stall);
+}
+
+TEST(MuxerTest, testCopyPackets) {
+	std::string file = testing::TempDir() + "/test_copy.mp4";
+	MuxerOptions options;
+	options.copyAudio = true;
+	options.copyVideo = true;
+	Muxer muxer(file, AV_CODEC_ID_OPUS, AV_CODEC_ID_H264, options);
+
+	Encoder audioEncoder(AV_CODEC_ID_OPUS);
+	Encoder videoEncoder(AV_CODEC_ID_H264);
+	bool joined = false;
+	int dropped = 0;
+	for (int i = 0; i < 150; ++i) {
+		auto in1 =
+		    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 1, 1600, i * 1600);
+		fillNoise(in1);
+		auto in2 = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+		auto audioPackets = audioEncoder.encode(in1);
+		auto videoPackets = videoEncoder.encode(in2);
+		// Join mid-GOP like a recorder started after the sender
+		for (auto &packet : videoPackets) {
+			joined |= i >= 10 && !(packet->flags & AV_PKT_FLAG_KEY);
+		}
+		if (!joined) {
+			continue;
+		}
+		for (auto &packet : audioPackets) {
+			muxer.mux_audio_packet(packet, audioEncoder.parameters());
+		}
+		for (auto &packet : videoPackets) {
+			if (!muxer.mux_video_packet(packet, videoEncoder.parameters())) {
+				dropped += 1;
+				videoEncoder.requestKeyframe();
+			}
+		}
+	}
+	muxer.stop();
+	EXPECT_GT(dropped, 0);
+
+	AVFormatContext *fmt_ctx = nullptr;
+	ASSERT_EQ(avformat_open_input(&fmt_ctx, file.c_str(), NULL, NULL), 0);
+	ASSERT_GE(avformat_find_stream_info(fmt_ctx, NULL), 0);
+	ASSERT_EQ(fmt_ctx->nb_streams, 2);
+	bool sawVideo = false;
+	auto packet = createAVPacket();
+	while (av_read_frame(fmt_ctx, packet.get()) >= 0) {
+		auto par = fmt_ctx->streams[packet->stream_index]->codecpar;
+		if (par->codec_type == AVMEDIA_TYPE_VIDEO && !sawVideo) {
+			EXPECT_EQ(par->codec_id, AV_CODEC_ID_H264);
+			EXPECT_TRUE(packet->flags & AV_PKT_FLAG_KEY);
+			sawVideo = true;
+		}
+		av_packet_unref(packet.get());
+	}
+	avformat_close_input(&fmt_ctx);
+	EXPECT_TRUE(sawVideo);
+}
+
+TEST(MuxerTest, testCopyStartsTogether) {
+	std::string file = testing::TempDir() + "/test_copy_start.mp4";
+	MuxerOptions options;
+	options.copyAudio = true;
+	options.copyVideo = true;
+	Muxer muxer(file, AV_CODEC_ID_OPUS, AV_CODEC_ID_H264, options);
+
+	// The audio comes a second before the video keyframe, which its
+	// encoder started later on
+	Encoder audioEncoder(AV_CODEC_ID_OPUS);
+	Encoder videoEncoder(AV_CODEC_ID_H264);
+	for (int i = 0; i < 90; ++i) {
+		auto in1 =
+		    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 1, 1600, i * 1600);
+		fillNoise(in1);
+		for (auto &packet : audioEncoder.encode(in1)) {
+			muxer.mux_audio_packet(packet, audioEncoder.parameters());
+		}
+		if (i < 30) {
+			continue;
+		}
+		auto in2 = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+		for (auto &packet : videoEncoder.encode(in2)) {
+			ASSERT_TRUE(
+			    muxer.mux_video_packet(packet, videoEncoder.parameters()));
+		}
+	}
+	muxer.stop();
+
+	AVFormatContext *fmt_ctx = nullptr;
+	ASSERT_EQ(avformat_open_input(&fmt_ctx, file.c_str(), NULL, NULL), 0);
+	ASSERT_GE(avformat_find_stream_info(fmt_ctx, NULL), 0);
+	double first[2] = {-1, -1};
+	auto packet = createAVPacket();
+	while (av_read_frame(fmt_ctx, packet.get()) >= 0) {
+		auto stream = fmt_ctx->streams[packet->stream_index];
+		bool video = stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+		if (first[video] < 0) {
+			first[video] = packet->pts * av_q2d(stream->time_base);
+		}
+		av_packet_unref(packet.get());
+	}
+	avformat_close_input(&fmt_ctx);
+	ASSERT_GE(first[0], 0);
+	ASSERT_GE(first[1], 0);
+	EXPECT_NEAR(first[0], first[1], 0.1);
+}
+
+TEST(MuxerTest, testCopyAcrossSetSize) {
+	std::string file = testing::TempDir() + "/test_copy_resize.mkv";
+	MuxerOptions options;
+	options.copyVideo = true;
+	Muxer muxer(file, AV_CODEC_ID_NONE, AV_CODEC_ID_H264, options);
+	std::vector<std::string> paths;
+	muxer.onSegment([&](const std::string &path, int, int64_t, int64_t,
+	                    bool) { paths.push_back(path); });
+
+	// Stepped down like an overused sender
+	Encoder encoder(AV_CODEC_ID_H264);
+	for (int i = 0; i < 60; ++i) {
+		if (i == 30) {
+			encoder.setSize(320, 240);
+		}
+		auto frame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+		auto packets = encoder.encode(frame);
+		for (auto &packet : packets) {
+			muxer.mux_video_packet(packet, encoder.parameters());
+		}
+	}
+	muxer.stop();
+
+	// Each file's header describes its own packets
+	ASSERT_EQ(paths.size(), 2u);
+	EXPECT_EQ(paths[0], file);
+	int widths[] = {640, 320};
+	for (int i = 0; i < 2; ++i) {
+		AVFormatContext *fmt_ctx = nullptr;
+		ASSERT_EQ(avformat_open_input(&fmt_ctx, paths[i].c_str(), NULL, NULL),
+		          0);
+		ASSERT_GE(avformat_find_stream_info(fmt_ctx, NULL), 0);
+		auto par = fmt_ctx->streams[0]->codecpar;
+		EXPECT_EQ(par->width, widths[i]);
+		Decoder decoder(AV_CODEC_ID_H264);
+		int frames = 0;
+		auto packet = createAVPacket();
+		while (av_read_frame(fmt_ctx, packet.get()) >= 0) {
+			for (auto &frame : decoder.decode(packet)) {
+				EXPECT_EQ(frame->width, widths[i]);
+				frames += 1;
+			}
+			av_packet_unref(packet.get());
+		}
+		avformat_close_input(&fmt_ctx);
+		EXPECT_GT(frames, 20);
+	}
+}
+
+TEST(EncoderTest, testKeyPacket) {
+	Encoder encoder(AV_CODEC_ID_H264);
+	std::vector<std::shared_ptr<AVPacket>> packets;
+	for (int i = 0; i < 10; ++i) {
+		auto frame = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+		for (auto &packet : encoder.encode(frame)) {
+			packets.push_back(packet);
+		}
+	}
+	ASSERT_GT(packets.size(), 1);
+	auto first = packets.front();
+	auto last = packets.back();
+	EXPECT_TRUE(isKeyPacket(AV_CODEC_ID_H264, first->data, first->size));
+	EXPECT_FALSE(isKeyPacket(AV_CODEC_ID_H264, last->data, last->size));
+	EXPECT_GT(
+	    extractParameterSets(AV_CODEC_ID_H264, first->data, first->size).size(),
+	    0);
+	EXPECT_EQ(
+	    extractParameterSets(AV_CODEC_ID_H264, last->data, last->size).size(),
+	    0);
+}
+
+// Noise, so that every frame has enough data to break.
+static std::shared_ptr<AVFrame> noiseNV12(int pts) {
+	auto frame = createVideoFrame(AV_PIX_FMT_NV12, 320, 240, pts);
+	for (int y = 0; y < 240; ++y) {
+		for (int x = 0; x < 320; ++x) {
+			frame->data[0][y * frame->linesize[0] + x] = rand() & 0xff;
+		}
+	}
+	return frame;
+}
+
+TEST(DecoderTest, testRecoversFromCorruptPackets) {
+	Encoder encoder(AV_CODEC_ID_H264);
+	int requests = 0;
+	Decoder decoder(AV_CODEC_ID_H264, [&]() { requests++; });
+	std::vector<std::shared_ptr<AVPacket>> packets;
+	for (int i = 0; i < 40; ++i) {
+		for (auto &packet : encoder.encode(noiseNV12(i * 3000))) {
+			packets.push_back(packet);
+		}
+	}
+	ASSERT_GT(packets.size(), 20u);
+	ASSERT_TRUE(packets[0]->flags & AV_PKT_FLAG_KEY);
+
+	// Joining mid-stream waits for the keyframe
+	EXPECT_TRUE(decoder.decode(packets[5]).empty());
+	EXPECT_EQ(requests, 1);
+	size_t decoded = 0;
+	for (int i = 0; i < 8; ++i) {
+		decoded += decoder.decode(packets[i]).size();
+	}
+	EXPECT_GT(decoded, 0u);
+	std::this_thread::sleep_for(std::chrono::milliseconds(350));
+
+	auto truncated = createAVPacket();
+	av_packet_ref(truncated.get(), packets[8].get());
+	truncated->size /= 2;
+	auto corrupted = createAVPacket();
+	av_new_packet(corrupted.get(), packets[9]->size);
+	memcpy(corrupted->data, packets[9]->data, packets[9]->size);
+	for (int i = corrupted->size / 3; i < corrupted->size * 2 / 3; ++i) {
+		corrupted->data[i] ^= 0x5a;
+	}
+	EXPECT_NO_THROW(decoder.decode(truncated));
+	EXPECT_NO_THROW(decoder.decode(corrupted));
+	for (size_t i = 10; i < packets.size(); ++i) {
+		EXPECT_TRUE(decoder.decode(packets[i]).empty());
+	}
+	auto stats = decoder.stats();
+	EXPECT_GE(stats.errors, 1u);
+	EXPECT_GE(stats.dropped, packets.size() - 10);
+	// Rate limited, one request for the whole broken run
+	EXPECT_EQ(requests, 2);
+	EXPECT_EQ(stats.keyframeRequests, 2u);
+
+	encoder.requestKeyframe();
+	bool key = false;
+	size_t recovered = 0;
+	for (int i = 40; i < 60; ++i) {
+		for (auto &packet : encoder.encode(noiseNV12(i * 3000))) {
+			key |= (packet->flags & AV_PKT_FLAG_KEY) != 0;
+			auto frames = decoder.decode(packet);
+			if (key) {
+				recovered += frames.size();
+			} else {
+				EXPECT_TRUE(frames.empty());
+			}
+		}
+	}
+	EXPECT_TRUE(key);
+	EXPECT_GT(recovered, 10u);
+	EXPECT_EQ(decoder.stats().errors, stats.errors);
+}
+
+TEST(DecoderTest, testSkipResumesAtKeyframe) {
+	Encoder encoder(AV_CODEC_ID_H264);
+	int requests = 0;
+	Decoder decoder(AV_CODEC_ID_H264, [&]() { requests++; });
+	std::vector<std::shared_ptr<AVPacket>> packets;
+	for (int i = 0; i < 30; ++i) {
+		for (auto &packet : encoder.encode(noiseNV12(i * 3000))) {
+			packets.push_back(packet);
+		}
+	}
+	ASSERT_GT(packets.size(), 10u);
+	size_t decoded = 0;
+	for (int i = 0; i < 5; ++i) {
+		decoded += decoder.decode(packets[i]).size();
+	}
+	EXPECT_GT(decoded, 0u);
+
+	// Unwatched, nothing is decoded or asked for
+	for (int i = 5; i < 10; ++i) {
+		decoder.skip();
+	}
+	EXPECT_EQ(decoder.stats().skipped, 5u);
+	EXPECT_EQ(requests, 0);
+
+	// Watched again mid-GOP, the missing references are asked for
+	EXPECT_TRUE(decoder.decode(packets[10]).empty());
+	EXPECT_EQ(requests, 1);
+	encoder.requestKeyframe();
+	bool key = false;
+	size_t recovered = 0;
+	for (int i = 30; i < 40; ++i) {
+		for (auto &packet : encoder.encode(noiseNV12(i * 3000))) {
+			key |= (packet->flags & AV_PKT_FLAG_KEY) != 0;
+			recovered += decoder.decode(packet).size();
+		}
+	}
+	EXPECT_TRUE(key);
+	EXPECT_GT(recovered, 0u);
+	EXPECT_EQ(decoder.stats().errors, 0u);
+}
+
+// Starvation is simulated by delivering the stream far faster than the
+// decoder can go, which leaves it the same fraction of a frame interval
+// as a CPU busy with other work would.
+TEST(DecoderTest, benchmarkStarvation) {
+	Encoder encoder(AV_CODEC_ID_H264);
+	std::vector<std::shared_ptr<AVPacket>> packets;
+	for (int i = 0; i < 300; ++i) {
+		for (auto &packet : encoder.encode(noiseNV12(i * 3000))) {
+			packets.push_back(packet);
+		}
+	}
+	ASSERT_GT(packets.size(), 250u);
+
+	Decoder decoder(AV_CODEC_ID_H264);
+	auto run = [&](int64_t interval, double &decodeTime, size_t &frames) {
+		decodeTime = 0;
+		frames = 0;
+		for (size_t i = 0; i < packets.size(); ++i) {
+			std::shared_ptr<AVPacket> packet(
+			    av_packet_clone(packets[i].get()),
+			    [](AVPacket *p) { av_packet_free(&p); });
+			packet->pts = packet->dts = i * interval;
+			auto start = std::chrono::steady_clock::now();
+			frames += decoder.decode(packet).size();
+			// The last third shows the level settled on
+			if (i >= packets.size() * 2 / 3) {
+				decodeTime += std::chrono::duration<double, std::milli>(
+				                  std::chrono::steady_clock::now() - start)
+				                  .count();
+			}
+		}
+		decodeTime /= packets.size() - packets.size() * 2 / 3;
+	};
+
+	double normalTime, starvedTime, recoveredTime;
+	size_t normalFrames, starvedFrames, recoveredFrames;
+	run(3000, normalTime, normalFrames);
+	EXPECT_EQ(decoder.stats().degradation, DecodeDegradation::None);
+	run(1, starvedTime, starvedFrames);
+	auto starved = decoder.stats();
+	run(3000, recoveredTime, recoveredFrames);
+	auto recovered = decoder.stats();
+	LOGI("starvation: %.2f ms/packet normal, %.2f starved, %.2f recovered, "
+	     "frames %zu, %zu, %zu\n",
+	     normalTime, starvedTime, recoveredTime, normalFrames, starvedFrames,
+	     recoveredFrames);
+
+	EXPECT_EQ(starved.degradation, DecodeDegradation::KeyframesOnly);
+	EXPECT_EQ(starved.degradations, 3u);
+	EXPECT_LT(starvedTime, normalTime);
+	EXPECT_LT(starvedFrames, normalFrames / 2);
+	EXPECT_EQ(recovered.degradation, DecodeDegradation::None);
+	EXPECT_EQ(recovered.errors, 0u);
+	EXPECT_EQ(normalFrames, packets.size());
+}
+
+static std::vector<AVCodecID> readCodecs(const std::string &file) {
+	AVFormatContext *fmt_ctx = nullptr;
+	std::vector<AVCodecID> codecs;
+	if (avformat_open_input(&fmt_ctx, file.c_str(), NULL, NULL) < 0) {
+		return codecs;
+	}
+	if (avformat_find_stream_info(fmt_ctx, NULL) >= 0) {
+		for (unsigned int i = 0; i < fmt_ctx->nb_streams; ++i) {
+			codecs.push_back(fmt_ctx->streams[i]->codecpar->codec_id);
+		}
+	}
+	avformat_close_input(&fmt_ctx);
+	return codecs;
+}
+
+TEST(MuxerTest, testMatroskaOpus) {
+	std::string file = testing::TempDir() + "/test_opus.mkv";
+	Muxer muxer(file, AV_CODEC_ID_OPUS, AV_CODEC_ID_H264);
+	for (int i = 0; i < 60; ++i) {
+		auto in1 =
+		    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 1, 1600, i * 1600);
+		fillNoise(in1);
+		auto in2 = createVideoFrame(AV_PIX_FMT_NV12, 640, 480, i * 3000);
+		muxer.mux_audio(in1);
+		muxer.mux_video(in2);
+	}
+	muxer.stop();
+
+	auto codecs = readCodecs(file);
+	ASSERT_EQ(codecs.size(), 2);
+	EXPECT_EQ(codecs[0], AV_CODEC_ID_OPUS);
+	EXPECT_EQ(codecs[1], AV_CODEC_ID_H264);
+}
+
+TEST(MuxerTest, testCopyReceivedOpus) {
+	// Received Opus packets carry no extradata, the decoder provides it
+	Encoder encoder(AV_CODEC_ID_OPUS);
+	Decoder decoder(AV_CODEC_ID_OPUS);
+	MuxerOptions options;
+	options.copyAudio = true;
+	std::string webm = testing::TempDir() + "/test_copy_opus.webm";
+	std::string mp4 = testing::TempDir() + "/test_copy_opus.mp4";
+	Muxer webmMuxer(webm, AV_CODEC_ID_OPUS, AV_CODEC_ID_NONE, options);
+	Muxer mp4Muxer(mp4, AV_CODEC_ID_OPUS, AV_CODEC_ID_NONE, options);
+	for (int i = 0; i < 50; ++i) {
+		auto frame =
+		    createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, i * 960);
+		fillNoise(frame);
+		for (auto &packet : encoder.encode(frame)) {
+			decoder.decode(packet);
+			auto par = decoder.parameters();
+			ASSERT_NE(par, nullptr);
+			ASSERT_EQ(par->extradata_size, 19);
+			webmMuxer.mux_audio_packet(packet, par);
+			mp4Muxer.mux_audio_packet(packet, par);
+		}
+	}
+	webmMuxer.stop();
+	mp4Muxer.stop();
+
+	EXPECT_EQ(readCodecs(webm), std::vector<AVCodecID>({AV_CODEC_ID_OPUS}));
+	EXPECT_EQ(readCodecs(mp4), std::vector<AVCodecID>({AV_CODEC_ID_OPUS}));
+}
@@ -90,4 +90,119 @@ TEST(FramePipeTest, testUnsubscribeInCallback) {
 	publish("test_pipe", frame);
 	unsubscribe(subscriptionId);
 	ASSERT_EQ(count, 1);
-}
\ No newline at end of file
+}
+
+TEST(FramePipeTest, testHasSubscribers) {
+	ASSERT_FALSE(hasSubscribers("demand_pipe"));
+	int first = subscribe({"other_pipe", "demand_pipe"},
+	                      [](std::string, int, std::shared_ptr<AVFrame>) {});
+	int second = subscribe({"demand_pipe"},
+	                       [](std::string, int, std::shared_ptr<AVFrame>) {});
+	ASSERT_TRUE(hasSubscribers("demand_pipe"));
+	unsubscribe(first);
+	ASSERT_TRUE(hasSubscribers("demand_pipe"));
+	unsubscribe(second);
+	ASSERT_FALSE(hasSubscribers("demand_pipe"));
+	// Packet subscribers need no decoded frames
+	int packets = subscribePacket(
+	    {"demand_pipe"}, [](std::string, int, std::shared_ptr<AVPacket>,
+	                        std::shared_ptr<AVCodecParameters>) {});
+	ASSERT_FALSE(hasSubscribers("demand_pipe"));
+	unsubscribe(packets);
+}
+
+TEST(FramePipeTest, testPacketSource) {
+	int keyframeRequests = 0;
+	int first = addPacketSource("packet_pipe", AV_CODEC_ID_H264,
+	                            [&]() { keyframeRequests++; });
+	int second = addPacketSource("packet_pipe", AV_CODEC_ID_H265, {});
+	ASSERT_EQ(packetSourceCodec("packet_pipe"), AV_CODEC_ID_H264);
+	ASSERT_EQ(packetSourceCodec("other_pipe"), AV_CODEC_ID_NONE);
+
+	int received = 0;
+	int subscriptionId = subscribePacket(
+	    {"packet_pipe"},
+	    [&received](std::string pipeId, int, std::shared_ptr<AVPacket> packet,
+	                std::shared_ptr<AVCodecParameters>) {
+		    ASSERT_EQ(pipeId, std::string("packet_pipe"));
+		    ASSERT_NE(packet, nullptr);
+		    received++;
+	    });
+
+	// Only the first source of a pipe is forwarded
+	publishPacket(first, createAVPacket(), nullptr);
+	publishPacket(second, createAVPacket(), nullptr);
+	ASSERT_EQ(received, 1);
+
+	requestKeyframe("packet_pipe");
+	ASSERT_EQ(keyframeRequests, 1);
+
+	removePacketSource(first);
+	ASSERT_EQ(packetSourceCodec("packet_pipe"), AV_CODEC_ID_H265);
+	publishPacket(second, createAVPacket(), nullptr);
+	ASSERT_EQ(received, 2);
+
+	unsubscribe(subscriptionId);
+	publishPacket(second, createAVPacket(), nullptr);
+	ASSERT_EQ(received, 2);
+	removePacketSource(second);
+	ASSERT_EQ(packetSourceCodec("packet_pipe"), AV_CODEC_ID_NONE);
+}
+
+TEST(FramePipeTest, testPlayoutListener) {
+	std::vector<int64_t> played;
+	int listenerId = addPlayoutListener(
+	    "playout_pipe", [&](int64_t pts, int64_t) { played.push_back(pts); },
+	    []() { return (int64_t)100000; });
+	PlayoutBuffer buffer;
+	auto out = createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960);
+	for (int i = 0; i < 50; ++i) {
+		playOut("playout_pipe", buffer,
+		        createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, i * 960));
+		// Enough buffered to start with the delay asked for
+		if (i >= 10) {
+			buffer.read(out->data, 960);
+		}
+	}
+	EXPECT_NEAR(buffer.stats().extraDelay, 100, 0.1);
+	EXPECT_NEAR(playoutStats(buffer)["playout.extraDelay"], 100, 0.1);
+	ASSERT_FALSE(played.empty());
+	EXPECT_EQ(played.back(), 49 * 960);
+
+	// Also from the pipe its frames are forwarded to
+	int forward = forwardPipe("playout_pipe", "playout_sink");
+	playOut("playout_sink", buffer,
+	        createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, 50 * 960));
+	EXPECT_EQ(played.back(), 50 * 960);
+	unsubscribe(forward);
+
+	removePlayoutListener(listenerId);
+	size_t count = played.size();
+	playOut("playout_pipe", buffer,
+	        createAudioFrame(AV_SAMPLE_FMT_FLT, 48000, 2, 960, 51 * 960));
+	EXPECT_EQ(played.size(), count);
+	EXPECT_EQ(buffer.stats().extraDelay, 0);
+}
+
+TEST(FramePipeTest, testStats) {
+	int frames = 0;
+	int first = addStatsSource("stats_pipe", [&]() {
+		return PipeStats{{"decoder.frames", (double)frames}};
+	});
+	int second = addStatsSource(
+	    "stats_pipe", []() { return PipeStats{{"playout.latency", 40}}; });
+	int other = addStatsSource(
+	    "other_pipe", []() { return PipeStats{{"pacer.packets", 1}}; });
+
+	frames = 3;
+	auto stats = getStats("stats_pipe");
+	ASSERT_EQ(stats.size(), 2u);
+	EXPECT_EQ(stats["decoder.frames"], 3);
+	EXPECT_EQ(stats["playout.latency"], 40);
+
+	removeStatsSource(first);
+	removeStatsSource(second);
+	EXPECT_TRUE(getStats("stats_pipe").empty());
+	EXPECT_EQ(getStats("other_pipe").size(), 1u);
+	removeStatsSource(other);
+}
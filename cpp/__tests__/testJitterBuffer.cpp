@@ -0,0 +1,326 @@
+#include "jitterbuffer.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <gtest/gtest.h>
+#include <random>
+
+struct TracePacket {
+	std::vector<uint8_t> data;
+	int64_t arrival; // us
+};
+
+struct Released {
+	JitterBufferFrame frame;
+	int64_t time;
+};
+
+static std::vector<uint8_t> rtp(uint16_t seq, uint32_t timestamp, bool marker,
+                                const std::vector<uint8_t> &payload) {
+	std::vector<uint8_t> p = {0x80,
+	                          (uint8_t)(marker ? 0xe0 : 0x60),
+	                          (uint8_t)(seq >> 8),
+	                          (uint8_t)seq,
+	                          (uint8_t)(timestamp >> 24),
+	                          (uint8_t)(timestamp >> 16),
+	                          (uint8_t)(timestamp >> 8),
+	                          (uint8_t)timestamp,
+	                          0x12,
+	                          0x34,
+	                          0x56,
+	                          0x78};
+	p.insert(p.end(), payload.begin(), payload.end());
+	return p;
+}
+
+// The Annex B access unit holding one H.264 NAL unit.
+static std::vector<uint8_t> annexB(const std::vector<uint8_t> &nal) {
+	std::vector<uint8_t> out = {0, 0, 0, 1};
+	out.insert(out.end(), nal.begin(), nal.end());
+	return out;
+}
+
+static std::vector<uint8_t> h264Nal(int index, int size) {
+	std::vector<uint8_t> nal(size, (uint8_t)index);
+	nal[0] = index == 0 ? 0x65 : 0x41;
+	return nal;
+}
+
+// A NAL unit in FU-A packets of at most 100 bytes.
+static std::vector<std::vector<uint8_t>>
+packetizeH264(const std::vector<uint8_t> &nal, uint16_t &seq,
+              uint32_t timestamp) {
+	std::vector<std::vector<uint8_t>> packets;
+	if (nal.size() <= 100) {
+		packets.push_back(rtp(seq++, timestamp, true, nal));
+		return packets;
+	}
+	for (size_t offset = 1; offset < nal.size(); offset += 98) {
+		size_t end = std::min(nal.size(), offset + 98);
+		uint8_t header = nal[0] & 0x1f;
+		header |= offset == 1 ? 0x80 : 0;
+		header |= end == nal.size() ? 0x40 : 0;
+		std::vector<uint8_t> payload = {(uint8_t)((nal[0] & 0xe0) | 28),
+		                                header};
+		payload.insert(payload.end(), nal.begin() + offset, nal.begin() + end);
+		packets.push_back(rtp(seq++, timestamp, end == nal.size(), payload));
+	}
+	return packets;
+}
+
+// Frames every 33 ms, each packet delayed by what jitter() returns.
+static std::vector<TracePacket>
+trace(int count, int size, const std::function<int64_t(int)> &jitter,
+      uint16_t seq = 1000, uint32_t timestamp = 90000) {
+	std::vector<TracePacket> packets;
+	for (int i = 0; i < count; ++i) {
+		int64_t sent = i * 33333LL;
+		for (auto &p : packetizeH264(h264Nal(i, size), seq,
+		                             timestamp + i * 3000)) {
+			packets.push_back({p, sent + jitter(i)});
+			sent += 100;
+		}
+	}
+	std::stable_sort(packets.begin(), packets.end(),
+	                 [](auto &a, auto &b) { return a.arrival < b.arrival; });
+	return packets;
+}
+
+// Feeds the packets at their arrival times and pops whenever a frame may
+// be due.
+static std::vector<Released> play(JitterBuffer &buffer,
+                                  const std::vector<TracePacket> &packets) {
+	std::vector<Released> released;
+	size_t next = 0;
+	while (true) {
+		int64_t now = buffer.nextRelease();
+		if (next < packets.size()) {
+			now = std::min(now, packets[next].arrival);
+		}
+		if (now == INT64_MAX) {
+			break;
+		}
+		while (next < packets.size() && packets[next].arrival <= now) {
+			auto &p = packets[next++];
+			buffer.insert(p.data.data(), p.data.size(), p.arrival);
+		}
+		for (auto &frame : buffer.pop(now)) {
+			released.push_back({frame, now});
+		}
+	}
+	return released;
+}
+
+static auto noJitter = [](int) -> int64_t { return 0; };
+
+TEST(JitterBufferTest, testInOrder) {
+	JitterBuffer buffer(RtpVideoCodec::H264);
+	auto released = play(buffer, trace(30, 350, noJitter));
+	ASSERT_EQ(released.size(), 30u);
+	for (int i = 0; i < 30; ++i) {
+		EXPECT_EQ(released[i].frame.data, annexB(h264Nal(i, 350)));
+		EXPECT_EQ(released[i].frame.pts, 90000 + i * 3000);
+		EXPECT_FALSE(released[i].frame.afterLoss);
+	}
+	auto stats = buffer.stats();
+	EXPECT_EQ(stats.frames, 30u);
+	EXPECT_EQ(stats.dropped, 0u);
+	EXPECT_EQ(stats.buffered, 0u);
+	EXPECT_LT(stats.targetDelay, 1);
+}
+
+TEST(JitterBufferTest, testReordering) {
+	auto packets = trace(30, 350, noJitter);
+	std::mt19937 rng(1);
+	// Swaps neighbours a few milliseconds apart
+	for (size_t i = 0; i + 1 < packets.size(); i += 2) {
+		if (rng() % 3 == 0) {
+			std::swap(packets[i].data, packets[i + 1].data);
+		}
+	}
+	JitterBuffer buffer(RtpVideoCodec::H264);
+	auto released = play(buffer, packets);
+	ASSERT_EQ(released.size(), 30u);
+	for (int i = 0; i < 30; ++i) {
+		EXPECT_EQ(released[i].frame.data, annexB(h264Nal(i, 350)));
+	}
+	EXPECT_EQ(buffer.stats().dropped, 0u);
+}
+
+TEST(JitterBufferTest, testIncompleteFrameHeld) {
+	auto packets = trace(10, 350, noJitter);
+	// The second packet of frame 4, resent 60 ms later
+	auto resent = std::find_if(packets.begin(), packets.end(),
+	                           [](auto &p) { return p.arrival >= 4 * 33333; });
+	resent[1].arrival += 60000;
+	std::stable_sort(packets.begin(), packets.end(),
+	                 [](auto &a, auto &b) { return a.arrival < b.arrival; });
+	JitterBuffer buffer(RtpVideoCodec::H264, 0, 500, 100);
+	auto released = play(buffer, packets);
+	ASSERT_EQ(released.size(), 10u);
+	EXPECT_EQ(released[4].frame.data, annexB(h264Nal(4, 350)));
+	EXPECT_GE(released[4].time, 133333 + 60000);
+	// Frames after it wait their turn
+	EXPECT_GE(released[5].time, released[4].time);
+	EXPECT_EQ(buffer.stats().dropped, 0u);
+}
+
+TEST(JitterBufferTest, testIncompleteFrameDropped) {
+	auto packets = trace(10, 350, noJitter);
+	auto lost = std::find_if(packets.begin(), packets.end(),
+	                         [](auto &p) { return p.arrival >= 4 * 33333; });
+	packets.erase(lost + 1);
+	JitterBuffer buffer(RtpVideoCodec::H264, 0, 500, 100);
+	auto released = play(buffer, packets);
+	ASSERT_EQ(released.size(), 9u);
+	// Given up on 100 ms after it was due
+	EXPECT_EQ(released[4].frame.pts, 90000 + 5 * 3000);
+	EXPECT_TRUE(released[4].frame.afterLoss);
+	EXPECT_GE(released[4].time, 133333 + 100000);
+	EXPECT_FALSE(released[5].frame.afterLoss);
+	auto stats = buffer.stats();
+	EXPECT_EQ(stats.dropped, 1u);
+	EXPECT_EQ(stats.frames, 9u);
+}
+
+TEST(JitterBufferTest, testLostFrameSkipped) {
+	auto packets = trace(10, 50, noJitter);
+	// A whole single packet frame, the next one can still be trusted
+	// once the wait is over since it starts with a complete NAL unit
+	packets.erase(packets.begin() + 3);
+	JitterBuffer buffer(RtpVideoCodec::H264, 0, 500, 100);
+	auto released = play(buffer, packets);
+	ASSERT_EQ(released.size(), 9u);
+	EXPECT_EQ(released[3].frame.pts, 90000 + 4 * 3000);
+	EXPECT_TRUE(released[3].frame.afterLoss);
+	EXPECT_EQ(buffer.stats().dropped, 0u);
+}
+
+TEST(JitterBufferTest, testAdaptiveDelay) {
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int64_t> dist(0, 40000);
+	std::vector<int64_t> delays(300);
+	for (auto &d : delays) {
+		d = dist(rng);
+	}
+	JitterBuffer buffer(RtpVideoCodec::H264);
+	auto released =
+	    play(buffer, trace(300, 350, [&](int i) { return delays[i]; }));
+	ASSERT_EQ(released.size(), 300u);
+	auto stats = buffer.stats();
+	EXPECT_GT(stats.jitter, 5);
+	EXPECT_GT(stats.targetDelay, 20);
+	EXPECT_LE(stats.targetDelay, 60);
+	EXPECT_GT(stats.avgDelay, 0);
+
+	// After settling, frames leave as evenly as they were sent
+	double worst = 0;
+	for (size_t i = 101; i < released.size(); ++i) {
+		double interval = (released[i].time - released[i - 1].time) / 1000.0;
+		worst = std::max(worst, std::abs(interval - 33.333));
+	}
+	EXPECT_LT(worst, 10);
+
+	// A calm network brings the delay back down
+	JitterBuffer calm(RtpVideoCodec::H264);
+	play(calm, trace(100, 350, [&](int i) { return delays[i]; }));
+	double before = calm.stats().targetDelay;
+	auto packets =
+	    trace(400, 350, [&](int i) { return i < 100 ? delays[i] : 0; });
+	JitterBuffer settling(RtpVideoCodec::H264);
+	play(settling, packets);
+	EXPECT_LT(settling.stats().targetDelay, before / 2);
+}
+
+TEST(JitterBufferTest, testSequenceWrap) {
+	JitterBuffer buffer(RtpVideoCodec::H264);
+	auto released =
+	    play(buffer, trace(10, 350, noJitter, 65530, UINT32_MAX - 9000));
+	ASSERT_EQ(released.size(), 10u);
+	for (int i = 0; i < 10; ++i) {
+		EXPECT_EQ(released[i].frame.data, annexB(h264Nal(i, 350)));
+		EXPECT_EQ(released[i].frame.pts,
+		          (int64_t)UINT32_MAX - 9000 + i * 3000);
+	}
+}
+
+TEST(JitterBufferTest, testDuplicateLateAndInvalid) {
+	auto packets = trace(5, 350, noJitter);
+	packets.insert(packets.begin() + 2, packets[1]);
+	// A frame that was released long ago
+	packets.push_back({packets[0].data, packets.back().arrival + 1});
+	JitterBuffer buffer(RtpVideoCodec::H264);
+	auto released = play(buffer, packets);
+	EXPECT_EQ(released.size(), 5u);
+	uint8_t junk[4] = {0};
+	buffer.insert(junk, sizeof(junk), 0);
+	auto stats = buffer.stats();
+	EXPECT_EQ(stats.duplicates, 1u);
+	EXPECT_EQ(stats.late, 1u);
+	EXPECT_EQ(stats.invalid, 1u);
+}
+
+TEST(JitterBufferTest, testAggregatedAndH265) {
+	const std::vector<uint8_t> sps = {0x67, 1, 2}, pps = {0x68, 3};
+	const std::vector<uint8_t> idr = {0x65, 4, 5, 6};
+	std::vector<uint8_t> stap = {24, 0, 3};
+	stap.insert(stap.end(), sps.begin(), sps.end());
+	stap.insert(stap.end(), {0, 2});
+	stap.insert(stap.end(), pps.begin(), pps.end());
+	JitterBuffer h264(RtpVideoCodec::H264);
+	auto released = play(h264, {{rtp(1, 0, false, stap), 0},
+	                            {rtp(2, 0, true, idr), 0}});
+	ASSERT_EQ(released.size(), 1u);
+	std::vector<uint8_t> expected = annexB(sps);
+	for (auto &nal : {pps, idr}) {
+		auto unit = annexB(nal);
+		expected.insert(expected.end(), unit.begin(), unit.end());
+	}
+	EXPECT_EQ(released[0].frame.data, expected);
+
+	// An IDR_W_RADL NAL unit (type 19) fragmented, after a VPS in an AP
+	const std::vector<uint8_t> vps = {0x40, 0x01, 7};
+	std::vector<uint8_t> ap = {48 << 1, 1, 0, 3};
+	ap.insert(ap.end(), vps.begin(), vps.end());
+	std::vector<uint8_t> fuStart = {49 << 1, 1, 0x80 | 19, 8, 9};
+	std::vector<uint8_t> fuEnd = {49 << 1, 1, 0x40 | 19, 10};
+	JitterBuffer h265(RtpVideoCodec::H265);
+	released = play(h265, {{rtp(7, 0, false, ap), 0},
+	                       {rtp(8, 0, false, fuStart), 0},
+	                       {rtp(9, 0, true, fuEnd), 0}});
+	ASSERT_EQ(released.size(), 1u);
+	expected = annexB(vps);
+	auto idr265 = annexB({19 << 1, 1, 8, 9, 10});
+	expected.insert(expected.end(), idr265.begin(), idr265.end());
+	EXPECT_EQ(released[0].frame.data, expected);
+}
+
+TEST(JitterBufferTest, testBounded) {
+	// A frame that never completes and cannot be waited on forever
+	JitterBuffer buffer(RtpVideoCodec::H264, 0, 500, 100, 20);
+	auto packets = trace(10, 350, noJitter);
+	for (auto &p : packets) {
+		p.arrival = 0;
+	}
+	packets.erase(packets.begin() + 1);
+	for (auto &p : packets) {
+		buffer.insert(p.data.data(), p.data.size(), 0);
+	}
+	auto stats = buffer.stats();
+	EXPECT_LE(stats.buffered, 20u);
+	EXPECT_GE(stats.dropped, 1u);
+}
+
+TEST(JitterBufferTest, testExtraDelay) {
+	auto packets = trace(30, 350, noJitter);
+	JitterBuffer plain(RtpVideoCodec::H264);
+	auto expected = play(plain, packets);
+	JitterBuffer delayed(RtpVideoCodec::H264);
+	delayed.setExtraDelay(80000);
+	auto released = play(delayed, packets);
+	ASSERT_EQ(released.size(), expected.size());
+	for (size_t i = 0; i < released.size(); ++i) {
+		EXPECT_NEAR(released[i].time, expected[i].time + 80000, 1);
+	}
+	EXPECT_EQ(delayed.stats().lateFrames, 0u);
+}
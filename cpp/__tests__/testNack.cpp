@@ -0,0 +1,233 @@
+#include "nack.h"
+#include <deque>
+#include <gtest/gtest.h>
+#include <random>
+
+static std::vector<uint8_t> rtpPacket(uint16_t seq, uint8_t payloadType = 96,
+                                      uint32_t ssrc = 1234) {
+	std::vector<uint8_t> packet = {0x80,
+	                               payloadType,
+	                               (uint8_t)(seq >> 8),
+	                               (uint8_t)seq,
+	                               0,
+	                               0,
+	                               0,
+	                               0,
+	                               (uint8_t)(ssrc >> 24),
+	                               (uint8_t)(ssrc >> 16),
+	                               (uint8_t)(ssrc >> 8),
+	                               (uint8_t)ssrc};
+	packet.insert(packet.end(), {0x65, 0x88, 0x84, 0x00});
+	return packet;
+}
+
+static uint16_t seqOf(const std::vector<uint8_t> &packet) {
+	return packet[2] << 8 | packet[3];
+}
+
+TEST(NackTest, testFindsGaps) {
+	NackGenerator generator;
+	generator.insert(1, 0);
+	generator.insert(2, 0);
+	generator.insert(5, 1000);
+	EXPECT_EQ(generator.poll(1000), (std::vector<uint16_t>{3, 4}));
+	// Not again until a round trip has passed
+	EXPECT_TRUE(generator.poll(50000).empty());
+	EXPECT_EQ(generator.poll(200000), (std::vector<uint16_t>{3, 4}));
+	generator.insert(3, 250000);
+	EXPECT_EQ(generator.poll(400000), (std::vector<uint16_t>{4}));
+	generator.insert(4, 420000);
+	auto stats = generator.stats();
+	EXPECT_EQ(stats.missing, 2u);
+	EXPECT_EQ(stats.requests, 5u);
+	EXPECT_EQ(stats.recovered, 2u);
+	EXPECT_EQ(stats.lost, 0u);
+}
+
+TEST(NackTest, testReordered) {
+	NackGenerator generator;
+	generator.insert(1, 0);
+	generator.insert(3, 0);
+	generator.insert(2, 0);
+	EXPECT_TRUE(generator.poll(0).empty());
+	EXPECT_EQ(generator.stats().reordered, 1u);
+	EXPECT_EQ(generator.stats().recovered, 0u);
+}
+
+TEST(NackTest, testGivesUp) {
+	NackGenerator generator(3, 1000);
+	generator.insert(1, 0);
+	generator.insert(3, 0);
+	int requests = 0;
+	for (int64_t now = 0; now < 2000000; now += 10000) {
+		requests += generator.poll(now).size();
+	}
+	EXPECT_EQ(requests, 3);
+	EXPECT_EQ(generator.stats().lost, 1u);
+	// Too late to count
+	generator.insert(2, 2000000);
+	EXPECT_EQ(generator.stats().recovered, 0u);
+}
+
+TEST(NackTest, testLargeGap) {
+	NackGenerator generator(10, 1000, 100);
+	generator.insert(1, 0);
+	generator.insert(500, 0);
+	EXPECT_TRUE(generator.poll(0).empty());
+	EXPECT_EQ(generator.stats().lost, 498u);
+	generator.insert(502, 0);
+	EXPECT_EQ(generator.poll(0), (std::vector<uint16_t>{501}));
+}
+
+TEST(NackTest, testWraps) {
+	NackGenerator generator;
+	generator.insert(65534, 0);
+	generator.insert(1, 0);
+	EXPECT_EQ(generator.poll(0), (std::vector<uint16_t>{65535, 0}));
+}
+
+TEST(NackTest, testBuildParse) {
+	std::vector<uint16_t> seqs = {65530, 65535, 3, 10, 40};
+	auto nack = buildNack(1, 1234, seqs);
+	// One FCI covers 65530 to 65546, wrapped
+	ASSERT_EQ(nack.size(), 12u + 2 * 4);
+	EXPECT_EQ(nack[0], 0x81);
+	EXPECT_EQ(nack[1], 205);
+	EXPECT_EQ(nack[3], 4);
+
+	// After a receiver report, as in a compound packet
+	std::vector<uint8_t> compound = {0x80, 201, 0, 1, 0, 0, 0, 1};
+	compound.insert(compound.end(), nack.begin(), nack.end());
+	EXPECT_EQ(parseNacks(compound.data(), compound.size(), 1234), seqs);
+	EXPECT_TRUE(parseNacks(compound.data(), compound.size(), 99).empty());
+	EXPECT_TRUE(
+	    parseNacks(compound.data(), compound.size() - 1, 1234).empty());
+}
+
+TEST(NackTest, testHistory) {
+	RtpHistory history(100);
+	for (int i = 0; i < 300; ++i) {
+		auto packet = rtpPacket(65400 + i);
+		history.store(packet.data(), packet.size());
+	}
+	EXPECT_EQ(history.get((uint16_t)(65400 + 199)), nullptr);
+	auto packet = history.get((uint16_t)(65400 + 200));
+	ASSERT_NE(packet, nullptr);
+	EXPECT_EQ(seqOf(*packet), (uint16_t)(65400 + 200));
+	packet = history.get((uint16_t)(65400 + 299));
+	ASSERT_NE(packet, nullptr);
+	EXPECT_EQ(*packet, rtpPacket((uint16_t)(65400 + 299)));
+	auto stats = history.stats();
+	EXPECT_EQ(stats.stored, 300u);
+	EXPECT_EQ(stats.resent, 2u);
+	EXPECT_EQ(stats.expired, 1u);
+}
+
+TEST(NackTest, testUnwrapRtx) {
+	auto original = rtpPacket(1000);
+	original[1] |= 0x80;
+	// RTX on its own payload type, SSRC and sequence numbers
+	auto rtx = rtpPacket(7, 0x80 | 97, 5678);
+	rtx.resize(12);
+	rtx.push_back(1000 >> 8);
+	rtx.push_back(1000 & 0xff);
+	rtx.insert(rtx.end(), original.begin() + 12, original.end());
+	ASSERT_TRUE(unwrapRtx(rtx, 96, 1234));
+	EXPECT_EQ(rtx, original);
+
+	// Padding only, to probe the bandwidth
+	auto probe = rtpPacket(8, 97, 5678);
+	probe.resize(12);
+	probe[0] |= 0x20;
+	probe.insert(probe.end(), {0, 0, 0, 4});
+	EXPECT_FALSE(unwrapRtx(probe, 96, 1234));
+}
+
+struct LoopbackResult {
+	int lost = 0;      // first transmissions the link dropped
+	int recovered = 0; // of those, received in the end
+	int fast = 0;      // of those, within a round trip of the first
+	NackStats stats;
+};
+
+// A sender keeping its history and a receiver sending NACKs, over a link
+// dropping packets either way at random. 500 packets a second for 10 s,
+// 25 ms each way.
+static LoopbackResult loopback(double loss) {
+	const int64_t delay = 25000;
+	std::mt19937 random(1);
+	std::bernoulli_distribution drop(loss);
+	std::deque<std::pair<int64_t, std::vector<uint8_t>>> forward, backward;
+	RtpHistory history(512);
+	NackGenerator generator;
+	std::vector<int64_t> sentAt(5000, -1), receivedAt(5000, -1);
+	std::vector<bool> dropped(5000, false);
+	LoopbackResult result;
+
+	for (int64_t now = 0; now < 12000000; now += 1000) {
+		if (now % 2000 == 0 && now < 10000000) {
+			auto packet = rtpPacket(now / 2000);
+			history.store(packet.data(), packet.size());
+			sentAt[now / 2000] = now;
+			if (drop(random)) {
+				dropped[now / 2000] = true;
+			} else {
+				forward.push_back({now + delay, packet});
+			}
+		}
+		while (!forward.empty() && forward.front().first <= now) {
+			uint16_t seq = seqOf(forward.front().second);
+			forward.pop_front();
+			if (receivedAt[seq] < 0) {
+				receivedAt[seq] = now;
+			}
+			generator.insert(seq, now);
+			auto seqs = generator.poll(now);
+			if (!seqs.empty() && !drop(random)) {
+				backward.push_back({now + delay, buildNack(1, 1234, seqs)});
+			}
+		}
+		while (!backward.empty() && backward.front().first <= now) {
+			auto nack = backward.front().second;
+			backward.pop_front();
+			for (uint16_t seq : parseNacks(nack.data(), nack.size(), 1234)) {
+				auto packet = history.get(seq);
+				if (packet && !drop(random)) {
+					forward.push_back({now + delay, *packet});
+				}
+			}
+		}
+	}
+
+	// The last losses are never noticed, nothing comes after them
+	for (int i = 0; i < 4900; ++i) {
+		if (!dropped[i]) {
+			continue;
+		}
+		result.lost++;
+		if (receivedAt[i] >= 0) {
+			result.recovered++;
+			// Noticed when the next packet arrives 2 ms later, then a round
+			// trip
+			if (receivedAt[i] - sentAt[i] <= 3 * delay + 3000) {
+				result.fast++;
+			}
+		}
+	}
+	result.stats = generator.stats();
+	return result;
+}
+
+TEST(NackTest, testLossyLoopback) {
+	for (double loss : {0.05, 0.2}) {
+		SCOPED_TRACE(loss);
+		auto result = loopback(loss);
+		double recovered = (double)result.recovered / result.lost;
+		double fast = (double)result.fast / result.lost;
+		EXPECT_GT(result.lost, (int)(5000 * loss * 0.8));
+		EXPECT_GT(recovered, 0.999);
+		// The next packet, the NACK and the retransmission all got through
+		EXPECT_GT(fast, (1 - loss) * (1 - loss) * (1 - loss) - 0.05);
+		EXPECT_NEAR(result.stats.rtt, 50, 5);
+	}
+}
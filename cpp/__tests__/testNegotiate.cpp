@@ -51,6 +51,30 @@ TEST(NegotiateTest, H265Property) {
 	EXPECT_EQ(getH265LevelId(b), 180);
 }
 
+TEST(NegotiateTest, OpusProperty) {
+	std::vector<std::string> a = {"minptime=10;useinbandfec=1;usedtx=1;"
+	                              "maxaveragebitrate=32000"};
+	std::vector<std::string> b = {"minptime=10", "stereo=1"};
+
+	EXPECT_EQ(getOpusUseDtx(a), 1);
+	EXPECT_EQ(getOpusUseDtx(b), 0);
+
+	EXPECT_EQ(getOpusUseInbandFec(a), 1);
+	EXPECT_EQ(getOpusUseInbandFec(b), 0);
+
+	EXPECT_EQ(getOpusMaxAverageBitrate(a), 32000);
+	EXPECT_EQ(getOpusMaxAverageBitrate(b), 0);
+}
+
+TEST(NegotiateTest, getOpusFmtp) {
+	EXPECT_EQ(getOpusFmtp(true),
+	          "minptime=10;maxaveragebitrate=510000;stereo=1;sprop-stereo=1;"
+	          "useinbandfec=1;usedtx=1");
+	EXPECT_EQ(getOpusFmtp(false),
+	          "minptime=10;maxaveragebitrate=510000;stereo=1;sprop-stereo=1;"
+	          "useinbandfec=1");
+}
+
 TEST(NegotiateTest, getFmtpsString) {
 	EXPECT_EQ(
 	    getFmtpsString({"level-asymmetry-allowed=1", "packetization-mode=1",
@@ -70,6 +94,10 @@ TEST(NegotiateTest, getSupportedVideo) {
 	EXPECT_TRUE(sdp.find("a=sendrecv") != std::string::npos);
 	EXPECT_TRUE(sdp.find("a=rtpmap:96 H264/90000") != std::string::npos);
 	EXPECT_TRUE(sdp.find("a=rtpmap:104 H265/90000") != std::string::npos);
+	EXPECT_TRUE(sdp.find("a=rtpmap:97 rtx/90000") != std::string::npos);
+	EXPECT_TRUE(sdp.find("a=fmtp:97 apt=96") != std::string::npos);
+	EXPECT_TRUE(sdp.find("a=fmtp:105 apt=104") != std::string::npos);
+	EXPECT_TRUE(sdp.find("a=rtcp-fb:96 nack") != std::string::npos);
 }
 
 TEST(NegotiateTest, getSupportedAudio) {
@@ -207,6 +235,36 @@ TEST(NegotiateTest, answerOpus) {
 	EXPECT_TRUE(sdp.find("a=fmtp:111") != std::string::npos);
 }
 
+TEST(NegotiateTest, answerOpusFmtp) {
+	rtc::Description remoteDesc("v=0\r\n"
+	                            "o=- 0 0 IN IP4 127.0.0.1\r\n"
+	                            "s=-\r\n"
+	                            "t=0 0\r\n"
+	                            "m=audio 9 UDP/TLS/RTP/SAVPF 111\r\n"
+	                            "c=IN IP4 0.0.0.0\r\n"
+	                            "a=mid:0\r\n"
+	                            "a=sendrecv\r\n"
+	                            "a=rtcp-mux\r\n"
+	                            "a=rtpmap:111 opus/48000/2\r\n"
+	                            "a=fmtp:111 minptime=10;useinbandfec=1;"
+	                            "maxaveragebitrate=20000\r\n");
+	auto fmtps = getFmtps(remoteDesc, "0", 111);
+	EXPECT_EQ(getOpusUseInbandFec(fmtps), 1);
+	EXPECT_EQ(getOpusUseDtx(fmtps), 0);
+	EXPECT_EQ(getOpusMaxAverageBitrate(fmtps), 20000);
+	EXPECT_TRUE(getFmtps(remoteDesc, "0", 96).empty());
+	EXPECT_TRUE(getFmtps(remoteDesc, "1", 111).empty());
+
+	// The answer states its own preferences
+	auto media = negotiateAnswerMedia(
+	    remoteDesc, 0, rtc::Description::Direction::SendRecv, "audio", {},
+	    std::nullopt, getOpusFmtp(true));
+	auto sdp = media->generateSdp();
+	EXPECT_TRUE(sdp.find("a=fmtp:111 minptime=10;maxaveragebitrate=510000;"
+	                     "stereo=1;sprop-stereo=1;useinbandfec=1;usedtx=1") !=
+	            std::string::npos);
+}
+
 TEST(NegotiateTest, negotiateRtpMap) {
 	rtc::Description remoteDesc("v=0\r\n"
 	                            "o=- 0 0 IN IP4 127.0.0.1\r\n"
@@ -277,4 +335,58 @@ TEST(NegotiateTest, negotiateRtpMapPriority) {
 	EXPECT_EQ(rtpMap->payloadType, 109);
 	EXPECT_EQ(rtpMap->format, "H265");
 	EXPECT_EQ(rtpMap->clockRate, 90000);
-}
\ No newline at end of file
+}
+
+TEST(NegotiateTest, answerRtx) {
+	rtc::Description remoteDesc("v=0\r\n"
+	                            "o=- 0 0 IN IP4 127.0.0.1\r\n"
+	                            "s=-\r\n"
+	                            "t=0 0\r\n"
+	                            "m=video 9 UDP/TLS/RTP/SAVPF 96 97 109 110\r\n"
+	                            "c=IN IP4 0.0.0.0\r\n"
+	                            "a=mid:0\r\n"
+	                            "a=sendrecv\r\n"
+	                            "a=rtcp-mux\r\n"
+	                            "a=rtpmap:96 VP8/90000\r\n"
+	                            "a=rtpmap:97 rtx/90000\r\n"
+	                            "a=fmtp:97 apt=96\r\n"
+	                            "a=rtpmap:109 H264/90000\r\n"
+	                            "a=fmtp:109 level-asymmetry-allowed=1;"
+	                            "packetization-mode=1;"
+	                            "profile-level-id=42e01f\r\n"
+	                            "a=rtpmap:110 rtx/90000\r\n"
+	                            "a=fmtp:110 apt=109\r\n",
+	                            rtc::Description::Type::Offer);
+	auto media = negotiateAnswerMedia(remoteDesc, 0,
+	                                  rtc::Description::Direction::SendRecv,
+	                                  "video", {}, std::nullopt);
+	auto sdp = media->generateSdp();
+	EXPECT_TRUE(sdp.find("m=video 9 UDP/TLS/RTP/SAVPF 109 110") !=
+	            std::string::npos);
+	EXPECT_TRUE(sdp.find("a=fmtp:110 apt=109") != std::string::npos);
+	// Not the RTX of VP8, which is not accepted
+	EXPECT_TRUE(sdp.find("a=rtpmap:97") == std::string::npos);
+
+	EXPECT_EQ(getRtxPayloadType(remoteDesc, "0", 109), 110);
+	EXPECT_EQ(getRtxPayloadType(remoteDesc, "0", 96), 97);
+	EXPECT_EQ(getRtxPayloadType(remoteDesc, "0", 98), -1);
+}
+
+TEST(NegotiateTest, negotiateRtpMapSkipsRtx) {
+	rtc::Description remoteDesc("v=0\r\n"
+	                            "o=- 0 0 IN IP4 127.0.0.1\r\n"
+	                            "s=-\r\n"
+	                            "t=0 0\r\n"
+	                            "m=video 9 UDP/TLS/RTP/SAVPF 97 96\r\n"
+	                            "c=IN IP4 0.0.0.0\r\n"
+	                            "a=mid:0\r\n"
+	                            "a=recvonly\r\n"
+	                            "a=rtcp-mux\r\n"
+	                            "a=rtpmap:97 rtx/90000\r\n"
+	                            "a=fmtp:97 apt=96\r\n"
+	                            "a=rtpmap:96 H264/90000\r\n",
+	                            rtc::Description::Type::Offer);
+	auto rtpMap = negotiateRtpMap(remoteDesc, remoteDesc, "0");
+	EXPECT_EQ(rtpMap->payloadType, 96);
+	EXPECT_EQ(rtpMap->format, "H264");
+}
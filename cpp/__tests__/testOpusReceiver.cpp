@@ -0,0 +1,207 @@
+#include "opusreceiver.h"
+#include <cmath>
+#include <gtest/gtest.h>
+#include <opus/opus.h>
+#include <set>
+
+struct RtpPacket {
+	std::vector<uint8_t> data;
+	uint32_t timestamp;
+};
+
+// 20 ms packets of a stereo tone changing pitch every packet, which
+// concealment cannot predict.
+static std::vector<RtpPacket> encodePackets(int count, bool fec,
+                                            uint32_t timestamp = 1000) {
+	int error = 0;
+	auto encoder =
+	    opus_encoder_create(48000, 2, OPUS_APPLICATION_VOIP, &error);
+	EXPECT_EQ(error, OPUS_OK);
+	opus_encoder_ctl(encoder, OPUS_SET_BITRATE(32000));
+	opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(fec ? 1 : 0));
+	opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(fec ? 20 : 0));
+	std::vector<RtpPacket> packets;
+	std::vector<float> pcm(960 * 2);
+	double phase = 0;
+	for (int p = 0; p < count; ++p) {
+		double frequency = 200 + (p * 7919) % 600;
+		for (int i = 0; i < 960; ++i) {
+			phase += 2 * M_PI * frequency / 48000;
+			pcm[2 * i] = 0.3 * sin(phase);
+			pcm[2 * i + 1] = 0.2 * sin(phase);
+		}
+		std::vector<uint8_t> data(1500);
+		int size =
+		    opus_encode_float(encoder, pcm.data(), 960, data.data(), 1500);
+		EXPECT_GT(size, 0);
+		data.resize(size);
+		packets.push_back({data, timestamp + (uint32_t)(p * 960)});
+	}
+	opus_encoder_destroy(encoder);
+	return packets;
+}
+
+struct Received {
+	std::vector<float> samples;
+	int64_t firstPts = -1;
+	int64_t nextPts = -1;
+	bool continuous = true;
+};
+
+static OpusSink collect(Received &received) {
+	return [&received](const float *samples, int nb_samples, int64_t pts) {
+		if (received.firstPts < 0) {
+			received.firstPts = pts;
+		} else if (pts != received.nextPts) {
+			received.continuous = false;
+		}
+		received.nextPts = pts + nb_samples;
+		received.samples.insert(received.samples.end(), samples,
+		                        samples + nb_samples * 2);
+	};
+}
+
+// Feeds the packets whose index is not in lost.
+static Received receive(OpusReceiver &receiver,
+                        const std::vector<RtpPacket> &packets,
+                        const std::set<int> &lost) {
+	Received received;
+	auto sink = collect(received);
+	for (size_t i = 0; i < packets.size(); ++i) {
+		if (lost.count(i)) {
+			continue;
+		}
+		auto &p = packets[i];
+		receiver.receive(p.data.data(), p.data.size(), p.timestamp, sink);
+	}
+	return received;
+}
+
+TEST(OpusReceiverTest, testNoLoss) {
+	auto packets = encodePackets(50, false);
+	OpusReceiver receiver;
+	auto received = receive(receiver, packets, {});
+	EXPECT_TRUE(received.continuous);
+	EXPECT_EQ(received.firstPts, 1000);
+	EXPECT_EQ(received.samples.size(), 50u * 960 * 2);
+	auto stats = receiver.stats();
+	EXPECT_EQ(stats.packets, 50u);
+	EXPECT_EQ(stats.concealed, 0u);
+	EXPECT_EQ(stats.recovered, 0u);
+}
+
+TEST(OpusReceiverTest, testLossPatterns) {
+	std::set<int> every5th, burst, random;
+	for (int i = 5; i < 99; i += 5) {
+		every5th.insert(i);
+	}
+	for (int i = 40; i < 43; ++i) {
+		burst.insert(i);
+	}
+	srand(1);
+	for (int i = 1; i < 99; ++i) {
+		if (rand() % 5 == 0) {
+			random.insert(i);
+		}
+	}
+	auto packets = encodePackets(100, true);
+	uint64_t recovered = 0;
+	for (auto &lost : {every5th, burst, random}) {
+		OpusReceiver receiver;
+		auto received = receive(receiver, packets, lost);
+		// The first and last packets arrive, everything between is filled
+		EXPECT_TRUE(received.continuous);
+		EXPECT_EQ(received.firstPts, 1000);
+		EXPECT_EQ(received.nextPts, 1000 + 100 * 960);
+		EXPECT_EQ(received.samples.size(), 100u * 960 * 2);
+		auto stats = receiver.stats();
+		EXPECT_EQ(stats.packets, 100u - lost.size());
+		EXPECT_EQ(stats.recovered + stats.concealed, lost.size() * 960);
+		recovered += stats.recovered;
+	}
+	// Not every packet carries FEC, the encoder skips it when cheap to lose
+	EXPECT_GT(recovered, 0u);
+}
+
+TEST(OpusReceiverTest, testFecBeatsConcealment) {
+	std::set<int> lost;
+	for (int i = 10; i < 90; i += 4) {
+		lost.insert(i);
+	}
+	auto error = [&](bool fec) {
+		auto packets = encodePackets(100, fec);
+		OpusReceiver reference, receiver;
+		auto clean = receive(reference, packets, {});
+		auto lossy = receive(receiver, packets, lost);
+		double energy = 0;
+		for (int i : lost) {
+			for (int j = i * 960 * 2; j < (i + 1) * 960 * 2; ++j) {
+				double d = lossy.samples[j] - clean.samples[j];
+				energy += d * d;
+			}
+		}
+		return energy;
+	};
+	EXPECT_LT(error(true), error(false));
+}
+
+TEST(OpusReceiverTest, testLateAndDuplicate) {
+	auto packets = encodePackets(10, false);
+	std::swap(packets[3], packets[4]);
+	packets.insert(packets.begin() + 7, packets[6]);
+	OpusReceiver receiver;
+	auto received = receive(receiver, packets, {});
+	EXPECT_TRUE(received.continuous);
+	EXPECT_EQ(received.samples.size(), 10u * 960 * 2);
+	auto stats = receiver.stats();
+	// Packet 3 came after 4 had been played, so it was concealed
+	EXPECT_EQ(stats.late, 2u);
+	EXPECT_EQ(stats.packets, 9u);
+	EXPECT_EQ(stats.concealed + stats.recovered, 960u);
+}
+
+TEST(OpusReceiverTest, testTimestampWrap) {
+	uint32_t start = UINT32_MAX - 5 * 960 + 1;
+	auto packets = encodePackets(10, true, start);
+	OpusReceiver receiver;
+	auto received = receive(receiver, packets, {7});
+	EXPECT_TRUE(received.continuous);
+	EXPECT_EQ(received.firstPts, start);
+	EXPECT_EQ(received.nextPts, (int64_t)start + 10 * 960);
+
+	// Each packet's own timestamp, unwrapped too
+	OpusReceiver again;
+	Received ignored;
+	for (size_t i = 0; i < packets.size(); ++i) {
+		auto &p = packets[i];
+		int64_t pts = again.receive(p.data.data(), p.data.size(), p.timestamp,
+		                            collect(ignored));
+		EXPECT_EQ(pts, (int64_t)start + (int64_t)i * 960);
+	}
+	auto &p = packets[2];
+	EXPECT_EQ(again.receive(p.data.data(), p.data.size(), p.timestamp,
+	                        collect(ignored)),
+	          -1);
+}
+
+TEST(OpusReceiverTest, testLongGapResets) {
+	auto packets = encodePackets(10, false);
+	for (size_t i = 5; i < packets.size(); ++i) {
+		packets[i].timestamp += 48000 * 5;
+	}
+	OpusReceiver receiver;
+	auto received = receive(receiver, packets, {});
+	EXPECT_FALSE(received.continuous);
+	EXPECT_EQ(received.samples.size(), 10u * 960 * 2);
+	EXPECT_EQ(received.nextPts, 1000 + 48000 * 5 + 10 * 960);
+	EXPECT_EQ(receiver.stats().resets, 1u);
+}
+
+TEST(OpusReceiverTest, testInvalidPacket) {
+	OpusReceiver receiver;
+	Received received;
+	const uint8_t empty[1] = {0};
+	receiver.receive(empty, 0, 0, collect(received));
+	EXPECT_EQ(receiver.stats().invalid, 1u);
+	EXPECT_TRUE(received.samples.empty());
+}
@@ -0,0 +1,116 @@
+#include "overusedetector.h"
+#include <gtest/gtest.h>
+
+// Feeds frames at 30 fps to an encoder taking cost us per frame at full
+// size, its time following the number of pixels.
+static void run(OveruseDetector &detector, int64_t &now, int frames,
+                double cost) {
+	for (int i = 0; i < frames; ++i) {
+		now += 33333;
+		if (detector.offer(now)) {
+			double scale = detector.scale();
+			detector.encoded((int64_t)(cost * scale * scale));
+		}
+	}
+}
+
+TEST(OveruseDetectorTest, testFastEncoder) {
+	OveruseDetector detector;
+	int64_t now = 0;
+	run(detector, now, 600, 10000);
+	auto stats = detector.stats();
+	EXPECT_EQ(stats.level, 0);
+	EXPECT_EQ(stats.frames, 600u);
+	EXPECT_EQ(stats.dropped, 0u);
+	EXPECT_EQ(stats.downgrades, 0u);
+	EXPECT_NEAR(stats.encodeTime, 10, 0.1);
+	EXPECT_NEAR(stats.usage, 0.3, 0.01);
+}
+
+TEST(OveruseDetectorTest, testStepsDownResolution) {
+	OveruseDetector detector;
+	int64_t now = 0;
+	// 0.75 of the size still takes 34 ms, half of it 15 ms
+	run(detector, now, 300, 60000);
+	auto stats = detector.stats();
+	EXPECT_EQ(stats.level, 2);
+	EXPECT_EQ(stats.scale, 0.5);
+	EXPECT_EQ(stats.downgrades, 2u);
+	EXPECT_EQ(stats.dropped, 0u);
+	EXPECT_LT(stats.usage, 0.85);
+
+	// Full size would not fit, so it stays
+	run(detector, now, 600, 60000);
+	EXPECT_EQ(detector.stats().level, 2);
+	EXPECT_EQ(detector.stats().upgrades, 0u);
+}
+
+TEST(OveruseDetectorTest, testDropsFrames) {
+	OveruseDetector detector;
+	int64_t now = 0;
+	// Even half the size takes 37.5 ms, every other frame goes
+	run(detector, now, 300, 150000);
+	auto stats = detector.stats();
+	EXPECT_EQ(stats.level, 3);
+	EXPECT_EQ(stats.downgrades, 3u);
+	EXPECT_GT(stats.dropped, 100u);
+	uint64_t dropped = stats.dropped;
+	run(detector, now, 100, 150000);
+	EXPECT_EQ(detector.stats().dropped, dropped + 50);
+}
+
+TEST(OveruseDetectorTest, testRecovers) {
+	OveruseDetector detector;
+	int64_t now = 0;
+	run(detector, now, 300, 150000);
+	ASSERT_EQ(detector.stats().level, 3);
+	// The load goes away, levels come back one at a time
+	run(detector, now, 30, 10000);
+	EXPECT_EQ(detector.stats().level, 2);
+	run(detector, now, 1000, 10000);
+	auto stats = detector.stats();
+	EXPECT_EQ(stats.level, 0);
+	EXPECT_EQ(stats.scale, 1);
+	EXPECT_EQ(stats.upgrades, 3u);
+	EXPECT_EQ(stats.downgrades, 3u);
+}
+
+TEST(OveruseDetectorTest, testRelapseWaitsLonger) {
+	OveruseDetector detector;
+	int64_t now = 0;
+	run(detector, now, 100, 60000);
+	ASSERT_EQ(detector.stats().level, 2);
+	// Headroom that vanishes as soon as it is used
+	int upgradeFrame = -1;
+	int second = -1;
+	for (int i = 0; i < 2000 && second < 0; ++i) {
+		now += 33333;
+		int level = detector.stats().level;
+		if (detector.offer(now)) {
+			double cost = level == 2 ? 10000 : 60000;
+			double scale = detector.scale();
+			detector.encoded((int64_t)(cost * scale * scale));
+		}
+		if (detector.stats().level < level) {
+			if (upgradeFrame < 0) {
+				upgradeFrame = i;
+			} else {
+				second = i - upgradeFrame;
+			}
+		}
+	}
+	// The second step back waited twice as long after the relapse
+	EXPECT_GT(upgradeFrame, 0);
+	EXPECT_GT(second, 2 * 90);
+	EXPECT_EQ(detector.stats().downgrades, 3u);
+}
+
+TEST(OveruseDetectorTest, testPauseIgnored) {
+	OveruseDetector detector;
+	int64_t now = 0;
+	run(detector, now, 100, 10000);
+	now += 5000000;
+	run(detector, now, 10, 10000);
+	EXPECT_NEAR(detector.stats().usage, 0.3, 0.01);
+	EXPECT_EQ(detector.stats().level, 0);
+}
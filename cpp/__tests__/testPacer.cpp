@@ -0,0 +1,148 @@
+#include "pacer.h"
+#include <climits>
+#include <gtest/gtest.h>
+
+struct Sent {
+	int id;
+	int64_t time;
+};
+
+struct Clock {
+	int64_t now = 0;
+	std::vector<Sent> sent;
+};
+
+static void push(Pacer &pacer, Clock &clock, int id, PacketPriority priority,
+                 size_t size = 1200, int stream = 0) {
+	pacer.push(stream, priority, size, clock.now, [&clock, id]() {
+		clock.sent.push_back({id, clock.now});
+	});
+}
+
+// Runs the clock to each time the pacer asks for, until it is empty.
+static void drain(Pacer &pacer, Clock &clock) {
+	int64_t next;
+	while ((next = pacer.nextSend()) != INT64_MAX) {
+		clock.now = std::max(clock.now, next);
+		for (auto &send : pacer.pop(clock.now)) {
+			send();
+		}
+	}
+}
+
+TEST(PacerTest, testSpreadsBurst) {
+	Pacer pacer(1000000);
+	Clock clock;
+	for (int i = 0; i < 20; ++i) {
+		push(pacer, clock, i, PacketPriority::Video);
+	}
+	drain(pacer, clock);
+	ASSERT_EQ(clock.sent.size(), 20u);
+	for (int i = 0; i < 20; ++i) {
+		EXPECT_EQ(clock.sent[i].id, i);
+	}
+	// 24 KB at 1 Mbps, less the burst that went at once
+	EXPECT_NEAR(clock.sent.back().time, 187000, 10000);
+	for (int i = 2; i < 20; ++i) {
+		EXPECT_NEAR(clock.sent[i].time - clock.sent[i - 1].time, 9600, 100);
+	}
+	auto stats = pacer.stats();
+	EXPECT_EQ(stats.packets, 20u);
+	EXPECT_EQ(stats.bytes, 24000u);
+	EXPECT_EQ(stats.queued, 0u);
+	EXPECT_NEAR(stats.maxDelay, 187, 10);
+	EXPECT_NEAR(stats.delay, 187 / 2.0, 10);
+}
+
+TEST(PacerTest, testIdleSendsAtOnce) {
+	Pacer pacer(1000000);
+	Clock clock;
+	for (int i = 0; i < 5; ++i) {
+		clock.now = i * 100000;
+		push(pacer, clock, i, PacketPriority::Video, 500);
+		drain(pacer, clock);
+		EXPECT_EQ(clock.sent.back().time, clock.now);
+	}
+	EXPECT_EQ(pacer.stats().maxDelay, 0);
+}
+
+TEST(PacerTest, testAudioFirst) {
+	Pacer pacer(1000000);
+	Clock clock;
+	for (int i = 0; i < 20; ++i) {
+		push(pacer, clock, i, PacketPriority::Video);
+	}
+	auto first = pacer.pop(clock.now);
+	for (auto &send : first) {
+		send();
+	}
+	clock.now += 1000;
+	push(pacer, clock, 100, PacketPriority::Audio, 100);
+	push(pacer, clock, 200, PacketPriority::Retransmission);
+	// Audio does not wait for the budget
+	EXPECT_EQ(pacer.nextSend(), clock.now);
+	drain(pacer, clock);
+	size_t audio = first.size();
+	EXPECT_EQ(clock.sent[audio].id, 100);
+	EXPECT_EQ(clock.sent[audio].time, 1000);
+	// The retransmission goes before the video queued earlier
+	EXPECT_EQ(clock.sent[audio + 1].id, 200);
+	EXPECT_EQ(clock.sent.size(), 22u);
+}
+
+TEST(PacerTest, testQueueTimeBounded) {
+	// 85 packets of a keyframe would take 816 ms at 1 Mbps
+	Pacer pacer(1000000, 500);
+	Clock clock;
+	for (int i = 0; i < 85; ++i) {
+		push(pacer, clock, i, PacketPriority::Video);
+	}
+	EXPECT_GT(pacer.stats().rate, 1000000);
+	drain(pacer, clock);
+	EXPECT_EQ(clock.sent.size(), 85u);
+	EXPECT_LE(clock.sent.back().time, 502000);
+	EXPECT_GT(clock.sent.back().time, 400000);
+	EXPECT_LE(pacer.stats().maxDelay, 502);
+	EXPECT_EQ(pacer.stats().rate, 1000000);
+}
+
+TEST(PacerTest, testQueueBounded) {
+	Pacer pacer(1000000, 500, 10);
+	Clock clock;
+	push(pacer, clock, 100, PacketPriority::Audio, 100);
+	for (int i = 0; i < 15; ++i) {
+		push(pacer, clock, i, PacketPriority::Video);
+	}
+	EXPECT_EQ(pacer.stats().dropped, 6u);
+	drain(pacer, clock);
+	ASSERT_EQ(clock.sent.size(), 10u);
+	EXPECT_EQ(clock.sent[0].id, 100);
+	// The oldest video went
+	EXPECT_EQ(clock.sent[1].id, 6);
+}
+
+TEST(PacerTest, testRemoveStream) {
+	Pacer pacer(1000000);
+	Clock clock;
+	for (int i = 0; i < 10; ++i) {
+		push(pacer, clock, i, PacketPriority::Video, 1200, i % 2);
+	}
+	pacer.remove(1);
+	drain(pacer, clock);
+	ASSERT_EQ(clock.sent.size(), 5u);
+	for (auto &sent : clock.sent) {
+		EXPECT_EQ(sent.id % 2, 0);
+	}
+	EXPECT_EQ(pacer.nextSend(), INT64_MAX);
+}
+
+TEST(PacerTest, testSetBitrate) {
+	Pacer pacer(1000000);
+	pacer.setBitrate(2000000);
+	Clock clock;
+	for (int i = 0; i < 20; ++i) {
+		push(pacer, clock, i, PacketPriority::Video);
+	}
+	drain(pacer, clock);
+	EXPECT_NEAR(clock.sent.back().time, 187000 / 2, 10000);
+}
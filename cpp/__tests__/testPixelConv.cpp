@@ -0,0 +1,298 @@
+#include "ffmpeg.h"
+#include "pixelconv.h"
+#include <algorithm>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <random>
+
+// Odd sizes so every kernel also runs its scalar tail
+static const int width = 646;
+static const int height = 362;
+
+static std::vector<SimdLevel> supportedLevels() {
+	std::vector<SimdLevel> levels;
+	for (auto level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2,
+	                   SimdLevel::NEON}) {
+		if (simdLevelSupported(level)) {
+			levels.push_back(level);
+		}
+	}
+	return levels;
+}
+
+static std::shared_ptr<AVFrame> randomNV12(int w, int h) {
+	static std::mt19937 rng(1);
+	auto frame = createVideoFrame(AV_PIX_FMT_NV12, w, h, 0);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			frame->data[0][y * frame->linesize[0] + x] = rng();
+		}
+	}
+	for (int y = 0; y < (h + 1) / 2; ++y) {
+		for (int x = 0; x < (w + 1) / 2 * 2; ++x) {
+			frame->data[1][y * frame->linesize[1] + x] = rng();
+		}
+	}
+	return frame;
+}
+
+// Gradients, swscale interpolates chroma so noise is not comparable
+static std::shared_ptr<AVFrame> smoothNV12(int w, int h) {
+	auto frame = createVideoFrame(AV_PIX_FMT_NV12, w, h, 0);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			frame->data[0][y * frame->linesize[0] + x] = 16 + x * 219 / w;
+		}
+	}
+	int cw = (w + 1) / 2;
+	int ch = (h + 1) / 2;
+	for (int y = 0; y < ch; ++y) {
+		uint8_t *row = frame->data[1] + y * frame->linesize[1];
+		for (int x = 0; x < cw; ++x) {
+			row[2 * x] = 16 + x * 224 / cw;
+			row[2 * x + 1] = 16 + y * 224 / ch;
+		}
+	}
+	return frame;
+}
+
+static bool samePlane(const uint8_t *a, int aStride, const uint8_t *b,
+                      int bStride, int w, int h) {
+	for (int y = 0; y < h; ++y) {
+		if (memcmp(a + y * aStride, b + y * bStride, w) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+class PixelConvTest : public testing::Test {
+  protected:
+	void TearDown() override { setSimdLevel(detectSimdLevel()); }
+};
+
+TEST_F(PixelConvTest, testNV12ToI420) {
+	auto src = randomNV12(width, height);
+	Scaler scaler;
+	auto ref = scaler.scale(src, AV_PIX_FMT_YUV420P, width, height);
+	for (auto level : supportedLevels()) {
+		setSimdLevel(level);
+		auto dst = createVideoFrame(AV_PIX_FMT_YUV420P, width, height, 0);
+		nv12ToI420(src->data[0], src->linesize[0], src->data[1],
+		           src->linesize[1], dst->data[0], dst->linesize[0],
+		           dst->data[1], dst->linesize[1], dst->data[2],
+		           dst->linesize[2], width, height);
+		for (int p = 0; p < 3; ++p) {
+			int w = p ? (width + 1) / 2 : width;
+			int h = p ? (height + 1) / 2 : height;
+			EXPECT_TRUE(samePlane(dst->data[p], dst->linesize[p], ref->data[p],
+			                      ref->linesize[p], w, h))
+			    << simdLevelName(level) << " plane " << p;
+		}
+	}
+}
+
+TEST_F(PixelConvTest, testI420ToNV12) {
+	Scaler scaler;
+	auto src =
+	    scaler.scale(randomNV12(width, height), AV_PIX_FMT_YUV420P, width,
+	                 height);
+	auto ref = scaler.scale(src, AV_PIX_FMT_NV12, width, height);
+	for (auto level : supportedLevels()) {
+		setSimdLevel(level);
+		auto dst = createVideoFrame(AV_PIX_FMT_NV12, width, height, 0);
+		i420ToNV12(src->data[0], src->linesize[0], src->data[1],
+		           src->linesize[1], src->data[2], src->linesize[2],
+		           dst->data[0], dst->linesize[0], dst->data[1],
+		           dst->linesize[1], width, height);
+		EXPECT_TRUE(samePlane(dst->data[0], dst->linesize[0], ref->data[0],
+		                      ref->linesize[0], width, height))
+		    << simdLevelName(level);
+		EXPECT_TRUE(samePlane(dst->data[1], dst->linesize[1], ref->data[1],
+		                      ref->linesize[1], (width + 1) / 2 * 2,
+		                      (height + 1) / 2))
+		    << simdLevelName(level);
+	}
+}
+
+TEST_F(PixelConvTest, testPackNV21) {
+	// Android YUV_420_888 with pixel stride 2 and V first
+	auto nv12 = randomNV12(width, height);
+	auto nv21 = createVideoFrame(AV_PIX_FMT_NV21, width, height, 0);
+	int cw = (width + 1) / 2;
+	int ch = (height + 1) / 2;
+	for (int y = 0; y < ch; ++y) {
+		for (int x = 0; x < cw; ++x) {
+			uint8_t *src = nv12->data[1] + y * nv12->linesize[1] + 2 * x;
+			uint8_t *dst = nv21->data[1] + y * nv21->linesize[1] + 2 * x;
+			dst[0] = src[1];
+			dst[1] = src[0];
+		}
+	}
+	for (auto level : supportedLevels()) {
+		setSimdLevel(level);
+		auto dst = createVideoFrame(AV_PIX_FMT_NV12, width, height, 0);
+		packNV12UV(nv21->data[1] + 1, nv21->linesize[1], nv21->data[1],
+		           nv21->linesize[1], 2, dst->data[1], dst->linesize[1], cw,
+		           ch);
+		EXPECT_TRUE(samePlane(dst->data[1], dst->linesize[1], nv12->data[1],
+		                      nv12->linesize[1], cw * 2, ch))
+		    << simdLevelName(level);
+	}
+}
+
+// BT.601 limited range in the 8 bit fixed point every kernel computes
+static std::vector<uint8_t> referenceRGBA(const AVFrame *src, int w, int h,
+                                          bool bgra) {
+	auto clamp8 = [](int v) { return (uint8_t)std::clamp(v, 0, 255); };
+	std::vector<uint8_t> dst(w * 4 * h);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			const uint8_t *uv =
+			    src->data[1] + y / 2 * src->linesize[1] + x / 2 * 2;
+			int c = src->data[0][y * src->linesize[0] + x] - 16;
+			int d = uv[0] - 128;
+			int e = uv[1] - 128;
+			int base = 298 * c + 128;
+			uint8_t r = clamp8((base + 409 * e) >> 8);
+			uint8_t g = clamp8((base - 100 * d - 208 * e) >> 8);
+			uint8_t b = clamp8((base + 516 * d) >> 8);
+			uint8_t *pixel = dst.data() + (y * w + x) * 4;
+			pixel[0] = bgra ? b : r;
+			pixel[1] = g;
+			pixel[2] = bgra ? r : b;
+			pixel[3] = 255;
+		}
+	}
+	return dst;
+}
+
+TEST_F(PixelConvTest, testRGBABitExact) {
+	// Widths around the vector sizes, for the scalar tails
+	for (int w : {width, 1, 2, 15, 17, 31, 33, 63, 65}) {
+		auto src = randomNV12(w, 6);
+		for (bool bgra : {false, true}) {
+			auto ref = referenceRGBA(src.get(), w, 6, bgra);
+			for (auto level : supportedLevels()) {
+				setSimdLevel(level);
+				std::vector<uint8_t> dst(w * 4 * 6);
+				nv12ToRGBA(src->data[0], src->linesize[0], src->data[1],
+				           src->linesize[1], dst.data(), w * 4, w, 6, bgra);
+				EXPECT_EQ(dst, ref)
+				    << simdLevelName(level) << " width " << w << " bgra "
+				    << bgra;
+			}
+		}
+	}
+}
+
+// Only a sanity check of the coefficients, bit-exactness is tested above
+TEST_F(PixelConvTest, testRGBAMatchesSwscale) {
+	auto src = smoothNV12(width, height);
+	Scaler scaler;
+	for (auto format : {AV_PIX_FMT_RGBA, AV_PIX_FMT_BGRA}) {
+		auto ref = scaler.scale(src, format, width, height);
+		auto dst = createVideoFrame(format, width, height, 0);
+		nv12ToRGBA(src->data[0], src->linesize[0], src->data[1],
+		           src->linesize[1], dst->data[0], dst->linesize[0], width,
+		           height, format == AV_PIX_FMT_BGRA);
+		int maxDiff = 0;
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width * 4; ++x) {
+				int a = dst->data[0][y * dst->linesize[0] + x];
+				int b = ref->data[0][y * ref->linesize[0] + x];
+				maxDiff = std::max(maxDiff, std::abs(a - b));
+			}
+		}
+		// swscale interpolates chroma vertically, the kernels repeat it
+		EXPECT_LE(maxDiff, 4) << av_get_pix_fmt_name(format);
+	}
+}
+
+TEST_F(PixelConvTest, testBoxDownscale) {
+	std::mt19937 rng(2);
+	std::vector<uint8_t> src(width * 4 * height);
+	for (auto &value : src) {
+		value = rng();
+	}
+	for (int channels : {1, 2, 4}) {
+		for (int factor : {2, 4}) {
+			int stride = width * channels;
+			int w = width / factor;
+			int h = height / factor;
+			std::vector<uint8_t> ref(w * channels * h);
+			for (int y = 0; y < h; ++y) {
+				for (int x = 0; x < w * channels; ++x) {
+					int c = x % channels;
+					int sum = 0;
+					for (int dy = 0; dy < factor; ++dy) {
+						for (int dx = 0; dx < factor; ++dx) {
+							sum += src[(y * factor + dy) * stride +
+							           (x - c) * factor + dx * channels + c];
+						}
+					}
+					ref[y * w * channels + x] =
+					    (sum + factor * factor / 2) / (factor * factor);
+				}
+			}
+			for (auto level : supportedLevels()) {
+				setSimdLevel(level);
+				std::vector<uint8_t> dst(w * channels * h);
+				downscaleBox(src.data(), stride, dst.data(), w * channels, w, h,
+				             channels, factor);
+				EXPECT_EQ(dst, ref) << simdLevelName(level) << " channels "
+				                    << channels << " factor " << factor;
+			}
+		}
+	}
+}
+
+TEST_F(PixelConvTest, benchmark1080p) {
+	const int w = 1920;
+	const int h = 1080;
+	const int runs = 20;
+	auto src = randomNV12(w, h);
+	auto i420 = createVideoFrame(AV_PIX_FMT_YUV420P, w, h, 0);
+	auto rgba = createVideoFrame(AV_PIX_FMT_RGBA, w, h, 0);
+	auto time = [&](const std::function<void()> &fn) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < runs; ++i) {
+			fn();
+		}
+		return std::chrono::duration<double, std::milli>(
+		           std::chrono::steady_clock::now() - start)
+		           .count() /
+		       runs;
+	};
+
+	Scaler scaler;
+	double swsI420 =
+	    time([&]() { scaler.scale(src, AV_PIX_FMT_YUV420P, w, h); });
+	double swsRGBA = time([&]() { scaler.scale(src, AV_PIX_FMT_RGBA, w, h); });
+	LOGI("swscale: nv12->i420 %.3f ms, nv12->rgba %.3f ms\n", swsI420,
+	     swsRGBA);
+
+	for (auto level : supportedLevels()) {
+		setSimdLevel(level);
+		double toI420 = time([&]() {
+			nv12ToI420(src->data[0], src->linesize[0], src->data[1],
+			           src->linesize[1], i420->data[0], i420->linesize[0],
+			           i420->data[1], i420->linesize[1], i420->data[2],
+			           i420->linesize[2], w, h);
+		});
+		double toNV12 = time([&]() {
+			i420ToNV12(i420->data[0], i420->linesize[0], i420->data[1],
+			           i420->linesize[1], i420->data[2], i420->linesize[2],
+			           src->data[0], src->linesize[0], src->data[1],
+			           src->linesize[1], w, h);
+		});
+		double toRGBA = time([&]() {
+			nv12ToRGBA(src->data[0], src->linesize[0], src->data[1],
+			           src->linesize[1], rgba->data[0], rgba->linesize[0], w,
+			           h);
+		});
+		LOGI("%s: nv12->i420 %.3f ms, i420->nv12 %.3f ms, nv12->rgba %.3f "
+		     "ms\n",
+		     simdLevelName(level), toI420, toNV12, toRGBA);
+	}
+}
@@ -0,0 +1,152 @@
+#include "asyncwriter.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+
+AsyncWriter::AsyncWriter(const std::string &path, size_t maxQueue)
+    : maxQueue(maxQueue) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) {
+		throw std::runtime_error("Could not open output file");
+	}
+	auto file = std::shared_ptr<FILE>(f, [](FILE *f) { fclose(f); });
+	sink = [file](int64_t offset, const uint8_t *data, size_t size) {
+		if (fseeko(file.get(), offset, SEEK_SET) != 0) {
+			throw std::runtime_error("Could not seek output file");
+		}
+		if (fwrite(data, 1, size, file.get()) != size) {
+			throw std::runtime_error("Could not write output file");
+		}
+	};
+	thread = std::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::AsyncWriter(WriteSink sink, size_t maxQueue)
+    : sink(std::move(sink)), maxQueue(maxQueue) {
+	thread = std::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+	try {
+		close();
+	} catch (const std::exception &) {
+	}
+}
+
+void AsyncWriter::run() {
+	while (true) {
+		Chunk chunk;
+		{
+			std::unique_lock lock(mutex);
+			cond.wait(lock, [this] { return closed || !queue.empty(); });
+			if (queue.empty()) {
+				return;
+			}
+			chunk = std::move(queue.front());
+			queue.pop_front();
+			busy = true;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		bool ok = true;
+		try {
+			sink(chunk.offset, chunk.data.data(), chunk.data.size());
+		} catch (const std::exception &) {
+			ok = false;
+		}
+		double latency = std::chrono::duration<double, std::milli>(
+		                     std::chrono::steady_clock::now() - start)
+		                     .count();
+
+		std::lock_guard lock(mutex);
+		busy = false;
+		failed = failed || !ok;
+		stat.writes += 1;
+		stat.bytesWritten += chunk.data.size();
+		stat.lastWriteLatency = latency;
+		stat.maxWriteLatency = std::max(stat.maxWriteLatency, latency);
+		stat.avgWriteLatency +=
+		    (latency - stat.avgWriteLatency) / (double)stat.writes;
+		chunk.data.clear();
+		freeBuffers.push_back(std::move(chunk.data));
+		cond.notify_all();
+	}
+}
+
+void AsyncWriter::write(const uint8_t *data, size_t bytes) {
+	std::unique_lock lock(mutex);
+	if (closed) {
+		throw std::runtime_error("AsyncWriter is closed");
+	}
+	cond.wait(lock, [this] { return queue.size() < maxQueue || failed; });
+	if (failed) {
+		throw std::runtime_error("Could not write output file");
+	}
+
+	std::vector<uint8_t> buffer;
+	if (!freeBuffers.empty()) {
+		buffer = std::move(freeBuffers.back());
+		freeBuffers.pop_back();
+	}
+	buffer.assign(data, data + bytes);
+	queue.push_back(Chunk{position, std::move(buffer)});
+	position += bytes;
+	size = std::max(size, position);
+
+	stat.maxQueueDepth = std::max(stat.maxQueueDepth, queue.size());
+	cond.notify_all();
+}
+
+int64_t AsyncWriter::seek(int64_t offset, int whence) {
+	std::lock_guard lock(mutex);
+	if (whence == SEEK_SET) {
+		position = offset;
+	} else if (whence == SEEK_CUR) {
+		position += offset;
+	} else if (whence == SEEK_END) {
+		position = size + offset;
+	} else {
+		return -1;
+	}
+	return position;
+}
+
+int64_t AsyncWriter::length() {
+	std::lock_guard lock(mutex);
+	return size;
+}
+
+void AsyncWriter::flush() {
+	std::unique_lock lock(mutex);
+	cond.wait(lock, [this] { return (queue.empty() && !busy) || failed; });
+	if (failed) {
+		throw std::runtime_error("Could not write output file");
+	}
+}
+
+void AsyncWriter::close() {
+	{
+		std::lock_guard lock(mutex);
+		if (closed) {
+			return;
+		}
+		closed = true;
+		cond.notify_all();
+	}
+	if (thread.joinable()) {
+		thread.join();
+	}
+	sink = nullptr;
+	std::lock_guard lock(mutex);
+	if (failed) {
+		throw std::runtime_error("Could not write output file");
+	}
+}
+
+AsyncWriterStats AsyncWriter::stats() {
+	std::lock_guard lock(mutex);
+	AsyncWriterStats result = stat;
+	result.queueDepth = queue.size() + (busy ? 1 : 0);
+	return result;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using WriteSink =
+    std::function<void(int64_t offset, const uint8_t *data, size_t size)>;
+
+struct AsyncWriterStats {
+	size_t queueDepth = 0;
+	size_t maxQueueDepth = 0;
+	double lastWriteLatency = 0; // ms
+	double maxWriteLatency = 0;  // ms
+	double avgWriteLatency = 0;  // ms
+	uint64_t bytesWritten = 0;
+	uint64_t writes = 0;
+};
+
+// Hands positioned buffers to a dedicated thread so that slow storage never
+// blocks the caller until the bounded queue is full.
+class AsyncWriter {
+  private:
+	struct Chunk {
+		int64_t offset;
+		std::vector<uint8_t> data;
+	};
+
+	WriteSink sink;
+	size_t maxQueue;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<Chunk> queue;
+	std::vector<std::vector<uint8_t>> freeBuffers;
+	std::thread thread;
+	bool closed = false;
+	bool busy = false;
+	bool failed = false;
+	int64_t position = 0;
+	int64_t size = 0;
+	AsyncWriterStats stat;
+
+	void run();
+
+  public:
+	AsyncWriter(const std::string &path, size_t maxQueue = 8);
+	AsyncWriter(WriteSink sink, size_t maxQueue = 8);
+	~AsyncWriter();
+
+	void write(const uint8_t *data, size_t bytes);
+	int64_t seek(int64_t offset, int whence);
+	int64_t length();
+	void flush();
+	// Waits for what is queued to reach the sink, throws if any of it
+	// could not.
+	void close();
+	AsyncWriterStats stats();
+};
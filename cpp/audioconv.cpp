@@ -0,0 +1,285 @@
+#include "audioconv.h"
+#include "pixelconv.h"
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+struct Kernels {
+	void (*s16ToFloat)(const int16_t *src, float *dst, int count);
+	void (*floatToS16)(const float *src, int16_t *dst, int count);
+	void (*interleave2)(const float *left, const float *right, float *dst,
+	                    int n);
+	void (*deinterleave2)(const float *src, float *left, float *right, int n);
+	void (*mix2)(const float *left, const float *right, float *dst, int n,
+	             float gain);
+	void (*applyGain)(const float *src, float *dst, int n, float gain);
+};
+
+// Scalar
+
+void s16ToFloatScalar(const int16_t *src, float *dst, int count) {
+	for (int i = 0; i < count; ++i) {
+		dst[i] = src[i] * (1.0f / 32768);
+	}
+}
+
+// Clamped before rounding so that every level saturates the same way.
+void floatToS16Scalar(const float *src, int16_t *dst, int count) {
+	for (int i = 0; i < count; ++i) {
+		float v = src[i] * 32768;
+		v = v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+		dst[i] = (int16_t)lrintf(v);
+	}
+}
+
+void interleave2Scalar(const float *left, const float *right, float *dst,
+                       int n) {
+	for (int i = 0; i < n; ++i) {
+		dst[2 * i] = left[i];
+		dst[2 * i + 1] = right[i];
+	}
+}
+
+void deinterleave2Scalar(const float *src, float *left, float *right, int n) {
+	for (int i = 0; i < n; ++i) {
+		left[i] = src[2 * i];
+		right[i] = src[2 * i + 1];
+	}
+}
+
+// Each channel scaled before adding, the way swresample mixes.
+void mix2Scalar(const float *left, const float *right, float *dst, int n,
+                float gain) {
+	for (int i = 0; i < n; ++i) {
+		dst[i] = left[i] * gain + right[i] * gain;
+	}
+}
+
+void applyGainScalar(const float *src, float *dst, int n, float gain) {
+	for (int i = 0; i < n; ++i) {
+		dst[i] = src[i] * gain;
+	}
+}
+
+const Kernels scalarKernels = {s16ToFloatScalar, floatToS16Scalar,
+                               interleave2Scalar, deinterleave2Scalar,
+                               mix2Scalar, applyGainScalar};
+
+// SSE2
+
+#if defined(__SSE2__)
+
+void s16ToFloatSSE2(const int16_t *src, float *dst, int count) {
+	const __m128 scale = _mm_set1_ps(1.0f / 32768);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		// Sign extend by placing each sample in the high half
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	s16ToFloatScalar(src + i, dst + i, count - i);
+}
+
+void floatToS16SSE2(const float *src, int16_t *dst, int count) {
+	const __m128 scale = _mm_set1_ps(32768);
+	const __m128 low = _mm_set1_ps(-32768);
+	const __m128 high = _mm_set1_ps(32767);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+		a = _mm_min_ps(_mm_max_ps(a, low), high);
+		b = _mm_min_ps(_mm_max_ps(b, low), high);
+		// Rounds to nearest even like lrintf()
+		__m128i packed =
+		    _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+		_mm_storeu_si128((__m128i *)(dst + i), packed);
+	}
+	floatToS16Scalar(src + i, dst + i, count - i);
+}
+
+void interleave2SSE2(const float *left, const float *right, float *dst,
+                     int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 l = _mm_loadu_ps(left + i);
+		__m128 r = _mm_loadu_ps(right + i);
+		_mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(l, r));
+	}
+	interleave2Scalar(left + i, right + i, dst + 2 * i, n - i);
+}
+
+void deinterleave2SSE2(const float *src, float *left, float *right, int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = _mm_loadu_ps(src + 2 * i);
+		__m128 b = _mm_loadu_ps(src + 2 * i + 4);
+		_mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(right + i,
+		              _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	deinterleave2Scalar(src + 2 * i, left + i, right + i, n - i);
+}
+
+void mix2SSE2(const float *left, const float *right, float *dst, int n,
+              float gain) {
+	const __m128 g = _mm_set1_ps(gain);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 l = _mm_mul_ps(_mm_loadu_ps(left + i), g);
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(right + i), g);
+		_mm_storeu_ps(dst + i, _mm_add_ps(l, r));
+	}
+	mix2Scalar(left + i, right + i, dst + i, n - i, gain);
+}
+
+void applyGainSSE2(const float *src, float *dst, int n, float gain) {
+	const __m128 g = _mm_set1_ps(gain);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+	}
+	applyGainScalar(src + i, dst + i, n - i, gain);
+}
+
+// Audio buffers are small, AVX2 brings nothing over SSE2 here.
+const Kernels sse2Kernels = {s16ToFloatSSE2, floatToS16SSE2,
+                             interleave2SSE2, deinterleave2SSE2, mix2SSE2,
+                             applyGainSSE2};
+
+#endif
+
+// NEON
+
+#if defined(__ARM_NEON)
+
+void s16ToFloatNEON(const int16_t *src, float *dst, int count) {
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		int16x8_t v = vld1q_s16(src + i);
+		float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+		float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+		vst1q_f32(dst + i, vmulq_n_f32(lo, 1.0f / 32768));
+		vst1q_f32(dst + i + 4, vmulq_n_f32(hi, 1.0f / 32768));
+	}
+	s16ToFloatScalar(src + i, dst + i, count - i);
+}
+
+void floatToS16NEON(const float *src, int16_t *dst, int count) {
+	int i = 0;
+#if defined(__aarch64__)
+	// ARMv7 has no round to nearest even conversion, it stays scalar
+	const float32x4_t low = vdupq_n_f32(-32768);
+	const float32x4_t high = vdupq_n_f32(32767);
+	for (; i + 8 <= count; i += 8) {
+		float32x4_t a = vmulq_n_f32(vld1q_f32(src + i), 32768);
+		float32x4_t b = vmulq_n_f32(vld1q_f32(src + i + 4), 32768);
+		a = vminq_f32(vmaxq_f32(a, low), high);
+		b = vminq_f32(vmaxq_f32(b, low), high);
+		int16x8_t packed = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+		                                vqmovn_s32(vcvtnq_s32_f32(b)));
+		vst1q_s16(dst + i, packed);
+	}
+#endif
+	floatToS16Scalar(src + i, dst + i, count - i);
+}
+
+void interleave2NEON(const float *left, const float *right, float *dst,
+                     int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		float32x4x2_t v = {{vld1q_f32(left + i), vld1q_f32(right + i)}};
+		vst2q_f32(dst + 2 * i, v);
+	}
+	interleave2Scalar(left + i, right + i, dst + 2 * i, n - i);
+}
+
+void deinterleave2NEON(const float *src, float *left, float *right, int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		float32x4x2_t v = vld2q_f32(src + 2 * i);
+		vst1q_f32(left + i, v.val[0]);
+		vst1q_f32(right + i, v.val[1]);
+	}
+	deinterleave2Scalar(src + 2 * i, left + i, right + i, n - i);
+}
+
+void mix2NEON(const float *left, const float *right, float *dst, int n,
+              float gain) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		float32x4_t l = vmulq_n_f32(vld1q_f32(left + i), gain);
+		float32x4_t r = vmulq_n_f32(vld1q_f32(right + i), gain);
+		vst1q_f32(dst + i, vaddq_f32(l, r));
+	}
+	mix2Scalar(left + i, right + i, dst + i, n - i, gain);
+}
+
+void applyGainNEON(const float *src, float *dst, int n, float gain) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		vst1q_f32(dst + i, vmulq_n_f32(vld1q_f32(src + i), gain));
+	}
+	applyGainScalar(src + i, dst + i, n - i, gain);
+}
+
+const Kernels neonKernels = {s16ToFloatNEON, floatToS16NEON,
+                             interleave2NEON, deinterleave2NEON, mix2NEON,
+                             applyGainNEON};
+
+#endif
+
+const Kernels &kernels() {
+	switch (simdLevel()) {
+#if defined(__SSE2__)
+	case SimdLevel::SSE2:
+	case SimdLevel::AVX2:
+		return sse2Kernels;
+#endif
+#if defined(__ARM_NEON)
+	case SimdLevel::NEON:
+		return neonKernels;
+#endif
+	default:
+		return scalarKernels;
+	}
+}
+
+} // namespace
+
+void s16ToFloat(const int16_t *src, float *dst, int count) {
+	kernels().s16ToFloat(src, dst, count);
+}
+
+void floatToS16(const float *src, int16_t *dst, int count) {
+	kernels().floatToS16(src, dst, count);
+}
+
+void interleave2(const float *left, const float *right, float *dst,
+                 int samples) {
+	kernels().interleave2(left, right, dst, samples);
+}
+
+void deinterleave2(const float *src, float *left, float *right, int samples) {
+	kernels().deinterleave2(src, left, right, samples);
+}
+
+void mix2(const float *left, const float *right, float *dst, int samples,
+          float gain) {
+	kernels().mix2(left, right, dst, samples, gain);
+}
+
+void applyGain(const float *src, float *dst, int samples, float gain) {
+	kernels().applyGain(src, dst, samples, gain);
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+
+// Sample kernels for conversions at an unchanged rate, they run at the
+// level selected with setSimdLevel() in pixelconv.h.
+
+// Scales by 1 / 32768 like swresample.
+void s16ToFloat(const int16_t *src, float *dst, int count);
+// Scales by 32768, rounds to nearest even and saturates like swresample.
+void floatToS16(const float *src, int16_t *dst, int count);
+
+void interleave2(const float *left, const float *right, float *dst,
+                 int samples);
+void deinterleave2(const float *src, float *left, float *right, int samples);
+
+// left * gain + right * gain, a stereo to mono downmix.
+void mix2(const float *left, const float *right, float *dst, int samples,
+          float gain);
+void applyGain(const float *src, float *dst, int samples, float gain);
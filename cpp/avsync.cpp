@@ -0,0 +1,143 @@
+#include "avsync.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+// Seconds from 1900 to 1970
+const uint64_t ntpUnixOffset = 2208988800ULL;
+// Delays are measured over this many frames before they are acted on
+const uint64_t minSamples = 10;
+// Changes smaller than this are not worth the glitch of making them
+const int64_t minChange = 10000;
+
+uint32_t read32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+} // namespace
+
+std::optional<SenderReport> parseSenderReport(const uint8_t *data,
+                                              size_t size, uint32_t ssrc) {
+	size_t offset = 0;
+	while (offset + 4 <= size && (data[offset] >> 6) == 2) {
+		const uint8_t *p = data + offset;
+		size_t length = ((p[2] << 8 | p[3]) + 1) * 4;
+		if (offset + length > size) {
+			break;
+		}
+		if (p[1] == 200 && length >= 28 && read32(p + 4) == ssrc) {
+			SenderReport report;
+			report.ntp = (uint64_t)read32(p + 8) << 32 | read32(p + 12);
+			report.rtpTimestamp = read32(p + 16);
+			return report;
+		}
+		offset += length;
+	}
+	return std::nullopt;
+}
+
+int64_t ntpToUnixMicros(uint64_t ntp) {
+	int64_t seconds = (int64_t)(ntp >> 32) - (int64_t)ntpUnixOffset;
+	int64_t fraction = (int64_t)(((ntp & 0xffffffff) * 1000000) >> 32);
+	return seconds * 1000000 + fraction;
+}
+
+MediaClock::MediaClock(int clockRate) : clockRate(clockRate) {}
+
+int64_t MediaClock::ticks(uint32_t timestamp) const {
+	return lastTicks + (int32_t)(timestamp - last);
+}
+
+void MediaClock::arrived(uint32_t timestamp, int64_t now) {
+	if (!started) {
+		started = true;
+		last = timestamp;
+		anchorTime = now;
+		return;
+	}
+	lastTicks = ticks(timestamp);
+	last = timestamp;
+}
+
+void MediaClock::report(const SenderReport &report) {
+	if (!started) {
+		return;
+	}
+	reported = true;
+	reportTime = ntpToUnixMicros(report.ntp);
+	reportTicks = ticks(report.rtpTimestamp);
+}
+
+int64_t MediaClock::offset() const {
+	return anchorTime + (reportTicks - anchorTicks) * 1000000 / clockRate -
+	       reportTime;
+}
+
+void MediaClock::align(int64_t offset) {
+	if (!reported) {
+		return;
+	}
+	aligned = true;
+	anchorTime = reportTime + offset;
+	anchorTicks = reportTicks;
+}
+
+bool MediaClock::synced() const { return aligned; }
+
+int64_t MediaClock::toLocalClock(uint32_t timestamp) const {
+	return anchorTime + (ticks(timestamp) - anchorTicks) * 1000000 / clockRate;
+}
+
+AvSync::AvSync(int maxDelay) : maxDelay(maxDelay * 1000LL) {}
+
+void AvSync::played(SyncStream stream, int64_t senderTime,
+                    int64_t localTime) {
+	auto &s = streams[(int)stream];
+	double sample = (double)(localTime - senderTime);
+	s.samples++;
+	s.delay = s.samples == 1 ? sample : s.delay + (sample - s.delay) / 16;
+	update();
+}
+
+void AvSync::update() {
+	auto &audio = streams[(int)SyncStream::Audio];
+	auto &video = streams[(int)SyncStream::Video];
+	if (audio.samples < minSamples || video.samples < minSamples) {
+		return;
+	}
+	// The stream played out sooner waits for the other
+	int64_t offset = (int64_t)(video.delay - audio.delay);
+	int64_t audioTarget = std::clamp(offset, (int64_t)0, maxDelay);
+	int64_t videoTarget = std::clamp(-offset, (int64_t)0, maxDelay);
+	if (std::abs(audioTarget - audio.extra) >= minChange) {
+		audio.extra = audioTarget;
+	}
+	if (std::abs(videoTarget - video.extra) >= minChange) {
+		video.extra = videoTarget;
+	}
+}
+
+int64_t AvSync::delay(SyncStream stream) const {
+	return streams[(int)stream].extra;
+}
+
+int64_t AvSync::clockOffset(int64_t measured) {
+	if (!offset) {
+		offset = measured;
+	}
+	return *offset;
+}
+
+AvSyncStats AvSync::stats() const {
+	auto &audio = streams[(int)SyncStream::Audio];
+	auto &video = streams[(int)SyncStream::Video];
+	AvSyncStats s;
+	s.synced = audio.samples >= minSamples && video.samples >= minSamples;
+	if (s.synced) {
+		s.offset = (video.delay - audio.delay) / 1000;
+	}
+	s.audioDelay = audio.extra / 1000.0;
+	s.videoDelay = video.extra / 1000.0;
+	return s;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+struct SenderReport {
+	uint64_t ntp;          // 32.32 fixed point seconds since 1900
+	uint32_t rtpTimestamp; // of the same instant
+};
+
+// The sender report of ssrc in a compound RTCP packet.
+std::optional<SenderReport> parseSenderReport(const uint8_t *data,
+                                              size_t size, uint32_t ssrc);
+
+// Microseconds since the Unix epoch of an NTP timestamp.
+int64_t ntpToUnixMicros(uint64_t ntp);
+
+// Maps the RTP timestamps of a stream to the local clock, for pts that
+// never jump with the sender reports. The arrival of the first packet
+// anchors it, and the first sender report moves it once onto the sender's
+// clock plus an offset shared by the streams of the sender, which lines
+// them up with each other. Times are in microseconds.
+class MediaClock {
+  private:
+	int clockRate;
+	bool started = false;
+	// The latest timestamp arrived and its ticks since the first
+	uint32_t last = 0;
+	int64_t lastTicks = 0;
+	int64_t anchorTime = 0;
+	int64_t anchorTicks = 0;
+	bool reported = false;
+	bool aligned = false;
+	int64_t reportTime = 0;
+	int64_t reportTicks = 0;
+
+	int64_t ticks(uint32_t timestamp) const;
+
+  public:
+	MediaClock(int clockRate);
+
+	// A packet with timestamp arrived at now.
+	void arrived(uint32_t timestamp, int64_t now);
+	// Ignored until a packet arrived.
+	void report(const SenderReport &report);
+	// The local clock less the sender's at the last report, as the clock
+	// runs now.
+	int64_t offset() const;
+	// Runs the clock at the sender's plus offset from the last report on.
+	void align(int64_t offset);
+	// Whether a sender report aligned the clock.
+	bool synced() const;
+	// Within 2^31 ticks of the latest arrival.
+	int64_t toLocalClock(uint32_t timestamp) const;
+};
+
+enum class SyncStream { Audio, Video };
+
+struct AvSyncStats {
+	double offset = 0;     // ms video plays out behind audio, left alone
+	double audioDelay = 0; // ms added to the audio
+	double videoDelay = 0; // ms added to the video
+	bool synced = false;   // both streams measured
+};
+
+// Lines up the audio and video of a remote sender. Each stream reports
+// when it plays out what the sender captured when, and the earlier one
+// waits out the difference of their delays. The clocks of the two sides
+// need not agree, their offset cancels. Times are in microseconds.
+class AvSync {
+  private:
+	struct Stream {
+		uint64_t samples = 0;
+		double delay = 0;
+		int64_t extra = 0;
+	};
+
+	int64_t maxDelay;
+	Stream streams[2];
+	std::optional<int64_t> offset;
+
+	void update();
+
+  public:
+	// maxDelay in milliseconds bounds the wait.
+	AvSync(int maxDelay = 1000);
+
+	// What the sender captured at senderTime, on any clock its streams
+	// share, played out at localTime, the delay added to the stream left
+	// out.
+	void played(SyncStream stream, int64_t senderTime, int64_t localTime);
+	// How long the stream waits before playing out.
+	int64_t delay(SyncStream stream) const;
+	// The offset of the local clock from the sender's for all streams,
+	// the one measured by the first stream to ask.
+	int64_t clockOffset(int64_t measured);
+	AvSyncStats stats() const;
+};
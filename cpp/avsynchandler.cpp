@@ -0,0 +1,72 @@
+#include "avsynchandler.h"
+#include "ffmpeg.h"
+#include <utility>
+
+bool SyncGroup::join(SyncStream stream) {
+	std::lock_guard lock(mutex);
+	return !std::exchange(joined[(int)stream], true);
+}
+
+void SyncGroup::leave(SyncStream stream) {
+	std::lock_guard lock(mutex);
+	joined[(int)stream] = false;
+}
+
+void SyncGroup::played(SyncStream stream, int64_t senderTime,
+                       int64_t localTime) {
+	std::lock_guard lock(mutex);
+	sync.played(stream, senderTime, localTime);
+}
+
+int64_t SyncGroup::delay(SyncStream stream) {
+	std::lock_guard lock(mutex);
+	return sync.delay(stream);
+}
+
+int64_t SyncGroup::clockOffset(int64_t measured) {
+	std::lock_guard lock(mutex);
+	return sync.clockOffset(measured);
+}
+
+AvSyncStats SyncGroup::stats() {
+	std::lock_guard lock(mutex);
+	return sync.stats();
+}
+
+MediaClockHandler::MediaClockHandler(int clockRate,
+                                     std::shared_ptr<SyncGroup> syncGroup)
+    : clock(clockRate), syncGroup(std::move(syncGroup)) {}
+
+void MediaClockHandler::incoming(rtc::message_vector &messages,
+                                 const rtc::message_callback &) {
+	std::lock_guard lock(mutex);
+	for (auto &m : messages) {
+		auto data = (const uint8_t *)m->data();
+		if (m->type == rtc::Message::Binary && m->size() >= 12) {
+			ssrc = (rtc::SSRC)data[8] << 24 | data[9] << 16 | data[10] << 8 |
+			       data[11];
+			uint32_t timestamp = (uint32_t)data[4] << 24 | data[5] << 16 |
+			                     data[6] << 8 | data[7];
+			clock.arrived(timestamp, micros(std::chrono::system_clock::now()));
+		} else if (m->type == rtc::Message::Control && ssrc) {
+			auto report = parseSenderReport(data, m->size(), *ssrc);
+			if (!report) {
+				continue;
+			}
+			clock.report(*report);
+			if (!clock.synced()) {
+				clock.align(syncGroup->clockOffset(clock.offset()));
+			}
+		}
+	}
+}
+
+bool MediaClockHandler::synced() {
+	std::lock_guard lock(mutex);
+	return clock.synced();
+}
+
+int64_t MediaClockHandler::toLocalClock(uint32_t timestamp) {
+	std::lock_guard lock(mutex);
+	return clock.toLocalClock(timestamp);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "avsync.h"
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <rtc/rtc.hpp>
+
+// Lines up the audio and video received on a peer connection. The first
+// receiving track of each kind joins.
+class SyncGroup {
+  private:
+	std::mutex mutex;
+	AvSync sync;
+	bool joined[2] = {false, false};
+
+  public:
+	// Whether the stream is the one of its kind synchronized.
+	bool join(SyncStream stream);
+	void leave(SyncStream stream);
+	void played(SyncStream stream, int64_t senderTime, int64_t localTime);
+	int64_t delay(SyncStream stream);
+	int64_t clockOffset(int64_t measured);
+	AvSyncStats stats();
+};
+
+// Chained on a receiving track ahead of what takes its RTP packets. Maps
+// their timestamps to the local clock, aligned with the other streams of
+// the sync group by the first sender report.
+class MediaClockHandler : public rtc::MediaHandler {
+  private:
+	std::mutex mutex;
+	MediaClock clock;
+	std::shared_ptr<SyncGroup> syncGroup;
+	std::optional<rtc::SSRC> ssrc;
+
+  public:
+	MediaClockHandler(int clockRate, std::shared_ptr<SyncGroup> syncGroup);
+
+	void incoming(rtc::message_vector &messages,
+	              const rtc::message_callback &send) override;
+	// Whether a sender report aligned the clock.
+	bool synced();
+	int64_t toLocalClock(uint32_t timestamp);
+};
@@ -1,19 +1,32 @@
 #pragma once
 
+#include "asyncwriter.h"
+#include "audioconv.h"
 #include "log.h"
+#include "pixelconv.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <stdexcept>
+#include <thread>
+#include <utility>
 #include <vector>
 
 extern "C" {
 #define AVMediaType FFmpeg_AVMediaType
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-#include <libavutil/audio_fifo.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/log.h>
+#include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 #undef AVMediaType
@@ -32,17 +45,88 @@ inline int currentPts(AVRational time_base) {
 	return seconds * time_base.den / time_base.num;
 }
 
+// Microseconds since the epoch of the clock.
+template <typename Clock, typename Duration>
+int64_t micros(std::chrono::time_point<Clock, Duration> time) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+	           time.time_since_epoch())
+	    .count();
+}
+
 inline std::shared_ptr<AVPacket> createAVPacket() {
 	return std::shared_ptr<AVPacket>(av_packet_alloc(),
 	                                 [](AVPacket *f) { av_packet_free(&f); });
 }
 
-inline std::shared_ptr<AVFrame>
-createVideoFrame(AVPixelFormat format, int width, int height, int pts = -1) {
-	AVRational time_base = {1, 90000};
-	if (pts == -1) {
-		pts = currentPts(time_base);
+// Calls fn for every NAL unit of an Annex B H264/H265 bitstream.
+inline void
+forEachNalUnit(const uint8_t *data, int size,
+               const std::function<void(const uint8_t *nal, int size)> &fn) {
+	int start = -1;
+	int i = 0;
+	while (i + 3 <= size) {
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+			if (start >= 0) {
+				int end = i;
+				while (end > start && data[end - 1] == 0) {
+					end--;
+				}
+				fn(data + start, end - start);
+			}
+			i += 3;
+			start = i;
+		} else {
+			i++;
+		}
+	}
+	if (start >= 0 && start < size) {
+		fn(data + start, size - start);
 	}
+}
+
+inline int nalUnitType(AVCodecID codecId, const uint8_t *nal) {
+	return codecId == AV_CODEC_ID_H265 ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+}
+
+// Whether an Annex B packet starts a decodable picture (IDR / IRAP).
+inline bool isKeyPacket(AVCodecID codecId, const uint8_t *data, int size) {
+	bool key = false;
+	forEachNalUnit(data, size, [&](const uint8_t *nal, int nalSize) {
+		if (nalSize <= 0) {
+			return;
+		}
+		int type = nalUnitType(codecId, nal);
+		if (codecId == AV_CODEC_ID_H264) {
+			key |= type == 5;
+		} else if (codecId == AV_CODEC_ID_H265) {
+			key |= type >= 16 && type <= 21;
+		}
+	});
+	return key;
+}
+
+// The VPS/SPS/PPS NAL units of a keyframe as Annex B extradata.
+inline std::vector<uint8_t> extractParameterSets(AVCodecID codecId,
+                                                 const uint8_t *data,
+                                                 int size) {
+	std::vector<uint8_t> extradata;
+	forEachNalUnit(data, size, [&](const uint8_t *nal, int nalSize) {
+		if (nalSize <= 0) {
+			return;
+		}
+		int type = nalUnitType(codecId, nal);
+		bool parameterSet = codecId == AV_CODEC_ID_H265
+		                        ? type >= 32 && type <= 34
+		                        : type == 7 || type == 8;
+		if (parameterSet) {
+			extradata.insert(extradata.end(), {0, 0, 0, 1});
+			extradata.insert(extradata.end(), nal, nal + nalSize);
+		}
+	});
+	return extradata;
+}
+
+inline std::shared_ptr<AVFrame> allocFrame() {
 	auto frame = std::shared_ptr<AVFrame>(av_frame_alloc(), [](AVFrame *f) {
 		if (f) {
 			av_frame_free(&f);
@@ -51,6 +135,16 @@ createVideoFrame(AVPixelFormat format, int width, int height, int pts = -1) {
 	if (!frame) {
 		throw std::runtime_error("Could not allocate AVFrame");
 	}
+	return frame;
+}
+
+inline std::shared_ptr<AVFrame>
+createVideoFrame(AVPixelFormat format, int width, int height, int pts = -1) {
+	AVRational time_base = {1, 90000};
+	if (pts == -1) {
+		pts = currentPts(time_base);
+	}
+	auto frame = allocFrame();
 	frame->format = format;
 	frame->time_base = (AVRational){1, 90000};
 	frame->pts = pts;
@@ -70,14 +164,7 @@ inline std::shared_ptr<AVFrame> createAudioFrame(AVSampleFormat format,
 	if (pts == -1) {
 		pts = currentPts(time_base);
 	}
-	auto frame = std::shared_ptr<AVFrame>(av_frame_alloc(), [](AVFrame *f) {
-		if (f) {
-			av_frame_free(&f);
-		}
-	});
-	if (!frame) {
-		throw std::runtime_error("Could not allocate AVFrame");
-	}
+	auto frame = allocFrame();
 	frame->format = format;
 	frame->time_base = time_base;
 	frame->pts = pts;
@@ -91,12 +178,275 @@ inline std::shared_ptr<AVFrame> createAudioFrame(AVSampleFormat format,
 	return frame;
 }
 
+// Owns the release callback of memory wrapped by wrapVideoFrame() and
+// wrapAudioFrame(), run once the last reference to the frame is gone.
+inline AVBufferRef *wrapBuffer(uint8_t *data, size_t size,
+                               std::function<void()> release) {
+	auto opaque = new std::function<void()>(std::move(release));
+	AVBufferRef *buf = av_buffer_create(
+	    data, size,
+	    [](void *opaque, uint8_t *) {
+		    auto release = (std::function<void()> *)opaque;
+		    try {
+			    if (*release) {
+				    (*release)();
+			    }
+		    } catch (const std::exception &e) {
+			    LOGE("Release of wrapped frame failed: %s\n", e.what());
+		    }
+		    delete release;
+	    },
+	    opaque, AV_BUFFER_FLAG_READONLY);
+	if (!buf) {
+		delete opaque;
+		throw std::runtime_error("Could not create AVBufferRef");
+	}
+	return buf;
+}
+
+// A video frame over memory owned by the caller, one pointer and stride
+// per plane as the format defines them, a negative stride for an image
+// stored bottom-up with the pointer on its top row. Nothing is copied,
+// release is called when the last subscriber drops the frame and the
+// memory must stay valid until then. The frame is read only,
+// av_frame_make_writable() copies it.
+inline std::shared_ptr<AVFrame>
+wrapVideoFrame(AVPixelFormat format, int width, int height,
+               uint8_t *const data[], const int linesize[],
+               std::function<void()> release, int pts = -1) {
+	auto desc = av_pix_fmt_desc_get(format);
+	if (!desc || width <= 0 || height <= 0) {
+		throw std::invalid_argument("Invalid video frame to wrap");
+	}
+	if (pts == -1) {
+		pts = currentPts((AVRational){1, 90000});
+	}
+	auto frame = allocFrame();
+	frame->format = format;
+	frame->time_base = (AVRational){1, 90000};
+	frame->pts = pts;
+	frame->width = width;
+	frame->height = height;
+	int planes = av_pix_fmt_count_planes(format);
+	for (int p = 0; p < planes; ++p) {
+		if (!data[p] || !linesize[p]) {
+			throw std::invalid_argument("Missing plane of wrapped frame");
+		}
+		frame->data[p] = data[p];
+		frame->linesize[p] = linesize[p];
+	}
+	// A single reference owns every plane, from the first row in memory
+	uint8_t *base = data[0];
+	if (linesize[0] < 0) {
+		base += (ptrdiff_t)linesize[0] * (height - 1);
+	}
+	frame->buf[0] = wrapBuffer(base, (size_t)std::abs(linesize[0]) * height,
+	                           std::move(release));
+	return frame;
+}
+
+// An audio frame over caller owned samples, one pointer per channel for
+// planar formats and a single interleaved one otherwise. See
+// wrapVideoFrame() for the ownership rules.
+inline std::shared_ptr<AVFrame>
+wrapAudioFrame(AVSampleFormat format, int sampleRate, int channels,
+               int nb_samples, uint8_t *const data[],
+               std::function<void()> release, int pts = -1) {
+	int planes = av_sample_fmt_is_planar(format) ? channels : 1;
+	if (channels <= 0 || nb_samples <= 0 || planes > AV_NUM_DATA_POINTERS) {
+		throw std::invalid_argument("Invalid audio frame to wrap");
+	}
+	if (pts == -1) {
+		pts = currentPts((AVRational){1, sampleRate});
+	}
+	auto frame = allocFrame();
+	frame->format = format;
+	frame->time_base = (AVRational){1, sampleRate};
+	frame->pts = pts;
+	frame->sample_rate = sampleRate;
+	frame->nb_samples = nb_samples;
+	av_channel_layout_default(&frame->ch_layout, channels);
+	int linesize = 0;
+	if (av_samples_get_buffer_size(&linesize, channels, nb_samples, format,
+	                               1) < 0) {
+		throw std::invalid_argument("Invalid audio frame to wrap");
+	}
+	for (int p = 0; p < planes; ++p) {
+		if (!data[p]) {
+			throw std::invalid_argument("Missing plane of wrapped frame");
+		}
+		frame->data[p] = data[p];
+	}
+	frame->linesize[0] = linesize;
+	frame->extended_data = frame->data;
+	frame->buf[0] = wrapBuffer(data[0], linesize, std::move(release));
+	return frame;
+}
+
+// A view of a region of a video frame sharing its buffers, nothing is
+// copied and the parent's buffers stay alive as long as the view. The
+// left and top edges are moved down to the chroma grid of subsampled
+// formats such as NV12 and I420, growing the region to still cover it.
+inline std::shared_ptr<AVFrame> cropVideoFrame(std::shared_ptr<AVFrame> frame,
+                                               int x, int y, int width,
+                                               int height) {
+	auto desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+	if (!desc ||
+	    desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)) {
+		throw std::invalid_argument("Pixel format cannot be cropped");
+	}
+	int alignX = x & ((1 << desc->log2_chroma_w) - 1);
+	int alignY = y & ((1 << desc->log2_chroma_h) - 1);
+	x -= alignX;
+	y -= alignY;
+	width += alignX;
+	height += alignY;
+	if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+	    x + width > frame->width || y + height > frame->height) {
+		throw std::invalid_argument("Crop region outside of the frame");
+	}
+
+	auto view = allocFrame();
+	if (av_frame_ref(view.get(), frame.get()) < 0) {
+		throw std::runtime_error("Could not reference AVFrame");
+	}
+	view->crop_left = x;
+	view->crop_top = y;
+	view->crop_right = frame->width - x - width;
+	view->crop_bottom = frame->height - y - height;
+	if (av_frame_apply_cropping(view.get(), AV_FRAME_CROP_UNALIGNED) < 0) {
+		throw std::runtime_error("Could not crop AVFrame");
+	}
+	return view;
+}
+
+// Interpolation used by a Scaler, from fastest to sharpest.
+enum class ScaleQuality { Point, FastBilinear, Bilinear, Bicubic, Lanczos };
+
 class Scaler {
   private:
 	SwsContext *sws_ctx = nullptr;
 	std::recursive_mutex mutex;
+	ScaleQuality quality;
+	int threads;
+	// Parameters sws_ctx was created for
+	std::vector<int> config;
+
+	int swsFlags() {
+		switch (quality) {
+		case ScaleQuality::Point:
+			return SWS_POINT;
+		case ScaleQuality::FastBilinear:
+			return SWS_FAST_BILINEAR;
+		case ScaleQuality::Bilinear:
+			return SWS_BILINEAR;
+		case ScaleQuality::Bicubic:
+			return SWS_BICUBIC;
+		case ScaleQuality::Lanczos:
+			return SWS_LANCZOS;
+		}
+		return SWS_BILINEAR;
+	}
+
+	// Exact 2:1 or 4:1 downscale without a format change, 0 otherwise.
+	int boxFactor(const AVFrame *frame, AVPixelFormat format, int width,
+	              int height) {
+		if (quality >= ScaleQuality::Bicubic || frame->format != format ||
+		    width <= 0 || height <= 0) {
+			return 0;
+		}
+		for (int factor : {2, 4}) {
+			if (frame->width != width * factor ||
+			    frame->height != height * factor) {
+				continue;
+			}
+			switch (format) {
+			case AV_PIX_FMT_NV12:
+			case AV_PIX_FMT_YUV420P:
+				// Chroma blocks must not straddle the edge
+				return width % 2 == 0 && height % 2 == 0 ? factor : 0;
+			case AV_PIX_FMT_RGBA:
+			case AV_PIX_FMT_BGRA:
+				return factor;
+			default:
+				return 0;
+			}
+		}
+		return 0;
+	}
+
+	void boxScale(const AVFrame *frame, AVFrame *dst, int factor) {
+		auto box = [&](int plane, int channels, int w, int h) {
+			downscaleBox(frame->data[plane], frame->linesize[plane],
+			             dst->data[plane], dst->linesize[plane], w, h, channels,
+			             factor);
+		};
+		int w = dst->width;
+		int h = dst->height;
+		switch (dst->format) {
+		case AV_PIX_FMT_NV12:
+			box(0, 1, w, h);
+			box(1, 2, w / 2, h / 2);
+			break;
+		case AV_PIX_FMT_YUV420P:
+			box(0, 1, w, h);
+			box(1, 1, w / 2, h / 2);
+			box(2, 1, w / 2, h / 2);
+			break;
+		default:
+			box(0, 4, w, h);
+			break;
+		}
+	}
+
+	// sws_getCachedContext() cannot set the thread count, so contexts are
+	// allocated and cached here.
+	SwsContext *context(const AVFrame *src, const AVFrame *dst) {
+		std::vector<int> wanted = {src->width, src->height, src->format,
+		                           dst->width, dst->height, dst->format,
+		                           swsFlags(), threads};
+		if (sws_ctx && config == wanted) {
+			return sws_ctx;
+		}
+		sws_freeContext(sws_ctx);
+		config.clear();
+		sws_ctx = sws_alloc_context();
+		if (!sws_ctx) {
+			throw std::runtime_error("Could not allocate scale context");
+		}
+		av_opt_set_int(sws_ctx, "srcw", src->width, 0);
+		av_opt_set_int(sws_ctx, "srch", src->height, 0);
+		av_opt_set_int(sws_ctx, "src_format", src->format, 0);
+		av_opt_set_int(sws_ctx, "dstw", dst->width, 0);
+		av_opt_set_int(sws_ctx, "dsth", dst->height, 0);
+		av_opt_set_int(sws_ctx, "dst_format", dst->format, 0);
+		av_opt_set_int(sws_ctx, "sws_flags", swsFlags(), 0);
+		av_opt_set_int(sws_ctx, "threads", threads, 0);
+		if (sws_init_context(sws_ctx, nullptr, nullptr) < 0) {
+			sws_freeContext(sws_ctx);
+			sws_ctx = nullptr;
+			throw std::runtime_error("Could not initialize scale context");
+		}
+		config = wanted;
+		return sws_ctx;
+	}
 
   public:
+	// threads > 1 splits each conversion into slices, 0 uses every core.
+	// The output is the same for any thread count.
+	Scaler(ScaleQuality quality = ScaleQuality::Bilinear, int threads = 1)
+	    : quality(quality), threads(threads) {}
+
+	void setQuality(ScaleQuality value) {
+		std::lock_guard lock(mutex);
+		quality = value;
+	}
+
+	void setThreads(int value) {
+		std::lock_guard lock(mutex);
+		threads = value;
+	}
+
 	std::shared_ptr<AVFrame> scale(std::shared_ptr<AVFrame> frame,
 	                               AVPixelFormat format, int width,
 	                               int height) {
@@ -110,13 +460,12 @@ class Scaler {
 		}
 
 		auto dst = createVideoFrame(format, width, height, frame->pts);
-		sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height,
-		                               (AVPixelFormat)frame->format, dst->width,
-		                               dst->height, (AVPixelFormat)dst->format,
-		                               SWS_BILINEAR, nullptr, nullptr, nullptr);
-
-		if (sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height,
-		              dst->data, dst->linesize) < 0) {
+		if (int factor = boxFactor(frame.get(), format, width, height)) {
+			boxScale(frame.get(), dst.get(), factor);
+			return dst;
+		}
+		if (sws_scale_frame(context(frame.get(), dst.get()), dst.get(),
+		                    frame.get()) < 0) {
 			throw std::runtime_error("Could not scale image");
 		}
 		return dst;
@@ -129,6 +478,53 @@ class Scaler {
 	}
 };
 
+// Hands out audio frames again once nobody references them any more, so
+// that steady streams stop allocating.
+class AudioFramePool {
+  private:
+	struct Entry {
+		std::shared_ptr<AVFrame> frame;
+		int capacity;
+	};
+	std::vector<Entry> entries;
+	size_t maxFrames;
+	uint64_t allocated = 0;
+
+  public:
+	AudioFramePool(size_t maxFrames = 8) : maxFrames(maxFrames) {
+		entries.reserve(maxFrames);
+	}
+
+	// A writable frame of nb_samples, the contents are undefined.
+	std::shared_ptr<AVFrame> get(AVSampleFormat format, int sampleRate,
+	                             int channels, int nb_samples, int64_t pts) {
+		for (auto &entry : entries) {
+			auto &frame = entry.frame;
+			if (frame.use_count() == 1 && frame->format == format &&
+			    frame->sample_rate == sampleRate &&
+			    frame->ch_layout.nb_channels == channels &&
+			    entry.capacity >= nb_samples &&
+			    av_frame_is_writable(frame.get())) {
+				frame->nb_samples = nb_samples;
+				frame->pts = pts;
+				return frame;
+			}
+		}
+		auto frame =
+		    createAudioFrame(format, sampleRate, channels, nb_samples, pts);
+		// createAudioFrame() takes an int
+		frame->pts = pts;
+		allocated++;
+		if (entries.size() < maxFrames) {
+			entries.push_back({frame, nb_samples});
+		}
+		return frame;
+	}
+
+	// Frames created so far.
+	uint64_t allocations() const { return allocated; }
+};
+
 class Resampler {
   private:
 	SwrContext *swr_ctx = nullptr;
@@ -140,6 +536,114 @@ class Resampler {
 	int outChannels = 0;
 	int outSampleRate = 0;
 	int pts = -1;
+	AudioFramePool pool;
+	// Same rate conversions between S16 and FLT, planar or packed, mono or
+	// stereo, run on the audioconv kernels instead of swresample.
+	bool direct = false;
+	// Clock drift compensation, which needs swresample
+	bool stretch = false;
+	int compensationDelta = 0;
+	int compensationDistance = 0;
+	std::vector<float> planes[3];
+	std::vector<float> packed;
+
+	static bool directFormat(AVSampleFormat format, int channels) {
+		return (format == AV_SAMPLE_FMT_S16 || format == AV_SAMPLE_FMT_S16P ||
+		        format == AV_SAMPLE_FMT_FLT || format == AV_SAMPLE_FMT_FLTP) &&
+		       (channels == 1 || channels == 2);
+	}
+
+	// Float planes of the input, pointing into the frame when possible.
+	void load(const AVFrame *frame, const float *in[2]) {
+		int n = frame->nb_samples;
+		for (auto &plane : planes) {
+			plane.resize(n);
+		}
+		packed.resize(2 * n);
+		switch (inFormat) {
+		case AV_SAMPLE_FMT_FLTP:
+			for (int c = 0; c < inChannels; ++c) {
+				in[c] = (const float *)frame->data[c];
+			}
+			return;
+		case AV_SAMPLE_FMT_FLT:
+			if (inChannels == 1) {
+				in[0] = (const float *)frame->data[0];
+				return;
+			}
+			deinterleave2((const float *)frame->data[0], planes[0].data(),
+			              planes[1].data(), n);
+			break;
+		case AV_SAMPLE_FMT_S16P:
+			for (int c = 0; c < inChannels; ++c) {
+				s16ToFloat((const int16_t *)frame->data[c], planes[c].data(),
+				           n);
+			}
+			break;
+		default:
+			if (inChannels == 1) {
+				s16ToFloat((const int16_t *)frame->data[0], planes[0].data(),
+				           n);
+				break;
+			}
+			s16ToFloat((const int16_t *)frame->data[0], packed.data(), 2 * n);
+			deinterleave2(packed.data(), planes[0].data(), planes[1].data(),
+			              n);
+			break;
+		}
+		in[0] = planes[0].data();
+		in[1] = planes[1].data();
+	}
+
+	std::shared_ptr<AVFrame> convert(const AVFrame *frame) {
+		int n = frame->nb_samples;
+		const float *in[2] = {};
+		load(frame, in);
+
+		// Mixing gains of swresample, which normalizes only integer output
+		const float *out[2] = {in[0], in[1]};
+		if (inChannels == 1 && outChannels == 2) {
+			applyGain(in[0], planes[2].data(), n, M_SQRT1_2);
+			out[0] = out[1] = planes[2].data();
+		} else if (inChannels == 2 && outChannels == 1) {
+			bool integer = outFormat == AV_SAMPLE_FMT_S16 ||
+			               outFormat == AV_SAMPLE_FMT_S16P;
+			mix2(in[0], in[1], planes[2].data(), n,
+			     integer ? 0.5f : (float)M_SQRT1_2);
+			out[0] = planes[2].data();
+		}
+
+		auto dst = pool.get(outFormat, outSampleRate, outChannels, n, pts);
+		switch (outFormat) {
+		case AV_SAMPLE_FMT_FLTP:
+			for (int c = 0; c < outChannels; ++c) {
+				memcpy(dst->data[c], out[c], n * sizeof(float));
+			}
+			break;
+		case AV_SAMPLE_FMT_FLT:
+			if (outChannels == 1) {
+				memcpy(dst->data[0], out[0], n * sizeof(float));
+			} else {
+				interleave2(out[0], out[1], (float *)dst->data[0], n);
+			}
+			break;
+		case AV_SAMPLE_FMT_S16P:
+			for (int c = 0; c < outChannels; ++c) {
+				floatToS16(out[c], (int16_t *)dst->data[c], n);
+			}
+			break;
+		default:
+			if (outChannels == 1) {
+				floatToS16(out[0], (int16_t *)dst->data[0], n);
+			} else {
+				interleave2(out[0], out[1], packed.data(), n);
+				floatToS16(packed.data(), (int16_t *)dst->data[0], 2 * n);
+			}
+			break;
+		}
+		pts += n;
+		return dst;
+	}
 
 	void init(std::shared_ptr<AVFrame> frame, AVSampleFormat outFormat,
 	          int outSampleRate, int outChannels) {
@@ -150,6 +654,12 @@ class Resampler {
 		this->outChannels = outChannels;
 		this->outSampleRate = outSampleRate;
 		this->pts = frame->pts;
+		direct = !stretch && inSampleRate == outSampleRate &&
+		         directFormat(inFormat, inChannels) &&
+		         directFormat(outFormat, outChannels);
+		if (direct) {
+			return;
+		}
 
 		AVChannelLayout outLayout;
 		av_channel_layout_default(&outLayout, outChannels);
@@ -164,6 +674,16 @@ class Resampler {
 		if (ret < 0) {
 			throw std::runtime_error("Could not open resample context");
 		}
+		if (stretch) {
+			applyCompensation();
+		}
+	}
+
+	void applyCompensation() {
+		if (swr_set_compensation(swr_ctx, compensationDelta,
+		                         compensationDistance) < 0) {
+			throw std::runtime_error("Could not set resampler compensation");
+		}
 	}
 
   public:
@@ -171,9 +691,13 @@ class Resampler {
 	                                  AVSampleFormat outFormat,
 	                                  int outSampleRate, int outChannels) {
 		std::lock_guard lock(mutex);
-		if (!swr_ctx && frame) {
+		if (!swr_ctx && !direct && frame) {
 			init(frame, outFormat, outSampleRate, outChannels);
 		}
+		if (direct) {
+			// Nothing is buffered without swresample
+			return frame ? convert(frame.get()) : nullptr;
+		}
 		if (!swr_ctx && !frame) {
 			return nullptr;
 		}
@@ -186,8 +710,7 @@ class Resampler {
 
 		std::shared_ptr<AVFrame> dst;
 		int ret = -1;
-		dst = createAudioFrame(outFormat, outSampleRate, outChannels,
-		                       outSamples, pts);
+		dst = pool.get(outFormat, outSampleRate, outChannels, outSamples, pts);
 		if (frame) {
 			ret = swr_convert(swr_ctx, dst->data, dst->nb_samples, frame->data,
 			                  in_nb_samples);
@@ -206,6 +729,28 @@ class Resampler {
 		pts += ret;
 		return dst;
 	}
+
+	// Makes the next distance output samples delta samples longer, or
+	// shorter when negative, to follow a drifting clock. Conversions at an
+	// unchanged rate go through swresample from then on.
+	void compensate(int delta, int distance) {
+		std::lock_guard lock(mutex);
+		stretch = true;
+		compensationDelta = delta;
+		compensationDistance = distance;
+		if (swr_ctx) {
+			applyCompensation();
+		}
+		// Set up with swresample on the next frame
+		direct = false;
+	}
+
+	// Output frames allocated, they are reused once released.
+	uint64_t allocations() {
+		std::lock_guard lock(mutex);
+		return pool.allocations();
+	}
+
 	~Resampler() {
 		if (swr_ctx) {
 			swr_free(&swr_ctx);
@@ -214,67 +759,131 @@ class Resampler {
 	}
 };
 
+// Ring buffer cutting audio into frames of a fixed size. Output frames
+// come from a pool and a frame matching the requested size that arrives
+// while nothing is buffered is handed on as it is, without a copy.
 class AudioFifo {
   private:
-	AVAudioFifo *fifo = nullptr;
 	std::recursive_mutex mutex;
 	AVSampleFormat format = AV_SAMPLE_FMT_NONE;
 	int channels = 0;
 	int sample_rate = 0;
 	int64_t pts = -1;
+	// Bytes per sample in each plane
+	int sampleSize = 0;
+	std::vector<std::vector<uint8_t>> ring;
+	int capacity = 0;
+	int head = 0;
+	int size = 0;
+	std::shared_ptr<AVFrame> pending;
+	AudioFramePool pool;
+	uint64_t growths = 0;
 
 	void init(std::shared_ptr<AVFrame> frame) {
 		format = (AVSampleFormat)frame->format;
 		channels = frame->ch_layout.nb_channels;
 		sample_rate = frame->sample_rate;
 		pts = frame->pts;
-		fifo = av_audio_fifo_alloc(format, channels, 1024);
-		if (!fifo) {
-			throw std::runtime_error("Could not allocate audio fifo");
+		bool planar = av_sample_fmt_is_planar(format);
+		sampleSize =
+		    av_get_bytes_per_sample(format) * (planar ? 1 : channels);
+		ring.resize(planar ? channels : 1);
+		reserve(std::max(2048, 2 * frame->nb_samples));
+	}
+
+	void reserve(int samples) {
+		if (samples <= capacity) {
+			return;
+		}
+		int grown = std::max(samples, 2 * capacity);
+		for (auto &plane : ring) {
+			std::vector<uint8_t> data((size_t)grown * sampleSize);
+			copyOut(plane, data.data(), size);
+			plane = std::move(data);
 		}
+		capacity = grown;
+		head = 0;
+		growths++;
 	}
 
-  public:
-	~AudioFifo() {
-		if (fifo) {
-			av_audio_fifo_free(fifo);
-			fifo = nullptr;
+	// Copies n samples from the read position without consuming them.
+	void copyOut(const std::vector<uint8_t> &plane, uint8_t *dst, int n) {
+		if (n == 0) {
+			return;
+		}
+		int first = std::min(n, capacity - head);
+		memcpy(dst, plane.data() + (size_t)head * sampleSize,
+		       (size_t)first * sampleSize);
+		memcpy(dst + (size_t)first * sampleSize, plane.data(),
+		       (size_t)(n - first) * sampleSize);
+	}
+
+	void copyIn(const AVFrame *frame) {
+		int n = frame->nb_samples;
+		reserve(size + n);
+		int tail = (head + size) % capacity;
+		int first = std::min(n, capacity - tail);
+		for (size_t p = 0; p < ring.size(); ++p) {
+			uint8_t *plane = ring[p].data();
+			memcpy(plane + (size_t)tail * sampleSize, frame->data[p],
+			       (size_t)first * sampleSize);
+			memcpy(plane, frame->data[p] + (size_t)first * sampleSize,
+			       (size_t)(n - first) * sampleSize);
+		}
+		size += n;
+	}
+
+	void spill() {
+		if (pending) {
+			copyIn(pending.get());
+			pending.reset();
 		}
 	}
 
+  public:
 	void write(std::shared_ptr<AVFrame> frame) {
 		std::lock_guard lock(mutex);
 		if (!frame) {
 			return;
 		}
 
-		if (!fifo && frame) {
+		if (format == AV_SAMPLE_FMT_NONE) {
 			init(frame);
 		}
 
-		if (av_audio_fifo_write(fifo, (void **)frame->data, frame->nb_samples) <
-		    frame->nb_samples) {
-			throw std::runtime_error("Could not write to audio fifo");
+		spill();
+		if (size == 0) {
+			// Kept by reference until read() tells whether it fits
+			pending = frame;
+			return;
 		}
+		copyIn(frame.get());
 	}
 
 	std::shared_ptr<AVFrame> read(int nb_samples = 960) {
 		std::lock_guard lock(mutex);
-		if (!fifo) {
+		if (format == AV_SAMPLE_FMT_NONE) {
 			return nullptr;
 		}
 
-		if (av_audio_fifo_size(fifo) < nb_samples) {
+		if (pending && pending->nb_samples == nb_samples &&
+		    pending->pts == pts) {
+			auto frame = std::move(pending);
+			pts += nb_samples;
+			return frame;
+		}
+		spill();
+		if (size < nb_samples) {
 			return nullptr;
 		}
 
 		auto frame =
-		    createAudioFrame(format, sample_rate, channels, nb_samples, pts);
-
-		int ret = av_audio_fifo_read(fifo, (void **)frame->data, nb_samples);
-		if (ret < 0) {
-			throw std::runtime_error("Could not read from audio fifo");
+		    pool.get(format, sample_rate, channels, nb_samples, pts);
+		for (size_t p = 0; p < ring.size(); ++p) {
+			copyOut(ring[p], frame->data[p], nb_samples);
 		}
+		head = (head + nb_samples) % capacity;
+		size -= nb_samples;
 
 		pts += nb_samples;
 
@@ -283,12 +892,375 @@ class AudioFifo {
 
 	void clear() {
 		std::lock_guard lock(mutex);
-		if (fifo) {
-			av_audio_fifo_reset(fifo);
+		pending.reset();
+		head = 0;
+		size = 0;
+	}
+
+	// Samples written and not read yet.
+	int buffered() {
+		std::lock_guard lock(mutex);
+		return size + (pending ? pending->nb_samples : 0);
+	}
+
+	// Frames and ring growths allocated so far.
+	uint64_t allocations() {
+		std::lock_guard lock(mutex);
+		return pool.allocations() + growths;
+	}
+};
+
+struct PlayoutBufferStats {
+	uint64_t reads = 0;
+	uint64_t underruns = 0; // reads that ran dry, silence until refilled
+	uint64_t discarded = 0; // samples dropped to catch up with a backlog
+	uint64_t resets = 0;    // timestamp jumps restarting the estimate
+	double latency = 0;     // ms buffered at the last read
+	double targetDelay = 0; // ms
+	double extraDelay = 0;  // ms asked for on top of the target
+	double jitter = 0;      // ms
+	double drift = 0;       // ppm, positive when stretching
+};
+
+// Holds received audio for a sink that pulls fixed amounts at its own
+// cadence. The delay kept follows the arrival jitter, measured against the
+// samples pulled so far rather than a wall clock. Sender and sink clocks
+// drifting apart are made up for by resampling up to 0.5% faster or
+// slower, backlogs over maxDelay are dropped and once the buffer runs dry
+// silence plays until the target delay is buffered again. An extra delay,
+// e.g. to wait for video, is held on top.
+//
+// The writer resamples into a single producer, single consumer ring and
+// does all of the estimation. read() only copies out of the ring, without
+// locks or allocations, so it can run on a real-time audio thread.
+class PlayoutBuffer {
+  private:
+	// Writer side, also taken by stats() and reset()
+	std::mutex mutex;
+	AVSampleFormat format;
+	int sampleRate;
+	int channels;
+	// In samples
+	double minDelay;
+	double maxDelay;
+	Resampler resampler;
+	// Lowest transit of a frame from its pts to the sink clock, and the
+	// last one
+	bool haveBase = false;
+	int64_t base = 0;
+	int64_t lastTransit = 0;
+	double jitter = 0;
+	double target;
+	double extra = 0;
+	// Extra samples to insert, or drop when negative, while playing
+	int extraChange = 0;
+	double level = -1;
+	int delta = 0;
+	uint64_t discarded = 0;
+	uint64_t resets = 0;
+
+	// The ring, one per plane, and positions counted in samples since the
+	// start. written is only stored by the writer, consumed by the reader.
+	int sampleSize;
+	int capacity;
+	std::vector<std::vector<uint8_t>> ring;
+	std::atomic<int64_t> written{0};
+	std::atomic<int64_t> consumed{0};
+	// The reader skips ahead to here, to drop a backlog or on reset
+	std::atomic<int64_t> skipTo{0};
+	// Samples buffered before playing again
+	std::atomic<int> threshold;
+	std::atomic<bool> flush{false};
+
+	// Stored by the reader
+	std::atomic<bool> playing{false};
+	std::atomic<int> readSize{0};
+	// Samples pulled by the sink, its clock
+	std::atomic<int64_t> played{0};
+	std::atomic<uint64_t> reads{0};
+	std::atomic<uint64_t> underruns{0};
+	std::atomic<int> latency{0};
+	// Only touched by the reader
+	bool buffering = true;
+
+	void arrived(int64_t pts) {
+		int64_t transit = played.load(std::memory_order_relaxed) - pts;
+		if (!haveBase || std::abs(transit - base) > 3 * sampleRate) {
+			if (haveBase) {
+				resets++;
+			}
+			haveBase = true;
+			base = transit;
+			lastTransit = transit;
+		}
+		jitter += (std::abs(transit - lastTransit) - jitter) / 16;
+		lastTransit = transit;
+		base = transit < base ? transit : base + (transit - base) / 256;
+
+		// Raised at once to cover a late frame, lowered slowly
+		double desired = std::max(4 * jitter, (double)(transit - base));
+		if (desired > target) {
+			target = desired;
+		} else {
+			target += (desired - target) / 64;
+		}
+		target = std::clamp(target, minDelay, maxDelay);
+		threshold.store((int)(target + extra), std::memory_order_relaxed);
+	}
+
+	// Steers the buffered amount towards the target, closing the gap over
+	// about four seconds. Measured as a frame is written, halfway through
+	// it on average.
+	void correct(double buffered) {
+		if (!playing.load(std::memory_order_relaxed)) {
+			level = -1;
+			return;
+		}
+		level = level < 0 ? buffered : level + (buffered - level) / 16;
+		int pull = readSize.load(std::memory_order_relaxed);
+		double error = level - (target + extra + pull);
+		double limit = sampleRate / 200;
+		int next = (int)std::clamp(-error / 4, -limit, limit);
+		if (next != delta) {
+			delta = next;
+			resampler.compensate(delta, sampleRate);
+		}
+	}
+
+	void copyIn(const AVFrame *frame, int64_t at, int n) {
+		int offset = (int)(at % capacity);
+		int first = std::min(n, capacity - offset);
+		for (size_t p = 0; p < ring.size(); ++p) {
+			uint8_t *plane = ring[p].data();
+			memcpy(plane + (size_t)offset * sampleSize, frame->data[p],
+			       (size_t)first * sampleSize);
+			memcpy(plane, frame->data[p] + (size_t)first * sampleSize,
+			       (size_t)(n - first) * sampleSize);
+		}
+	}
+
+	void copyOut(uint8_t *const *data, int64_t at, int n) {
+		int offset = (int)(at % capacity);
+		int first = std::min(n, capacity - offset);
+		for (size_t p = 0; p < ring.size(); ++p) {
+			const uint8_t *plane = ring[p].data();
+			memcpy(data[p], plane + (size_t)offset * sampleSize,
+			       (size_t)first * sampleSize);
+			memcpy(data[p] + (size_t)first * sampleSize, plane,
+			       (size_t)(n - first) * sampleSize);
+		}
+	}
+
+	// Applies a change of the extra delay at once, a single glitch rather
+	// than minutes of stretching. Returns the samples now buffered.
+	int applyExtraChange(int64_t start, int buffered) {
+		int change = std::exchange(extraChange, 0);
+		if (!playing.load(std::memory_order_relaxed)) {
+			return buffered;
+		}
+		if (change < 0) {
+			int drop = std::min(-change, buffered);
+			skipTo.store(start + drop, std::memory_order_release);
+			return buffered - drop;
+		}
+		int n = std::min(change, capacity - buffered);
+		if (n <= 0) {
+			return buffered;
+		}
+		auto silence = createAudioFrame(format, sampleRate, channels, n);
+		av_samples_set_silence(silence->data, 0, n, channels, format);
+		int64_t end = written.load(std::memory_order_relaxed);
+		copyIn(silence.get(), end, n);
+		written.store(end + n, std::memory_order_release);
+		return buffered + n;
+	}
+
+  public:
+	// Delays are in milliseconds.
+	PlayoutBuffer(AVSampleFormat format = AV_SAMPLE_FMT_FLT,
+	              int sampleRate = 48000, int channels = 2, int minDelay = 20,
+	              int maxDelay = 400)
+	    : format(format), sampleRate(sampleRate), channels(channels),
+	      minDelay(minDelay * sampleRate / 1000.0),
+	      maxDelay(maxDelay * sampleRate / 1000.0), target(this->minDelay),
+	      threshold((int)this->minDelay) {
+		resampler.compensate(0, sampleRate);
+		bool planar = av_sample_fmt_is_planar(format);
+		sampleSize =
+		    av_get_bytes_per_sample(format) * (planar ? 1 : channels);
+		// Room on top of maxDelay for an extra delay and bursts before a drop
+		capacity = (int)this->maxDelay + 2 * sampleRate;
+		ring.resize(planar ? channels : 1);
+		for (auto &plane : ring) {
+			plane.resize((size_t)capacity * sampleSize);
 		}
 	}
+
+	// Returns the microseconds until the frame starts playing, -1 when not
+	// known as nothing plays yet.
+	int64_t write(std::shared_ptr<AVFrame> frame) {
+		std::lock_guard lock(mutex);
+		if (!frame) {
+			return -1;
+		}
+		// Arrivals only tell something once the sink clock runs
+		if (reads.load(std::memory_order_relaxed) > 0 &&
+		    frame->pts != AV_NOPTS_VALUE) {
+			arrived(av_rescale(frame->pts, sampleRate, frame->sample_rate));
+		}
+		auto out = resampler.resample(frame, format, sampleRate, channels);
+		if (!out) {
+			return -1;
+		}
+		int64_t start = std::max(consumed.load(std::memory_order_acquire),
+		                         skipTo.load(std::memory_order_relaxed));
+		int64_t end = written.load(std::memory_order_relaxed);
+		int buffered =
+		    applyExtraChange(start, (int)(end - std::min(start, end)));
+		start = std::max(start, skipTo.load(std::memory_order_relaxed));
+		end = written.load(std::memory_order_relaxed);
+		correct(buffered + out->nb_samples / 2.0);
+		int64_t delay = playing.load(std::memory_order_relaxed)
+		                    ? av_rescale(buffered, 1000000, sampleRate)
+		                    : -1;
+
+		int n = std::min(out->nb_samples, capacity - buffered);
+		copyIn(out.get(), end, n);
+		written.store(end + n, std::memory_order_release);
+		discarded += out->nb_samples - n;
+
+		int pull = readSize.load(std::memory_order_relaxed);
+		// Over maxDelay before this frame
+		if (buffered > maxDelay + extra + pull) {
+			int drop = buffered + n - (int)(target + extra + pull);
+			skipTo.store(start + drop, std::memory_order_release);
+			discarded += drop;
+			delay = -1;
+		}
+		return delay;
+	}
+
+	// Microseconds held on top of the target delay.
+	void setExtraDelay(int64_t delay) {
+		std::lock_guard lock(mutex);
+		double next = delay * sampleRate / 1000000.0;
+		extraChange += (int)(next - extra);
+		extra = next;
+		threshold.store((int)(target + extra), std::memory_order_relaxed);
+	}
+
+	// Copies nb_samples into data, a pointer per plane, silence when
+	// nothing can be played.
+	void read(uint8_t *const *data, int nb_samples) {
+		readSize.store(nb_samples, std::memory_order_relaxed);
+		if (flush.exchange(false, std::memory_order_acquire)) {
+			buffering = true;
+		}
+		int64_t start = consumed.load(std::memory_order_relaxed);
+		int64_t end = written.load(std::memory_order_acquire);
+		start = std::clamp(skipTo.load(std::memory_order_acquire), start, end);
+		int buffered = (int)(end - start);
+		if (buffering &&
+		    buffered >= threshold.load(std::memory_order_relaxed) +
+		                    nb_samples) {
+			buffering = false;
+		}
+		int n = 0;
+		if (!buffering) {
+			if (buffered >= nb_samples) {
+				n = nb_samples;
+				copyOut(data, start, n);
+			} else {
+				underruns.fetch_add(1, std::memory_order_relaxed);
+				buffering = true;
+			}
+		}
+		if (n < nb_samples) {
+			av_samples_set_silence(data, n, nb_samples - n, channels, format);
+		}
+		consumed.store(start + n, std::memory_order_release);
+		playing.store(!buffering, std::memory_order_relaxed);
+		latency.store(buffered, std::memory_order_relaxed);
+		played.fetch_add(nb_samples, std::memory_order_relaxed);
+		reads.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Drops what is buffered, for a new stream.
+	void reset() {
+		std::lock_guard lock(mutex);
+		skipTo.store(written.load(std::memory_order_relaxed),
+		             std::memory_order_release);
+		flush.store(true, std::memory_order_release);
+		haveBase = false;
+		level = -1;
+	}
+
+	PlayoutBufferStats stats() {
+		std::lock_guard lock(mutex);
+		PlayoutBufferStats s;
+		s.reads = reads.load(std::memory_order_relaxed);
+		s.underruns = underruns.load(std::memory_order_relaxed);
+		s.discarded = discarded;
+		s.resets = resets;
+		s.latency = latency.load(std::memory_order_relaxed) * 1000.0 /
+		            sampleRate;
+		s.targetDelay = target * 1000 / sampleRate;
+		s.extraDelay = extra * 1000 / sampleRate;
+		s.jitter = jitter * 1000 / sampleRate;
+		s.drift = delta * 1e6 / sampleRate;
+		return s;
+	}
+};
+
+struct OpusEncoderOptions {
+	// Target bitrate in bits per second.
+	int bitrate = 64000;
+	// Discontinuous transmission by libopus: what its voice activity
+	// detection finds silent is not sent past a short hangover, apart
+	// from a comfort noise update every 400 ms.
+	bool dtx = false;
+	// In-band forward error correction sized for the expected packet loss
+	// percentage, which also makes the encoder itself more loss robust. On
+	// when the remote asks for it with useinbandfec.
+	bool fec = false;
+	int packetLoss = 0;
+	// Variable bitrate, constrained keeps each packet close to the target.
+	bool vbr = true;
+	bool constrainedVbr = false;
+	// 0 (fastest) to 10 (best quality).
+	int complexity = 10;
+	// Milliseconds of audio per packet: 10, 20, 40 or 60. Longer packets
+	// cut the packet rate and its overhead at the cost of latency.
+	int frameDuration = 20;
 };
 
+struct VideoEncoderOptions {
+	// Target bitrate in bits per second.
+	int bitrate = 1000000;
+	// Refreshes the picture a column of intra blocks at a time across the
+	// GOP instead of in one IDR, keeping frame sizes and the bitrate flat.
+	bool intraRefresh = false;
+	// No periodic keyframes or refreshes, only those requested.
+	bool infiniteGop = false;
+	// Sent RTP packets kept to retransmit when the remote NACKs them.
+	int nackHistory = 512;
+};
+
+inline void checkOpusOptions(const OpusEncoderOptions &opus) {
+	int duration = opus.frameDuration;
+	if (duration != 10 && duration != 20 && duration != 40 && duration != 60) {
+		throw std::invalid_argument(
+		    "Opus frame duration must be 10, 20, 40 or 60 ms");
+	}
+	if (opus.complexity < 0 || opus.complexity > 10) {
+		throw std::invalid_argument("Opus complexity must be between 0 and 10");
+	}
+	if (opus.packetLoss < 0 || opus.packetLoss > 100) {
+		throw std::invalid_argument(
+		    "Opus packet loss must be between 0 and 100");
+	}
+}
+
 class Encoder {
   private:
 	Scaler scaler;
@@ -296,23 +1268,88 @@ class Encoder {
 	AudioFifo fifo;
 	std::recursive_mutex mutex;
 	int basePts = -1;
+	bool keyframeRequested = false;
+	// Video size to encode at, the frames' own when 0
+	int width = 0;
+	int height = 0;
+	std::shared_ptr<AVCodecParameters> par;
+	OpusEncoderOptions opus;
+	VideoEncoderOptions video;
+	// The input format when the encoder takes it (x264, MediaCodec and
+	// VideoToolbox take NV12), otherwise the given fallback.
+	AVPixelFormat pixelFormat(AVPixelFormat input, AVPixelFormat fallback) {
+		const void *configs = nullptr;
+		int count = 0;
+		if (avcodec_get_supported_config(nullptr, encoder,
+		                                 AV_CODEC_CONFIG_PIX_FORMAT, 0,
+		                                 &configs, &count) < 0 ||
+		    !configs) {
+			return fallback;
+		}
+		auto formats = static_cast<const AVPixelFormat *>(configs);
+		for (int i = 0; i < count; ++i) {
+			if (formats[i] == input) {
+				return input;
+			}
+		}
+		return fallback;
+	}
+
+	// Through the libx264 and libx265 private options, which other
+	// encoders do not have and ignore.
+	void applyVideoOptions() {
+		if (video.intraRefresh) {
+			// A VBV of a fifth of a second keeps every frame near the
+			// average
+			ctx->rc_max_rate = ctx->bit_rate;
+			ctx->rc_buffer_size = ctx->bit_rate / 5;
+		}
+		if (encoder->id == AV_CODEC_ID_H264) {
+			if (video.infiniteGop) {
+				// X264_KEYINT_MAX_INFINITE
+				ctx->gop_size = 1 << 30;
+			}
+			if (video.intraRefresh) {
+				av_opt_set_int(ctx->priv_data, "intra-refresh", 1, 0);
+			}
+			return;
+		}
+		std::vector<std::string> params;
+		if (video.intraRefresh) {
+			params.push_back("intra-refresh=1");
+		}
+		if (video.infiniteGop) {
+			params.push_back("keyint=-1");
+		}
+		std::string joined;
+		for (auto &param : params) {
+			joined += (joined.empty() ? "" : ":") + param;
+		}
+		if (!joined.empty()) {
+			av_opt_set(ctx->priv_data, "x265-params", joined.c_str(), 0);
+		}
+	}
 
 	void init(std::shared_ptr<AVFrame> frame) {
 		ctx = avcodec_alloc_context3(encoder);
 		if (!ctx)
 			throw std::runtime_error("Could not allocate AVCodecContext");
-		this->basePts = frame->pts;
+		// A stream reopened at a new size keeps its timeline
+		if (!par) {
+			this->basePts = frame->pts;
+		}
 		if (encoder->id == AV_CODEC_ID_H264) {
 			printf("init H264 ctx\n");
 			ctx->codec_id = AV_CODEC_ID_H264;
-			ctx->width = frame->width;
-			ctx->height = frame->height;
+			ctx->width = width ? width : frame->width;
+			ctx->height = height ? height : frame->height;
 			ctx->time_base = (AVRational){1, 90000};
 			ctx->framerate = (AVRational){30, 1};
-			ctx->bit_rate = 1000000; // 1Mbps ~ 130KB/s
+			ctx->bit_rate = video.bitrate;
 			ctx->gop_size = 60;
 			ctx->max_b_frames = 0;
-			ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+			ctx->pix_fmt = pixelFormat((AVPixelFormat)frame->format,
+			                           AV_PIX_FMT_YUV420P);
 			ctx->profile = FF_PROFILE_H264_CONSTRAINED_BASELINE;
 			ctx->color_range = AVCOL_RANGE_MPEG;
 			ctx->color_primaries = AVCOL_PRI_BT709;
@@ -321,14 +1358,15 @@ class Encoder {
 		} else if (encoder->id == AV_CODEC_ID_H265) {
 			printf("init H265 ctx\n");
 			ctx->codec_id = AV_CODEC_ID_H265;
-			ctx->width = frame->width;
-			ctx->height = frame->height;
+			ctx->width = width ? width : frame->width;
+			ctx->height = height ? height : frame->height;
 			ctx->time_base = (AVRational){1, 90000};
 			ctx->framerate = (AVRational){30, 1};
-			ctx->bit_rate = 1000000; // 1Mbps ~ 130KB/s
+			ctx->bit_rate = video.bitrate;
 			ctx->gop_size = 60;
 			ctx->max_b_frames = 0;
-			ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+			ctx->pix_fmt = pixelFormat((AVPixelFormat)frame->format,
+			                           AV_PIX_FMT_YUV420P);
 			ctx->profile = FF_PROFILE_HEVC_MAIN;
 			ctx->color_range = AVCOL_RANGE_MPEG;
 			ctx->color_primaries = AVCOL_PRI_BT709;
@@ -339,9 +1377,18 @@ class Encoder {
 			ctx->codec_id = AV_CODEC_ID_OPUS;
 			ctx->time_base = (AVRational){1, 48000};
 			ctx->sample_rate = 48000;
-			ctx->bit_rate = 64000; // 64kbps ~ 8KB/s
+			ctx->bit_rate = opus.bitrate;
 			ctx->sample_fmt = AV_SAMPLE_FMT_FLT;
+			ctx->compression_level = opus.complexity;
 			av_channel_layout_default(&ctx->ch_layout, 2);
+			// libopus takes the frame size from frame_duration
+			av_opt_set_double(ctx->priv_data, "frame_duration",
+			                  opus.frameDuration, 0);
+			av_opt_set_int(ctx->priv_data, "vbr",
+			               !opus.vbr ? 0 : opus.constrainedVbr ? 2 : 1, 0);
+			av_opt_set_int(ctx->priv_data, "fec", opus.fec, 0);
+			av_opt_set_int(ctx->priv_data, "dtx", opus.dtx, 0);
+			av_opt_set_int(ctx->priv_data, "packet_loss", opus.packetLoss, 0);
 		} else if (encoder->id == AV_CODEC_ID_AAC) {
 			printf("init aac ctx\n");
 			ctx->codec_id = AV_CODEC_ID_AAC;
@@ -357,14 +1404,43 @@ class Encoder {
 			ctx->width = frame->width;
 			ctx->height = frame->height;
 			ctx->pix_fmt = AV_PIX_FMT_RGBA;
+			// Snapshots are single large frames, convert them on every core
+			scaler.setThreads(0);
 		} else {
 			throw std::runtime_error("Unsupported encoder" +
 			                         std::to_string(encoder->id));
 		}
 		ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		if (ctx->codec_type == AVMEDIA_TYPE_VIDEO && ctx->priv_data) {
+			// requested keyframes must be IDRs that repeat SPS/PPS
+			av_opt_set_int(ctx->priv_data, "forced-idr", 1, 0);
+		}
+		if (encoder->id == AV_CODEC_ID_H264 ||
+		    encoder->id == AV_CODEC_ID_H265) {
+			applyVideoOptions();
+		}
 		if (avcodec_open2(ctx, encoder, NULL) < 0)
 			throw std::runtime_error("Could not open codec" +
 			                         std::string(encoder->name));
+
+		par = std::shared_ptr<AVCodecParameters>(
+		    avcodec_parameters_alloc(),
+		    [](AVCodecParameters *p) { avcodec_parameters_free(&p); });
+		if (!par || avcodec_parameters_from_context(par.get(), ctx) < 0)
+			throw std::runtime_error("Could not copy codec parameters");
+	}
+
+	void receive(std::vector<std::shared_ptr<AVPacket>> &packets) {
+		while (true) {
+			auto packet = createAVPacket();
+			int ret = avcodec_receive_packet(ctx, packet.get());
+			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+				break;
+			else if (ret < 0)
+				throw std::runtime_error("Error during decoding");
+			packet->time_base = ctx->time_base;
+			packets.push_back(packet);
+		}
 	}
 
 	void destroy() {
@@ -378,11 +1454,17 @@ class Encoder {
 	const AVCodec *encoder = nullptr;
 	AVCodecContext *ctx = nullptr;
 
-	Encoder(AVCodecID codecId = AV_CODEC_ID_NONE) {
+	Encoder(AVCodecID codecId = AV_CODEC_ID_NONE,
+	        const OpusEncoderOptions &opus = {},
+	        const VideoEncoderOptions &video = {})
+	    : opus(opus), video(video) {
 		std::lock_guard lock(mutex);
 		if (codecId == AV_CODEC_ID_NONE) {
 			return;
 		}
+		if (codecId == AV_CODEC_ID_OPUS) {
+			checkOpusOptions(opus);
+		}
 		encoder = avcodec_find_encoder(codecId);
 		if (encoder) {
 			LOGI("encoder %s enabled\n", encoder->name);
@@ -395,10 +1477,49 @@ class Encoder {
 
 	~Encoder() { destroy(); }
 
+	// Stream parameters, available once the first frame opened the codec.
+	std::shared_ptr<AVCodecParameters> parameters() {
+		std::lock_guard lock(mutex);
+		return par;
+	}
+
+	// Interpolation for frames converted before encoding.
+	void setScaleQuality(ScaleQuality quality) {
+		std::lock_guard lock(mutex);
+		scaler.setQuality(quality);
+	}
+
+	// Scales video to width x height before encoding, 0 for the size of
+	// the frames. A new size restarts the stream with a keyframe.
+	void setSize(int width, int height) {
+		std::lock_guard lock(mutex);
+		this->width = width;
+		this->height = height;
+	}
+
+	// Encode the next video frame as a keyframe.
+	void requestKeyframe() {
+		std::lock_guard lock(mutex);
+		keyframeRequested = true;
+	}
+
 	std::vector<std::shared_ptr<AVPacket>>
 	encode(std::shared_ptr<AVFrame> frame) {
 		std::lock_guard lock(mutex);
 
+		std::vector<std::shared_ptr<AVPacket>> packets;
+		bool isVideo = encoder->id == AV_CODEC_ID_H264 ||
+		               encoder->id == AV_CODEC_ID_H265;
+		if (ctx && frame && isVideo &&
+		    (ctx->width != (width ? width : frame->width) ||
+		     ctx->height != (height ? height : frame->height))) {
+			// Drains the stream at the old size before starting over
+			if (avcodec_send_frame(ctx, nullptr) < 0) {
+				throw std::runtime_error("Error sending frame");
+			}
+			receive(packets);
+			destroy();
+		}
 		if (!ctx && frame) {
 			init(frame);
 		}
@@ -412,21 +1533,20 @@ class Encoder {
 			auto resampled_frame =
 			    resampler.resample(frame, AV_SAMPLE_FMT_FLT, 48000, 2);
 			fifo.write(resampled_frame);
-			while (auto f = fifo.read(960)) {
+			while (auto f = fifo.read(ctx->frame_size)) {
 				frames.push_back(f);
 			}
 		} else if (encoder->id == AV_CODEC_ID_AAC) {
 			auto resampled_frame =
 			    resampler.resample(frame, AV_SAMPLE_FMT_FLTP, 48000, 2);
 			fifo.write(resampled_frame);
-			while (auto f = fifo.read(1024)) {
+			while (auto f = fifo.read(ctx->frame_size)) {
 				frames.push_back(f);
 			}
-		} else if (encoder->id == AV_CODEC_ID_H264 ||
-		           encoder->id == AV_CODEC_ID_H265) {
+		} else if (isVideo) {
 			if (frame) {
-				frames.push_back(scaler.scale(frame, AV_PIX_FMT_YUV420P,
-				                              frame->width, frame->height));
+				frames.push_back(scaler.scale(frame, ctx->pix_fmt, ctx->width,
+				                              ctx->height));
 			}
 		} else if (encoder->id == AV_CODEC_ID_PNG) {
 			if (frame) {
@@ -442,38 +1562,188 @@ class Encoder {
 			frames.push_back(nullptr);
 		}
 
-		std::vector<std::shared_ptr<AVPacket>> packets;
 		for (auto &f : frames) {
+			bool forceKeyframe = false;
+			if (f == frame && f) {
+				// Not converted, reference it so the caller's frame keeps
+				// its pts.
+				f = std::shared_ptr<AVFrame>(
+				    av_frame_clone(frame.get()),
+				    [](AVFrame *f) { av_frame_free(&f); });
+				if (!f)
+					throw std::runtime_error("Could not reference frame");
+			}
 			if (f) {
 				f->pts -= this->basePts;
+				forceKeyframe = keyframeRequested &&
+				                ctx->codec_type == AVMEDIA_TYPE_VIDEO;
+			}
+			if (forceKeyframe) {
+				f->pict_type = AV_PICTURE_TYPE_I;
+				keyframeRequested = false;
 			}
 			int ret = avcodec_send_frame(ctx, f.get());
+			if (forceKeyframe) {
+				f->pict_type = AV_PICTURE_TYPE_NONE;
+			}
 			if (ret < 0) {
 				throw std::runtime_error("Error sending frame");
 			}
-
-			while (true) {
-				auto packet = createAVPacket();
-				ret = avcodec_receive_packet(ctx, packet.get());
-				if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-					break;
-				else if (ret < 0)
-					throw std::runtime_error("Error during decoding");
-				packets.push_back(packet);
-			}
+			receive(packets);
 		}
 
+		if (encoder->id == AV_CODEC_ID_OPUS && opus.dtx) {
+			// What DTX leaves out comes as packets of just their TOC,
+			// which are not sent
+			auto end = std::remove_if(packets.begin(), packets.end(),
+			                          [](const std::shared_ptr<AVPacket> &p) {
+				                          return p->size <= 2;
+			                          });
+			packets.erase(end, packets.end());
+		}
 		return packets;
 	}
 };
 
+// What the decoder leaves out to keep up, each level adding to the last.
+enum class DecodeDegradation {
+	None,
+	SkipNonReference, // frames nothing is predicted from
+	SkipLoopFilter,   // deblocking, errors spread until the next keyframe
+	KeyframesOnly,
+};
+
+struct DecoderStats {
+	uint64_t packets = 0;
+	uint64_t frames = 0;
+	uint64_t errors = 0;  // packets that failed or decoded corrupt
+	uint64_t dropped = 0; // packets skipped waiting for a keyframe
+	uint64_t skipped = 0; // packets nobody needed decoded
+	uint64_t keyframeRequests = 0;
+	DecodeDegradation degradation = DecodeDegradation::None;
+	uint64_t degradations = 0; // steps to a cheaper level
+	double load = 0;           // decode time over the frame interval
+};
+
+// Video decoding stops at the first error and resumes at the next
+// keyframe, which is asked for through requestKeyframe. A decoder that
+// cannot keep up with the frame rate steps through cheaper levels of
+// DecodeDegradation, and back as the load drops.
 class Decoder {
   private:
 	AVCodecContext *ctx = nullptr;
 	std::recursive_mutex mutex;
+	std::shared_ptr<AVCodecParameters> par;
+	std::function<void()> onKeyframeNeeded;
+	// At most one request per interval, the sender answers within an RTT
+	const std::chrono::milliseconds requestInterval{300};
+	std::chrono::steady_clock::time_point lastRequest;
+	bool requested = false;
+	bool waitingKeyframe = false;
+	DecoderStats stat;
+
+	// Load above overload steps up a level once the last step has had
+	// settleFrames to take effect. Load below underload for recoverFrames
+	// steps down, waiting longer after each relapse.
+	static constexpr double overload = 0.8;
+	static constexpr double underload = 0.4;
+	static constexpr int settleFrames = 10;
+	static constexpr int minRecoverFrames = 60;
+	static constexpr int maxRecoverFrames = 960;
+	int recoverFrames = minRecoverFrames;
+	int framesAtLevel = 0;
+	int sinceRecovery = INT_MAX;
+	// Leaving KeyframesOnly waits for a keyframe to predict from
+	bool recovering = false;
+	int64_t lastPts = AV_NOPTS_VALUE;
+	double frameInterval = 0; // seconds
+
+	void degrade(DecodeDegradation level) {
+		stat.degradation = level;
+		framesAtLevel = 0;
+		ctx->skip_frame = AVDISCARD_DEFAULT;
+		if (level == DecodeDegradation::KeyframesOnly) {
+			ctx->skip_frame = AVDISCARD_NONKEY;
+		} else if (level >= DecodeDegradation::SkipNonReference) {
+			ctx->skip_frame = AVDISCARD_NONREF;
+		}
+		ctx->skip_loop_filter = level >= DecodeDegradation::SkipLoopFilter
+		                            ? AVDISCARD_ALL
+		                            : AVDISCARD_DEFAULT;
+	}
+
+	// Updates the load with the time the packet took to decode.
+	void adapt(const AVPacket *packet, double seconds) {
+		AVRational timeBase =
+		    packet->time_base.num ? packet->time_base : (AVRational){1, 90000};
+		if (lastPts != AV_NOPTS_VALUE && packet->pts != AV_NOPTS_VALUE) {
+			double interval = (packet->pts - lastPts) * av_q2d(timeBase);
+			// Gaps and restarts say nothing about the frame rate
+			if (interval > 0 && interval < 1 && frameInterval > 0) {
+				frameInterval += (interval - frameInterval) / 8;
+			} else if (interval > 0 && interval < 1) {
+				frameInterval = interval;
+			}
+		}
+		lastPts = packet->pts;
+		if (frameInterval <= 0) {
+			return;
+		}
+		stat.load += (seconds / frameInterval - stat.load) / 8;
+		framesAtLevel++;
+		if (sinceRecovery < INT_MAX) {
+			sinceRecovery++;
+		}
+
+		int level = (int)stat.degradation;
+		if (stat.load >= underload) {
+			recovering = false;
+		}
+		if (stat.load > overload && framesAtLevel >= settleFrames &&
+		    stat.degradation < DecodeDegradation::KeyframesOnly) {
+			recoverFrames = sinceRecovery < recoverFrames
+			                    ? std::min(recoverFrames * 2, maxRecoverFrames)
+			                    : minRecoverFrames;
+			recovering = false;
+			stat.degradations++;
+			degrade((DecodeDegradation)(level + 1));
+		} else if (stat.load < underload && framesAtLevel >= recoverFrames &&
+		           level > 0) {
+			if (stat.degradation == DecodeDegradation::KeyframesOnly) {
+				recovering = true;
+				requestKeyframe();
+			} else {
+				sinceRecovery = 0;
+				degrade((DecodeDegradation)(level - 1));
+			}
+		}
+	}
+
+	void requestKeyframe() {
+		auto now = std::chrono::steady_clock::now();
+		if (!onKeyframeNeeded ||
+		    (requested && now - lastRequest < requestInterval)) {
+			return;
+		}
+		requested = true;
+		lastRequest = now;
+		stat.keyframeRequests++;
+		onKeyframeNeeded();
+	}
+
+	// Throws away the broken references. Audio just skips the packet.
+	void fail() {
+		stat.errors++;
+		avcodec_flush_buffers(ctx);
+		if (ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+			waitingKeyframe = true;
+			requestKeyframe();
+		}
+	}
 
   public:
-	Decoder(AVCodecID codecId) {
+	Decoder(AVCodecID codecId, std::function<void()> requestKeyframe = {})
+	    : onKeyframeNeeded(requestKeyframe) {
 		std::lock_guard lock(mutex);
 		auto decoder = avcodec_find_decoder(codecId);
 		if (!decoder)
@@ -491,6 +1761,12 @@ class Decoder {
 			av_channel_layout_default(&ctx->ch_layout, 2);
 		}
 		ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		if (ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+			// Bitstream errors fail the packet rather than being concealed
+			// into the frames predicted from it
+			ctx->err_recognition |= AV_EF_EXPLODE;
+			waitingKeyframe = true;
+		}
 		if (avcodec_open2(ctx, decoder, NULL) < 0)
 			throw std::runtime_error("Could not open codec");
 	}
@@ -498,28 +1774,129 @@ class Decoder {
 	std::vector<std::shared_ptr<AVFrame>>
 	decode(std::shared_ptr<AVPacket> packet) {
 		std::lock_guard lock(mutex);
-		if (avcodec_send_packet(ctx, packet.get()) < 0) {
-			throw std::runtime_error("Error sending packet");
+		std::vector<std::shared_ptr<AVFrame>> frames;
+		if (packet && waitingKeyframe) {
+			if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+				stat.dropped++;
+				requestKeyframe();
+				return frames;
+			}
+			waitingKeyframe = false;
+		}
+		if (packet && recovering && (packet->flags & AV_PKT_FLAG_KEY)) {
+			recovering = false;
+			sinceRecovery = 0;
+			degrade(DecodeDegradation::SkipLoopFilter);
+		}
+		auto start = std::chrono::steady_clock::now();
+		int ret = avcodec_send_packet(ctx, packet.get());
+		if (ret < 0) {
+			if (packet && ret != AVERROR(ENOMEM)) {
+				fail();
+				return frames;
+			}
+			if (ret != AVERROR_EOF) {
+				throw std::runtime_error("Error sending packet");
+			}
+		}
+		if (packet) {
+			stat.packets++;
 		}
 
-		std::vector<std::shared_ptr<AVFrame>> frames;
 		while (1) {
 			std::shared_ptr<AVFrame> frame(
 			    av_frame_alloc(), [](AVFrame *f) { av_frame_free(&f); });
 			if (!frame)
 				throw std::runtime_error("Could not allocate image");
 
-			int ret = avcodec_receive_frame(ctx, frame.get());
+			ret = avcodec_receive_frame(ctx, frame.get());
 			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
 				break;
-			else if (ret < 0)
+			else if (ret == AVERROR(ENOMEM))
 				throw std::runtime_error("Error during decoding");
+			if (ret < 0 || frame->decode_error_flags ||
+			    (frame->flags & AV_FRAME_FLAG_CORRUPT)) {
+				fail();
+				frames.clear();
+				break;
+			}
 
 			frames.push_back(frame);
 		}
+		stat.frames += frames.size();
+		if (packet && ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+			adapt(packet.get(), std::chrono::duration<double>(
+			                        std::chrono::steady_clock::now() - start)
+			                        .count());
+		}
 		return frames;
 	}
 
+	// Passes over a packet whose frames nobody needs. Decoding resumes at
+	// a keyframe, which is asked for if the next packet decoded is not.
+	void skip() {
+		std::lock_guard lock(mutex);
+		stat.skipped++;
+		if (ctx->codec_type == AVMEDIA_TYPE_VIDEO && !waitingKeyframe) {
+			avcodec_flush_buffers(ctx);
+			waitingKeyframe = true;
+		}
+	}
+
+	// Decodes again from the next keyframe, for when packets were lost
+	// before the next one.
+	void resync() {
+		std::lock_guard lock(mutex);
+		if (ctx->codec_type == AVMEDIA_TYPE_VIDEO && !waitingKeyframe) {
+			avcodec_flush_buffers(ctx);
+			waitingKeyframe = true;
+			requestKeyframe();
+		}
+	}
+
+	DecoderStats stats() {
+		std::lock_guard lock(mutex);
+		return stat;
+	}
+
+	// Parameters of the decoded stream for muxing its packets, available
+	// once video dimensions are known. Opus gets a default OpusHead.
+	std::shared_ptr<AVCodecParameters> parameters() {
+		std::lock_guard lock(mutex);
+		if (par) {
+			return par;
+		}
+		if (ctx->codec_type == AVMEDIA_TYPE_VIDEO && ctx->width <= 0) {
+			return nullptr;
+		}
+		auto p = std::shared_ptr<AVCodecParameters>(
+		    avcodec_parameters_alloc(),
+		    [](AVCodecParameters *p) { avcodec_parameters_free(&p); });
+		if (!p || avcodec_parameters_from_context(p.get(), ctx) < 0)
+			throw std::runtime_error("Could not copy codec parameters");
+		if (p->codec_id == AV_CODEC_ID_OPUS && p->extradata_size < 19) {
+			const int size = 19;
+			auto head =
+			    (uint8_t *)av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+			if (!head)
+				throw std::runtime_error("Could not allocate extradata");
+			// version 1, pre-skip 312, input sample rate 48000, gain 0,
+			// channel mapping family 0
+			memcpy(head, "OpusHead", 8);
+			head[8] = 1;
+			head[9] = p->ch_layout.nb_channels;
+			head[10] = 312 & 0xff;
+			head[11] = 312 >> 8;
+			head[12] = 48000 & 0xff;
+			head[13] = (48000 >> 8) & 0xff;
+			av_freep(&p->extradata);
+			p->extradata = head;
+			p->extradata_size = size;
+		}
+		par = p;
+		return par;
+	}
+
 	void flush() { decode(nullptr); }
 
 	~Decoder() {
@@ -531,41 +1908,458 @@ class Decoder {
 	}
 };
 
+struct MuxerOptions {
+	// Write a fragmented MP4 (empty moov + moof per fragment) so that
+	// everything up to the last fragment survives a crash before stop().
+	// Matroska output is always progressive, this bounds its clusters.
+	bool fragmented = false;
+	// Maximum fragment or cluster length in milliseconds, MP4 fragments are
+	// also cut on every video keyframe.
+	int fragmentDuration = 1000;
+	// Upper bound in milliseconds for the interleaving queue, a stalled
+	// stream forces the buffered packets out once exceeded.
+	int maxInterleaveDelta = 1000;
+	// Size in bytes of the AVIO buffer handed to the writer thread at once.
+	int writeBufferSize = 1024 * 1024;
+	// Buffers the writer thread may lag behind before muxing blocks.
+	int writeQueueSize = 8;
+	// Rotate to a new file on the next keyframe once the current segment
+	// reaches this duration in milliseconds or size in bytes, 0 disables.
+	int segmentDuration = 0;
+	int64_t segmentSize = 0;
+	// Completed segments kept on disk, older ones are deleted. 0 keeps all.
+	int maxSegments = 0;
+	// Streams fed with already encoded packets through mux_audio_packet()
+	// and mux_video_packet() instead of frames. Copied video changing its
+	// size goes on in a new file, named and reported like a segment.
+	bool copyAudio = false;
+	bool copyVideo = false;
+	// Opens where the bytes of each file go instead of the file itself,
+	// e.g. storage of its own.
+	std::function<WriteSink(const std::string &path)> openSink;
+};
+
+using SegmentCallback =
+    std::function<void(const std::string &path, int index, int64_t duration,
+                       int64_t size, bool last)>;
+
 class Muxer {
   private:
 	std::recursive_mutex mutex;
+	MuxerOptions options;
+	std::string path;
 	AVFormatContext *fmt_ctx = nullptr;
 	AVIOContext *avio_ctx = nullptr;
+	std::shared_ptr<AsyncWriter> writer;
 	Encoder audioEncoder;
 	Encoder videoEncoder;
 	Resampler audioResampler;
 	Scaler videoScaler;
 
+	bool hasAudio = false;
+	bool hasVideo = false;
+	std::shared_ptr<AVCodecParameters> audio_par;
+	std::shared_ptr<AVCodecParameters> video_par;
+	// As the source of copied video gave them, to notice it changing
+	std::shared_ptr<AVCodecParameters> copied_video_par;
+	// Subtracted from the pts of each stream (AV_TIME_BASE_Q), whose
+	// sources start their timelines apart. Set by the first packet of the
+	// stream written, to the time since the first header.
+	int64_t audioBase = AV_NOPTS_VALUE;
+	int64_t videoBase = AV_NOPTS_VALUE;
+	std::chrono::steady_clock::time_point startTime;
+	bool started = false;
+
 	AVStream *audio_stream = nullptr;
 	AVStream *video_stream = nullptr;
 	bool has_wrote_header = false;
 	bool audio_opened = false;
 	bool video_opened = false;
 
+	int segmentIndex = 0;
+	std::string segmentPath;
+	int64_t segmentStart = AV_NOPTS_VALUE; // AV_TIME_BASE_Q
+	int64_t segmentEnd = 0;                // AV_TIME_BASE_Q
+	std::deque<std::string> segments;
+	SegmentCallback segmentCallback;
+	// Finishes the last rotated segment
+	std::thread closer;
+	// A finished file did not fully reach its sink, thrown by stop()
+	bool writeFailed = false;
+
+	bool segmenting() {
+		return options.segmentDuration > 0 || options.segmentSize > 0;
+	}
+
+	// Whether the recording is spread over files, by segmenting or by a
+	// copied stream changing its parameters.
+	bool split() { return segmenting() || segmentIndex > 0; }
+
+	std::string nextSegmentPath() {
+		if (!split()) {
+			return path;
+		}
+		auto p = std::filesystem::path(path);
+		char index[16];
+		snprintf(index, sizeof(index), "_%06d", segmentIndex);
+		auto name = p.stem().string() + index + p.extension().string();
+		return (p.parent_path() / name).string();
+	}
+
+	AVStream *add_stream(const AVCodecParameters *par) {
+		auto stream = avformat_new_stream(fmt_ctx, nullptr);
+		if (!stream) {
+			throw std::runtime_error("Could not create stream");
+		}
+		if (avcodec_parameters_copy(stream->codecpar, par) < 0) {
+			throw std::runtime_error("Could not copy codec parameters");
+		}
+		stream->codecpar->codec_tag = 0;
+		return stream;
+	}
+
+	void open_audio(std::shared_ptr<AVCodecParameters> par) {
+		audio_par = par;
+		audio_stream = add_stream(par.get());
+		audio_opened = true;
+		try_write_header();
+	}
+
+	bool is_mov() {
+		return strcmp(fmt_ctx->oformat->name, "mp4") == 0 ||
+		       strcmp(fmt_ctx->oformat->name, "mov") == 0;
+	}
+
+	// The mov muxer builds avcC/hvcC from the first packet, Matroska needs
+	// the in-band parameter sets as CodecPrivate up front.
+	bool needs_parameter_sets(const AVCodecParameters *par) {
+		bool annexb = par->codec_id == AV_CODEC_ID_H264 ||
+		              par->codec_id == AV_CODEC_ID_H265;
+		return annexb && par->extradata_size == 0 && !is_mov();
+	}
+
+	// The parameters to write video with, with the in-band parameter sets
+	// of the keyframe as extradata where the container needs them.
+	std::shared_ptr<AVCodecParameters>
+	video_parameters(std::shared_ptr<AVCodecParameters> par,
+	                 std::shared_ptr<AVPacket> keyframe) {
+		if (!needs_parameter_sets(par.get())) {
+			return par;
+		}
+		auto extradata =
+		    extractParameterSets(par->codec_id, keyframe->data, keyframe->size);
+		auto copy = std::shared_ptr<AVCodecParameters>(
+		    avcodec_parameters_alloc(),
+		    [](AVCodecParameters *p) { avcodec_parameters_free(&p); });
+		if (!copy || avcodec_parameters_copy(copy.get(), par.get()) < 0)
+			throw std::runtime_error("Could not copy codec parameters");
+		copy->extradata = (uint8_t *)av_mallocz(extradata.size() +
+		                                        AV_INPUT_BUFFER_PADDING_SIZE);
+		if (!copy->extradata)
+			throw std::runtime_error("Could not allocate extradata");
+		memcpy(copy->extradata, extradata.data(), extradata.size());
+		copy->extradata_size = extradata.size();
+		return copy;
+	}
+
+	void open_video(std::shared_ptr<AVCodecParameters> par,
+	                std::shared_ptr<AVPacket> keyframe) {
+		video_par = video_parameters(par, keyframe);
+		video_stream = add_stream(video_par.get());
+		video_opened = true;
+		try_write_header();
+	}
+
+	static bool same_parameters(const AVCodecParameters *a,
+	                            const AVCodecParameters *b) {
+		return a->codec_id == b->codec_id && a->width == b->width &&
+		       a->height == b->height &&
+		       a->extradata_size == b->extradata_size &&
+		       (a->extradata_size == 0 ||
+		        memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+	}
+
 	void try_write_header() {
-		if (audioEncoder.encoder && !audio_opened) {
+		if (hasAudio && !audio_opened) {
 			return;
 		}
-		if (videoEncoder.encoder && !video_opened) {
+		if (hasVideo && !video_opened) {
 			return;
 		}
 
-		if (avformat_write_header(fmt_ctx, NULL) < 0) {
+		AVDictionary *opts = nullptr;
+		if (options.fragmented && is_mov()) {
+			av_dict_set(&opts, "movflags",
+			            "frag_keyframe+empty_moov+default_base_moof", 0);
+			av_dict_set_int(&opts, "frag_duration",
+			                (int64_t)options.fragmentDuration * 1000, 0);
+		} else if (options.fragmented) {
+			// Matroska clusters are complete on disk once written.
+			av_dict_set_int(&opts, "cluster_time_limit",
+			                options.fragmentDuration, 0);
+		}
+		int ret = avformat_write_header(fmt_ctx, &opts);
+		av_dict_free(&opts);
+		if (ret < 0) {
 			return;
 		}
 
 		has_wrote_header = true;
+		if (!started) {
+			started = true;
+			startTime = std::chrono::steady_clock::now();
+		}
 	}
 
-	void destroy() {
+	static int write_packet(void *opaque, const uint8_t *buf, int buf_size) {
+		auto writer = static_cast<AsyncWriter *>(opaque);
+		try {
+			writer->write(buf, buf_size);
+		} catch (const std::exception &e) {
+			LOGE("write_packet failed: %s\n", e.what());
+			return AVERROR(EIO);
+		}
+		return buf_size;
+	}
+
+	static int64_t seek(void *opaque, int64_t offset, int whence) {
+		auto writer = static_cast<AsyncWriter *>(opaque);
+		if (whence & AVSEEK_SIZE) {
+			return writer->length();
+		}
+		return writer->seek(offset, whence & ~AVSEEK_FORCE);
+	}
+
+	void open_output() {
+		segmentPath = nextSegmentPath();
+		if (avformat_alloc_output_context2(&fmt_ctx, NULL, NULL,
+		                                   segmentPath.c_str()) < 0) {
+			throw std::runtime_error("Could not allocate output context");
+		}
+
+		if (options.openSink) {
+			writer = std::make_shared<AsyncWriter>(
+			    options.openSink(segmentPath), options.writeQueueSize);
+		} else {
+			writer = std::make_shared<AsyncWriter>(segmentPath,
+			                                       options.writeQueueSize);
+		}
+		auto buffer = (unsigned char *)av_malloc(options.writeBufferSize);
+		if (!buffer) {
+			throw std::runtime_error("Could not allocate output buffer");
+		}
+		avio_ctx =
+		    avio_alloc_context(buffer, options.writeBufferSize, 1,
+		                       writer.get(), nullptr, write_packet, seek);
+		if (!avio_ctx) {
+			av_free(buffer);
+			throw std::runtime_error("Could not allocate output context");
+		}
+		fmt_ctx->pb = avio_ctx;
+		fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+		fmt_ctx->max_interleave_delta =
+		    (int64_t)options.maxInterleaveDelta * 1000;
+		if (options.fragmented) {
+			// Fragments are assembled in memory by the mov muxer, flushing
+			// after each write pushes every finished fragment to the file.
+			fmt_ctx->flush_packets = 1;
+		}
+		if (split()) {
+			// Audio that precedes the keyframe a segment starts on.
+			fmt_ctx->avoid_negative_ts = AVFMT_AVOID_NEG_TS_MAKE_ZERO;
+		}
+
+		has_wrote_header = false;
+		segmentStart = AV_NOPTS_VALUE;
+		segmentEnd = 0;
+		if (audio_opened) {
+			audio_stream = add_stream(audio_par.get());
+		}
+		if (video_opened) {
+			video_stream = add_stream(video_par.get());
+		}
+		if (audio_opened || video_opened) {
+			try_write_header();
+		}
+	}
+
+	// A file done with, whose trailer is still to be written.
+	struct Output {
+		AVFormatContext *fmt_ctx = nullptr;
+		AVIOContext *avio_ctx = nullptr;
+		std::shared_ptr<AsyncWriter> writer;
+		std::string path;
+		int index = 0;
+		int64_t duration = 0;
+		bool wroteHeader = false;
+	};
+
+	// Writes the trailer, waits for the writer to drain and reports the
+	// segment. Runs on the closer thread for rotated segments, one at a
+	// time.
+	void finish_output(Output output, bool last, SegmentCallback callback) {
+		bool failed = false;
+		if (output.wroteHeader) {
+			failed = av_write_trailer(output.fmt_ctx) < 0;
+			avio_flush(output.avio_ctx);
+		}
+		try {
+			output.writer->close();
+		} catch (const std::exception &e) {
+			LOGE("Could not finish %s: %s\n", output.path.c_str(), e.what());
+			failed = true;
+		}
+		free_output(output.fmt_ctx, output.avio_ctx);
+
+		auto stat = output.writer->stats();
+		LOGI("muxer wrote %llu bytes, write latency avg %.1f ms max %.1f ms, "
+		     "max queue depth %zu\n",
+		     (unsigned long long)stat.bytesWritten, stat.avgWriteLatency,
+		     stat.maxWriteLatency, stat.maxQueueDepth);
+
+		// A recording kept in a single file is not reported, nor is a
+		// segment that is not whole
+		bool single = !segmenting() && output.index == 0 && last;
+		if (failed) {
+			writeFailed = true;
+			return;
+		}
+		if (!output.wroteHeader || single) {
+			return;
+		}
+		if (callback) {
+			callback(output.path, output.index, output.duration,
+			         output.writer->length(), last);
+		}
+		segments.push_back(output.path);
+		while (options.maxSegments > 0 &&
+		       (int)segments.size() > options.maxSegments) {
+			std::error_code ec;
+			std::filesystem::remove(segments.front(), ec);
+			segments.pop_front();
+		}
+	}
+
+	// The last output is finished before returning, a rotated segment on
+	// the closer thread so that the next one opens without waiting for
+	// its trailer and writes to land.
+	void rotate() {
+		close_output(false);
+		segmentIndex += 1;
+		open_output();
+	}
+
+	void close_output(bool last) {
+		if (!fmt_ctx) {
+			return;
+		}
+		Output output;
+		output.fmt_ctx = fmt_ctx;
+		output.avio_ctx = avio_ctx;
+		output.writer = writer;
+		output.path = segmentPath;
+		output.index = segmentIndex;
+		output.wroteHeader = has_wrote_header;
+		if (segmentStart != AV_NOPTS_VALUE) {
+			output.duration = (segmentEnd - segmentStart) / 1000;
+		}
+		fmt_ctx = nullptr;
+		avio_ctx = nullptr;
+		has_wrote_header = false;
+
+		if (closer.joinable()) {
+			closer.join();
+		}
+		if (last) {
+			finish_output(std::move(output), last, segmentCallback);
+		} else {
+			closer = std::thread(&Muxer::finish_output, this,
+			                     std::move(output), last, segmentCallback);
+		}
+	}
+
+	bool segment_full(int64_t time) {
+		if (segmentStart == AV_NOPTS_VALUE) {
+			return false;
+		}
+		if (options.segmentDuration > 0 &&
+		    time - segmentStart >= (int64_t)options.segmentDuration * 1000) {
+			return true;
+		}
+		if (options.segmentSize > 0 &&
+		    avio_tell(fmt_ctx->pb) >= options.segmentSize) {
+			return true;
+		}
+		return false;
+	}
+
+	void mux_packet(std::shared_ptr<AVPacket> packet, bool video) {
+		if (!has_wrote_header) {
+			return;
+		}
+		AVRational time_base = packet->time_base;
+		int64_t &base = video ? videoBase : audioBase;
+		if (base == AV_NOPTS_VALUE) {
+			int64_t elapsed =
+			    std::chrono::duration_cast<std::chrono::microseconds>(
+			        std::chrono::steady_clock::now() - startTime)
+			        .count();
+			base = av_rescale_q(packet->pts, time_base, AV_TIME_BASE_Q) -
+			       elapsed;
+		}
+		int64_t offset = av_rescale_q(base, AV_TIME_BASE_Q, time_base);
+		packet->pts -= offset;
+		if (packet->dts != AV_NOPTS_VALUE) {
+			packet->dts -= offset;
+		}
+		int64_t time = av_rescale_q(packet->pts, time_base, AV_TIME_BASE_Q);
+
+		// Cut on video keyframes, or on any packet for audio-only files, so
+		// every segment starts decodable without touching the encoders.
+		bool cut =
+		    (packet->flags & AV_PKT_FLAG_KEY) && (video || !video_opened);
+		if (segmenting() && cut && segment_full(time)) {
+			rotate();
+		}
+		if (!has_wrote_header) {
+			return;
+		}
+		if (segmentStart == AV_NOPTS_VALUE) {
+			segmentStart = time;
+		}
+		segmentEnd = std::max(segmentEnd, time);
+
+		AVStream *stream = video ? video_stream : audio_stream;
+		packet->stream_index = stream->index;
+		if (split()) {
+			int64_t offset =
+			    av_rescale_q(segmentStart, AV_TIME_BASE_Q, time_base);
+			packet->pts -= offset;
+			if (packet->dts != AV_NOPTS_VALUE) {
+				packet->dts -= offset;
+			}
+		}
+		av_packet_rescale_ts(packet.get(), time_base, stream->time_base);
+		if (av_interleaved_write_frame(fmt_ctx, packet.get()) < 0) {
+			throw std::runtime_error(video ? "Could not write video frame"
+			                               : "Could not write audio frame");
+		}
+	}
+
+	static std::shared_ptr<AVPacket>
+	copy_packet(std::shared_ptr<AVPacket> src) {
+		auto packet = createAVPacket();
+		if (av_packet_ref(packet.get(), src.get()) < 0) {
+			throw std::runtime_error("Could not reference packet");
+		}
+		return packet;
+	}
+
+	static void free_output(AVFormatContext *&fmt_ctx,
+	                        AVIOContext *&avio_ctx) {
 		if (avio_ctx) {
-			av_free(avio_ctx->buffer);
-			av_free(avio_ctx);
+			av_freep(&avio_ctx->buffer);
+			avio_context_free(&avio_ctx);
 		}
 		if (fmt_ctx) {
 			avformat_free_context(fmt_ctx);
@@ -573,82 +2367,116 @@ class Muxer {
 		}
 	}
 
+	void destroy() {
+		if (closer.joinable()) {
+			closer.join();
+		}
+		free_output(fmt_ctx, avio_ctx);
+	}
+
   public:
 	Muxer(const std::string &path, AVCodecID audioCodecId = AV_CODEC_ID_NONE,
-	      AVCodecID videoCodecId = AV_CODEC_ID_NONE)
+	      AVCodecID videoCodecId = AV_CODEC_ID_NONE,
+	      const MuxerOptions &options = {})
 
-	    : audioEncoder(audioCodecId), videoEncoder(videoCodecId) {
+	    : options(options), path(path),
+	      audioEncoder(options.copyAudio ? AV_CODEC_ID_NONE : audioCodecId),
+	      videoEncoder(options.copyVideo ? AV_CODEC_ID_NONE : videoCodecId),
+	      hasAudio(audioCodecId != AV_CODEC_ID_NONE),
+	      hasVideo(videoCodecId != AV_CODEC_ID_NONE) {
 
 		std::lock_guard lock(mutex);
+		// Recordings are kept, spend more on their conversion than previews
+		videoEncoder.setScaleQuality(ScaleQuality::Bicubic);
+		open_output();
+	}
 
-		if (avformat_alloc_output_context2(&fmt_ctx, NULL, NULL, path.c_str()) <
-		    0) {
-			throw std::runtime_error("Could not allocate output context");
-		}
-
-		int ret = avio_open(&fmt_ctx->pb, path.c_str(), AVIO_FLAG_WRITE);
-		if (ret < 0) {
-			char errbuf[256];
-			av_strerror(ret, errbuf, sizeof(errbuf));
-			printf("avio_open failed: %s\n", errbuf);
-			throw std::runtime_error("Could not open output file");
-		}
+	void onSegment(SegmentCallback callback) {
+		std::lock_guard lock(mutex);
+		segmentCallback = callback;
 	}
 
 	void mux_audio(std::shared_ptr<AVFrame> frame) {
 		std::lock_guard lock(mutex);
+		if (options.copyAudio) {
+			return;
+		}
 
 		auto packets = audioEncoder.encode(frame);
 
 		if (frame && !audio_opened) {
-			audio_stream = avformat_new_stream(fmt_ctx, audioEncoder.encoder);
-			if (!audio_stream) {
-				throw std::runtime_error("Could not create audio stream");
-			}
-			if (avcodec_parameters_from_context(audio_stream->codecpar,
-			                                    audioEncoder.ctx) < 0) {
-				throw std::runtime_error(
-				    "Could not copy audio codec parameters");
-			}
-			audio_opened = true;
-			try_write_header();
+			open_audio(audioEncoder.parameters());
 		}
-		if (has_wrote_header) {
-			for (auto &packet : packets) {
-				packet->stream_index = audio_stream->index;
-				if (av_interleaved_write_frame(fmt_ctx, packet.get()) < 0) {
-					throw std::runtime_error("Could not write audio frame");
-				}
-			}
+		for (auto &packet : packets) {
+			mux_packet(packet, false);
 		}
 	}
 
 	void mux_video(std::shared_ptr<AVFrame> frame) {
 		std::lock_guard lock(mutex);
+		if (options.copyVideo) {
+			return;
+		}
 
 		auto packets = videoEncoder.encode(frame);
 
 		if (frame && !video_opened) {
-			video_stream = avformat_new_stream(fmt_ctx, videoEncoder.encoder);
-			if (!video_stream) {
-				throw std::runtime_error("Could not create video stream");
-			}
-			if (avcodec_parameters_from_context(video_stream->codecpar,
-			                                    videoEncoder.ctx) < 0) {
-				throw std::runtime_error(
-				    "Could not copy video codec parameters");
+			auto par = videoEncoder.parameters();
+			if (!needs_parameter_sets(par.get())) {
+				open_video(par, nullptr);
+			} else if (!packets.empty()) {
+				open_video(par, packets.front());
 			}
-			video_opened = true;
-			try_write_header();
 		}
-		if (has_wrote_header) {
-			for (auto &packet : packets) {
-				packet->stream_index = video_stream->index;
-				if (av_interleaved_write_frame(fmt_ctx, packet.get()) < 0) {
-					throw std::runtime_error("Could not write video frame");
-				}
+		for (auto &packet : packets) {
+			mux_packet(packet, true);
+		}
+	}
+
+	// Mux a packet encoded elsewhere, e.g. by a sender track. The packet is
+	// referenced, not modified.
+	void mux_audio_packet(std::shared_ptr<AVPacket> packet,
+	                      std::shared_ptr<AVCodecParameters> par) {
+		std::lock_guard lock(mutex);
+		if (!options.copyAudio || !packet || !par) {
+			return;
+		}
+		if (!audio_opened) {
+			open_audio(par);
+		}
+		// Dropped until the video opens the file too
+		mux_packet(copy_packet(packet), false);
+	}
+
+	// Returns false while waiting for a keyframe, the first one or the one
+	// of changed parameters. Packets before it are dropped and the caller
+	// should ask the source for a keyframe.
+	bool mux_video_packet(std::shared_ptr<AVPacket> packet,
+	                      std::shared_ptr<AVCodecParameters> par) {
+		std::lock_guard lock(mutex);
+		if (!options.copyVideo || !packet || !par) {
+			return true;
+		}
+		bool key = packet->flags & AV_PKT_FLAG_KEY;
+		if (!video_opened) {
+			if (!key) {
+				return false;
+			}
+			copied_video_par = par;
+			open_video(par, packet);
+		} else if (!same_parameters(par.get(), copied_video_par.get())) {
+			// E.g. a sender encoder stepping its size down. The header no
+			// longer describes the stream, which goes on in a new file
+			// from its keyframe.
+			if (!key) {
+				return false;
 			}
+			copied_video_par = par;
+			video_par = video_parameters(par, packet);
+			rotate();
 		}
+		mux_packet(copy_packet(packet), true);
+		return true;
 	}
 
 	void stop() {
@@ -657,16 +2485,38 @@ class Muxer {
 		if (!has_wrote_header) {
 			return;
 		}
-		if (audio_opened) {
+		if (audio_opened && !options.copyAudio) {
 			mux_audio(nullptr);
 		}
-		if (video_opened) {
+		if (video_opened && !options.copyVideo) {
 			mux_video(nullptr);
 		}
 
-		av_write_trailer(fmt_ctx);
-		avio_closep(&fmt_ctx->pb);
+		close_output(true);
+		if (std::exchange(writeFailed, false)) {
+			throw std::runtime_error("Could not write output file");
+		}
 	}
 
-	~Muxer() { destroy(); }
+	AsyncWriterStats writerStats() {
+		std::lock_guard lock(mutex);
+		return writer->stats();
+	}
+
+	~Muxer() {
+		// Without stop() what was muxed still reaches the file, up to the
+		// last fragment of a fragmented MP4
+		if (avio_ctx) {
+			avio_flush(avio_ctx);
+		}
+		if (writer) {
+			try {
+				writer->close();
+			} catch (const std::exception &e) {
+				LOGE("Could not finish %s: %s\n", segmentPath.c_str(),
+				     e.what());
+			}
+		}
+		destroy();
+	}
 };
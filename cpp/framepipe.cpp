@@ -1,14 +1,48 @@
 #include "framepipe.h"
+#include <algorithm>
+#include <map>
 #include <unordered_map>
 
 static std::recursive_mutex mutex;
 static int nextSubscriptionId = 1;
+static int nextSourceId = 1;
+static int nextListenerId = 1;
+static int nextStatsSourceId = 1;
 struct Subscription {
 	std::vector<std::string> pipeIds;
 	FrameCallback onFrame;
 	CleanupCallback onCleanup;
 };
+struct PacketSubscription {
+	std::vector<std::string> pipeIds;
+	PacketCallback onPacket;
+	CleanupCallback onCleanup;
+};
+struct PacketSource {
+	std::string pipeId;
+	AVCodecID codecId;
+	KeyframeCallback onKeyframeRequest;
+};
+struct PlayoutListener {
+	std::string pipeId;
+	PlayoutCallback onPlayout;
+	DelayCallback delay;
+};
 std::unordered_map<int, Subscription> subscriptions;
+std::unordered_map<int, PacketSubscription> packetSubscriptions;
+// Ordered so that the first source added for a pipe comes first
+std::map<int, PacketSource> packetSources;
+std::map<int, PlayoutListener> playoutListeners;
+struct StatsSource {
+	std::string pipeId;
+	StatsCallback getStats;
+};
+struct Forward {
+	std::string fromPipeId;
+	std::string toPipeId;
+};
+std::unordered_map<int, Forward> forwards;
+std::map<int, StatsSource> statsSources;
 
 int subscribe(const std::vector<std::string> &pipeIds, FrameCallback onFrame,
               CleanupCallback onCleanup) {
@@ -18,18 +52,30 @@ int subscribe(const std::vector<std::string> &pipeIds, FrameCallback onFrame,
 	return subscriptionId;
 }
 
+int subscribePacket(const std::vector<std::string> &pipeIds,
+                    PacketCallback onPacket, CleanupCallback onCleanup) {
+	std::lock_guard lock(mutex);
+	int subscriptionId = nextSubscriptionId++;
+	packetSubscriptions[subscriptionId] =
+	    PacketSubscription{pipeIds, onPacket, onCleanup};
+	return subscriptionId;
+}
+
 void unsubscribe(int subscriptionId) {
 	std::lock_guard lock(mutex);
-	// Make a copy to avoid iterator invalidation
-	auto subscriptionsCopy = subscriptions;
-	subscriptions.erase(subscriptionId);
+	CleanupCallback onCleanup;
+	if (auto it = subscriptions.find(subscriptionId);
+	    it != subscriptions.end()) {
+		onCleanup = it->second.onCleanup;
+		subscriptions.erase(it);
+	} else if (auto it = packetSubscriptions.find(subscriptionId);
+	           it != packetSubscriptions.end()) {
+		onCleanup = it->second.onCleanup;
+		packetSubscriptions.erase(it);
+	}
 
-	for (auto &subscription : subscriptionsCopy) {
-		if (subscription.first == subscriptionId) {
-			if (subscription.second.onCleanup) {
-				subscription.second.onCleanup(subscriptionId);
-			}
-		}
+	if (onCleanup) {
+		onCleanup(subscriptionId);
 	}
 }
 
@@ -52,3 +98,205 @@ void publish(const std::string &pipeId, std::shared_ptr<AVFrame> frame) {
 		}
 	}
 }
+
+bool hasSubscribers(const std::string &pipeId) {
+	std::lock_guard lock(mutex);
+	for (auto &subscription : subscriptions) {
+		for (const auto &pipeIdInSubscription : subscription.second.pipeIds) {
+			if (pipeId == pipeIdInSubscription) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+int forwardPipe(const std::string &fromPipeId, const std::string &toPipeId) {
+	std::lock_guard lock(mutex);
+	int subscriptionId = subscribe(
+	    {fromPipeId},
+	    [toPipeId](std::string, int, std::shared_ptr<AVFrame> frame) {
+		    publish(toPipeId, frame);
+	    },
+	    [](int subscriptionId) { forwards.erase(subscriptionId); });
+	forwards[subscriptionId] = Forward{fromPipeId, toPipeId};
+	return subscriptionId;
+}
+
+int addPacketSource(const std::string &pipeId, AVCodecID codecId,
+                    KeyframeCallback onKeyframeRequest) {
+	std::lock_guard lock(mutex);
+	int sourceId = nextSourceId++;
+	packetSources[sourceId] = PacketSource{pipeId, codecId, onKeyframeRequest};
+	return sourceId;
+}
+
+void removePacketSource(int sourceId) {
+	std::lock_guard lock(mutex);
+	packetSources.erase(sourceId);
+}
+
+static std::map<int, PacketSource>::iterator
+findPacketSource(const std::string &pipeId) {
+	for (auto it = packetSources.begin(); it != packetSources.end(); ++it) {
+		if (it->second.pipeId == pipeId) {
+			return it;
+		}
+	}
+	return packetSources.end();
+}
+
+AVCodecID packetSourceCodec(const std::string &pipeId) {
+	std::lock_guard lock(mutex);
+	auto it = findPacketSource(pipeId);
+	if (it == packetSources.end()) {
+		return AV_CODEC_ID_NONE;
+	}
+	return it->second.codecId;
+}
+
+void requestKeyframe(const std::string &pipeId) {
+	KeyframeCallback onKeyframeRequest;
+	{
+		std::lock_guard lock(mutex);
+		auto it = findPacketSource(pipeId);
+		if (it == packetSources.end()) {
+			return;
+		}
+		onKeyframeRequest = it->second.onKeyframeRequest;
+	}
+	if (onKeyframeRequest) {
+		onKeyframeRequest();
+	}
+}
+
+void publishPacket(int sourceId, std::shared_ptr<AVPacket> packet,
+                   std::shared_ptr<AVCodecParameters> par) {
+	std::string pipeId;
+	std::unordered_map<int, PacketSubscription> subscriptionsCopy;
+	{
+		std::lock_guard lock(mutex);
+		if (packetSubscriptions.empty()) {
+			return;
+		}
+		auto source = packetSources.find(sourceId);
+		if (source == packetSources.end()) {
+			return;
+		}
+		pipeId = source->second.pipeId;
+		if (findPacketSource(pipeId) != source) {
+			return;
+		}
+		subscriptionsCopy = packetSubscriptions;
+	}
+
+	for (auto &subscription : subscriptionsCopy) {
+		for (const auto &pipeIdInSubscription : subscription.second.pipeIds) {
+			if (pipeId == pipeIdInSubscription) {
+				int subscriptionId = subscription.first;
+				if (subscription.second.onPacket) {
+					subscription.second.onPacket(pipeId, subscriptionId,
+					                             packet, par);
+				}
+			}
+		}
+	}
+}
+
+int addPlayoutListener(const std::string &pipeId, PlayoutCallback onPlayout,
+                       DelayCallback delay) {
+	std::lock_guard lock(mutex);
+	int listenerId = nextListenerId++;
+	playoutListeners[listenerId] = PlayoutListener{pipeId, onPlayout, delay};
+	return listenerId;
+}
+
+void removePlayoutListener(int listenerId) {
+	std::lock_guard lock(mutex);
+	playoutListeners.erase(listenerId);
+}
+
+// The listener of the pipe, or of a pipe forwarded to it.
+static PlayoutListener findPlayoutListener(std::string pipeId) {
+	// A hop for each forward at most, should they loop
+	for (size_t hops = 0; hops <= forwards.size(); ++hops) {
+		for (auto &[listenerId, listener] : playoutListeners) {
+			if (listener.pipeId == pipeId) {
+				return listener;
+			}
+		}
+		auto it = std::find_if(forwards.begin(), forwards.end(),
+		                       [&](const auto &forward) {
+			                       return forward.second.toPipeId == pipeId;
+		                       });
+		if (it == forwards.end()) {
+			break;
+		}
+		pipeId = it->second.fromPipeId;
+	}
+	return {};
+}
+
+void playOut(const std::string &pipeId, PlayoutBuffer &buffer,
+             std::shared_ptr<AVFrame> frame) {
+	PlayoutListener listener;
+	{
+		std::lock_guard lock(mutex);
+		listener = findPlayoutListener(pipeId);
+	}
+	int64_t extra = listener.delay ? listener.delay() : 0;
+	buffer.setExtraDelay(extra);
+	int64_t delay = buffer.write(frame);
+	if (delay < 0 || !listener.onPlayout || !frame ||
+	    frame->pts == AV_NOPTS_VALUE) {
+		return;
+	}
+	// As it would have played without the delay asked for
+	int64_t now = micros(std::chrono::steady_clock::now());
+	listener.onPlayout(frame->pts, now + delay - extra);
+}
+
+int addStatsSource(const std::string &pipeId, StatsCallback getStats) {
+	std::lock_guard lock(mutex);
+	int sourceId = nextStatsSourceId++;
+	statsSources[sourceId] = StatsSource{pipeId, getStats};
+	return sourceId;
+}
+
+void removeStatsSource(int sourceId) {
+	std::lock_guard lock(mutex);
+	statsSources.erase(sourceId);
+}
+
+PipeStats getStats(const std::string &pipeId) {
+	std::vector<StatsCallback> callbacks;
+	{
+		std::lock_guard lock(mutex);
+		for (auto &[sourceId, source] : statsSources) {
+			if (source.pipeId == pipeId) {
+				callbacks.push_back(source.getStats);
+			}
+		}
+	}
+	// Outside the lock, the sources take their own
+	PipeStats stats;
+	for (auto &callback : callbacks) {
+		stats.merge(callback());
+	}
+	return stats;
+}
+
+PipeStats playoutStats(PlayoutBuffer &buffer) {
+	auto played = buffer.stats();
+	return PipeStats{
+	    {"playout.reads", (double)played.reads},
+	    {"playout.underruns", (double)played.underruns},
+	    {"playout.discarded", (double)played.discarded},
+	    {"playout.resets", (double)played.resets},
+	    {"playout.latency", played.latency},
+	    {"playout.targetDelay", played.targetDelay},
+	    {"playout.extraDelay", played.extraDelay},
+	    {"playout.jitter", played.jitter},
+	    {"playout.drift", played.drift},
+	};
+}
@@ -1,12 +1,64 @@
 #pragma once
 #include "ffmpeg.h"
 #include <functional>
+#include <map>
 
 using FrameCallback = std::function<void(std::string pipeId, int subscriptionId,
                                          std::shared_ptr<AVFrame> frame)>;
+using PacketCallback = std::function<void(
+    std::string pipeId, int subscriptionId, std::shared_ptr<AVPacket> packet,
+    std::shared_ptr<AVCodecParameters> par)>;
 using CleanupCallback = std::function<void(int subscriptionId)>;
+using KeyframeCallback = std::function<void()>;
+// pts of a frame started playing out at time, in microseconds on the
+// steady clock.
+using PlayoutCallback = std::function<void(int64_t pts, int64_t time)>;
+using DelayCallback = std::function<int64_t()>;
+// Figures by name, e.g. "jitterBuffer.frames".
+using PipeStats = std::map<std::string, double>;
+using StatsCallback = std::function<PipeStats()>;
 
 int subscribe(const std::vector<std::string> &pipeIds, FrameCallback onFrame,
               CleanupCallback onCleanup = {});
+int subscribePacket(const std::vector<std::string> &pipeIds,
+                    PacketCallback onPacket, CleanupCallback onCleanup = {});
 void unsubscribe(int subscriptionId);
 void publish(const std::string &pipeId, std::shared_ptr<AVFrame> frame);
+// Whether anything is subscribed to the frames of the pipe.
+bool hasSubscribers(const std::string &pipeId);
+// Publishes the frames of a pipe on another as well, e.g. those of a track
+// on the pipe its sinks subscribe to. Returns the subscription to
+// unsubscribe.
+int forwardPipe(const std::string &fromPipeId, const std::string &toPipeId);
+
+// Encoded packets of a pipe, e.g. from a sender encoder. Only the first
+// source added for a pipe is forwarded to packet subscribers.
+int addPacketSource(const std::string &pipeId, AVCodecID codecId,
+                    KeyframeCallback onKeyframeRequest);
+void removePacketSource(int sourceId);
+// Codec of the packets forwarded for a pipe, AV_CODEC_ID_NONE if none.
+AVCodecID packetSourceCodec(const std::string &pipeId);
+void requestKeyframe(const std::string &pipeId);
+void publishPacket(int sourceId, std::shared_ptr<AVPacket> packet,
+                   std::shared_ptr<AVCodecParameters> par);
+
+// Lets the publisher of a pipe, e.g. a receiver lining its audio up with
+// its video, learn when the frames play out and hold them back by the
+// microseconds delay returns. Only the first listener of a pipe is used,
+// it also hears of the frames forwarded from it.
+int addPlayoutListener(const std::string &pipeId, PlayoutCallback onPlayout,
+                       DelayCallback delay);
+void removePlayoutListener(int listenerId);
+// Writes a frame of the pipe into a sink's playout buffer with the delay
+// the listener asks for, and tells it when the frame plays.
+void playOut(const std::string &pipeId, PlayoutBuffer &buffer,
+             std::shared_ptr<AVFrame> frame);
+
+// What handles the frames of a pipe, e.g. the jitter buffer of a receiver,
+// reports its figures with the pipe's.
+int addStatsSource(const std::string &pipeId, StatsCallback getStats);
+void removeStatsSource(int sourceId);
+// Of every source of the pipe, read now.
+PipeStats getStats(const std::string &pipeId);
+// The figures of a sink's playout buffer, for its stats source.
+PipeStats playoutStats(PlayoutBuffer &buffer);
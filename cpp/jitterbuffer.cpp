@@ -0,0 +1,303 @@
+#include "jitterbuffer.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+namespace {
+
+const int64_t clockRate = 90000;
+// A frame this much slower than the fastest comes from a restarted clock
+const int64_t resetTransit = 3000000;
+const uint8_t startCode[] = {0, 0, 0, 1};
+
+void appendNal(std::vector<uint8_t> &out, const uint8_t *nal, size_t size) {
+	out.insert(out.end(), startCode, startCode + sizeof(startCode));
+	out.insert(out.end(), nal, nal + size);
+}
+
+// STAP-A and AP payloads, NAL units each preceded by a 16 bit size.
+void appendAggregated(std::vector<uint8_t> &out,
+                      const std::vector<uint8_t> &payload, size_t offset) {
+	while (offset + 2 <= payload.size()) {
+		size_t size = payload[offset] << 8 | payload[offset + 1];
+		offset += 2;
+		if (offset + size > payload.size()) {
+			return;
+		}
+		appendNal(out, payload.data() + offset, size);
+		offset += size;
+	}
+}
+
+// RFC 6184, single NAL unit, STAP-A and FU-A packets.
+void depacketizeH264(std::vector<uint8_t> &out,
+                     const std::vector<uint8_t> &payload) {
+	int type = payload[0] & 0x1f;
+	if (type >= 1 && type <= 23) {
+		appendNal(out, payload.data(), payload.size());
+	} else if (type == 24) {
+		appendAggregated(out, payload, 1);
+	} else if (type == 28 && payload.size() > 2) {
+		if (payload[1] & 0x80) {
+			out.insert(out.end(), startCode, startCode + sizeof(startCode));
+			out.push_back((payload[0] & 0xe0) | (payload[1] & 0x1f));
+		}
+		out.insert(out.end(), payload.begin() + 2, payload.end());
+	}
+}
+
+// RFC 7798, single NAL unit, AP and FU packets without DONL.
+void depacketizeH265(std::vector<uint8_t> &out,
+                     const std::vector<uint8_t> &payload) {
+	if (payload.size() < 2) {
+		return;
+	}
+	int type = (payload[0] >> 1) & 0x3f;
+	if (type < 48) {
+		appendNal(out, payload.data(), payload.size());
+	} else if (type == 48) {
+		appendAggregated(out, payload, 2);
+	} else if (type == 49 && payload.size() > 3) {
+		if (payload[2] & 0x80) {
+			out.insert(out.end(), startCode, startCode + sizeof(startCode));
+			out.push_back((payload[0] & 0x81) | (payload[2] & 0x3f) << 1);
+			out.push_back(payload[1]);
+		}
+		out.insert(out.end(), payload.begin() + 3, payload.end());
+	}
+}
+
+} // namespace
+
+JitterBuffer::JitterBuffer(RtpVideoCodec codec, int minDelay, int maxDelay,
+                           int maxWait, size_t maxPackets)
+    : codec(codec), minDelay(minDelay * 1000LL), maxDelay(maxDelay * 1000LL),
+      maxWait(maxWait * 1000LL), maxPackets(maxPackets),
+      target(minDelay * 1000.0) {}
+
+int64_t JitterBuffer::toMicros(int64_t timestamp) const {
+	return timestamp * 1000000 / clockRate;
+}
+
+int64_t JitterBuffer::playoutTime(const Frame &frame,
+                                  int64_t timestamp) const {
+	if (!haveBase) {
+		return frame.arrival + (int64_t)target + extraDelay;
+	}
+	return toMicros(timestamp) + base + (int64_t)target + extraDelay;
+}
+
+// Fragments other than the first cannot begin a frame.
+bool JitterBuffer::isFrameStart(const Packet &packet) const {
+	auto &p = packet.payload;
+	if (codec == RtpVideoCodec::H264) {
+		return (p[0] & 0x1f) != 28 || (p.size() > 1 && (p[1] & 0x80));
+	}
+	return ((p[0] >> 1) & 0x3f) != 49 || (p.size() > 2 && (p[2] & 0x80));
+}
+
+void JitterBuffer::insert(const uint8_t *data, size_t size, int64_t now) {
+	if (size < 12 || (data[0] >> 6) != 2) {
+		stat.invalid++;
+		return;
+	}
+	size_t offset = 12 + 4 * (data[0] & 0x0f);
+	if ((data[0] & 0x10) && offset + 4 <= size) {
+		offset += 4 + 4 * (data[offset + 2] << 8 | data[offset + 3]);
+	}
+	size_t end = size;
+	if ((data[0] & 0x20) && size > 12) {
+		end = data[size - 1] <= size ? size - data[size - 1] : 0;
+	}
+	if (offset > end) {
+		stat.invalid++;
+		return;
+	}
+	bool marker = data[1] & 0x80;
+	uint16_t seq = data[2] << 8 | data[3];
+	uint32_t timestamp = (uint32_t)data[4] << 24 | data[5] << 16 |
+	                     data[6] << 8 | data[7];
+
+	if (!started) {
+		started = true;
+		lastSeq = seq;
+		lastTimestamp = timestamp;
+	}
+	int64_t s = lastSeq + (int16_t)(seq - (uint16_t)lastSeq);
+	int64_t t = lastTimestamp + (int32_t)(timestamp - (uint32_t)lastTimestamp);
+	lastSeq = std::max(lastSeq, s);
+	lastTimestamp = std::max(lastTimestamp, t);
+
+	if (released && s < nextSeq) {
+		stat.late++;
+		return;
+	}
+	if (packets.count(s) || padding.count(s)) {
+		stat.duplicates++;
+		return;
+	}
+	if (offset == end) {
+		// Padding only, it still takes a sequence number
+		padding.insert(s);
+		return;
+	}
+
+	auto it = frames.find(t);
+	if (it == frames.end()) {
+		Frame frame;
+		frame.first = s;
+		frame.last = s;
+		frame.arrival = now;
+		it = frames.emplace(t, frame).first;
+	}
+	Frame &frame = it->second;
+	frame.first = std::min(frame.first, s);
+	frame.last = std::max(frame.last, s);
+	frame.count++;
+	frame.marker |= marker;
+	packets.emplace(s, Packet{t, std::vector<uint8_t>(data + offset,
+	                                                  data + end)});
+	stat.packets++;
+
+	if (frame.completed < 0 && frame.marker &&
+	    frame.count == frame.last - frame.first + 1) {
+		complete(frame, t, now);
+	}
+
+	while (packets.size() > maxPackets) {
+		int64_t head = packets.begin()->second.timestamp;
+		drop(head, frames.at(head));
+	}
+}
+
+// Updates the schedule with the time the frame took to arrive whole.
+void JitterBuffer::complete(Frame &frame, int64_t timestamp, int64_t now) {
+	frame.completed = now;
+	if (now > playoutTime(frame, timestamp)) {
+		stat.lateFrames++;
+	}
+	int64_t transit = now - toMicros(timestamp);
+	if (!haveBase || transit - base > resetTransit) {
+		if (haveBase) {
+			stat.resets++;
+		}
+		haveBase = true;
+		base = transit;
+		lastTransit = transit;
+	}
+	jitter += (std::abs(transit - lastTransit) - jitter) / 16;
+	lastTransit = transit;
+	// The fastest frames set the base, which creeps up to follow a
+	// slower path or a faster sender clock
+	base = transit < base ? transit : base + (transit - base) / 256;
+
+	// Raised at once to cover a late frame, lowered slowly
+	double desired = std::max(4 * jitter, (double)(transit - base));
+	if (desired > target) {
+		target = desired;
+	} else {
+		target += (desired - target) / 64;
+	}
+	target = std::clamp(target, (double)minDelay, (double)maxDelay);
+}
+
+// Whether nothing can be missing from the start of the head frame.
+bool JitterBuffer::hasStart(const Frame &frame) const {
+	if (!released) {
+		return isFrameStart(packets.at(frame.first));
+	}
+	int64_t s = frame.first - 1;
+	while (padding.count(s)) {
+		s--;
+	}
+	return s < nextSeq && clean;
+}
+
+JitterBufferFrame JitterBuffer::assemble(int64_t timestamp,
+                                         const Frame &frame) {
+	JitterBufferFrame out;
+	out.pts = timestamp;
+	out.afterLoss = loss;
+	for (auto it = packets.find(frame.first);
+	     it != packets.end() && it->first <= frame.last; ++it) {
+		if (codec == RtpVideoCodec::H264) {
+			depacketizeH264(out.data, it->second.payload);
+		} else {
+			depacketizeH265(out.data, it->second.payload);
+		}
+	}
+	return out;
+}
+
+void JitterBuffer::remove(int64_t timestamp, const Frame &frame) {
+	nextSeq = frame.last + 1;
+	released = true;
+	clean = frame.marker;
+	for (auto it = packets.begin();
+	     it != packets.end() && it->first <= frame.last;) {
+		it = it->second.timestamp == timestamp ? packets.erase(it)
+		                                       : std::next(it);
+	}
+	padding.erase(padding.begin(), padding.lower_bound(nextSeq));
+	frames.erase(timestamp);
+}
+
+void JitterBuffer::drop(int64_t timestamp, const Frame &frame) {
+	stat.dropped++;
+	loss = true;
+	remove(timestamp, frame);
+}
+
+std::vector<JitterBufferFrame> JitterBuffer::pop(int64_t now) {
+	std::vector<JitterBufferFrame> out;
+	while (!packets.empty()) {
+		int64_t timestamp = packets.begin()->second.timestamp;
+		const Frame &frame = frames.at(timestamp);
+		int64_t due = playoutTime(frame, timestamp);
+		bool whole = frame.completed >= 0;
+		if (!(whole && hasStart(frame) && now >= due)) {
+			if (now < due + maxWait) {
+				break;
+			}
+			// Held as long as allowed, a frame lacking only what came
+			// before it still decodes
+			if (!whole || !isFrameStart(packets.at(frame.first))) {
+				drop(timestamp, frame);
+				continue;
+			}
+			loss = true;
+		}
+
+		out.push_back(assemble(timestamp, frame));
+		loss = false;
+		double delay = (now - frame.completed) / 1000.0;
+		stat.frames++;
+		stat.lastDelay = delay;
+		stat.avgDelay += (delay - stat.avgDelay) / (double)stat.frames;
+		remove(timestamp, frame);
+	}
+	return out;
+}
+
+int64_t JitterBuffer::nextRelease() const {
+	if (packets.empty()) {
+		return INT64_MAX;
+	}
+	int64_t timestamp = packets.begin()->second.timestamp;
+	const Frame &frame = frames.at(timestamp);
+	int64_t due = playoutTime(frame, timestamp);
+	if (frame.completed >= 0 && hasStart(frame)) {
+		return due;
+	}
+	return due + maxWait;
+}
+
+void JitterBuffer::setExtraDelay(int64_t delay) { extraDelay = delay; }
+
+JitterBufferStats JitterBuffer::stats() const {
+	JitterBufferStats s = stat;
+	s.buffered = packets.size();
+	s.jitter = jitter / 1000;
+	s.targetDelay = target / 1000;
+	return s;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+enum class RtpVideoCodec { H264, H265 };
+
+struct JitterBufferFrame {
+	std::vector<uint8_t> data; // Annex B access unit
+	int64_t pts;               // unwrapped RTP timestamp
+	bool afterLoss;            // frames before it were lost or dropped
+};
+
+struct JitterBufferStats {
+	uint64_t packets = 0;    // buffered
+	uint64_t duplicates = 0; // dropped, already buffered
+	uint64_t late = 0;       // dropped, their frame was already played out
+	uint64_t invalid = 0;    // dropped, not an RTP packet
+	uint64_t frames = 0;     // released
+	uint64_t lateFrames = 0; // completed after their playout time
+	uint64_t dropped = 0;    // incomplete frames given up on
+	uint64_t resets = 0;     // timestamp jumps restarting the schedule
+	size_t buffered = 0;     // packets waiting
+	double jitter = 0;       // ms, frame completion jitter
+	double targetDelay = 0;  // ms, playout delay over the fastest frames
+	double lastDelay = 0;    // ms, time the last frame spent complete
+	double avgDelay = 0;     // ms
+};
+
+// Reassembles the frames of an H.264 or H.265 RTP stream and releases
+// them in sequence order on a playout schedule. Each frame plays out a
+// target delay after the fastest frames would have arrived, the delay
+// following the measured jitter. Incomplete frames are held until
+// maxWait past their playout time, then given up on. Times are in
+// microseconds on any monotonic clock.
+class JitterBuffer {
+  private:
+	struct Packet {
+		int64_t timestamp;
+		std::vector<uint8_t> payload;
+	};
+	struct Frame {
+		int64_t first;
+		int64_t last;
+		int count = 0;
+		bool marker = false;
+		int64_t arrival;
+		int64_t completed = -1;
+	};
+
+	RtpVideoCodec codec;
+	int64_t minDelay;
+	int64_t maxDelay;
+	int64_t maxWait;
+	size_t maxPackets;
+	// By unwrapped sequence number and timestamp
+	std::map<int64_t, Packet> packets;
+	std::map<int64_t, Frame> frames;
+	std::set<int64_t> padding;
+	bool started = false;
+	int64_t lastSeq = 0;
+	int64_t lastTimestamp = 0;
+	// Sequence number after the last frame released or dropped
+	int64_t nextSeq = 0;
+	bool released = false;
+	// Whether that frame ended with its marker packet
+	bool clean = false;
+	bool loss = false;
+	// Lowest transit time of a frame, and the last one
+	bool haveBase = false;
+	int64_t base = 0;
+	int64_t lastTransit = 0;
+	double jitter = 0;
+	double target = 0;
+	int64_t extraDelay = 0;
+	JitterBufferStats stat;
+
+	int64_t toMicros(int64_t timestamp) const;
+	int64_t playoutTime(const Frame &frame, int64_t timestamp) const;
+	bool isFrameStart(const Packet &packet) const;
+	bool hasStart(const Frame &frame) const;
+	void complete(Frame &frame, int64_t timestamp, int64_t now);
+	JitterBufferFrame assemble(int64_t timestamp, const Frame &frame);
+	void remove(int64_t timestamp, const Frame &frame);
+	void drop(int64_t timestamp, const Frame &frame);
+
+  public:
+	// Delays are in milliseconds, maxPackets bounds what is held.
+	JitterBuffer(RtpVideoCodec codec, int minDelay = 0, int maxDelay = 500,
+	             int maxWait = 100, size_t maxPackets = 2000);
+
+	void insert(const uint8_t *data, size_t size, int64_t now);
+	// The frames due at now, in decoding order.
+	std::vector<JitterBufferFrame> pop(int64_t now);
+	// When pop() may next release a frame, INT64_MAX when nothing is held.
+	int64_t nextRelease() const;
+	// Added to the playout delay, to wait for another stream to line up
+	// with. In microseconds.
+	void setExtraDelay(int64_t delay);
+	JitterBufferStats stats() const;
+};
@@ -0,0 +1,76 @@
+#include "jitterbufferhandler.h"
+#include "ffmpeg.h"
+#include <algorithm>
+#include <climits>
+
+JitterBufferHandler::JitterBufferHandler(RtpVideoCodec codec,
+                                         FrameCallback callback,
+                                         std::function<int64_t()> extraDelay)
+    : buffer(codec), callback(std::move(callback)),
+      extraDelay(std::move(extraDelay)) {
+	thread = std::thread(&JitterBufferHandler::run, this);
+}
+
+JitterBufferHandler::~JitterBufferHandler() { close(); }
+
+void JitterBufferHandler::run() {
+	std::unique_lock lock(mutex);
+	while (!closed) {
+		if (extraDelay) {
+			buffer.setExtraDelay(extraDelay());
+		}
+		auto frames = buffer.pop(micros(std::chrono::steady_clock::now()));
+		if (frames.empty()) {
+			int64_t next = buffer.nextRelease();
+			if (next == INT64_MAX) {
+				cond.wait(lock);
+			} else {
+				cond.wait_until(lock, std::chrono::steady_clock::time_point(
+				                          std::chrono::microseconds(next)));
+			}
+			continue;
+		}
+		lock.unlock();
+		for (auto &frame : frames) {
+			try {
+				callback(frame);
+			} catch (const std::exception &e) {
+				LOGE("Could not decode received frame: %s\n", e.what());
+			}
+		}
+		lock.lock();
+	}
+}
+
+void JitterBufferHandler::incoming(rtc::message_vector &messages,
+                                   const rtc::message_callback &) {
+	std::lock_guard lock(mutex);
+	int64_t time = micros(std::chrono::steady_clock::now());
+	// RTCP is left to the rest of the chain
+	auto end = std::remove_if(
+	    messages.begin(), messages.end(), [&](const rtc::message_ptr &m) {
+		    if (m->type != rtc::Message::Binary) {
+			    return false;
+		    }
+		    buffer.insert((const uint8_t *)m->data(), m->size(), time);
+		    return true;
+	    });
+	messages.erase(end, messages.end());
+	cond.notify_all();
+}
+
+void JitterBufferHandler::close() {
+	{
+		std::lock_guard lock(mutex);
+		closed = true;
+		cond.notify_all();
+	}
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
+
+JitterBufferStats JitterBufferHandler::stats() {
+	std::lock_guard lock(mutex);
+	return buffer.stats();
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "jitterbuffer.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <rtc/rtc.hpp>
+#include <thread>
+
+// Takes the RTP packets of a video track off the libdatachannel thread
+// into a jitter buffer. Frames are handed on by a thread of its own as
+// they fall due.
+class JitterBufferHandler : public rtc::MediaHandler {
+  private:
+	using FrameCallback = std::function<void(const JitterBufferFrame &)>;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	JitterBuffer buffer;
+	FrameCallback callback;
+	std::function<int64_t()> extraDelay;
+	std::thread thread;
+	bool closed = false;
+
+	void run();
+
+  public:
+	// extraDelay in microseconds, asked for before each release.
+	JitterBufferHandler(RtpVideoCodec codec, FrameCallback callback,
+	                    std::function<int64_t()> extraDelay = {});
+	~JitterBufferHandler() override;
+
+	void incoming(rtc::message_vector &messages,
+	              const rtc::message_callback &send) override;
+	void close();
+	JitterBufferStats stats();
+};
@@ -4,6 +4,8 @@
 #include "guid.h"
 #include "log.h"
 #include "negotiate.h"
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <mutex>
@@ -15,6 +17,9 @@ static std::mutex mutex;
 
 std::unordered_map<std::string, std::shared_ptr<rtc::PeerConnection>>
     peerConnectionMap;
+// Shared by the tracks of the peer connection of the same id
+std::unordered_map<std::string, std::shared_ptr<PeerConnectionMedia>>
+    peerConnectionMediaMap;
 std::unordered_map<std::string, std::shared_ptr<rtc::Track>> trackMap;
 
 std::shared_ptr<rtc::PeerConnection> getPeerConnection(const std::string &id) {
@@ -25,13 +30,31 @@ std::shared_ptr<rtc::PeerConnection> getPeerConnection(const std::string &id) {
 		throw std::invalid_argument("PeerConnection ID does not exist");
 }
 
+std::shared_ptr<PeerConnectionMedia>
+getPeerConnectionMedia(const std::string &id) {
+	std::lock_guard lock(mutex);
+	if (auto it = peerConnectionMediaMap.find(id);
+	    it != peerConnectionMediaMap.end())
+		return it->second;
+	else
+		throw std::invalid_argument("PeerConnection ID does not exist");
+}
+
 std::string emplacePeerConnection(std::shared_ptr<rtc::PeerConnection> ptr) {
 	std::lock_guard lock(mutex);
 	std::string id = genUUIDV4();
 	peerConnectionMap.emplace(std::make_pair(id, ptr));
+	peerConnectionMediaMap.emplace(
+	    std::make_pair(id, std::make_shared<PeerConnectionMedia>()));
 	return id;
 }
 
+void erasePeerConnection(const std::string &id) {
+	std::lock_guard lock(mutex);
+	peerConnectionMap.erase(id);
+	peerConnectionMediaMap.erase(id);
+}
+
 std::shared_ptr<rtc::Track> getTrack(const std::string &id) {
 	std::lock_guard lock(mutex);
 	if (auto it = trackMap.find(id); it != trackMap.end())
@@ -131,7 +154,7 @@ void NativeDatachannel::closePeerConnection(jsi::Runtime &,
 	try {
 		auto peerConnection = getPeerConnection(pc);
 		peerConnection->close();
-		peerConnectionMap.erase(pc);
+		erasePeerConnection(pc);
 	} catch (const std::exception &e) {
 		jsInvoker_->invokeAsync([&]() { throw e; });
 		throw e;
@@ -142,12 +165,26 @@ std::string NativeDatachannel::createRTCRtpTransceiver(
     jsi::Runtime &, const std::string &pc, int index, const std::string &kind,
     rtc::Description::Direction direction, const std::string &sendPipeId,
     const std::string &recvPipeId, const std::vector<std::string> &msids,
-    const std::optional<std::string> &trackid) {
+    const std::optional<std::string> &trackid, const OpusOptions &opus,
+    const VideoOptions &video) {
 
 	try {
+		OpusEncoderOptions opusOptions;
+		opusOptions.bitrate = opus.bitrate;
+		opusOptions.dtx = opus.dtx;
+		opusOptions.packetLoss = opus.packetLoss;
+		opusOptions.vbr = opus.vbr;
+		opusOptions.constrainedVbr = opus.constrainedVbr;
+		opusOptions.complexity = opus.complexity;
+		opusOptions.frameDuration = opus.frameDuration;
+		VideoEncoderOptions videoOptions;
+		videoOptions.intraRefresh = video.intraRefresh;
+		videoOptions.infiniteGop = video.infiniteGop;
+		videoOptions.nackHistory = video.nackHistory;
 		auto peerConnection = getPeerConnection(pc);
-		auto track = addTransceiver(peerConnection, index, kind, direction,
-		                            sendPipeId, recvPipeId, msids, trackid);
+		auto track = addTransceiver(
+		    peerConnection, getPeerConnectionMedia(pc), index, kind, direction,
+		    sendPipeId, recvPipeId, msids, trackid, opusOptions, videoOptions);
 
 		return emplaceTrack(track);
 	} catch (const std::exception &e) {
@@ -294,11 +331,7 @@ int NativeDatachannel::forwardPipe(jsi::Runtime &,
                                    const std::string &fromPipeId,
                                    const std::string &toPipeId) {
 	try {
-		return subscribe(
-		    {fromPipeId},
-		    [toPipeId](std::string, int, std::shared_ptr<AVFrame> frame) {
-			    publish(toPipeId, frame);
-		    });
+		return ::forwardPipe(fromPipeId, toPipeId);
 	} catch (const std::exception &e) {
 		jsInvoker_->invokeAsync([&]() { throw e; });
 		throw e;
@@ -307,28 +340,90 @@ int NativeDatachannel::forwardPipe(jsi::Runtime &,
 
 int NativeDatachannel::startRecording(jsi::Runtime &, const std::string &file,
                                       const std::string &audioPipeId,
-                                      const std::string &videoPipeId) {
+                                      const std::string &videoPipeId,
+                                      const RecordingOptions &options) {
 
 	try {
-		if (std::filesystem::path(file).extension() != ".mp4") {
-			throw std::invalid_argument("Only .mp4 format is supported c++");
+		auto extension = std::filesystem::path(file).extension();
+		bool webm = extension == ".webm";
+		if (extension != ".mp4" && extension != ".mkv" && !webm) {
+			throw std::invalid_argument(
+			    "Only .mp4, .mkv and .webm formats are supported");
 		}
+		if (webm && !videoPipeId.empty()) {
+			throw std::invalid_argument("WebM recordings are audio only");
+		}
+		// Codec audio frames are encoded to when there is nothing to copy
+		AVCodecID audioCodec =
+		    extension == ".mp4" ? AV_CODEC_ID_AAC : AV_CODEC_ID_OPUS;
+		if (options.audioCodec == "opus") {
+			audioCodec = AV_CODEC_ID_OPUS;
+		} else if (options.audioCodec == "aac" && !webm) {
+			audioCodec = AV_CODEC_ID_AAC;
+		} else if (!options.audioCodec.empty()) {
+			throw std::invalid_argument("Unsupported audio codec " +
+			                            options.audioCodec);
+		}
+
+		MuxerOptions muxerOptions;
+		muxerOptions.fragmented = options.fragmented;
+		muxerOptions.fragmentDuration = options.fragmentDuration;
+		muxerOptions.maxInterleaveDelta = options.maxInterleaveDelta;
+		muxerOptions.segmentDuration = options.segmentDuration;
+		muxerOptions.segmentSize = (int64_t)options.segmentSize;
+		muxerOptions.maxSegments = options.maxSegments;
+
+		// Mux already encoded packets of a pipe, from a sender encoder or a
+		// received track, when the container can hold their codec.
+		auto copyAudio = [&](const std::string &pipeId) {
+			auto codecId = packetSourceCodec(pipeId);
+			return options.passthrough &&
+			       (codecId == AV_CODEC_ID_OPUS ||
+			        (codecId == AV_CODEC_ID_AAC && !webm));
+		};
+		auto copyVideo = [&](const std::string &pipeId) {
+			auto codecId = packetSourceCodec(pipeId);
+			return options.passthrough && (codecId == AV_CODEC_ID_H264 ||
+			                               codecId == AV_CODEC_ID_H265);
+		};
+
 		AVCodecID audioCodecId = AV_CODEC_ID_NONE;
 		AVCodecID videoCodecId = AV_CODEC_ID_NONE;
 		std::vector<std::string> pipeIds;
+		std::vector<std::string> packetPipeIds;
 		if (!audioPipeId.empty()) {
-			pipeIds.push_back(audioPipeId);
-			audioCodecId = AV_CODEC_ID_AAC;
+			audioCodecId = audioCodec;
+			muxerOptions.copyAudio = copyAudio(audioPipeId);
+			(muxerOptions.copyAudio ? packetPipeIds : pipeIds)
+			    .push_back(audioPipeId);
 		}
 		if (!videoPipeId.empty()) {
-			pipeIds.push_back(videoPipeId);
 			videoCodecId = AV_CODEC_ID_H264;
+			muxerOptions.copyVideo = copyVideo(videoPipeId);
+			(muxerOptions.copyVideo ? packetPipeIds : pipeIds)
+			    .push_back(videoPipeId);
 		}
 
-		auto muxer = std::make_shared<Muxer>(file, audioCodecId, videoCodecId);
-		auto callback = [muxer, audioPipeId,
-		                 videoPipeId](std::string pipeId, int,
-		                              std::shared_ptr<AVFrame> frame) {
+		auto muxer = std::make_shared<Muxer>(file, audioCodecId, videoCodecId,
+		                                     muxerOptions);
+		// Set once subscribed, nothing is muxed before so that every
+		// segment reports it
+		auto recording = std::make_shared<std::atomic<int>>(-1);
+		muxer->onSegment([this, recording](const std::string &path, int index,
+		                                   int64_t duration, int64_t size,
+		                                   bool last) {
+			int id = recording->load();
+			RecordingSegmentEvent event{
+			    id, path, index, (double)duration, (double)size, last,
+			};
+			emitOnRecordingSegment(event);
+		});
+		auto callback = [muxer, audioPipeId, videoPipeId,
+		                 recording](std::string pipeId, int,
+		                            std::shared_ptr<AVFrame> frame) {
+			if (recording->load() < 0) {
+				return;
+			}
 			if (pipeId == audioPipeId) {
 				muxer->mux_audio(frame);
 			}
@@ -337,9 +432,56 @@ int NativeDatachannel::startRecording(jsi::Runtime &, const std::string &file,
 			}
 		};
 
-		auto cleanup = [muxer](int) { muxer->stop(); };
+		int packetSubscription = -1;
+		if (!packetPipeIds.empty()) {
+			// Asked again every second at most until a keyframe starts the
+			// file, the first request may be lost
+			auto lastRequest = std::make_shared<std::atomic<int64_t>>(-1);
+			auto askKeyframe = [videoPipeId, lastRequest]() {
+				int64_t now =
+				    std::chrono::duration_cast<std::chrono::milliseconds>(
+				        std::chrono::steady_clock::now().time_since_epoch())
+				        .count();
+				int64_t last = lastRequest->load();
+				if (last < 0 || now - last >= 1000) {
+					lastRequest->store(now);
+					requestKeyframe(videoPipeId);
+				}
+			};
+			auto onPacket = [muxer, audioPipeId, videoPipeId, askKeyframe,
+			                 recording](
+			                    std::string pipeId, int,
+			                    std::shared_ptr<AVPacket> packet,
+			                    std::shared_ptr<AVCodecParameters> par) {
+				if (recording->load() < 0) {
+					return;
+				}
+				if (pipeId == audioPipeId) {
+					muxer->mux_audio_packet(packet, par);
+				}
+				if (pipeId == videoPipeId &&
+				    !muxer->mux_video_packet(packet, par)) {
+					askKeyframe();
+				}
+			};
+			packetSubscription = subscribePacket(packetPipeIds, onPacket);
+			if (muxerOptions.copyVideo) {
+				// Start the recording on a fresh keyframe instead of waiting
+				// for the next GOP.
+				askKeyframe();
+			}
+		}
 
-		return subscribe(pipeIds, callback, cleanup);
+		auto cleanup = [muxer, packetSubscription](int) {
+			if (packetSubscription != -1) {
+				::unsubscribe(packetSubscription);
+			}
+			muxer->stop();
+		};
+
+		int id = subscribe(pipeIds, callback, cleanup);
+		recording->store(id);
+		return id;
 	} catch (const std::exception &e) {
 		jsInvoker_->invokeAsync([&]() { throw e; });
 		throw e;
@@ -394,4 +536,18 @@ void NativeDatachannel::unsubscribe(jsi::Runtime &, int subscriptionId) {
 	}
 }
 
+jsi::Object NativeDatachannel::getStats(jsi::Runtime &rt,
+                                        const std::string &pipeId) {
+	try {
+		jsi::Object stats(rt);
+		for (auto &[name, value] : ::getStats(pipeId)) {
+			stats.setProperty(rt, name.c_str(), value);
+		}
+		return stats;
+	} catch (const std::exception &e) {
+		jsInvoker_->invokeAsync([&]() { throw e; });
+		throw e;
+	}
+}
+
 } // namespace facebook::react
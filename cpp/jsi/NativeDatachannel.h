@@ -26,7 +26,8 @@ class NativeDatachannel : public NativeDatachannelCxxSpec<NativeDatachannel> {
 	    const std::string &kind, rtc::Description::Direction direction,
 	    const std::string &sendPipeId, const std::string &recvPipeId,
 	    const std::vector<std::string> &msids,
-	    const std::optional<std::string> &trackid);
+	    const std::optional<std::string> &trackid, const OpusOptions &opus,
+	    const VideoOptions &video);
 	void stopRTCTransceiver(jsi::Runtime &rt, const std::string &tr);
 
 	std::string createOffer(jsi::Runtime &rt, const std::string &pc);
@@ -49,11 +50,13 @@ class NativeDatachannel : public NativeDatachannelCxxSpec<NativeDatachannel> {
 
 	int startRecording(jsi::Runtime &rt, const std::string &file,
 	                   const std::string &audioPipeId,
-	                   const std::string &videoPipeId);
+	                   const std::string &videoPipeId,
+	                   const RecordingOptions &options);
 	facebook::react::AsyncPromise<std::string>
 	takePhoto(jsi::Runtime &rt, const std::string &file,
 	          const std::string &pipeId);
 	void unsubscribe(jsi::Runtime &rt, int subscriptionId);
+	jsi::Object getStats(jsi::Runtime &rt, const std::string &pipeId);
 
   private:
 };
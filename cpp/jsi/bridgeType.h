@@ -33,6 +33,32 @@ template <>
 struct Bridging<LocalCandidateEvent>
     : NativeDatachannelLocalCandidateEventBridging<LocalCandidateEvent> {};
 
+using RecordingOptions =
+    NativeDatachannelRecordingOptions<bool, int, int, int, double, int, bool,
+                                      std::string>;
+template <>
+struct Bridging<RecordingOptions>
+    : NativeDatachannelRecordingOptionsBridging<RecordingOptions> {};
+
+using OpusOptions =
+    NativeDatachannelOpusOptions<int, bool, bool, int, bool, bool, int, int>;
+template <>
+struct Bridging<OpusOptions>
+    : NativeDatachannelOpusOptionsBridging<OpusOptions> {};
+
+using VideoOptions = NativeDatachannelVideoOptions<bool, bool, int>;
+template <>
+struct Bridging<VideoOptions>
+    : NativeDatachannelVideoOptionsBridging<VideoOptions> {};
+
+using RecordingSegmentEvent =
+    NativeDatachannelRecordingSegmentEvent<int, std::string, int, double,
+                                           double, bool>;
+template <>
+struct Bridging<RecordingSegmentEvent>
+    : NativeDatachannelRecordingSegmentEventBridging<RecordingSegmentEvent> {
+};
+
 template <> struct Bridging<rtc::Description::Direction> {
 	static rtc::Description::Direction fromJs(jsi::Runtime &rt,
 	                                          const jsi::String &value) {
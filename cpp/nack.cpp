@@ -0,0 +1,224 @@
+#include "nack.h"
+#include <algorithm>
+
+namespace {
+
+const double initialRtt = 100000;
+const double minRtt = 10000;
+const double maxRtt = 1000000;
+// A packet is asked for again this many round trips after the last time
+const double retryRtts = 1.5;
+
+uint32_t read32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+void write32(std::vector<uint8_t> &out, uint32_t value) {
+	out.push_back(value >> 24);
+	out.push_back(value >> 16);
+	out.push_back(value >> 8);
+	out.push_back(value);
+}
+
+} // namespace
+
+NackGenerator::NackGenerator(int maxRetries, int maxAge, size_t maxMissing)
+    : maxRetries(maxRetries), maxAge(maxAge * 1000LL), maxMissing(maxMissing),
+      rtt(initialRtt) {}
+
+void NackGenerator::insert(uint16_t seq, int64_t now) {
+	if (!started) {
+		started = true;
+		highest = seq;
+		return;
+	}
+	int64_t s = highest + (int16_t)(seq - (uint16_t)highest);
+	if (s > highest) {
+		if ((size_t)(s - highest - 1) > maxMissing) {
+			stat.lost += missing.size() + (s - highest - 1);
+			missing.clear();
+		} else {
+			for (int64_t i = highest + 1; i < s; ++i) {
+				missing[i] = Missing{now};
+				stat.missing++;
+			}
+		}
+		highest = s;
+		while (missing.size() > maxMissing) {
+			missing.erase(missing.begin());
+			stat.lost++;
+		}
+		return;
+	}
+
+	// Duplicates and packets given up on are not looked for
+	auto it = missing.find(s);
+	if (it == missing.end()) {
+		return;
+	}
+	if (it->second.retries == 0) {
+		stat.reordered++;
+	} else {
+		stat.recovered++;
+		// Only the first request tells which one was answered
+		if (it->second.retries == 1) {
+			double sample =
+			    std::clamp((double)(now - it->second.sent), minRtt, maxRtt);
+			rtt += (sample - rtt) / 8;
+		}
+	}
+	missing.erase(it);
+}
+
+std::vector<uint16_t> NackGenerator::poll(int64_t now) {
+	std::vector<uint16_t> seqs;
+	for (auto it = missing.begin(); it != missing.end();) {
+		auto &m = it->second;
+		bool due = m.sent < 0 || now - m.sent >= rtt * retryRtts;
+		if (now - m.found > maxAge || (due && m.retries >= maxRetries)) {
+			stat.lost++;
+			it = missing.erase(it);
+			continue;
+		}
+		if (due) {
+			m.sent = now;
+			m.retries++;
+			stat.requests++;
+			seqs.push_back((uint16_t)it->first);
+		}
+		++it;
+	}
+	return seqs;
+}
+
+NackStats NackGenerator::stats() const {
+	NackStats s = stat;
+	s.rtt = rtt / 1000;
+	return s;
+}
+
+RtpHistory::RtpHistory(size_t maxSize) : maxSize(maxSize) {}
+
+int64_t RtpHistory::unwrap(uint16_t seq) const {
+	return highest + (int16_t)(seq - (uint16_t)highest);
+}
+
+void RtpHistory::store(const uint8_t *data, size_t size) {
+	if (size < 12 || maxSize == 0) {
+		return;
+	}
+	uint16_t seq = data[2] << 8 | data[3];
+	if (!started) {
+		started = true;
+		highest = seq;
+	}
+	int64_t s = unwrap(seq);
+	highest = std::max(highest, s);
+	packets[s].assign(data, data + size);
+	stat.stored++;
+	while (packets.size() > maxSize) {
+		packets.erase(packets.begin());
+	}
+}
+
+const std::vector<uint8_t> *RtpHistory::get(uint16_t seq) {
+	auto it = started ? packets.find(unwrap(seq)) : packets.end();
+	if (it == packets.end()) {
+		stat.expired++;
+		return nullptr;
+	}
+	stat.resent++;
+	return &it->second;
+}
+
+RtpHistoryStats RtpHistory::stats() const { return stat; }
+
+std::vector<uint8_t> buildNack(uint32_t senderSsrc, uint32_t mediaSsrc,
+                               const std::vector<uint16_t> &seqs) {
+	// Each FCI is a packet ID and a bitmask of the 16 after it
+	std::vector<std::pair<uint16_t, uint16_t>> fcis;
+	for (uint16_t seq : seqs) {
+		if (!fcis.empty()) {
+			uint16_t diff = seq - fcis.back().first;
+			if (diff >= 1 && diff <= 16) {
+				fcis.back().second |= 1 << (diff - 1);
+				continue;
+			}
+		}
+		fcis.push_back({seq, 0});
+	}
+
+	std::vector<uint8_t> out;
+	size_t length = 2 + fcis.size();
+	out.push_back(0x80 | 1); // FMT 1, generic NACK
+	out.push_back(205);      // RTPFB
+	out.push_back(length >> 8);
+	out.push_back(length);
+	write32(out, senderSsrc);
+	write32(out, mediaSsrc);
+	for (auto &[pid, blp] : fcis) {
+		write32(out, (uint32_t)pid << 16 | blp);
+	}
+	return out;
+}
+
+std::vector<uint16_t> parseNacks(const uint8_t *data, size_t size,
+                                 uint32_t mediaSsrc) {
+	std::vector<uint16_t> seqs;
+	size_t offset = 0;
+	while (offset + 4 <= size && (data[offset] >> 6) == 2) {
+		const uint8_t *p = data + offset;
+		size_t length = ((p[2] << 8 | p[3]) + 1) * 4;
+		if (offset + length > size) {
+			break;
+		}
+		if (p[1] == 205 && (p[0] & 0x1f) == 1 && length >= 12 &&
+		    read32(p + 8) == mediaSsrc) {
+			for (size_t i = 12; i + 4 <= length; i += 4) {
+				uint16_t pid = p[i] << 8 | p[i + 1];
+				uint16_t blp = p[i + 2] << 8 | p[i + 3];
+				seqs.push_back(pid);
+				for (int bit = 0; bit < 16; ++bit) {
+					if (blp & (1 << bit)) {
+						seqs.push_back(pid + bit + 1);
+					}
+				}
+			}
+		}
+		offset += length;
+	}
+	return seqs;
+}
+
+bool unwrapRtx(std::vector<uint8_t> &packet, uint8_t payloadType,
+               uint32_t ssrc) {
+	size_t size = packet.size();
+	if (size < 12 || (packet[0] >> 6) != 2) {
+		return false;
+	}
+	size_t offset = 12 + 4 * (packet[0] & 0x0f);
+	if ((packet[0] & 0x10) && offset + 4 <= size) {
+		offset += 4 + 4 * (packet[offset + 2] << 8 | packet[offset + 3]);
+	}
+	size_t end = size;
+	if (packet[0] & 0x20) {
+		end = packet[size - 1] <= size ? size - packet[size - 1] : 0;
+	}
+	// The original sequence number leads the payload
+	if (offset + 2 > end) {
+		return false;
+	}
+
+	std::vector<uint8_t> out(packet.begin(), packet.begin() + offset);
+	out[0] &= ~0x20;
+	out[1] = (out[1] & 0x80) | (payloadType & 0x7f);
+	out[2] = packet[offset];
+	out[3] = packet[offset + 1];
+	out[8] = ssrc >> 24;
+	out[9] = ssrc >> 16;
+	out[10] = ssrc >> 8;
+	out[11] = ssrc;
+	out.insert(out.end(), packet.begin() + offset + 2, packet.begin() + end);
+	packet = std::move(out);
+	return true;
+}
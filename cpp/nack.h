@@ -0,0 +1,89 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+struct NackStats {
+	uint64_t missing = 0;   // sequence numbers found missing
+	uint64_t requests = 0;  // sequence numbers NACKed, retries included
+	uint64_t recovered = 0; // arrived after being NACKed
+	uint64_t reordered = 0; // arrived late before being NACKed
+	uint64_t lost = 0;      // given up on
+	double rtt = 0;         // ms, from the first NACK to the recovery
+};
+
+// Finds the gaps in the sequence numbers of an RTP stream and says which
+// to ask the sender for again. A missing packet is asked for at once,
+// then again each time a round trip passes without it, until maxRetries
+// or maxAge. Times are in microseconds on any monotonic clock.
+class NackGenerator {
+  private:
+	struct Missing {
+		int64_t found;
+		int64_t sent = -1;
+		int retries = 0;
+	};
+
+	int maxRetries;
+	int64_t maxAge;
+	size_t maxMissing;
+	// By unwrapped sequence number
+	std::map<int64_t, Missing> missing;
+	bool started = false;
+	int64_t highest = 0;
+	double rtt;
+	NackStats stat;
+
+  public:
+	// maxAge in milliseconds. Larger gaps than maxMissing are not asked
+	// for, a keyframe repairs them sooner.
+	NackGenerator(int maxRetries = 10, int maxAge = 1000,
+	              size_t maxMissing = 250);
+
+	void insert(uint16_t seq, int64_t now);
+	// The sequence numbers to NACK at now, oldest first.
+	std::vector<uint16_t> poll(int64_t now);
+	NackStats stats() const;
+};
+
+struct RtpHistoryStats {
+	uint64_t stored = 0;
+	uint64_t resent = 0;  // found when asked for
+	uint64_t expired = 0; // asked for after they were forgotten
+};
+
+// The last maxSize packets sent of an RTP stream, to resend when NACKed.
+class RtpHistory {
+  private:
+	size_t maxSize;
+	// By unwrapped sequence number
+	std::map<int64_t, std::vector<uint8_t>> packets;
+	bool started = false;
+	int64_t highest = 0;
+	RtpHistoryStats stat;
+
+	int64_t unwrap(uint16_t seq) const;
+
+  public:
+	RtpHistory(size_t maxSize = 512);
+
+	void store(const uint8_t *data, size_t size);
+	// The packet sent with seq, nullptr once it is no longer kept.
+	const std::vector<uint8_t> *get(uint16_t seq);
+	RtpHistoryStats stats() const;
+};
+
+// An RTCP generic NACK (RFC 4585) asking mediaSsrc for seqs again.
+std::vector<uint8_t> buildNack(uint32_t senderSsrc, uint32_t mediaSsrc,
+                               const std::vector<uint16_t> &seqs);
+
+// The sequence numbers of mediaSsrc NACKed in a compound RTCP packet.
+std::vector<uint16_t> parseNacks(const uint8_t *data, size_t size,
+                                 uint32_t mediaSsrc);
+
+// Turns an RTX retransmission (RFC 4588) back into the packet it carries,
+// with the payload type and SSRC of the original stream. False when it
+// carries none, as the padding sent to probe the bandwidth.
+bool unwrapRtx(std::vector<uint8_t> &packet, uint8_t payloadType,
+               uint32_t ssrc);
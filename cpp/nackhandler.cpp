@@ -0,0 +1,92 @@
+#include "nackhandler.h"
+#include "ffmpeg.h"
+#include <cstring>
+
+NackResponder::NackResponder(size_t historySize, rtc::SSRC ssrc,
+                             std::shared_ptr<PacedSender> pacedSender,
+                             int stream)
+    : history(historySize), ssrc(ssrc), pacedSender(std::move(pacedSender)),
+      stream(stream) {}
+
+void NackResponder::outgoing(rtc::message_vector &messages,
+                             const rtc::message_callback &) {
+	std::lock_guard lock(mutex);
+	for (auto &m : messages) {
+		if (m->type == rtc::Message::Binary) {
+			history.store((const uint8_t *)m->data(), m->size());
+		}
+	}
+}
+
+void NackResponder::incoming(rtc::message_vector &messages,
+                             const rtc::message_callback &send) {
+	std::lock_guard lock(mutex);
+	for (auto &m : messages) {
+		if (m->type != rtc::Message::Control) {
+			continue;
+		}
+		for (uint16_t seq :
+		     parseNacks((const uint8_t *)m->data(), m->size(), ssrc)) {
+			auto packet = history.get(seq);
+			if (!packet) {
+				continue;
+			}
+			auto message = rtc::make_message(packet->size());
+			memcpy(message->data(), packet->data(), packet->size());
+			pacedSender->push(stream, PacketPriority::Retransmission, message,
+			                  send);
+		}
+	}
+}
+
+RtpHistoryStats NackResponder::stats() {
+	std::lock_guard lock(mutex);
+	return history.stats();
+}
+
+NackHandler::NackHandler(rtc::SSRC localSsrc, int payloadType,
+                         int rtxPayloadType)
+    : localSsrc(localSsrc), payloadType(payloadType),
+      rtxPayloadType(rtxPayloadType) {}
+
+void NackHandler::incoming(rtc::message_vector &messages,
+                           const rtc::message_callback &send) {
+	std::lock_guard lock(mutex);
+	int64_t now = micros(std::chrono::steady_clock::now());
+	for (auto it = messages.begin(); it != messages.end();) {
+		auto &m = *it;
+		if (m->type != rtc::Message::Binary || m->size() < 12) {
+			++it;
+			continue;
+		}
+		auto data = (const uint8_t *)m->data();
+		if ((data[1] & 0x7f) == rtxPayloadType) {
+			std::vector<uint8_t> packet(data, data + m->size());
+			if (!ssrc || !unwrapRtx(packet, payloadType, *ssrc)) {
+				it = messages.erase(it);
+				continue;
+			}
+			m = rtc::make_message(packet.size());
+			memcpy(m->data(), packet.data(), packet.size());
+			data = (const uint8_t *)m->data();
+		} else {
+			ssrc = (rtc::SSRC)data[8] << 24 | data[9] << 16 | data[10] << 8 |
+			       data[11];
+		}
+		generator.insert(data[2] << 8 | data[3], now);
+		++it;
+	}
+
+	auto seqs = generator.poll(now);
+	if (!seqs.empty() && ssrc) {
+		auto nack = buildNack(localSsrc, *ssrc, seqs);
+		auto message = rtc::make_message(nack.size(), rtc::Message::Control);
+		memcpy(message->data(), nack.data(), nack.size());
+		send(message);
+	}
+}
+
+NackStats NackHandler::stats() {
+	std::lock_guard lock(mutex);
+	return generator.stats();
+}
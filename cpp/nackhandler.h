@@ -0,0 +1,51 @@
+#pragma once
+#include "nack.h"
+#include "pacerhandler.h"
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <rtc/rtc.hpp>
+
+// Chained between the packetizer and the pacing handler, keeps the RTP
+// packets of a track as sent to answer the NACKs of the remote with. The
+// packets asked for go through the paced sender ahead of the video.
+class NackResponder : public rtc::MediaHandler {
+  private:
+	std::mutex mutex;
+	RtpHistory history;
+	rtc::SSRC ssrc;
+	std::shared_ptr<PacedSender> pacedSender;
+	int stream;
+
+  public:
+	NackResponder(size_t historySize, rtc::SSRC ssrc,
+	              std::shared_ptr<PacedSender> pacedSender, int stream);
+
+	void outgoing(rtc::message_vector &messages,
+	              const rtc::message_callback &send) override;
+	void incoming(rtc::message_vector &messages,
+	              const rtc::message_callback &send) override;
+	RtpHistoryStats stats();
+};
+
+// Chained last on a receiving video track, so that it sees the RTP
+// packets before the rest of the chain. Restores the retransmissions sent
+// as RTX and NACKs the packets missing from the stream.
+class NackHandler : public rtc::MediaHandler {
+  private:
+	std::mutex mutex;
+	NackGenerator generator;
+	rtc::SSRC localSsrc;
+	int payloadType;
+	int rtxPayloadType;
+	// Of the media, once a packet of it arrived
+	std::optional<rtc::SSRC> ssrc;
+
+  public:
+	// rtxPayloadType -1 when RTX was not negotiated.
+	NackHandler(rtc::SSRC localSsrc, int payloadType, int rtxPayloadType);
+
+	void incoming(rtc::message_vector &messages,
+	              const rtc::message_callback &send) override;
+	NackStats stats();
+};
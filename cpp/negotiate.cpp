@@ -126,6 +126,58 @@ int getH265TierFlag(const std::vector<std::string> &fmtps) {
 	return 0;
 }
 
+int getOpusUseDtx(const std::vector<std::string> &fmtps) {
+	for (const auto &fmtp : fmtps) {
+		try {
+			return extractFmtpIntValue(fmtp, "usedtx", 10);
+		} catch (const std::exception &) {
+			continue;
+		}
+	}
+	return 0;
+}
+
+int getOpusUseInbandFec(const std::vector<std::string> &fmtps) {
+	for (const auto &fmtp : fmtps) {
+		try {
+			return extractFmtpIntValue(fmtp, "useinbandfec", 10);
+		} catch (const std::exception &) {
+			continue;
+		}
+	}
+	return 0;
+}
+
+int getOpusMaxAverageBitrate(const std::vector<std::string> &fmtps) {
+	for (const auto &fmtp : fmtps) {
+		try {
+			return extractFmtpIntValue(fmtp, "maxaveragebitrate", 10);
+		} catch (const std::exception &) {
+			continue;
+		}
+	}
+	return 0;
+}
+
+int getRtxApt(const std::vector<std::string> &fmtps) {
+	for (const auto &fmtp : fmtps) {
+		try {
+			return extractFmtpIntValue(fmtp, "apt", 10);
+		} catch (const std::exception &) {
+			continue;
+		}
+	}
+	return -1;
+}
+
+std::string getOpusFmtp(bool dtx) {
+	// RFC 7587 upper bound, the receiver decodes any bitrate
+	std::string fmtp = "minptime=10;maxaveragebitrate=510000;stereo=1;"
+	                   "sprop-stereo=1;useinbandfec=1";
+	if (dtx) fmtp += ";usedtx=1";
+	return fmtp;
+}
+
 bool isRtpMapMatchExceptPayloadType(const rtc::Description::Media::RtpMap *a,
                                     const rtc::Description::Media::RtpMap *b) {
 
@@ -188,10 +240,18 @@ void addSupportedVideo(rtc::Description::Video &media) {
 	media.addH264Codec(96, "profile-level-id=42e01f;"
 	                       "packetization-mode=1;"
 	                       "level-asymmetry-allowed=1");
+	// Retransmissions may come in RTX, the original packet wrapped
+	media.addRtxCodec(105, 104, 90000);
+	media.addRtxCodec(97, 96, 90000);
 }
 
-void addSupportedAudio(rtc::Description::Audio &media) {
-	media.addOpusCodec(111);
+void addSupportedAudio(rtc::Description::Audio &media,
+                       const std::optional<std::string> &opusFmtp) {
+	if (opusFmtp) {
+		media.addOpusCodec(111, *opusFmtp);
+	} else {
+		media.addOpusCodec(111);
+	}
 }
 
 void addSSRC(rtc::Description::Media &media,
@@ -210,7 +270,8 @@ rtc::Description::Media
 getSupportedMedia(const std::string &mid, rtc::Description::Direction dir,
                   const std::string &kind,
                   const std::vector<std::string> &msids,
-                  const std::optional<std::string> &trackid) {
+                  const std::optional<std::string> &trackid,
+                  const std::optional<std::string> &opusFmtp) {
 	if (kind == "video") {
 		rtc::Description::Video media(mid, dir);
 		addSupportedVideo(media);
@@ -218,7 +279,7 @@ getSupportedMedia(const std::string &mid, rtc::Description::Direction dir,
 		return media;
 	} else if (kind == "audio") {
 		rtc::Description::Audio media(mid, dir);
-		addSupportedAudio(media);
+		addSupportedAudio(media, opusFmtp);
 		addSSRC(media, msids, trackid);
 		return media;
 	} else {
@@ -231,13 +292,14 @@ negotiateAnswerMedia(const rtc::Description &offer, int index,
                      rtc::Description::Direction direction,
                      const std::string &kind,
                      const std::vector<std::string> &msids,
-                     const std::optional<std::string> &trackid) {
+                     const std::optional<std::string> &trackid,
+                     const std::optional<std::string> &opusFmtp) {
 	auto offerMedia = getMediaFromIndex(offer, index);
 	if (!offerMedia)
 		return std::nullopt;
 
-	auto supportedMedia =
-	    getSupportedMedia(offerMedia->mid(), direction, kind, msids, trackid);
+	auto supportedMedia = getSupportedMedia(offerMedia->mid(), direction, kind,
+	                                        msids, trackid, opusFmtp);
 
 	if (kind == "video") {
 		rtc::Description::Video result(offerMedia->mid(), direction);
@@ -264,6 +326,17 @@ negotiateAnswerMedia(const rtc::Description &offer, int index,
 				}
 			}
 		}
+		// RTX of the codecs accepted
+		for (auto offerPt : offerMedia->payloadTypes()) {
+			auto offerRtpMap = offerMedia->rtpMap(offerPt);
+			if (!offerRtpMap || offerRtpMap->format != "rtx") {
+				continue;
+			}
+			int apt = getRtxApt(offerRtpMap->fmtps);
+			if (apt >= 0 && result.hasPayloadType(apt)) {
+				result.addRtxCodec(offerPt, apt, offerRtpMap->clockRate);
+			}
+		}
 		addSSRC(result, msids, trackid);
 		return result;
 	} else if (kind == "audio") {
@@ -285,8 +358,13 @@ negotiateAnswerMedia(const rtc::Description &offer, int index,
 				}
 				if (isRtpMapMatchExceptPayloadType(offerRtpMap,
 				                                   supportRtpMap)) {
+					// Opus parameters are receiver preferences, each side
+					// states its own
+					auto fmtp = format == "opus" && opusFmtp
+					                ? *opusFmtp
+					                : getFmtpsString(offerRtpMap->fmtps);
 					result.addAudioCodec(offerRtpMap->payloadType, format,
-					                     getFmtpsString(offerRtpMap->fmtps));
+					                     fmtp);
 				}
 			}
 		}
@@ -297,6 +375,15 @@ negotiateAnswerMedia(const rtc::Description &offer, int index,
 	}
 }
 
+std::vector<std::string> getFmtps(const rtc::Description &description,
+                                  const std::string &mid, int payloadType) {
+	auto media = getMediaFromMid(description, mid);
+	if (!media || !media->hasPayloadType(payloadType)) {
+		return {};
+	}
+	return media->rtpMap(payloadType)->fmtps;
+}
+
 std::optional<rtc::Description::Media::RtpMap>
 negotiateRtpMap(const rtc::Description &remoteDesc,
                 const rtc::Description &localDesc, const std::string &mid) {
@@ -314,10 +401,27 @@ negotiateRtpMap(const rtc::Description &remoteDesc,
 	}
 
 	for (auto offerPt : offerMedia->payloadTypes()) {
-		if (answerMedia->hasPayloadType(offerPt)) {
+		if (answerMedia->hasPayloadType(offerPt) &&
+		    offerMedia->rtpMap(offerPt)->format != "rtx") {
 			return *offerMedia->rtpMap(offerPt);
 		}
 	}
 
 	return std::nullopt;
 }
+
+int getRtxPayloadType(const rtc::Description &description,
+                      const std::string &mid, int payloadType) {
+	auto media = getMediaFromMid(description, mid);
+	if (!media) {
+		return -1;
+	}
+	for (auto pt : media->payloadTypes()) {
+		auto rtpMap = media->rtpMap(pt);
+		if (rtpMap->format == "rtx" &&
+		    getRtxApt(rtpMap->fmtps) == payloadType) {
+			return pt;
+		}
+	}
+	return -1;
+}
@@ -14,6 +14,15 @@ int getH264LevelId(const std::vector<std::string> &fmtps);
 int getH265ProfileId(const std::vector<std::string> &fmtps);
 int getH265TierFlag(const std::vector<std::string> &fmtps);
 int getH265LevelId(const std::vector<std::string> &fmtps);
+int getOpusUseDtx(const std::vector<std::string> &fmtps);
+int getOpusUseInbandFec(const std::vector<std::string> &fmtps);
+// 0 when the remote sets no limit.
+int getOpusMaxAverageBitrate(const std::vector<std::string> &fmtps);
+// The payload type an RTX payload type retransmits, -1 when none.
+int getRtxApt(const std::vector<std::string> &fmtps);
+// Parameters this side prefers to receive Opus with: whatever bitrate the
+// sender spends, with FEC, and DTX when the call uses it.
+std::string getOpusFmtp(bool dtx);
 
 std::optional<rtc::Description::Media>
 getMediaFromIndex(const rtc::Description &description, int index);
@@ -28,14 +37,25 @@ rtc::Description::Media
 getSupportedMedia(const std::string &mid, rtc::Description::Direction dir,
                   const std::string &kind,
                   const std::vector<std::string> &msids,
-                  const std::optional<std::string> &trackid);
+                  const std::optional<std::string> &trackid,
+                  const std::optional<std::string> &opusFmtp = std::nullopt);
 std::optional<rtc::Description::Media>
 negotiateAnswerMedia(const rtc::Description &offer, int index,
                      rtc::Description::Direction direction,
                      const std::string &kind,
                      const std::vector<std::string> &msids,
-                     const std::optional<std::string> &trackid);
+                     const std::optional<std::string> &trackid,
+                     const std::optional<std::string> &opusFmtp = std::nullopt);
+
+// Format parameters of a payload type of the media with this mid.
+std::vector<std::string> getFmtps(const rtc::Description &description,
+                                  const std::string &mid, int payloadType);
 
 std::optional<rtc::Description::Media::RtpMap>
 negotiateRtpMap(const rtc::Description &remoteDesc,
                 const rtc::Description &localDesc, const std::string &mid);
+
+// The RTX payload type of a payload type of the media with this mid, -1
+// when none was negotiated.
+int getRtxPayloadType(const rtc::Description &description,
+                      const std::string &mid, int payloadType);
@@ -0,0 +1,102 @@
+#include "opusreceiver.h"
+#include <algorithm>
+#include <opus/opus.h>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+const int sampleRate = 48000;
+// Longest packet Opus allows, 120 ms
+const int maxPacket = sampleRate * 120 / 1000;
+// Sink frames are at most 20 ms
+const int maxFrame = sampleRate * 20 / 1000;
+// Concealment and FEC work in 2.5 ms steps
+const int step = sampleRate / 400;
+
+} // namespace
+
+OpusReceiver::OpusReceiver(int channels, int maxGap)
+    : channels(channels), maxGap(maxGap) {
+	int error = OPUS_OK;
+	decoder = opus_decoder_create(sampleRate, channels, &error);
+	if (error != OPUS_OK) {
+		throw std::runtime_error(std::string("Could not create decoder: ") +
+		                         opus_strerror(error));
+	}
+}
+
+OpusReceiver::~OpusReceiver() { opus_decoder_destroy(decoder); }
+
+void OpusReceiver::output(int nb_samples, int64_t pts, const OpusSink &sink) {
+	for (int offset = 0; offset < nb_samples; offset += maxFrame) {
+		int n = std::min(maxFrame, nb_samples - offset);
+		sink(pcm.data() + (size_t)offset * channels, n, pts + offset);
+	}
+}
+
+int64_t OpusReceiver::receive(const uint8_t *data, int size,
+                              uint32_t timestamp, const OpusSink &sink) {
+	int samples = opus_packet_get_nb_samples(data, size, sampleRate);
+	if (samples <= 0 || samples > maxPacket) {
+		stat.invalid++;
+		return -1;
+	}
+	if (!started) {
+		started = true;
+		next = timestamp;
+		nextPts = timestamp;
+	}
+
+	int32_t gap = (int32_t)(timestamp - next);
+	if (gap < 0) {
+		stat.late++;
+		return -1;
+	}
+	if (gap > maxGap) {
+		// A restarted stream, not worth making up
+		opus_decoder_ctl(decoder, OPUS_RESET_STATE);
+		nextPts += gap;
+		gap = 0;
+		stat.resets++;
+	}
+
+	if (gap > 0) {
+		int fill = gap - gap % step;
+		pcm.assign((size_t)gap * channels, 0.0f);
+		if (fill > 0) {
+			// Conceals the gap, apart from its end when this packet
+			// carries the FEC of the one before
+			int n = opus_decode_float(decoder, data, size, pcm.data(), fill, 1);
+			if (n == fill && opus_packet_has_lbrr(data, size) == 1 &&
+			    fill >= samples) {
+				stat.recovered += samples;
+				stat.concealed += fill - samples;
+			} else if (n == fill) {
+				stat.concealed += fill;
+			} else {
+				std::fill(pcm.begin(), pcm.end(), 0.0f);
+			}
+		}
+		output(gap, nextPts, sink);
+		nextPts += gap;
+	}
+
+	pcm.resize((size_t)maxPacket * channels);
+	int n = opus_decode_float(decoder, data, size, pcm.data(), maxPacket, 0);
+	if (n != samples) {
+		// Corrupt, keep the timeline going
+		n = opus_decode_float(decoder, nullptr, 0, pcm.data(), samples, 0);
+		if (n != samples) {
+			std::fill(pcm.begin(), pcm.end(), 0.0f);
+		}
+		stat.concealed += samples;
+	} else {
+		stat.packets++;
+	}
+	int64_t pts = nextPts;
+	output(samples, pts, sink);
+	next = timestamp + samples;
+	nextPts += samples;
+	return pts;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct OpusDecoder;
+
+// Interleaved float samples at 48 kHz starting at an unwrapped RTP
+// timestamp.
+using OpusSink =
+    std::function<void(const float *samples, int nb_samples, int64_t pts)>;
+
+struct OpusReceiverStats {
+	uint64_t packets = 0;   // decoded
+	uint64_t late = 0;      // dropped, their time was already played out
+	uint64_t invalid = 0;   // dropped, not an Opus packet
+	uint64_t recovered = 0; // samples rebuilt from in-band FEC
+	uint64_t concealed = 0; // samples made up by packet loss concealment
+	uint64_t resets = 0;    // gaps too long to fill
+};
+
+// Decodes the Opus packets of an RTP stream into a gapless timeline. Time
+// missing before a packet, lost or skipped by a DTX sender, is rebuilt
+// from the packet's in-band FEC when it carries some and concealed by
+// libopus otherwise. Packets behind the timeline are dropped.
+class OpusReceiver {
+  private:
+	OpusDecoder *decoder = nullptr;
+	int channels;
+	int maxGap;
+	bool started = false;
+	// Timestamp the next packet should have, wrapped and unwrapped
+	uint32_t next = 0;
+	int64_t nextPts = 0;
+	std::vector<float> pcm;
+	OpusReceiverStats stat;
+
+	void output(int nb_samples, int64_t pts, const OpusSink &sink);
+
+  public:
+	// Gaps over maxGap samples restart the timeline at the next packet
+	// instead of being filled.
+	OpusReceiver(int channels = 2, int maxGap = 48000);
+	~OpusReceiver();
+	OpusReceiver(const OpusReceiver &) = delete;
+	OpusReceiver &operator=(const OpusReceiver &) = delete;
+
+	// Returns the unwrapped timestamp of the packet, -1 when it was
+	// dropped.
+	int64_t receive(const uint8_t *data, int size, uint32_t timestamp,
+	                const OpusSink &sink);
+	OpusReceiverStats stats() const { return stat; }
+};
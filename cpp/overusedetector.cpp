@@ -0,0 +1,101 @@
+#include "overusedetector.h"
+#include <algorithm>
+
+namespace {
+
+struct Level {
+	double scale;
+	int keepEvery;
+};
+
+// Resolution goes first, a lower frame rate shows more
+const Level levels[] = {{1, 1}, {0.75, 1}, {0.5, 1}, {0.5, 2}};
+const int maxLevel = sizeof(levels) / sizeof(levels[0]) - 1;
+// Encoded frames a step takes to show in the average
+const int settleFrames = 15;
+// Encoded frames of headroom before stepping back, doubled after each
+// step back that did not last
+const int minRecoverFrames = 90;
+const int maxRecoverFrames = 900;
+
+double area(int level) { return levels[level].scale * levels[level].scale; }
+
+} // namespace
+
+OveruseDetector::OveruseDetector(double overuse, double underuse)
+    : overuse(overuse), underuse(underuse), recoverFrames(minRecoverFrames) {}
+
+void OveruseDetector::setLevel(int next) {
+	// Encode time follows the number of pixels
+	encodeTime *= area(next) / area(level);
+	level = next;
+	phase = 0;
+	framesAtLevel = 0;
+}
+
+bool OveruseDetector::offer(int64_t now) {
+	stat.frames++;
+	if (lastOffer >= 0) {
+		int64_t interval = now - lastOffer;
+		// Pauses say nothing about the frame rate
+		if (interval > 0 && interval < 1000000 && frameInterval > 0) {
+			frameInterval += (interval - frameInterval) / 8;
+		} else if (interval > 0 && interval < 1000000) {
+			frameInterval = interval;
+		}
+	}
+	lastOffer = now;
+	phase = (phase + 1) % levels[level].keepEvery;
+	if (phase != 0) {
+		stat.dropped++;
+		return false;
+	}
+	return true;
+}
+
+void OveruseDetector::encoded(int64_t duration) {
+	if (encodeTime > 0) {
+		encodeTime += (duration - encodeTime) / 8;
+	} else {
+		encodeTime = duration;
+	}
+	if (frameInterval <= 0) {
+		return;
+	}
+	framesAtLevel++;
+	if (sinceUpgrade >= 0) {
+		sinceUpgrade++;
+	}
+
+	double usage = encodeTime / (frameInterval * levels[level].keepEvery);
+	if (usage > overuse && framesAtLevel >= settleFrames &&
+	    level < maxLevel) {
+		bool relapse = sinceUpgrade >= 0 && sinceUpgrade < recoverFrames;
+		recoverFrames = relapse ? std::min(recoverFrames * 2, maxRecoverFrames)
+		                        : minRecoverFrames;
+		sinceUpgrade = -1;
+		stat.downgrades++;
+		setLevel(level + 1);
+	} else if (level > 0 && framesAtLevel >= recoverFrames) {
+		double expected = encodeTime * area(level - 1) / area(level) /
+		                  (frameInterval * levels[level - 1].keepEvery);
+		if (expected < underuse) {
+			sinceUpgrade = 0;
+			stat.upgrades++;
+			setLevel(level - 1);
+		}
+	}
+}
+
+double OveruseDetector::scale() const { return levels[level].scale; }
+
+OveruseStats OveruseDetector::stats() const {
+	OveruseStats s = stat;
+	s.level = level;
+	s.scale = levels[level].scale;
+	s.encodeTime = encodeTime / 1000;
+	if (frameInterval > 0) {
+		s.usage = encodeTime / (frameInterval * levels[level].keepEvery);
+	}
+	return s;
+}
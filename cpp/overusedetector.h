@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+
+struct OveruseStats {
+	uint64_t frames = 0;     // offered
+	uint64_t dropped = 0;    // not encoded, to save time
+	uint64_t downgrades = 0; // steps to a cheaper level
+	uint64_t upgrades = 0;   // steps back
+	int level = 0;           // 0 encodes every frame at full size
+	double scale = 1;        // of the captured width and height
+	double encodeTime = 0;   // ms per encoded frame
+	double usage = 0;        // encode time over the time between frames
+};
+
+// Watches the time a sender takes to encode its frames against the time
+// between them. When encoding cannot keep up it steps the resolution
+// down, then the frame rate, and steps back once the level above is
+// expected to fit. Times are in microseconds on any monotonic clock.
+class OveruseDetector {
+  private:
+	double overuse;
+	double underuse;
+	int level = 0;
+	int phase = 0;
+	int framesAtLevel = 0;
+	int sinceUpgrade = -1;
+	int recoverFrames;
+	int64_t lastOffer = -1;
+	double frameInterval = 0;
+	double encodeTime = 0;
+	OveruseStats stat;
+
+	void setLevel(int next);
+
+  public:
+	// Usage above overuse steps down, a level above that would stay
+	// under underuse is stepped back to.
+	OveruseDetector(double overuse = 0.85, double underuse = 0.5);
+
+	// Whether to encode the frame captured at now.
+	bool offer(int64_t now);
+	// How long the frame last offered took to encode.
+	void encoded(int64_t duration);
+	// Of the captured width and height to encode at.
+	double scale() const;
+	OveruseStats stats() const;
+};
@@ -0,0 +1,131 @@
+#include "pacer.h"
+#include <algorithm>
+#include <climits>
+
+namespace {
+
+// Budget left unused is kept for at most this long, a small burst
+const int64_t burstTime = 5000;
+
+} // namespace
+
+Pacer::Pacer(int64_t bitrate, int maxQueueTime, size_t maxPackets)
+    : bitrate(bitrate), maxQueueTime(maxQueueTime * 1000LL),
+      maxPackets(maxPackets) {}
+
+void Pacer::setBitrate(int64_t bitrate) { this->bitrate = bitrate; }
+
+// Fast enough for the oldest packet to leave within maxQueueTime.
+double Pacer::rate() const {
+	int64_t oldest = INT64_MAX;
+	for (int p = (int)PacketPriority::Retransmission;
+	     p <= (int)PacketPriority::Video; ++p) {
+		if (!queues[p].empty()) {
+			oldest = std::min(oldest, queues[p].front().enqueued);
+		}
+	}
+	if (oldest == INT64_MAX) {
+		return bitrate;
+	}
+	int64_t left = std::max(maxQueueTime - (last - oldest), (int64_t)1000);
+	return std::max((double)bitrate, queuedBytes * 8e6 / left);
+}
+
+void Pacer::refill(int64_t now) {
+	double burst = rate() * burstTime / 8e6;
+	if (last < 0) {
+		budget = burst;
+	} else if (now > last) {
+		budget = std::min(budget + rate() * (now - last) / 8e6, burst);
+	}
+	last = std::max(last, now);
+}
+
+void Pacer::send(Packet &packet, int64_t now, std::vector<PacedSend> &out) {
+	budget -= packet.size;
+	queuedBytes -= packet.size;
+	double delay = (now - packet.enqueued) / 1000.0;
+	stat.packets++;
+	stat.bytes += packet.size;
+	stat.delay += (delay - stat.delay) / (double)stat.packets;
+	stat.maxDelay = std::max(stat.maxDelay, delay);
+	out.push_back(std::move(packet.send));
+}
+
+void Pacer::push(int stream, PacketPriority priority, size_t size,
+                 int64_t now, PacedSend send) {
+	refill(now);
+	queues[(int)priority].push_back(Packet{stream, size, now, std::move(send)});
+	queuedBytes += size;
+
+	size_t count = 0;
+	for (auto &queue : queues) {
+		count += queue.size();
+	}
+	if (count > maxPackets) {
+		for (int p = (int)PacketPriority::Video; p >= 0; --p) {
+			if (!queues[p].empty()) {
+				queuedBytes -= queues[p].front().size;
+				queues[p].pop_front();
+				stat.dropped++;
+				break;
+			}
+		}
+	}
+}
+
+std::vector<PacedSend> Pacer::pop(int64_t now) {
+	refill(now);
+	std::vector<PacedSend> out;
+	// Audio is small and late audio is heard, it is only counted
+	auto &audio = queues[(int)PacketPriority::Audio];
+	for (auto &packet : audio) {
+		send(packet, now, out);
+	}
+	audio.clear();
+	for (int p = (int)PacketPriority::Retransmission;
+	     p <= (int)PacketPriority::Video; ++p) {
+		auto &queue = queues[p];
+		while (!queue.empty() && budget > 0) {
+			send(queue.front(), now, out);
+			queue.pop_front();
+		}
+	}
+	return out;
+}
+
+int64_t Pacer::nextSend() const {
+	if (!queues[(int)PacketPriority::Audio].empty()) {
+		return std::max(last, (int64_t)0);
+	}
+	if (queues[(int)PacketPriority::Video].empty() &&
+	    queues[(int)PacketPriority::Retransmission].empty()) {
+		return INT64_MAX;
+	}
+	if (budget > 0) {
+		return last;
+	}
+	return last + (int64_t)(-budget * 8e6 / rate()) + 1;
+}
+
+void Pacer::remove(int stream) {
+	for (auto &queue : queues) {
+		for (auto it = queue.begin(); it != queue.end();) {
+			if (it->stream == stream) {
+				queuedBytes -= it->size;
+				it = queue.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+}
+
+PacerStats Pacer::stats() const {
+	PacerStats s = stat;
+	for (auto &queue : queues) {
+		s.queued += queue.size();
+	}
+	s.rate = rate();
+	return s;
+}
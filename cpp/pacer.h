@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+// Sent first to last.
+enum class PacketPriority { Audio, Retransmission, Video };
+
+using PacedSend = std::function<void()>;
+
+struct PacerStats {
+	uint64_t packets = 0; // sent
+	uint64_t bytes = 0;   // sent
+	uint64_t dropped = 0; // over maxPackets, the oldest of the lowest priority
+	size_t queued = 0;    // packets waiting
+	double rate = 0;      // bits per second paced at
+	double delay = 0;     // ms, average time queued
+	double maxDelay = 0;  // ms
+};
+
+// Spreads packets out at a rate instead of letting whole frames burst into
+// the network. Audio goes out at once, the rest in priority order while
+// the budget lasts, the budget growing at the rate. The rate is raised
+// when the queue would otherwise hold a packet past maxQueueTime. Times
+// are in microseconds on any monotonic clock.
+class Pacer {
+  private:
+	struct Packet {
+		int stream;
+		size_t size;
+		int64_t enqueued;
+		PacedSend send;
+	};
+
+	int64_t bitrate;
+	int64_t maxQueueTime;
+	size_t maxPackets;
+	// By PacketPriority
+	std::deque<Packet> queues[3];
+	size_t queuedBytes = 0;
+	// Bytes that may go out now, negative after a burst of audio
+	double budget = 0;
+	int64_t last = -1;
+	PacerStats stat;
+
+	double rate() const;
+	void refill(int64_t now);
+	void send(Packet &packet, int64_t now, std::vector<PacedSend> &out);
+
+  public:
+	// maxQueueTime in milliseconds.
+	Pacer(int64_t bitrate, int maxQueueTime = 500, size_t maxPackets = 2000);
+
+	// Bits per second, the pacing factor already applied.
+	void setBitrate(int64_t bitrate);
+	void push(int stream, PacketPriority priority, size_t size, int64_t now,
+	          PacedSend send);
+	// The packets to send at now, in order.
+	std::vector<PacedSend> pop(int64_t now);
+	// When pop() may next release a packet, INT64_MAX when nothing is held.
+	int64_t nextSend() const;
+	// Forgets the packets of a stream.
+	void remove(int stream);
+	PacerStats stats() const;
+};
@@ -0,0 +1,106 @@
+#include "pacerhandler.h"
+#include "ffmpeg.h"
+#include <algorithm>
+#include <climits>
+
+PacedSender::PacedSender() : pacer(0) {
+	thread = std::thread(&PacedSender::run, this);
+}
+
+PacedSender::~PacedSender() {
+	{
+		std::lock_guard lock(mutex);
+		closed = true;
+		cond.notify_all();
+	}
+	thread.join();
+}
+
+void PacedSender::updateBitrate() {
+	int64_t total = 0;
+	for (auto &[stream, bitrate] : bitrates) {
+		total += bitrate;
+	}
+	pacer.setBitrate((int64_t)(total * pacingFactor));
+}
+
+void PacedSender::run() {
+	std::unique_lock lock(mutex);
+	while (!closed) {
+		auto sends = pacer.pop(micros(std::chrono::steady_clock::now()));
+		if (sends.empty()) {
+			int64_t next = pacer.nextSend();
+			if (next == INT64_MAX) {
+				cond.wait(lock);
+			} else {
+				cond.wait_until(lock, std::chrono::steady_clock::time_point(
+				                          std::chrono::microseconds(next)));
+			}
+			continue;
+		}
+		{
+			std::lock_guard sending(sendMutex);
+			lock.unlock();
+			for (auto &send : sends) {
+				try {
+					send();
+				} catch (const std::exception &e) {
+					LOGE("Could not send paced packet: %s\n", e.what());
+				}
+			}
+		}
+		lock.lock();
+	}
+}
+
+int PacedSender::addStream(int64_t bitrate) {
+	std::lock_guard lock(mutex);
+	int stream = nextStream++;
+	bitrates[stream] = bitrate;
+	updateBitrate();
+	return stream;
+}
+
+void PacedSender::removeStream(int stream) {
+	{
+		std::lock_guard lock(mutex);
+		bitrates.erase(stream);
+		pacer.remove(stream);
+		updateBitrate();
+	}
+	std::lock_guard sending(sendMutex);
+}
+
+void PacedSender::push(int stream, PacketPriority priority,
+                       rtc::message_ptr message, rtc::message_callback send) {
+	std::lock_guard lock(mutex);
+	pacer.push(stream, priority, message->size(),
+	           micros(std::chrono::steady_clock::now()),
+	           [message, send]() { send(message); });
+	cond.notify_all();
+}
+
+PacerStats PacedSender::stats() {
+	std::lock_guard lock(mutex);
+	return pacer.stats();
+}
+
+PacingHandler::PacingHandler(std::shared_ptr<PacedSender> pacedSender,
+                             int stream, bool audio)
+    : pacedSender(std::move(pacedSender)), stream(stream), audio(audio) {}
+
+void PacingHandler::outgoing(rtc::message_vector &messages,
+                             const rtc::message_callback &send) {
+	auto end = std::remove_if(
+	    messages.begin(), messages.end(), [&](const rtc::message_ptr &m) {
+		    if (m->type != rtc::Message::Binary || m->size() < 12) {
+			    return false;
+		    }
+		    pacedSender->push(stream,
+		                      audio ? PacketPriority::Audio
+		                            : PacketPriority::Video,
+		                      m, send);
+		    return true;
+	    });
+	messages.erase(end, messages.end());
+}
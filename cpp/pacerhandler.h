@@ -0,0 +1,59 @@
+#pragma once
+#include "pacer.h"
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <rtc/rtc.hpp>
+#include <thread>
+
+// One pacer for the senders of a peer connection, so that its audio and
+// retransmissions go ahead of its video. A thread of its own sends the
+// packets as they fall due.
+class PacedSender {
+  private:
+	// Pacing rate over the target bitrate, room for the encoder's
+	// overshoot
+	static constexpr double pacingFactor = 2.5;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	// Held from taking packets out of the pacer until they are sent
+	std::mutex sendMutex;
+	Pacer pacer;
+	std::map<int, int64_t> bitrates;
+	int nextStream = 1;
+	std::thread thread;
+	bool closed = false;
+
+	void updateBitrate();
+	void run();
+
+  public:
+	PacedSender();
+	~PacedSender();
+
+	// A stream sending at bitrate, returns its id.
+	int addStream(int64_t bitrate);
+	// Nothing more of the stream is sent once this returns.
+	void removeStream(int stream);
+	void push(int stream, PacketPriority priority, rtc::message_ptr message,
+	          rtc::message_callback send);
+	PacerStats stats();
+};
+
+// Chained after the packetizer, takes the RTP packets of a track into the
+// paced sender instead of letting them go all at once. RTCP goes on.
+class PacingHandler : public rtc::MediaHandler {
+  private:
+	std::shared_ptr<PacedSender> pacedSender;
+	int stream;
+	bool audio;
+
+  public:
+	PacingHandler(std::shared_ptr<PacedSender> pacedSender, int stream,
+	              bool audio);
+
+	void outgoing(rtc::message_vector &messages,
+	              const rtc::message_callback &send) override;
+};
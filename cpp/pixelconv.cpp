@@ -0,0 +1,623 @@
+#include "pixelconv.h"
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#include <immintrin.h>
+#define PIXELCONV_AVX2 1
+#endif
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+struct Kernels {
+	void (*interleaveUV)(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+	                     int n);
+	void (*deinterleaveUV)(const uint8_t *uv, uint8_t *u, uint8_t *v, int n);
+	void (*swapUV)(const uint8_t *src, uint8_t *dst, int n);
+	void (*nv12ToRGBA)(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+	                   int width, bool bgra);
+	// 2x2 box average of single channel rows into n pixels
+	void (*box2)(const uint8_t *row0, const uint8_t *row1, uint8_t *dst,
+	             int n);
+};
+
+// Scalar
+
+void interleaveUVScalar(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        int n) {
+	for (int i = 0; i < n; ++i) {
+		uv[2 * i] = u[i];
+		uv[2 * i + 1] = v[i];
+	}
+}
+
+void deinterleaveUVScalar(const uint8_t *uv, uint8_t *u, uint8_t *v, int n) {
+	for (int i = 0; i < n; ++i) {
+		u[i] = uv[2 * i];
+		v[i] = uv[2 * i + 1];
+	}
+}
+
+void swapUVScalar(const uint8_t *src, uint8_t *dst, int n) {
+	for (int i = 0; i < n; ++i) {
+		uint8_t first = src[2 * i];
+		dst[2 * i] = src[2 * i + 1];
+		dst[2 * i + 1] = first;
+	}
+}
+
+inline uint8_t clamp8(int v) { return v < 0 ? 0 : v > 255 ? 255 : v; }
+
+// R = 1.164 (Y - 16) + 1.596 (V - 128) in 8 bit fixed point, the SIMD
+// variants compute the same integers so all levels are bit-exact.
+void nv12ToRGBAScalar(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+                      int width, bool bgra) {
+	for (int x = 0; x < width; ++x) {
+		int c = y[x] - 16;
+		int d = uv[x & ~1] - 128;
+		int e = uv[(x & ~1) + 1] - 128;
+		int base = 298 * c + 128;
+		uint8_t r = clamp8((base + 409 * e) >> 8);
+		uint8_t g = clamp8((base - 100 * d - 208 * e) >> 8);
+		uint8_t b = clamp8((base + 516 * d) >> 8);
+		dst[4 * x] = bgra ? b : r;
+		dst[4 * x + 1] = g;
+		dst[4 * x + 2] = bgra ? r : b;
+		dst[4 * x + 3] = 255;
+	}
+}
+
+void box2Scalar(const uint8_t *row0, const uint8_t *row1, uint8_t *dst,
+                int n) {
+	for (int x = 0; x < n; ++x) {
+		dst[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] +
+		          row1[2 * x + 1] + 2) >>
+		         2;
+	}
+}
+
+const Kernels scalarKernels = {interleaveUVScalar, deinterleaveUVScalar,
+                               swapUVScalar, nv12ToRGBAScalar, box2Scalar};
+
+#if defined(__SSE2__)
+
+// Two int16 coefficients for _mm_madd_epi16 on (lo, hi) pairs.
+inline __m128i pair16(int16_t lo, int16_t hi) {
+	return _mm_set1_epi32((int32_t)(((uint32_t)(uint16_t)hi << 16) |
+	                                (uint16_t)lo));
+}
+
+void interleaveUVSSE2(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n) {
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(u + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(v + i));
+		_mm_storeu_si128((__m128i *)(uv + 2 * i), _mm_unpacklo_epi8(a, b));
+		_mm_storeu_si128((__m128i *)(uv + 2 * i + 16),
+		                 _mm_unpackhi_epi8(a, b));
+	}
+	interleaveUVScalar(u + i, v + i, uv + 2 * i, n - i);
+}
+
+void deinterleaveUVSSE2(const uint8_t *uv, uint8_t *u, uint8_t *v, int n) {
+	const __m128i mask = _mm_set1_epi16(0xff);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(uv + 2 * i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 16));
+		__m128i lo = _mm_packus_epi16(_mm_and_si128(a, mask),
+		                              _mm_and_si128(b, mask));
+		__m128i hi =
+		    _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+		_mm_storeu_si128((__m128i *)(u + i), lo);
+		_mm_storeu_si128((__m128i *)(v + i), hi);
+	}
+	deinterleaveUVScalar(uv + 2 * i, u + i, v + i, n - i);
+}
+
+void swapUVSSE2(const uint8_t *src, uint8_t *dst, int n) {
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i), a);
+	}
+	swapUVScalar(src + 2 * i, dst + 2 * i, n - i);
+}
+
+// One channel of 8 pixels: (base + d * dk + e * ek) >> 8 as int16.
+inline __m128i channelSSE2(__m128i base0, __m128i base1, __m128i de0,
+                           __m128i de1, __m128i k) {
+	__m128i lo =
+	    _mm_srai_epi32(_mm_add_epi32(base0, _mm_madd_epi16(de0, k)), 8);
+	__m128i hi =
+	    _mm_srai_epi32(_mm_add_epi32(base1, _mm_madd_epi16(de1, k)), 8);
+	return _mm_packs_epi32(lo, hi);
+}
+
+// Converts 8 pixels given as int16 (Y - 16), (U - 128), (V - 128) with
+// chroma already repeated per pixel.
+inline void rgb8SSE2(__m128i c, __m128i d, __m128i e, __m128i &r, __m128i &g,
+                     __m128i &b) {
+	const __m128i kY = pair16(298, 128);
+	const __m128i kR = pair16(0, 409);
+	const __m128i kG = pair16(-100, -208);
+	const __m128i kB = pair16(516, 0);
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i base0 = _mm_madd_epi16(_mm_unpacklo_epi16(c, one), kY);
+	__m128i base1 = _mm_madd_epi16(_mm_unpackhi_epi16(c, one), kY);
+	__m128i de0 = _mm_unpacklo_epi16(d, e);
+	__m128i de1 = _mm_unpackhi_epi16(d, e);
+	r = channelSSE2(base0, base1, de0, de1, kR);
+	g = channelSSE2(base0, base1, de0, de1, kG);
+	b = channelSSE2(base0, base1, de0, de1, kB);
+}
+
+// Interleaves 16 pixels of 8 bit channels into RGBA/BGRA.
+inline void storeRGBA(uint8_t *dst, __m128i r, __m128i g, __m128i b,
+                      bool bgra) {
+	if (bgra) {
+		std::swap(r, b);
+	}
+	const __m128i a = _mm_set1_epi8((char)0xff);
+	__m128i rgLo = _mm_unpacklo_epi8(r, g);
+	__m128i rgHi = _mm_unpackhi_epi8(r, g);
+	__m128i baLo = _mm_unpacklo_epi8(b, a);
+	__m128i baHi = _mm_unpackhi_epi8(b, a);
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(rgLo, baLo));
+	_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(rgLo, baLo));
+	_mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(rgHi, baHi));
+	_mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(rgHi, baHi));
+}
+
+void nv12ToRGBASSE2(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+                    int width, bool bgra) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi16(0xff);
+	const __m128i k16 = _mm_set1_epi16(16);
+	const __m128i k128 = _mm_set1_epi16(128);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i yv = _mm_loadu_si128((const __m128i *)(y + x));
+		__m128i uvv = _mm_loadu_si128((const __m128i *)(uv + x));
+		__m128i cLo = _mm_sub_epi16(_mm_unpacklo_epi8(yv, zero), k16);
+		__m128i cHi = _mm_sub_epi16(_mm_unpackhi_epi8(yv, zero), k16);
+		__m128i u = _mm_sub_epi16(_mm_and_si128(uvv, mask), k128);
+		__m128i v = _mm_sub_epi16(_mm_srli_epi16(uvv, 8), k128);
+
+		__m128i r0, g0, b0, r1, g1, b1;
+		rgb8SSE2(cLo, _mm_unpacklo_epi16(u, u), _mm_unpacklo_epi16(v, v), r0,
+		         g0, b0);
+		rgb8SSE2(cHi, _mm_unpackhi_epi16(u, u), _mm_unpackhi_epi16(v, v), r1,
+		         g1, b1);
+		storeRGBA(dst + 4 * x, _mm_packus_epi16(r0, r1),
+		          _mm_packus_epi16(g0, g1), _mm_packus_epi16(b0, b1), bgra);
+	}
+	nv12ToRGBAScalar(y + x, uv + x, dst + 4 * x, width - x, bgra);
+}
+
+// Sums of horizontal byte pairs of both rows as 8 int16.
+inline __m128i pairSumSSE2(__m128i a, __m128i b) {
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i sa = _mm_add_epi16(_mm_and_si128(a, mask), _mm_srli_epi16(a, 8));
+	__m128i sb = _mm_add_epi16(_mm_and_si128(b, mask), _mm_srli_epi16(b, 8));
+	return _mm_add_epi16(sa, sb);
+}
+
+void box2SSE2(const uint8_t *row0, const uint8_t *row1, uint8_t *dst, int n) {
+	const __m128i k2 = _mm_set1_epi16(2);
+	int x = 0;
+	for (; x + 16 <= n; x += 16) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + 2 * x));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(row0 + 2 * x + 16));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(row1 + 2 * x));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + 2 * x + 16));
+		__m128i lo = _mm_srli_epi16(_mm_add_epi16(pairSumSSE2(a0, b0), k2), 2);
+		__m128i hi = _mm_srli_epi16(_mm_add_epi16(pairSumSSE2(a1, b1), k2), 2);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+	}
+	box2Scalar(row0 + 2 * x, row1 + 2 * x, dst + x, n - x);
+}
+
+const Kernels sse2Kernels = {interleaveUVSSE2, deinterleaveUVSSE2,
+                             swapUVSSE2, nv12ToRGBASSE2, box2SSE2};
+
+#endif
+
+#if defined(PIXELCONV_AVX2)
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET void interleaveUVAVX2(const uint8_t *u, const uint8_t *v,
+                                  uint8_t *uv, int n) {
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(u + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(v + i));
+		__m256i lo = _mm256_unpacklo_epi8(a, b);
+		__m256i hi = _mm256_unpackhi_epi8(a, b);
+		_mm256_storeu_si256((__m256i *)(uv + 2 * i),
+		                    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(uv + 2 * i + 32),
+		                    _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	interleaveUVSSE2(u + i, v + i, uv + 2 * i, n - i);
+}
+
+AVX2_TARGET void deinterleaveUVAVX2(const uint8_t *uv, uint8_t *u, uint8_t *v,
+                                    int n) {
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(uv + 2 * i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 32));
+		__m256i lo = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+		                                 _mm256_and_si256(b, mask));
+		__m256i hi = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+		                                 _mm256_srli_epi16(b, 8));
+		_mm256_storeu_si256((__m256i *)(u + i),
+		                    _mm256_permute4x64_epi64(lo, 0xd8));
+		_mm256_storeu_si256((__m256i *)(v + i),
+		                    _mm256_permute4x64_epi64(hi, 0xd8));
+	}
+	deinterleaveUVSSE2(uv + 2 * i, u + i, v + i, n - i);
+}
+
+AVX2_TARGET void swapUVAVX2(const uint8_t *src, uint8_t *dst, int n) {
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		a = _mm256_or_si256(_mm256_slli_epi16(a, 8), _mm256_srli_epi16(a, 8));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i), a);
+	}
+	swapUVSSE2(src + 2 * i, dst + 2 * i, n - i);
+}
+
+AVX2_TARGET inline __m256i channelAVX2(__m256i base0, __m256i base1,
+                                       __m256i de0, __m256i de1, __m256i k) {
+	__m256i lo = _mm256_srai_epi32(
+	    _mm256_add_epi32(base0, _mm256_madd_epi16(de0, k)), 8);
+	__m256i hi = _mm256_srai_epi32(
+	    _mm256_add_epi32(base1, _mm256_madd_epi16(de1, k)), 8);
+	return _mm256_packs_epi32(lo, hi);
+}
+
+// 16 pixels in order, unpack and pack stay within 128 bit lanes.
+AVX2_TARGET inline void rgb16AVX2(__m256i c, __m256i d, __m256i e,
+                                  __m256i &r, __m256i &g, __m256i &b) {
+	const __m256i kY = _mm256_broadcastsi128_si256(pair16(298, 128));
+	const __m256i kR = _mm256_broadcastsi128_si256(pair16(0, 409));
+	const __m256i kG = _mm256_broadcastsi128_si256(pair16(-100, -208));
+	const __m256i kB = _mm256_broadcastsi128_si256(pair16(516, 0));
+	const __m256i one = _mm256_set1_epi16(1);
+	__m256i base0 = _mm256_madd_epi16(_mm256_unpacklo_epi16(c, one), kY);
+	__m256i base1 = _mm256_madd_epi16(_mm256_unpackhi_epi16(c, one), kY);
+	__m256i de0 = _mm256_unpacklo_epi16(d, e);
+	__m256i de1 = _mm256_unpackhi_epi16(d, e);
+	r = channelAVX2(base0, base1, de0, de1, kR);
+	g = channelAVX2(base0, base1, de0, de1, kG);
+	b = channelAVX2(base0, base1, de0, de1, kB);
+}
+
+AVX2_TARGET inline __m256i pack8AVX2(__m256i lo, __m256i hi) {
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+}
+
+AVX2_TARGET void nv12ToRGBAAVX2(const uint8_t *y, const uint8_t *uv,
+                                uint8_t *dst, int width, bool bgra) {
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	const __m256i k16 = _mm256_set1_epi16(16);
+	const __m256i k128 = _mm256_set1_epi16(128);
+	int x = 0;
+	for (; x + 32 <= width; x += 32) {
+		__m128i y0 = _mm_loadu_si128((const __m128i *)(y + x));
+		__m128i y1 = _mm_loadu_si128((const __m128i *)(y + x + 16));
+		__m256i uvv = _mm256_loadu_si256((const __m256i *)(uv + x));
+		__m256i c0 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(y0), k16);
+		__m256i c1 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(y1), k16);
+		// u0-3 u8-11 | u4-7 u12-15 so that per lane unpacking repeats
+		// the samples of pixels 0-15 and 16-31
+		__m256i u = _mm256_permute4x64_epi64(
+		    _mm256_sub_epi16(_mm256_and_si256(uvv, mask), k128), 0xd8);
+		__m256i v = _mm256_permute4x64_epi64(
+		    _mm256_sub_epi16(_mm256_srli_epi16(uvv, 8), k128), 0xd8);
+
+		__m256i r0, g0, b0, r1, g1, b1;
+		rgb16AVX2(c0, _mm256_unpacklo_epi16(u, u), _mm256_unpacklo_epi16(v, v),
+		          r0, g0, b0);
+		rgb16AVX2(c1, _mm256_unpackhi_epi16(u, u), _mm256_unpackhi_epi16(v, v),
+		          r1, g1, b1);
+		__m256i r = pack8AVX2(r0, r1);
+		__m256i g = pack8AVX2(g0, g1);
+		__m256i b = pack8AVX2(b0, b1);
+		storeRGBA(dst + 4 * x, _mm256_castsi256_si128(r),
+		          _mm256_castsi256_si128(g), _mm256_castsi256_si128(b), bgra);
+		storeRGBA(dst + 4 * x + 64, _mm256_extracti128_si256(r, 1),
+		          _mm256_extracti128_si256(g, 1),
+		          _mm256_extracti128_si256(b, 1), bgra);
+	}
+	nv12ToRGBASSE2(y + x, uv + x, dst + 4 * x, width - x, bgra);
+}
+
+const Kernels avx2Kernels = {interleaveUVAVX2, deinterleaveUVAVX2,
+                             swapUVAVX2, nv12ToRGBAAVX2, box2SSE2};
+
+#endif
+
+#if defined(__ARM_NEON)
+
+void interleaveUVNEON(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n) {
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x2_t pair = {{vld1q_u8(u + i), vld1q_u8(v + i)}};
+		vst2q_u8(uv + 2 * i, pair);
+	}
+	interleaveUVScalar(u + i, v + i, uv + 2 * i, n - i);
+}
+
+void deinterleaveUVNEON(const uint8_t *uv, uint8_t *u, uint8_t *v, int n) {
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x2_t pair = vld2q_u8(uv + 2 * i);
+		vst1q_u8(u + i, pair.val[0]);
+		vst1q_u8(v + i, pair.val[1]);
+	}
+	deinterleaveUVScalar(uv + 2 * i, u + i, v + i, n - i);
+}
+
+void swapUVNEON(const uint8_t *src, uint8_t *dst, int n) {
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		vst1q_u8(dst + 2 * i, vrev16q_u8(vld1q_u8(src + 2 * i)));
+	}
+	swapUVScalar(src + 2 * i, dst + 2 * i, n - i);
+}
+
+inline uint8x8_t channelNEON(int32x4_t base0, int32x4_t base1, int16x8_t d,
+                             int16x8_t e, int16_t dk, int16_t ek) {
+	int32x4_t lo = vmlal_n_s16(vmlal_n_s16(base0, vget_low_s16(d), dk),
+	                           vget_low_s16(e), ek);
+	int32x4_t hi = vmlal_n_s16(vmlal_n_s16(base1, vget_high_s16(d), dk),
+	                           vget_high_s16(e), ek);
+	int16x8_t v = vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, 8)),
+	                           vqmovn_s32(vshrq_n_s32(hi, 8)));
+	return vqmovun_s16(v);
+}
+
+// 8 pixels, chroma already repeated per pixel.
+inline void rgb8NEON(int16x8_t c, int16x8_t d, int16x8_t e, uint8x8_t &r,
+                     uint8x8_t &g, uint8x8_t &b) {
+	int32x4_t base0 = vmlal_n_s16(vdupq_n_s32(128), vget_low_s16(c), 298);
+	int32x4_t base1 = vmlal_n_s16(vdupq_n_s32(128), vget_high_s16(c), 298);
+	r = channelNEON(base0, base1, d, e, 0, 409);
+	g = channelNEON(base0, base1, d, e, -100, -208);
+	b = channelNEON(base0, base1, d, e, 516, 0);
+}
+
+void nv12ToRGBANEON(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+                    int width, bool bgra) {
+	const int16x8_t k16 = vdupq_n_s16(16);
+	const int16x8_t k128 = vdupq_n_s16(128);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t yv = vld1q_u8(y + x);
+		uint8x8x2_t uvv = vld2_u8(uv + x);
+		int16x8_t c0 =
+		    vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(yv))), k16);
+		int16x8_t c1 =
+		    vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(yv))), k16);
+		int16x8_t u =
+		    vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uvv.val[0])), k128);
+		int16x8_t v =
+		    vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uvv.val[1])), k128);
+		int16x8x2_t uu = vzipq_s16(u, u);
+		int16x8x2_t vv = vzipq_s16(v, v);
+
+		uint8x8_t r0, g0, b0, r1, g1, b1;
+		rgb8NEON(c0, uu.val[0], vv.val[0], r0, g0, b0);
+		rgb8NEON(c1, uu.val[1], vv.val[1], r1, g1, b1);
+		uint8x16x4_t out;
+		out.val[0] = bgra ? vcombine_u8(b0, b1) : vcombine_u8(r0, r1);
+		out.val[1] = vcombine_u8(g0, g1);
+		out.val[2] = bgra ? vcombine_u8(r0, r1) : vcombine_u8(b0, b1);
+		out.val[3] = vdupq_n_u8(255);
+		vst4q_u8(dst + 4 * x, out);
+	}
+	nv12ToRGBAScalar(y + x, uv + x, dst + 4 * x, width - x, bgra);
+}
+
+void box2NEON(const uint8_t *row0, const uint8_t *row1, uint8_t *dst, int n) {
+	int x = 0;
+	for (; x + 8 <= n; x += 8) {
+		uint16x8_t sum = vaddq_u16(vpaddlq_u8(vld1q_u8(row0 + 2 * x)),
+		                           vpaddlq_u8(vld1q_u8(row1 + 2 * x)));
+		vst1_u8(dst + x, vrshrn_n_u16(sum, 2));
+	}
+	box2Scalar(row0 + 2 * x, row1 + 2 * x, dst + x, n - x);
+}
+
+const Kernels neonKernels = {interleaveUVNEON, deinterleaveUVNEON,
+                             swapUVNEON, nv12ToRGBANEON, box2NEON};
+
+#endif
+
+const Kernels *kernelsFor(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::Scalar:
+		return &scalarKernels;
+#if defined(__SSE2__)
+	case SimdLevel::SSE2:
+		return &sse2Kernels;
+#endif
+#if defined(PIXELCONV_AVX2)
+	case SimdLevel::AVX2:
+		return __builtin_cpu_supports("avx2") ? &avx2Kernels : nullptr;
+#endif
+#if defined(__ARM_NEON)
+	case SimdLevel::NEON:
+		return &neonKernels;
+#endif
+	default:
+		return nullptr;
+	}
+}
+
+std::atomic<const Kernels *> &currentKernels() {
+	static std::atomic<const Kernels *> kernels{
+	    kernelsFor(detectSimdLevel())};
+	return kernels;
+}
+
+const Kernels &kernels() { return *currentKernels().load(); }
+
+} // namespace
+
+SimdLevel detectSimdLevel() {
+	for (auto level : {SimdLevel::AVX2, SimdLevel::SSE2, SimdLevel::NEON}) {
+		if (kernelsFor(level)) {
+			return level;
+		}
+	}
+	return SimdLevel::Scalar;
+}
+
+bool simdLevelSupported(SimdLevel level) {
+	return kernelsFor(level) != nullptr;
+}
+
+void setSimdLevel(SimdLevel level) {
+	auto selected = kernelsFor(level);
+	if (!selected) {
+		throw std::invalid_argument(std::string("SIMD level not supported: ") +
+		                            simdLevelName(level));
+	}
+	currentKernels().store(selected);
+}
+
+SimdLevel simdLevel() {
+	auto selected = currentKernels().load();
+	for (auto level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2,
+	                   SimdLevel::NEON}) {
+		if (kernelsFor(level) == selected) {
+			return level;
+		}
+	}
+	return SimdLevel::Scalar;
+}
+
+const char *simdLevelName(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::SSE2:
+		return "sse2";
+	case SimdLevel::AVX2:
+		return "avx2";
+	case SimdLevel::NEON:
+		return "neon";
+	default:
+		return "scalar";
+	}
+}
+
+void copyPlane(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride,
+               int width, int height) {
+	if (srcStride == width && dstStride == width) {
+		memcpy(dst, src, (size_t)width * height);
+		return;
+	}
+	for (int row = 0; row < height; ++row) {
+		memcpy(dst + row * dstStride, src + row * srcStride, width);
+	}
+}
+
+void packNV12UV(const uint8_t *u, int uStride, const uint8_t *v, int vStride,
+                int pixelStride, uint8_t *uv, int uvStride, int width,
+                int height) {
+	auto &k = kernels();
+	for (int row = 0; row < height; ++row) {
+		const uint8_t *uRow = u + row * uStride;
+		const uint8_t *vRow = v + row * vStride;
+		uint8_t *dst = uv + row * uvStride;
+		if (pixelStride == 1) {
+			k.interleaveUV(uRow, vRow, dst, width);
+		} else if (pixelStride == 2 && vRow == uRow + 1) {
+			memcpy(dst, uRow, 2 * width);
+		} else if (pixelStride == 2 && uRow == vRow + 1) {
+			k.swapUV(vRow, dst, width);
+		} else {
+			for (int x = 0; x < width; ++x) {
+				dst[2 * x] = uRow[x * pixelStride];
+				dst[2 * x + 1] = vRow[x * pixelStride];
+			}
+		}
+	}
+}
+
+void nv12ToI420(const uint8_t *y, int yStride, const uint8_t *uv, int uvStride,
+                uint8_t *dstY, int dstYStride, uint8_t *dstU, int dstUStride,
+                uint8_t *dstV, int dstVStride, int width, int height) {
+	copyPlane(y, yStride, dstY, dstYStride, width, height);
+	auto &k = kernels();
+	for (int row = 0; row < (height + 1) / 2; ++row) {
+		k.deinterleaveUV(uv + row * uvStride, dstU + row * dstUStride,
+		                 dstV + row * dstVStride, (width + 1) / 2);
+	}
+}
+
+void i420ToNV12(const uint8_t *y, int yStride, const uint8_t *u, int uStride,
+                const uint8_t *v, int vStride, uint8_t *dstY, int dstYStride,
+                uint8_t *dstUV, int dstUVStride, int width, int height) {
+	copyPlane(y, yStride, dstY, dstYStride, width, height);
+	packNV12UV(u, uStride, v, vStride, 1, dstUV, dstUVStride, (width + 1) / 2,
+	           (height + 1) / 2);
+}
+
+void nv12ToRGBA(const uint8_t *y, int yStride, const uint8_t *uv, int uvStride,
+                uint8_t *dst, int dstStride, int width, int height,
+                bool bgra) {
+	auto &k = kernels();
+	for (int row = 0; row < height; ++row) {
+		k.nv12ToRGBA(y + row * yStride, uv + (row / 2) * uvStride,
+		             dst + row * dstStride, width, bgra);
+	}
+}
+
+void downscaleBox(const uint8_t *src, int srcStride, uint8_t *dst,
+                  int dstStride, int width, int height, int channels,
+                  int factor) {
+	if (factor != 2 && factor != 4) {
+		throw std::invalid_argument("Box downscale factor must be 2 or 4");
+	}
+	auto &k = kernels();
+	const int round = factor * factor / 2;
+	const int shift = factor == 2 ? 2 : 4;
+	const int step = factor * channels;
+	for (int row = 0; row < height; ++row) {
+		const uint8_t *in = src + row * factor * srcStride;
+		uint8_t *out = dst + row * dstStride;
+		if (factor == 2 && channels == 1) {
+			k.box2(in, in + srcStride, out, width);
+			continue;
+		}
+		for (int x = 0; x < width; ++x) {
+			for (int c = 0; c < channels; ++c) {
+				int sum = 0;
+				for (int dy = 0; dy < factor; ++dy) {
+					const uint8_t *p = in + dy * srcStride + x * step;
+					for (int dx = 0; dx < factor; ++dx) {
+						sum += p[dx * channels + c];
+					}
+				}
+				out[x * channels + c] = (sum + round) >> shift;
+			}
+		}
+	}
+}
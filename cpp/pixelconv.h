@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+
+// Instruction sets the pixel kernels are implemented for.
+enum class SimdLevel { Scalar, SSE2, AVX2, NEON };
+
+// Best level supported by this CPU, picked at startup.
+SimdLevel detectSimdLevel();
+bool simdLevelSupported(SimdLevel level);
+// Run the kernels at another supported level, e.g. to compare or benchmark.
+void setSimdLevel(SimdLevel level);
+SimdLevel simdLevel();
+const char *simdLevelName(SimdLevel level);
+
+// Sizes are in pixels of the plane written, strides in bytes.
+
+void copyPlane(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride,
+               int width, int height);
+
+// Build an NV12 UV plane from separate U and V planes sampled every
+// pixelStride bytes, as delivered by Android YUV_420_888 images: 1 is I420,
+// 2 with v == u + 1 is already NV12 and 2 with u == v + 1 is NV21.
+void packNV12UV(const uint8_t *u, int uStride, const uint8_t *v, int vStride,
+                int pixelStride, uint8_t *uv, int uvStride, int width,
+                int height);
+
+void nv12ToI420(const uint8_t *y, int yStride, const uint8_t *uv, int uvStride,
+                uint8_t *dstY, int dstYStride, uint8_t *dstU, int dstUStride,
+                uint8_t *dstV, int dstVStride, int width, int height);
+
+void i420ToNV12(const uint8_t *y, int yStride, const uint8_t *u, int uStride,
+                const uint8_t *v, int vStride, uint8_t *dstY, int dstYStride,
+                uint8_t *dstUV, int dstUVStride, int width, int height);
+
+// BT.601 limited range, nearest chroma sample.
+void nv12ToRGBA(const uint8_t *y, int yStride, const uint8_t *uv, int uvStride,
+                uint8_t *dst, int dstStride, int width, int height,
+                bool bgra = false);
+
+// Averages factor x factor blocks (2 or 4) of a plane with interleaved
+// channels, e.g. 2 for an NV12 UV plane and 4 for RGBA.
+void downscaleBox(const uint8_t *src, int srcStride, uint8_t *dst,
+                  int dstStride, int width, int height, int channels,
+                  int factor);
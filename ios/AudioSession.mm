@@ -6,16 +6,19 @@ static AudioSession *_sharedInstance = nil;
 
 @interface AudioSession ()
 @property(nonatomic, strong) dispatch_queue_t audioInQueue;
-@property(nonatomic, strong) dispatch_queue_t audioOutQueue;
 @property(nonatomic, strong) NSMutableArray<NSString *> *microphonePipes;
 @property(nonatomic, assign) int subscriptionId;
+@property(nonatomic, assign) int statsSourceId;
 @property(nonatomic, strong) AVAudioSession *audioSession;
 @property(nonatomic, strong) AVAudioEngine *audioEngine;
-@property(nonatomic, strong) AVAudioPlayerNode *playerNode;
+@property(nonatomic, strong) AVAudioSourceNode *sourceNode;
 @property(nonatomic, strong) AVAudioMixerNode *mixerNode;
 @end
 
-@implementation AudioSession
+@implementation AudioSession {
+	// Pulled by the source node at the output's cadence
+	std::shared_ptr<PlayoutBuffer> _playout;
+}
 
 + (instancetype)sharedInstance {
 	static dispatch_once_t onceToken;
@@ -28,11 +31,11 @@ static AudioSession *_sharedInstance = nil;
 - (instancetype)init {
 	self = [super init];
 	self.subscriptionId = -1;
+	self.statsSourceId = -1;
 	self.microphonePipes = [NSMutableArray array];
 	self.audioInQueue =
 	    dispatch_queue_create("audio.session.queue.in", DISPATCH_QUEUE_SERIAL);
-	self.audioOutQueue =
-	    dispatch_queue_create("audio.session.queue.out", DISPATCH_QUEUE_SERIAL);
+	_playout = std::make_shared<PlayoutBuffer>(AV_SAMPLE_FMT_FLTP, 48000, 2);
 
 	self.audioSession = [AVAudioSession sharedInstance];
 	[self.audioSession setCategory:AVAudioSessionCategoryPlayAndRecord
@@ -63,10 +66,31 @@ static AudioSession *_sharedInstance = nil;
 - (void)setupAudio {
 	self.audioEngine = [[AVAudioEngine alloc] init];
 
-	self.playerNode = [[AVAudioPlayerNode alloc] init];
+	AVAudioFormat *format =
+	    [[AVAudioFormat alloc] initStandardFormatWithSampleRate:48000
+	                                                   channels:2];
+	auto playout = _playout;
+	self.sourceNode = [[AVAudioSourceNode alloc]
+	    initWithFormat:format
+	       renderBlock:^OSStatus(BOOL *isSilence,
+	                             const AudioTimeStamp *timestamp,
+	                             AVAudioFrameCount frameCount,
+	                             AudioBufferList *outputData) {
+		     // Copies straight into the output, no locks or allocations
+		     // on the render thread
+		     if (outputData->mNumberBuffers < 2) {
+			     *isSilence = YES;
+			     return noErr;
+		     }
+		     uint8_t *planes[2] = {
+		         (uint8_t *)outputData->mBuffers[0].mData,
+		         (uint8_t *)outputData->mBuffers[1].mData};
+		     playout->read(planes, frameCount);
+		     return noErr;
+	       }];
 	self.mixerNode = self.audioEngine.mainMixerNode;
-	[self.audioEngine attachNode:self.playerNode];
-	[self.audioEngine connect:self.playerNode to:self.mixerNode format:nil];
+	[self.audioEngine attachNode:self.sourceNode];
+	[self.audioEngine connect:self.sourceNode to:self.mixerNode format:format];
 
 	AVAudioInputNode *inputNode = self.audioEngine.inputNode;
 	[inputNode removeTapOnBus:0];
@@ -135,19 +159,39 @@ static AudioSession *_sharedInstance = nil;
 	if ([self subscriptionId] > 0) {
 		unsubscribe([self subscriptionId]);
 	}
-	auto resampler = std::make_shared<Resampler>();
+	if (self.statsSourceId > 0) {
+		removeStatsSource(self.statsSourceId);
+	}
+	_playout->reset();
+	auto playout = _playout;
 	std::string cppStr = [pipeId UTF8String];
-	subscribe({cppStr}, [self, resampler](std::string, int,
-	                                      std::shared_ptr<AVFrame> frame) {
-		[self playAudio:frame resampler:resampler];
-	});
+	// Held back and reported played for the receiver's a/v sync
+	self.subscriptionId =
+	    subscribe({cppStr}, [playout](std::string pipeId, int,
+	                                  std::shared_ptr<AVFrame> frame) {
+		    playOut(pipeId, *playout, frame);
+	    });
+	self.statsSourceId = addStatsSource(
+	    cppStr, [playout]() { return playoutStats(*playout); });
 	[self.audioSession setActive:YES error:nil];
-	[self.playerNode play];
 	[self.audioEngine startAndReturnError:nil];
 }
 
 - (void)soundRemovePipe:(NSString *)pipeId {
-	[self.playerNode stop];
+	if ([self subscriptionId] > 0) {
+		unsubscribe([self subscriptionId]);
+		self.subscriptionId = -1;
+	}
+	if (self.statsSourceId > 0) {
+		removeStatsSource(self.statsSourceId);
+		self.statsSourceId = -1;
+	}
+	auto stats = _playout->stats();
+	LOGI("playout latency %.1f ms, target %.1f ms, jitter %.1f ms, "
+	     "%llu underruns, drift %.0f ppm\n",
+	     stats.latency, stats.targetDelay, stats.jitter,
+	     (unsigned long long)stats.underruns, stats.drift);
+	_playout->reset();
 	[self.audioEngine stop];
 	if (self.microphonePipes.count == 0) {
 		[self.audioSession setActive:NO error:nil];
@@ -163,7 +207,6 @@ static AudioSession *_sharedInstance = nil;
 	switch (interruptionType.unsignedIntegerValue) {
 	case AVAudioSessionInterruptionTypeBegan:
 		LOGI("Audio session interruption began - stopping capture");
-		[self.playerNode stop];
 		[self.audioEngine stop];
 		break;
 
@@ -175,7 +218,6 @@ static AudioSession *_sharedInstance = nil;
 		                     AVAudioSessionInterruptionOptionShouldResume) != 0;
 
 		if (shouldResume) {
-			[self.playerNode stop];
 			[self.audioEngine stop];
 			[self.audioEngine reset];
 			[self setupAudio];
@@ -195,48 +237,10 @@ static AudioSession *_sharedInstance = nil;
 	if (reason == AVAudioSessionRouteChangeReasonNewDeviceAvailable ||
 	    reason == AVAudioSessionRouteChangeReasonOverride) {
 		LOGI("Audio session route change detected");
-		[self.playerNode stop];
 		[self.audioEngine stop];
 		[self.audioEngine reset];
 		[self setupAudio];
 	}
 }
 
-- (void)playAudio:(std::shared_ptr<AVFrame>)raw
-        resampler:(std::shared_ptr<Resampler>)resampler {
-	AVAudioFormat *format = [self.playerNode outputFormatForBus:0];
-	AVSampleFormat avSampleFormat = AV_SAMPLE_FMT_NONE;
-	if (format.isInterleaved) {
-		avSampleFormat = AV_SAMPLE_FMT_FLT;
-	} else {
-		avSampleFormat = AV_SAMPLE_FMT_FLTP;
-	}
-	auto frame = resampler->resample(raw, avSampleFormat, format.sampleRate,
-	                                 format.channelCount);
-
-	[self.audioEngine startAndReturnError:nil];
-	[self.playerNode play];
-
-	AVAudioFrameCount frameCount = (AVAudioFrameCount)frame->nb_samples;
-	AVAudioPCMBuffer *buffer =
-	    [[AVAudioPCMBuffer alloc] initWithPCMFormat:format
-	                                  frameCapacity:frameCount];
-
-	if (format.isInterleaved) {
-		memcpy(buffer.audioBufferList->mBuffers[0].mData, frame->data[0],
-		       frame->nb_samples * sizeof(float) *
-		           frame->ch_layout.nb_channels);
-	} else {
-		memcpy(buffer.audioBufferList->mBuffers[0].mData, frame->data[0],
-		       frame->nb_samples * sizeof(float));
-		memcpy(buffer.audioBufferList->mBuffers[1].mData, frame->data[1],
-		       frame->nb_samples * sizeof(float));
-	}
-	buffer.frameLength = frameCount;
-
-	dispatch_async(self.audioOutQueue, ^{
-	  [self.playerNode scheduleBuffer:buffer completionHandler:nil];
-	});
-}
-
 @end
@@ -136,31 +136,26 @@ static CameraSession *_sharedInstance = nil;
            fromConnection:(AVCaptureConnection *)connection {
 
 	CVPixelBufferRef pixelBuffer = CMSampleBufferGetImageBuffer(sampleBuffer);
+	CVPixelBufferRetain(pixelBuffer);
 	CVPixelBufferLockBaseAddress(pixelBuffer, kCVPixelBufferLock_ReadOnly);
 
-	size_t width = CVPixelBufferGetWidth(pixelBuffer);
-	size_t height = CVPixelBufferGetHeight(pixelBuffer);
-
-	auto frame = createVideoFrame(AV_PIX_FMT_NV12, width, height);
-	uint8_t *srcY =
-	    (uint8_t *)CVPixelBufferGetBaseAddressOfPlane(pixelBuffer, 0);
-	uint8_t *srcUV =
-	    (uint8_t *)CVPixelBufferGetBaseAddressOfPlane(pixelBuffer, 1);
-	int srcYStride = (int)CVPixelBufferGetBytesPerRowOfPlane(pixelBuffer, 0);
-	int srcUVStride = (int)CVPixelBufferGetBytesPerRowOfPlane(pixelBuffer, 1);
-
-	// Copy Y
-	for (size_t i = 0; i < height; ++i) {
-		memcpy(frame->data[0] + i * frame->linesize[0], srcY + i * srcYStride,
-		       width);
-	}
-	// Copy UV
-	for (size_t i = 0; i < height / 2; ++i) {
-		memcpy(frame->data[1] + i * frame->linesize[1], srcUV + i * srcUVStride,
-		       width);
-	}
-
-	CVPixelBufferUnlockBaseAddress(pixelBuffer, kCVPixelBufferLock_ReadOnly);
+	int width = (int)CVPixelBufferGetWidth(pixelBuffer);
+	int height = (int)CVPixelBufferGetHeight(pixelBuffer);
+	uint8_t *data[] = {
+	    (uint8_t *)CVPixelBufferGetBaseAddressOfPlane(pixelBuffer, 0),
+	    (uint8_t *)CVPixelBufferGetBaseAddressOfPlane(pixelBuffer, 1)};
+	int linesize[] = {
+	    (int)CVPixelBufferGetBytesPerRowOfPlane(pixelBuffer, 0),
+	    (int)CVPixelBufferGetBytesPerRowOfPlane(pixelBuffer, 1)};
+
+	// Subscribers read the camera buffer directly, it goes back to the
+	// capture pool once the last of them drops the frame.
+	auto frame = wrapVideoFrame(
+	    AV_PIX_FMT_NV12, width, height, data, linesize, [pixelBuffer]() {
+		    CVPixelBufferUnlockBaseAddress(pixelBuffer,
+		                                   kCVPixelBufferLock_ReadOnly);
+		    CVPixelBufferRelease(pixelBuffer);
+	    });
 
 	for (NSString *pipeId in self.pipes) {
 		std::string cppPipeStr = [pipeId UTF8String];
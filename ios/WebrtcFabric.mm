@@ -68,7 +68,7 @@ using namespace facebook::react;
 		if (_lastCallbackId > 0) {
 			unsubscribe(_lastCallbackId);
 		}
-		auto scaler = std::make_shared<Scaler>();
+		auto scaler = std::make_shared<Scaler>(ScaleQuality::FastBilinear);
 		subscribe(
 		    {_currentVideoPipeId},
 		    [self, scaler](std::string, int, std::shared_ptr<AVFrame> frame) {
@@ -1,10 +1,39 @@
+import type { EventSubscription } from 'react-native';
 import NativeDatachannel from './NativeDatachannel';
+import type { RecordingSegmentEvent } from './NativeDatachannel';
 import { MediaStream } from './MediaStream';
 
+export type { RecordingSegmentEvent };
+
+export interface MediaRecorderOptions {
+  // Write a fragmented MP4 that stays playable if the app is killed.
+  fragmented?: boolean;
+  // Maximum fragment length in milliseconds.
+  fragmentDuration?: number;
+  // Maximum time in milliseconds a stalled stream may hold back the others.
+  maxInterleaveDelta?: number;
+  // Rotate files on the next keyframe after this many milliseconds.
+  segmentDuration?: number;
+  // Rotate files on the next keyframe after this many bytes.
+  segmentSize?: number;
+  // Number of completed segments kept on disk, older ones are deleted.
+  maxSegments?: number;
+  // Record the packets of a peer connection sending or receiving the track
+  // as they are instead of encoding it a second time. Video changing size
+  // goes on in a new file, reported through onsegment like a segment.
+  // Off by default.
+  passthrough?: boolean;
+  // Audio codec when encoding: 'aac' (.mp4 default) or 'opus' (.mkv/.webm).
+  audioCodec?: 'aac' | 'opus';
+}
+
 export class MediaRecorder {
   private audioPipeId: string;
   private videoPipeId: string;
   private subscriptionId: number;
+  private onRecordingSegmentCallback: EventSubscription | null = null;
+
+  public onsegment: ((event: RecordingSegmentEvent) => void) | null = null;
 
   constructor(stream: MediaStream) {
     const audioTrack = stream.getAudioTracks()[0];
@@ -17,17 +46,43 @@ export class MediaRecorder {
   async takePhoto(file: string) {
     await NativeDatachannel.takePhoto(file, this.videoPipeId);
   }
-  startRecording(file: string) {
+  startRecording(file: string, options?: MediaRecorderOptions) {
+    this.onRecordingSegmentCallback?.remove();
     this.subscriptionId = NativeDatachannel.startRecording(
       file,
       this.audioPipeId,
-      this.videoPipeId
+      this.videoPipeId,
+      {
+        fragmented: options?.fragmented ?? false,
+        fragmentDuration: options?.fragmentDuration ?? 1000,
+        maxInterleaveDelta: options?.maxInterleaveDelta ?? 1000,
+        segmentDuration: options?.segmentDuration ?? 0,
+        segmentSize: options?.segmentSize ?? 0,
+        maxSegments: options?.maxSegments ?? 0,
+        passthrough: options?.passthrough ?? false,
+        audioCodec: options?.audioCodec ?? '',
+      }
+    );
+    const recording = this.subscriptionId;
+    this.onRecordingSegmentCallback = NativeDatachannel.onRecordingSegment(
+      (event) => {
+        if (event.recording !== recording) {
+          return;
+        }
+        this.onsegment?.(event);
+        if (event.last) {
+          this.onRecordingSegmentCallback?.remove();
+          this.onRecordingSegmentCallback = null;
+        }
+      }
     );
   }
+  // Throws when the storage failed some of the recording.
   stopRecording() {
     if (this.subscriptionId) {
-      NativeDatachannel.unsubscribe(this.subscriptionId);
+      const subscriptionId = this.subscriptionId;
       this.subscriptionId = -1;
+      NativeDatachannel.unsubscribe(subscriptionId);
     }
   }
 }
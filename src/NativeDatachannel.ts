@@ -25,6 +25,42 @@ export type LocalCandidateEvent = {
   mid: string | null;
 };
 
+export type RecordingOptions = {
+  fragmented: boolean;
+  fragmentDuration: number;
+  maxInterleaveDelta: number;
+  segmentDuration: number;
+  segmentSize: number;
+  maxSegments: number;
+  passthrough: boolean;
+  audioCodec: string;
+};
+
+export type OpusOptions = {
+  bitrate: number;
+  dtx: boolean;
+  packetLoss: number;
+  vbr: boolean;
+  constrainedVbr: boolean;
+  complexity: number;
+  frameDuration: number;
+};
+
+export type VideoOptions = {
+  intraRefresh: boolean;
+  infiniteGop: boolean;
+  nackHistory: number;
+};
+
+export type RecordingSegmentEvent = {
+  recording: number;
+  path: string;
+  index: number;
+  duration: number;
+  size: number;
+  last: boolean;
+};
+
 export interface Spec extends TurboModule {
   createPeerConnection(servers: string[]): string;
   closePeerConnection(pc: string): void;
@@ -40,7 +76,9 @@ export interface Spec extends TurboModule {
     sendPipeId: string,
     recvPipeId: string,
     msids: string[],
-    trackid: string | null
+    trackid: string | null,
+    opus: OpusOptions,
+    video: VideoOptions
   ): string;
   stopRTCTransceiver(id: string): void;
 
@@ -59,15 +97,19 @@ export interface Spec extends TurboModule {
   startRecording(
     path: string,
     audioPipeId: string,
-    videoPipeId: string
+    videoPipeId: string,
+    options: RecordingOptions
   ): number;
   takePhoto(file: string, pipeId: string): Promise<string>;
   unsubscribe(subscriptionId: number): void;
+  // Figures of what handles the frames of a pipe, by name.
+  getStats(pipeId: string): Object;
 
   onTrack: EventEmitter<TrackEvent>;
   onConnectionStateChange: EventEmitter<ConnectionStateChangeEvent>;
   onGatheringStateChange: EventEmitter<GatheringStateChangeEvent>;
   onLocalCandidate: EventEmitter<LocalCandidateEvent>;
+  onRecordingSegment: EventEmitter<RecordingSegmentEvent>;
 }
 
 export default TurboModuleRegistry.getEnforcing<Spec>('NativeDatachannel');
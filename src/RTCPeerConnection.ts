@@ -212,7 +212,21 @@ export class RTCPeerConnection {
           sendPipeId,
           recvPipeId,
           msids,
-          t.sender.track?.id || null
+          t.sender.track?.id || null,
+          {
+            bitrate: t.opus.bitrate ?? 64000,
+            dtx: t.opus.dtx ?? false,
+            packetLoss: t.opus.packetLoss ?? 10,
+            vbr: t.opus.vbr ?? true,
+            constrainedVbr: t.opus.constrainedVbr ?? false,
+            complexity: t.opus.complexity ?? 10,
+            frameDuration: t.opus.frameDuration ?? 20,
+          },
+          {
+            intraRefresh: t.video.intraRefresh ?? false,
+            infiniteGop: t.video.infiniteGop ?? false,
+            nackHistory: t.video.nackHistory ?? 512,
+          }
         );
         t.id = id;
       }
@@ -8,9 +8,53 @@ export type RTCRtpTransceiverDirection =
   | 'sendrecv'
   | 'stopped';
 
+export interface RTCOpusOptions {
+  // Target bitrate in bits per second, capped by the remote's
+  // maxaveragebitrate.
+  bitrate?: number;
+  // Stop sending during silence except for periodic refreshes.
+  dtx?: boolean;
+  // Expected packet loss percentage the in-band FEC is sized for, 10 when
+  // unset. The remote asks for FEC or not with useinbandfec.
+  packetLoss?: number;
+  // Variable bitrate, constrained keeps packets close to the target.
+  vbr?: boolean;
+  constrainedVbr?: boolean;
+  // Encoder complexity from 0 (fastest) to 10 (best).
+  complexity?: number;
+  // Milliseconds of audio per packet: 10, 20, 40 or 60.
+  frameDuration?: 10 | 20 | 40 | 60;
+}
+
+export interface RTCVideoOptions {
+  // Refresh the picture gradually instead of with keyframes, so that
+  // frame sizes and the send bitrate stay flat.
+  intraRefresh?: boolean;
+  // No periodic keyframes, only those the receiver asks for.
+  infiniteGop?: boolean;
+  // Sent packets kept to retransmit when the receiver reports them lost.
+  nackHistory?: number;
+}
+
 export interface RTCRtpTransceiverInit {
   direction?: RTCRtpTransceiverDirection;
   streams?: MediaStream[];
+  // Opus encoding of an audio sender.
+  opus?: RTCOpusOptions;
+  // H.264 or H.265 encoding of a video sender.
+  video?: RTCVideoOptions;
+}
+
+// Figures of the native pipeline of a track, e.g. its jitter buffer, by
+// name. Read from both of its pipes, which the playout reports on.
+function getTrackStats(track: MediaStreamTrack | null) {
+  if (!track) {
+    return {};
+  }
+  return {
+    ...NativeDatachannel.getStats(track._srcPipeId),
+    ...NativeDatachannel.getStats(track._dstPipeId),
+  } as Record<string, number>;
 }
 
 export class RTCRtpReceiver {
@@ -19,6 +63,10 @@ export class RTCRtpReceiver {
   constructor(track: MediaStreamTrack | null) {
     this.track = track;
   }
+
+  getStats(): Record<string, number> {
+    return getTrackStats(this.track);
+  }
 }
 
 export class RTCRtpSender {
@@ -27,6 +75,10 @@ export class RTCRtpSender {
   constructor(track: MediaStreamTrack | null) {
     this.track = track;
   }
+
+  getStats(): Record<string, number> {
+    return getTrackStats(this.track);
+  }
 }
 
 export class RTCRtpTransceiver {
@@ -36,6 +88,8 @@ export class RTCRtpTransceiver {
   direction: RTCRtpTransceiverDirection;
   kind: 'audio' | 'video';
   streams: MediaStream[];
+  opus: RTCOpusOptions;
+  video: RTCVideoOptions;
   readonly receiver: RTCRtpReceiver;
   readonly sender: RTCRtpSender;
 
@@ -46,6 +100,8 @@ export class RTCRtpTransceiver {
   ) {
     this.direction = init?.direction || 'sendrecv';
     this.streams = init?.streams || [];
+    this.opus = init?.opus || {};
+    this.video = init?.video || {};
     this.mid = mid;
     let sendTrack: MediaStreamTrack | null = null;
     if (trackOrKind instanceof MediaStreamTrack) {